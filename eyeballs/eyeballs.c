@@ -0,0 +1,200 @@
+// Loopback test of the connection racing in connect.c with unreachable
+// addresses (see 'make eyeballs' in the Makefile).
+//
+// An unreachable address is simulated with a listening socket on 127.0.0.2
+// whose accept queue is full. The kernel then drops further SYNs to it, so
+// connection attempts hang as they would for a host that black-holes them,
+// e.g. a broken IPv6 route. Refused connections come from a bound socket on
+// 127.0.0.3 that isn't listening, and a listener on 127.0.0.1 accepts.
+//
+// Each scenario races a list of such addresses with connect_async(), as if
+// the list came from a lookup, and prints the time to connect. With
+// connection attempts started every -d milliseconds, each unreachable address
+// ahead of the reachable one should add one attempt delay, and a refused one
+// nothing, where trying the addresses one at a time would take a full TCP
+// connect timeout (minutes) per unreachable address. The times are checked
+// against that.
+//
+// usage: eyeballs [-d <attempt delay ms>]
+
+#include "common.h"
+#include "connect.h"
+#include "reactor.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+// Time allowed beyond the expected time to connect, for scheduling delays.
+#define SLACK_MS 100
+
+typedef struct Scenario {
+    const char *desc;
+    // Addresses in the order they are tried: 'u'nreachable, 'r'efused, or
+    // 'a'ccepting.
+    const char *addrs;
+    // Number of attempt delays expected before connecting, or -1 if all
+    // attempts should fail.
+    int n_delays;
+} Scenario;
+
+static const Scenario scenarios[] = {
+  { "reachable", "a", 0 },
+  { "unreachable, reachable", "ua", 1 },
+  { "2 unreachable, reachable", "uua", 2 },
+  { "refused, unreachable, reachable", "rua", 1 },
+  { "refused", "r", -1 } };
+
+static int attempt_delay_ms = 250;
+
+static struct sockaddr_in unreachable_addr;
+static struct sockaddr_in refused_addr;
+static struct sockaddr_in accepting_addr;
+
+// Result of the current scenario, set by connected().
+static bool done;
+static int result_fd;
+static int result_err;
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err_exit("clock_gettime");
+
+    return 1e3*ts.tv_sec + 1e-6*ts.tv_nsec;
+}
+
+// Returns a TCP socket bound to an ephemeral port on 'ip', with the address
+// in 'addr'.
+static int bound_socket(const char *ip, struct sockaddr_in *addr) {
+    socklen_t addr_len = sizeof *addr;
+    int fd;
+
+    clear(*addr);
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+        fail_exit("inet_pton() failed on '%s'", ip);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        err_exit("socket");
+    if (bind(fd, (struct sockaddr*)addr, sizeof *addr) == -1 ||
+        getsockname(fd, (struct sockaddr*)addr, &addr_len) == -1)
+        err_exit("binding a socket to %s", ip);
+
+    return fd;
+}
+
+// Sets up the addresses. The sockets are left open until we exit.
+static void set_up_addrs(void) {
+    int filler_fd;
+    int fd;
+
+    // A backlog of 0 still queues one connection. Fill the queue with a
+    // connection that is never accepted.
+    fd = bound_socket("127.0.0.2", &unreachable_addr);
+    if (listen(fd, 0) == -1)
+        err_exit("listen (unreachable)");
+    filler_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (filler_fd == -1)
+        err_exit("socket");
+    if (connect(filler_fd, (struct sockaddr*)&unreachable_addr,
+                sizeof unreachable_addr) == -1)
+        err_exit("connect (filling the accept queue)");
+
+    // Reserves the port, so that nothing else listens on it.
+    bound_socket("127.0.0.3", &refused_addr);
+
+    fd = bound_socket("127.0.0.1", &accepting_addr);
+    if (listen(fd, 16) == -1)
+        err_exit("listen (accepting)");
+}
+
+// connect_async() callback.
+static void connected(int fd, int err) {
+    done = true;
+    result_fd = fd;
+    result_err = err;
+}
+
+// Runs a scenario. Returns false if the outcome or the time is unexpected.
+static bool run(const Scenario *scenario) {
+    size_t n_addrs = strlen(scenario->addrs);
+    struct addrinfo *ais = emalloc(n_addrs*sizeof *ais, "addresses");
+    double expected_ms = scenario->n_delays*attempt_delay_ms;
+    double start;
+    double elapsed;
+
+    // A hand-made lookup result.
+    for (size_t i = 0; i < n_addrs; ++i) {
+        struct sockaddr_in *addr;
+
+        switch (scenario->addrs[i]) {
+        case 'u': addr = &unreachable_addr; break;
+        case 'r': addr = &refused_addr; break;
+        default:  addr = &accepting_addr; break;
+        }
+
+        clear(ais[i]);
+        ais[i].ai_family = AF_INET;
+        ais[i].ai_socktype = SOCK_STREAM;
+        ais[i].ai_addrlen = sizeof *addr;
+        ais[i].ai_addr = (struct sockaddr*)addr;
+        ais[i].ai_next = i + 1 < n_addrs ? &ais[i + 1] : NULL;
+    }
+
+    done = false;
+    start = now_ms();
+    connect_async(ais, attempt_delay_ms, connected);
+    free(ais);
+    while (!done)
+        reactor_poll(-1);
+    elapsed = now_ms() - start;
+
+    if (result_fd == -1) {
+        printf("%-34s failed after %6.1f ms: %s\n", scenario->desc, elapsed,
+               strerror(result_err));
+
+        return scenario->n_delays == -1 && elapsed < SLACK_MS;
+    }
+
+    printf("%-34s connected in %6.1f ms (expected %.0f ms)\n",
+           scenario->desc, elapsed, expected_ms);
+    close(result_fd);
+
+    return scenario->n_delays != -1 && elapsed >= expected_ms &&
+           elapsed < expected_ms + SLACK_MS;
+}
+
+static noreturn void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-d <attempt delay ms>]\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned n_failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+        switch (opt) {
+        case 'd': attempt_delay_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    if (argc != optind || attempt_delay_ms <= 0)
+        usage(argv[0]);
+
+    set_up_addrs();
+    init_reactor();
+
+    printf("Attempt delay: %d ms\n", attempt_delay_ms);
+    for (size_t i = 0; i < ARRAY_LEN(scenarios); ++i)
+        if (!run(&scenarios[i]))
+            ++n_failed;
+
+    free_reactor();
+
+    if (n_failed != 0)
+        fail_exit("%u of %zu scenarios did not connect as expected",
+                  n_failed, ARRAY_LEN(scenarios));
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,42 @@
+// IRC casemapping. Nicks and channel names are case-insensitive, but what
+// counts as upper and lower case depends on the CASEMAPPING the server
+// advertises in RPL_ISUPPORT:
+//
+//   ascii:           A-Z are the upper-case versions of a-z
+//   rfc1459:         Like ascii, plus []\^ as the upper-case versions of {}|~
+//   strict-rfc1459:  Like rfc1459, but without ^ and ~
+//
+// rfc1459 is used until the server says otherwise. The functions below work on
+// the folded (lower-case) forms without making folded copies. Long strings are
+// processed a word at a time.
+
+// Initializes the casemapping to rfc1459. Must be called before the functions
+// below.
+void init_casemap(void);
+
+// Sets the casemapping from a CASEMAPPING value. Unknown casemappings are
+// treated as ascii, with a warning.
+//
+// Returns true if the casemapping changed, in which case tables keyed by
+// folded strings need to be rehashed.
+bool set_casemapping(const char *name);
+
+// Returns the folded version of 'c'.
+char casemap_fold(char c);
+
+// Compares 'a' and 'b' like strcmp(), but on the folded strings.
+int casemap_cmp(const char *a, const char *b);
+
+// Returns true if 'a' and 'b' are equal after folding.
+bool casemap_eq(const char *a, const char *b);
+
+// Like casemap_eq(), for two strings that are both 'len' bytes long.
+bool casemap_eq_n(const char *a, const char *b, size_t len);
+
+// Returns a hash of the folded version of the 'len' bytes at 's'. Strings
+// that compare equal with casemap_eq() have the same hash.
+uint32_t casemap_hash(const char *s, size_t len);
+
+// Saves and restores the casemapping across a live upgrade (see upgrade.h).
+void upgrade_save_casemap(void);
+void upgrade_restore_casemap(void);
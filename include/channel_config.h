@@ -0,0 +1,62 @@
+// Channels to join and per-channel settings.
+//
+// Channels come from the 'channels' file in the data directory and from -c
+// options. Each is given as a channel name optionally followed by
+// space-separated settings:
+//
+//   #chan [log=on|off] [commands=on|off] [cmd_char=<char>] [key=<key>]
+//         [flood=off|ignore|warn]
+//
+//   log:       Whether to write messages in the channel to the chat log
+//   commands:  Whether to respond to bot commands in the channel
+//   cmd_char:  Initial character for bot commands in the channel
+//   key:       Channel key (password) to join with
+//   flood:     What to do about floods in the channel (see flood.h): nothing
+//              ('off'), ignore the messages ('ignore', the default), or also
+//              warn about them in the channel ('warn')
+//
+// Settings that are not given get the defaults from the command line. Empty
+// lines in the file are ignored.
+//
+// The file can be reloaded while connected (see reload.h). Channels that were
+// added are joined and channels that were removed are parted. Changed
+// settings apply right away, except for keys, which are only used when
+// joining.
+
+typedef enum Flood_action {
+    FLOOD_OFF,
+    FLOOD_IGNORE,
+    FLOOD_WARN
+} Flood_action;
+
+typedef struct Channel_config {
+    // NULL for the default configuration.
+    char *name;
+    // NULL if the channel has no key.
+    char *key;
+    char cmd_char;
+    bool log;
+    bool commands;
+    Flood_action flood;
+} Channel_config;
+
+// Configured channels, in the order they were given (file first). Replaced by
+// reload_channel_config(), so don't keep pointers to them.
+extern Channel_config **channel_configs;
+extern size_t n_channel_configs;
+
+// Loads the channel configuration from the channels file and the -c options.
+// Must be called before the functions below, after the interning table has
+// been initialized.
+void load_channel_config(void);
+
+// Reloads the channels file and applies the differences to the old
+// configuration.
+void reload_channel_config(void);
+
+// Frees the channel configuration.
+void free_channel_config(void);
+
+// Returns the configuration for 'channel', or the default configuration if
+// 'channel' is not configured (or is a nick). Never returns NULL.
+const Channel_config *get_channel_config(const char *channel);
@@ -0,0 +1,59 @@
+// Tracks which nicks are in which of the channels the bot is in. Fed from
+// JOIN/PART/KICK/NICK/QUIT messages and NAMES replies (RPL_NAMREPLY and
+// RPL_ENDOFNAMES).
+//
+// Nicks and channels are interned (see intern.h), and each channel keeps a
+// hash set of the ids of its members.
+
+// Initializes channel state tracking. Must be called before the functions
+// below, after the interning table has been initialized.
+void init_channel_state(void);
+
+// Frees all channel state.
+void free_channel_state(void);
+
+// Sets the bot's own nick (e.g. from RPL_WELCOME).
+void track_own_nick(const char *nick);
+
+// Returns true if 'nick' is the bot's current nick.
+bool is_own_nick(const char *nick);
+
+// Updates the state for 'nick' joining 'channel'. A JOIN by the bot itself
+// starts tracking the channel.
+void track_join(const char *nick, const char *channel);
+
+// Updates the state for 'nick' leaving 'channel' through a PART or a KICK. The
+// bot leaving a channel stops tracking it.
+void track_part(const char *nick, const char *channel);
+
+// Updates the state for 'nick' changing nick to 'to' in all channels.
+void track_nick(const char *nick, const char *to);
+
+// Removes 'nick' from all channels.
+void track_quit(const char *nick);
+
+// Adds the space-separated nicks from an RPL_NAMREPLY to 'channel'. Channel
+// membership prefixes ('@', '+', etc.) are stripped. The first reply after
+// the previous RPL_ENDOFNAMES starts a fresh member list. 'names' is split in
+// place.
+void track_names(const char *channel, char *names);
+
+// Marks the end of the NAMES list for 'channel' (RPL_ENDOFNAMES).
+void track_names_end(const char *channel);
+
+// Calls 'fn' with the name of each tracked channel that 'nick' is in,
+// passing 'data' along. Returns the number of channels.
+//
+// 'fn' must not modify the channel state.
+size_t for_each_channel_of(const char *nick,
+                           void (*fn)(const char *channel, void *data),
+                           void *data);
+
+// Returns the number of members of 'channel', or 0 if the channel is not
+// tracked.
+size_t channel_n_members(const char *channel);
+
+// Saves and restores the own nick and the tracked channels and members across
+// a live upgrade (see upgrade.h).
+void upgrade_save_channel_state(void);
+void upgrade_restore_channel_state(void);
@@ -1,3 +1,20 @@
+// Chat log. Entries are appended to the 'chat_log' file in the data directory
+// by a writer thread, so that the event loop doesn't wait for the disk.
+// Entries are buffered until the next flush_chat_log().
+
+// Starts the writer thread. Must be called before the functions below.
+void init_chat_log(void);
+
+// Writes the remaining entries and stops the writer thread.
+void free_chat_log(void);
+
+// Hands the entries logged since the last call over to the writer thread.
+// Called once per event loop iteration.
+void flush_chat_log(void);
+
+// Like flush_chat_log(), but also waits until all entries have been written.
+void sync_chat_log(void);
+
 // Appends a JOIN to the chat log.
 void log_join(const char *nick, const char *user, const char *host,
               const char *channel);
@@ -16,6 +33,14 @@ void log_part(const char *nick, const char *user, const char *host,
 // Appends a PRIVMSG to the chat log.
 void log_privmsg(const char *nick, const char *to, const char *text);
 
-// Appends a QUIT to the chat log.
+// Appends a QUIT to the chat log. 'channel' is one of the channels the user
+// was in, or NULL if unknown.
 void log_quit(const char *nick, const char *user, const char *host,
-              const char *text);
+              const char *channel, const char *text);
+
+// Searches the chat log for messages in 'channel' containing 'text' (ignoring
+// ASCII case) and returns a reply describing the result, allocated with
+// malloc(). Reads the whole log, so it's intended to be run on a worker
+// thread (see worker.h). Thread-safe. Waits for the entries that have been
+// flushed (see above) to be written first.
+char *search_chat_log(const char *channel, const char *text);
@@ -1,7 +1,13 @@
-// Handle commands (PRIVMSGs starting with '!').
+// Handle commands (PRIVMSGs starting with '!'). Heavy commands run on a worker
+// thread (see worker.h) and reply once done.
 //
 //   from: The nick of the user who sent the command.
 //
+//   user, host:
+//         The username and host of the user who sent the command. Commands
+//         are rate-limited per user@host (see rate_limit.h). 'host' may be
+//         NULL.
+//
 //   to:   The channel in which the command was sent, or the nick of the bot in
 //         case of a message directly to the bot.
 //
@@ -13,5 +19,6 @@
 //   arg:  The command's argument: text after the ' ' after the command. NULL
 //         in case the argument is missing (no ' ' after command) or empty
 //         (single ' ' after command).
-void handle_cmd(const char *from, const char *to, const char *rep,
-                const char *cmd, const char *arg);
+void handle_cmd(const char *from, const char *user, const char *host,
+                const char *to, const char *rep, const char *cmd,
+                const char *arg);
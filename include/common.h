@@ -21,6 +21,8 @@
 #include <stdnoreturn.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
@@ -106,22 +108,13 @@ unsigned long long ge_pow_2(unsigned long long n);
 // Sockets-related
 //
 
-// Returns a string corresponding to a socket type (SOCK_STREAM, SOCK_DGRAM,
-// etc.).
-const char *socket_type_str(int type);
+// Returns the addresses in 'ais' in the order they should be tried when
+// racing them, in a malloc()ed array with the length in 'n'.
+struct addrinfo **interleave_families(struct addrinfo *ais, size_t *n);
 
-// Connects to the internet host 'host' (specified e.g. via an IP address or
-// (DNS) hostname) using service 'service' (a port number or a service name
-// like "http" from /etc/services) and socket type 'type' (e.g. SOCK_STREAM or
-// SOCK_DGRAM). Returns a socket descriptor.
-//
-// Exits the program on errors.
-int connect_to(const char *host, const char *service, int type);
+// Sets or clears O_NONBLOCK on 'fd'.
+void set_nonblocking(int fd, bool nonblocking);
 
 // Reads 'n' bytes from file descriptor 'fd' into 'buf'. Handles partial reads
 // and signal interruption.
 ssize_t readn(int fd, void *buf, size_t n);
-
-// Writes 'n' bytes from file descriptor 'fd' into 'buf'. Handles partial
-// writes and signal interruption.
-void writen(int fd, const void *buf, size_t n);
@@ -0,0 +1,20 @@
+// Non-blocking connection establishment, driven by the event loop.
+//
+// The addresses are raced against each other as described in RFC 8305
+// ("Happy Eyeballs"): a new attempt is started every 'attempt_delay_ms'
+// milliseconds, or as soon as all the started attempts have failed, without
+// giving up on the earlier attempts. The first connection to complete wins.
+// Timers, signals, etc. are handled in the meantime, so an address that
+// black-holes our SYNs does not stall the bot.
+//
+// Only one connection can be in progress at a time.
+
+// Starts connecting to one of the addresses in 'ais', which is only used
+// during the call. 'done' is called from the event loop, never before
+// connect_async() returns, with the connected (non-blocking) socket, or with
+// -1 and the error from the last failed attempt in 'err'.
+void connect_async(struct addrinfo *ais, int attempt_delay_ms,
+                   void (*done)(int fd, int err));
+
+// Abandons the connection in progress, if any, without calling its callback.
+void cancel_connect(void);
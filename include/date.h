@@ -1,3 +1,33 @@
+// Conversion between time_t and local (civil) time.
+//
+// The UTC offset currently in effect is cached together with the time of the
+// next offset change (e.g. a DST transition), which turns conversions within
+// that interval into plain arithmetic instead of going through the C
+// library's time zone handling. The cache is refreshed once a conversion falls
+// outside the interval and when the time zone changes (TZ or /etc/localtime).
+//
+// Only for use from the event loop thread.
+
+// Returns the current time, like time(). In simulation mode (-S, see
+// time_event.h), returns the virtual clock instead.
+time_t current_time(void);
+
+// Returns the CLOCK_MONOTONIC time in milliseconds, for measuring intervals.
+// Follows the virtual clock in simulation mode.
+uint64_t monotonic_ms(void);
+
+// Moves the virtual clock forward to 't'. Does nothing if 't' is earlier than
+// the virtual clock. Only used in simulation mode.
+void set_virtual_time(time_t t);
+
+// Converts 't' to local time, like localtime_r(). Returns false on errors.
+bool local_time(time_t t, struct tm *tm);
+
+// Converts 'tm' (in local time) to a time_t and normalizes its fields, like
+// mktime(). tm_isdst = -1 means that it should be deduced. Returns
+// (time_t)-1 on errors.
+time_t make_local_time(struct tm *tm);
+
 // Returns the current time as a struct tm.
 //
 // Prints an error together with 'context' and returns false on errors.
@@ -12,3 +42,35 @@ bool get_current_time(struct tm *tm, const char *context);
 //
 // Returns (time_t)-1 if the time format or the time itself is invalid.
 time_t parse_date(const char **s);
+
+// A rule for recurring calendar times: a time of day on certain days of the
+// week, or on a certain day of the month.
+typedef struct Recurrence {
+    // Bit n is set if the rule applies to weekday n (0 = Sunday, as for
+    // tm_wday). Unused for monthly rules.
+    unsigned weekdays;
+    // Day of the month (1-31) for monthly rules, and 0 for weekly rules.
+    // Months that are too short use their last day instead.
+    int mday;
+    int hour;
+    int min;
+    int sec;
+} Recurrence;
+
+// Parses a recurrence in the format "<days> hh:mm[:ss]" from the start of 's',
+// where <days> is "day", "weekday", "weekend", a comma-separated list of
+// weekday names ("mon" or "monday" through "sun" or "sunday"), or
+// "month <dd>". Updates 's' like parse_date().
+//
+// Returns false if the recurrence is malformed or invalid.
+bool parse_recurrence(const char **s, Recurrence *r);
+
+// Writes 'r' to 'buf' (of length 'len') in a format accepted by
+// parse_recurrence().
+void format_recurrence(const Recurrence *r, char *buf, size_t len);
+
+// Returns the first time after 'after' matching 'r', or (time_t)-1 on errors.
+// A time on a day that doesn't exist locally because of a DST change is moved
+// forward like with mktime(), and each day matches at most once even if the
+// time occurs twice.
+time_t next_occurrence(const Recurrence *r, time_t after);
@@ -1,13 +1,16 @@
 typedef enum Open_mode {
     READ,
-    // This is the only write mode we need at the moment.
-    APPEND
+    APPEND,
+    // Read and write, creating the file if it does not exist.
+    READ_WRITE,
+    // Like READ_WRITE, but truncates an existing file.
+    CREATE
 } Open_mode;
 
 // Opens 'filename' inside the data directory (something like
 // ~/.botniklas/<filename>), returning a file descriptor. Attempts to create
-// the data directory if it does not exist and 'mode' is APPEND (creating it on
-// a read is pointless).
+// the data directory if it does not exist and 'mode' is not READ (creating it
+// on a read is pointless).
 //
 // Returns -1 if there was an error or if 'mode' is READ and the file does not
 // exist.
@@ -24,3 +27,11 @@ FILE *open_file_stdio(const char *filename, Open_mode mode);
 // On errors and if the file does not exist, returns NULL without modifying
 // 'len'.
 char *get_file_contents(const char *filename, size_t *len);
+
+// Renames 'from' to 'to' inside the data directory, replacing 'to' if it
+// exists. Returns false on errors.
+bool rename_file(const char *from, const char *to);
+
+// Returns the path to the data directory, allocated with malloc(), or NULL on
+// errors. The directory might not exist.
+char *get_data_dir_path(void);
@@ -0,0 +1,25 @@
+// Flood and repeat-spam detection for channel messages.
+//
+// Each channel keeps a fixed-size window of SimHash fingerprints of recent
+// messages, and a fixed-size table of per-sender message rates. A message is
+// part of a flood if several messages with nearly the same fingerprint (e.g.
+// the same URL or text pasted with small variations, possibly by many nicks)
+// were seen within a short time, or if its sender is writing too fast. Checking
+// a message takes constant time, independent of the channel's traffic.
+//
+// Messages that are part of a flood are still logged, but skip commands,
+// triggers, and statistics.
+
+// Initializes the detector. Must be called before the function below.
+void init_flood(void);
+
+// Frees the per-channel state.
+void free_flood(void);
+
+// Examines a message from 'nick' to 'channel' and returns true if it is part
+// of a flood. 'action' is the channel's flood setting (see
+// channel_config.h). With FLOOD_OFF, nothing is examined, and with
+// FLOOD_WARN, the channel is told when a flood starts (at most every few
+// minutes).
+bool flood_check(const char *nick, const char *channel, const char *text,
+                 Flood_action action);
@@ -0,0 +1,52 @@
+// Hash sets and maps keyed by interned string ids (see intern.h). Implemented
+// with open addressing and linear probing. Removals use backward shifting, so
+// there are no tombstones and lookups stay fast under churn.
+//
+// Iterate over the ids in a set like this:
+//
+//   for (size_t i = 0; i < set->size; ++i)
+//       if (set->ids[i] != NO_STR_ID)
+//           ... set->ids[i] ...
+
+typedef struct Id_set {
+    // NULL until the first insertion.
+    Str_id *ids;
+    // Number of slots in 'ids'. Zero or a power of two.
+    size_t size;
+    // Number of ids in the set.
+    size_t count;
+} Id_set;
+
+// Maps ids to pointers. 'vals[i]' is the value for 'keys.ids[i]'.
+typedef struct Id_map {
+    Id_set keys;
+    void **vals;
+} Id_map;
+
+// Initializes 's'. It is initially empty and uses no memory.
+void id_set_init(Id_set *set);
+void id_set_free(Id_set *set);
+
+// Removes all ids from 'set' but keeps the memory around for reuse.
+void id_set_clear(Id_set *set);
+
+// Adds 'id' to 'set'. Returns false if it was already there.
+bool id_set_add(Id_set *set, Str_id id);
+
+// Removes 'id' from 'set'. Returns false if it was not there.
+bool id_set_remove(Id_set *set, Str_id id);
+
+bool id_set_contains(const Id_set *set, Str_id id);
+
+// Initializes 'map'. It is initially empty and uses no memory.
+void id_map_init(Id_map *map);
+void id_map_free(Id_map *map);
+
+// Returns the value for 'id', or NULL if 'id' is not in 'map'.
+void *id_map_get(const Id_map *map, Str_id id);
+
+// Sets the value for 'id', adding it to 'map' if needed.
+void id_map_set(Id_map *map, Str_id id, void *val);
+
+// Removes 'id' from 'map' and returns its value, or NULL if it was not there.
+void *id_map_remove(Id_map *map, Str_id id);
@@ -0,0 +1,47 @@
+// String interning table. Each distinct string is stored once and identified
+// by a small integer id, so that nicks and channels can be compared and hashed
+// by id instead of by repeated strcmp()s.
+//
+// Strings are compared under the IRC casemapping (see casemap.h), so e.g.
+// "#Foo[]" and "#foo{}" get the same id. The spelling of the first string
+// interned is the one kept.
+//
+// Strings are reference counted and removed from the table when the last
+// reference goes away. The string data lives in a single pool that is
+// compacted as needed, so interning a string does not malloc() per entry.
+
+typedef uint32_t Str_id;
+
+// Never used for a string. Can be used as a "no string" marker.
+#define NO_STR_ID 0
+
+// Initializes the interning table. Must be called before the functions below.
+void intern_init(void);
+
+// Frees the interning table.
+void intern_free(void);
+
+// Returns the id of 's', adding it to the table if it is not already there.
+// Increments the reference count of the string.
+Str_id intern(const char *s);
+
+// Returns the id of 's' without adding it or touching the reference count.
+// Returns NO_STR_ID if 's' has not been interned.
+Str_id intern_find(const char *s);
+
+// Increments the reference count of 'id' and returns it.
+Str_id intern_ref(Str_id id);
+
+// Decrements the reference count of 'id', removing the string when it reaches
+// zero.
+void intern_unref(Str_id id);
+
+// Rebuilds the hash table after the casemapping has changed. Strings that
+// only become equal under the new casemapping keep separate ids.
+void intern_rehash(void);
+
+// Returns the string for 'id'.
+//
+// The pointer is only guaranteed to remain valid until the next call to
+// intern(), which might move the string pool.
+const char *intern_str(Str_id id);
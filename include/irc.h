@@ -1,4 +1,4 @@
-// Handle to the server's socket.
+// Handle to the server's socket. -1 while not connected.
 extern int serv_fd;
 
 // Maximum number of parameters in IRC messages.
@@ -24,25 +24,97 @@ typedef struct IRC_msg {
     size_t n_params;
 } IRC_msg;
 
-// Connects to the IRC server at 'host'/'port' and sends registration commands.
-// Initializes 'serv_fd' on success. Exits the program if we fail to connect.
+// Starts connecting to the IRC server at 'host'/'port'. The lookup, the
+// connection attempts (see connect.h), and the TLS handshake all run without
+// blocking the event loop. Once connected, 'serv_fd' is initialized,
+// registration commands are sent, and 'connected' is called.
+//
+// Exits the program if we fail to look up the host or to connect, or if
+// connecting takes longer than 'dead_timeout' seconds.
 void connect_to_irc_server(const char *host, const char *port, const char *nick,
-                           const char *username, const char *realname);
+                           const char *username, const char *realname,
+                           void (*connected)(void));
+
+// Closes the connection to the server and connects again after a delay, as
+// for connect_to_irc_server(). The delay doubles with each attempt that fails
+// before registering, up to a few minutes, and failed lookups and connection
+// attempts are retried instead of exiting the program.
+//
+// Per-connection state is reset: unprocessed data, tracked channels (see
+// channel_state.h), joining, and lag monitoring. Messages sent before
+// reconnecting are dropped.
+//
+// Must not be called while messages from the server are being processed.
+void reconnect_to_irc_server(void);
+
+// Resets the reconnect delay. Called once registered with the server.
+void reset_reconnect_delay(void);
+
+// Abandons the connection attempt in progress, if any (see
+// connect_to_irc_server()). Pending reconnects are not affected.
+void cancel_connect_to_irc_server(void);
 
 // Reads as much data as currently possible from the server and processes each
 // received complete message. Data forming a partial message at the end is left
 // in the read buffer for later.
 //
+// At most 'drain_budget_msgs' messages are processed per call, and processing
+// stops after 'drain_budget_us' microseconds (see options.h), so that timers
+// and signals are not held up by bursts. msgs_pending() then returns true,
+// and process_pending_msgs() continues where the call left off. PINGs are
+// answered as soon as they are received, ahead of the messages before them.
+//
 // Intended to be called when we know that there is data, a connection error,
 // or that the server closed the connection, so that we do not block.
 //
-// Returns false in case of an orderly shutdown from the server or a receive
-// error.
+// Returns false in case of an orderly shutdown from the server, a receive
+// error, or if sending to the server has failed (see serv_send()).
 bool process_msgs(void);
 
-// Returns true if 'channel_or_nick' starts with '&', '#', '+', or '!'.
+// Returns true if the last call to process_msgs() or process_pending_msgs()
+// ran out of budget before processing all messages.
+bool msgs_pending(void);
+
+// Continues processing messages after process_msgs() ran out of budget,
+// without waiting for the socket to become readable. Also has a budget.
+// Returns like process_msgs().
+bool process_pending_msgs(void);
+
+// Statistics for process_msgs() and process_pending_msgs().
+typedef struct Drain_stats {
+    // Number of calls.
+    uint64_t n_drains;
+    // Number of calls that ran out of budget.
+    uint64_t n_deferred;
+    // Number of messages processed.
+    uint64_t n_msgs;
+    // Most messages processed in one call, and the longest call in
+    // microseconds.
+    uint64_t max_msgs;
+    uint64_t max_us;
+    // Number of PINGs answered as soon as they were received.
+    uint64_t n_early_pongs;
+} Drain_stats;
+
+extern Drain_stats drain_stats;
+
+// Returns true if 'channel_or_nick' starts with one of the channel prefixes
+// the server uses. These are '&', '#', '+', and '!' unless the server
+// advertises something else.
 bool is_channel(const char *channel_or_nick);
 
+// Sets the channel prefixes from a CHANTYPES value in RPL_ISUPPORT.
+void set_chantypes(const char *chantypes);
+
 // Converts error replies (400-599) to their symbolic constants
 // (401 -> "ERR_NOSUCHNICK", etc.).
 const char *irc_errnum_str(unsigned errnum);
+
+// Makes process_pending_msgs() process the complete messages already in the
+// read buffer, answering PINGs among them first. Used after a live upgrade.
+void resume_msgs(void);
+
+// Saves and restores 'serv_fd' and the server's channel prefixes across a
+// live upgrade (see upgrade.h).
+void upgrade_save_irc(void);
+void upgrade_restore_irc(void);
@@ -0,0 +1,36 @@
+// Joining of the configured channels (see channel_config.h).
+//
+// Channels are packed into as few JOIN lines as the server allows, and the
+// lines are sent in small bursts spaced out in time to stay under the
+// server's flood limits.
+
+// Starts joining all configured channels. The first burst is sent right away
+// and the remaining ones from time events.
+void join_channels(void);
+
+// Joins the channels in 'configs' (e.g. newly configured ones), if
+// join_channels() has been called on this connection. Channels that are
+// still being joined go first.
+void join_more_channels(Channel_config **configs, size_t n);
+
+// Called after the channel configuration has been replaced, while the old
+// configuration is still around. Channels waiting to be joined are moved
+// over to the new configuration, and channels that are no longer configured
+// are not joined.
+void join_config_reloaded(void);
+
+// Sends a PART for 'channel' if the bot is in it.
+void part_channel(const char *channel);
+
+// Stops joining. Used when disconnecting, so that join_channels() starts over
+// on the next connection.
+void cancel_join(void);
+
+// Sets the maximum number of channels per JOIN, from the JOIN entry in the
+// TARGMAX RPL_ISUPPORT token. 0 means no limit.
+void set_join_max_targets(size_t n);
+
+// Saves and restores the join progress across a live upgrade (see upgrade.h).
+// Channels that are no longer configured after the upgrade are not joined.
+void upgrade_save_join(void);
+void upgrade_restore_join(void);
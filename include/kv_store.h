@@ -0,0 +1,52 @@
+// Persistent key-value store in a memory-mapped file in the data directory.
+//
+// The file holds an open-addressing hash table of fixed-size slots that point
+// to immutable records, each holding a key and a value. Opening a store just
+// maps the file, so nothing is read or parsed up front, and lookups touch one
+// or two pages. Since the memory is backed by the file, the kernel can drop
+// pages that haven't been used in a while, which keeps the memory usage
+// bounded even for stores much larger than the bot itself.
+//
+// Updates write a new record and then switch the slot to it with a single
+// aligned store, so a crash of the process at any point leaves a consistent
+// store behind. The table is grown copy-on-write: the new table is written and
+// synced to disk before the root in the file header is switched to it. Records
+// carry checksums, so records torn by a system crash are detected and treated
+// as missing rather than returned as garbage. Space used by replaced records
+// is reclaimed by rewriting the store to a new file and renaming it over the
+// old one once at least half of it is garbage.
+//
+// Only for use from the event loop thread.
+
+typedef struct KV_store KV_store;
+
+// Maximum length of keys and values.
+#define KV_MAX_LEN UINT16_MAX
+
+// Opens or creates the store in 'filename' inside the data directory. A file
+// that isn't a valid store is moved to '<filename>.bad' and replaced with an
+// empty store.
+//
+// Returns NULL on errors, after printing a warning.
+KV_store *kv_open(const char *filename);
+
+// Closes the store. Completed updates are written to disk by the kernel.
+void kv_close(KV_store *kv);
+
+// Returns the value for the 'key_len'-byte key 'key', with its length in
+// 'val_len', or NULL if the key is not in the store. The value is 8-byte
+// aligned, so fixed-size values can be read directly as structs. It stays
+// valid until the next kv_put() or kv_close().
+const void *kv_get(KV_store *kv, const void *key, size_t key_len,
+                   size_t *val_len);
+
+// Sets the value for 'key' to the 'val_len' bytes at 'val', replacing any
+// earlier value. Keys and values can be at most KV_MAX_LEN bytes long.
+//
+// Returns false if the file could not be grown (e.g. because the disk is
+// full), after printing a warning.
+bool kv_put(KV_store *kv, const void *key, size_t key_len, const void *val,
+            size_t val_len);
+
+// Returns the number of keys in the store.
+size_t kv_count(KV_store *kv);
@@ -0,0 +1,29 @@
+// Server lag monitoring and dead-connection detection.
+//
+// Once registered, the bot PINGs the server every 'ping_interval' seconds
+// (see options.h) and measures the round-trip time from the PONGs. If no PONG
+// arrives within 'dead_timeout' seconds, the connection is considered dead
+// and the bot reconnects (see reconnect_to_irc_server()).
+//
+// The server socket also gets TCP keepalive and TCP_USER_TIMEOUT, so that the
+// kernel gives up on a connection whose data goes unacknowledged for
+// 'dead_timeout' seconds. Reads then fail, which also makes the bot
+// reconnect.
+
+// Sets TCP keepalive and TCP_USER_TIMEOUT on 'serv_fd'. Prints a warning if
+// that fails.
+void set_keepalive(void);
+
+// Starts sending PINGs. Called once registered with the server. Does nothing
+// in simulation mode (see time_event.h).
+void lag_start(void);
+
+// Stops sending PINGs and forgets the outstanding one. Called when
+// disconnecting, which is counted for handle_lag().
+void lag_stop(void);
+
+// Handles a PONG from the server. 'token' is its last parameter.
+void lag_pong(const char *token);
+
+// Handles !lag. 'rep' is the reply target.
+void handle_lag(const char *rep);
@@ -0,0 +1,59 @@
+// Latency histograms for PINGs and commands, enabled with -l.
+//
+// With -l, the server socket has SO_TIMESTAMPNS set, and the kernel reports
+// when it received the data returned by each read. For each PING and command,
+// three latencies are recorded:
+//
+//   - queue: from kernel receive to the start of handling (time spent in the
+//     socket buffer, waking up from epoll, and behind other messages)
+//   - handling: from the start of handling to the send() of the first reply
+//   - total: from kernel receive to the send() of the first reply
+//
+// Replies are queued and sent at the end of the event loop iteration (see
+// serv_send()), so the send() time includes the time spent handling the
+// messages after the one being measured.
+//
+// Histogram buckets are a quarter of a power of two wide, so percentiles are
+// accurate to within 25%. Clock adjustments can skew samples, since kernel
+// timestamps use the realtime clock.
+//
+// With userspace TLS, and with kTLS if the kernel does not pass on receive
+// timestamps, the time of the read is used instead of the kernel timestamp.
+
+typedef enum Latency_kind {
+    LATENCY_PING,
+    LATENCY_CMD,
+    N_LATENCY_KINDS
+} Latency_kind;
+
+// Records the receive time of the data just read from the server, which is
+// the receive time of all complete messages in the read buffer. 'kernel_time'
+// is the kernel timestamp, or NULL if none was available.
+void latency_received(const struct timespec *kernel_time);
+
+// Forgets the receive time. Used after a live upgrade, where messages from the
+// previous process have no known receive time.
+void latency_rx_unknown(void);
+
+// Marks the start and the end of handling a PING or a command. Only one
+// message can be handled at a time.
+void latency_begin(Latency_kind kind);
+void latency_end(void);
+
+// Called when a reply is queued for sending (see serv_send()).
+void latency_queued(void);
+
+// Called after queued data has been sent to the server. Marks the reply for
+// the message being handled, if it has none yet, and for handled messages
+// whose replies were still queued.
+void latency_sent(void);
+
+// Called when queued data is discarded (on disconnection). The messages whose
+// replies were in it get no handling and total latencies.
+void latency_output_dropped(void);
+
+// Handles !latency. 'rep' is the reply target.
+void handle_latency(const char *rep);
+
+// Prints a summary to stdout, if -l was given. Used at shutdown.
+void print_latency_summary(void);
@@ -8,6 +8,9 @@ void msg_read_buf_init(void);
 // Frees the read buffer.
 void msg_read_buf_free(void);
 
+// Discards the data in the read buffer. Used when reconnecting.
+void msg_read_buf_reset(void);
+
 // Reads as much data as currently possible (and that fits in the read buffer)
 // from the server.
 //
@@ -30,6 +33,17 @@ bool recv_msgs(void);
 // Exits the program if a message that won't fit in the buffer is received.
 bool get_msg(char **msg);
 
+// Calls 'fn' for each complete message received since the last call, ahead of
+// get_msg(). 'msg' is not null-terminated. If 'fn' returns true, the message
+// has been handled and is dropped from the buffer, so that get_msg() never
+// returns it.
+void scan_new_msgs(bool (*fn)(const char *msg, size_t len));
+
+// Saves and restores the received data that has not been processed yet across
+// a live upgrade (see upgrade.h). Must be restored after msg_read_buf_init().
+void upgrade_save_msg_read_buf(void);
+void upgrade_restore_msg_read_buf(void);
+
 //
 // IRC message writing.
 //
@@ -66,3 +80,7 @@ void say(const char *to, const char *format, ...)
 
 // Like begin_msg(), but for starting a PRIVMSG.
 void begin_say(const char *to);
+
+// Appends the one or two most significant units of 'diff' (in seconds) to
+// the write buffer, e.g. "3 days, 2 hours".
+void append_short_duration(time_t diff);
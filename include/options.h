@@ -1,16 +1,54 @@
-// Channel to join after registering with the server.
-extern const char *channel;
+// Channels given with -c, each optionally followed by settings (see
+// channel_config.h). Joined after registering with the server, together with
+// the channels from the channels file.
+extern const char **channels;
+extern size_t      n_channels;
+// Channel to join if no channels are configured.
+extern const char *default_channel;
 extern char       cmd_char;
+// Delay in milliseconds between connection attempts to different addresses
+// of the server.
+extern int        connect_delay;
+// Seconds without a PONG to our PING after which the connection is considered
+// dead (see lag.h).
+extern unsigned   dead_timeout;
+// Budget for processing messages from the server per event loop iteration
+// (see process_msgs()).
+extern unsigned   drain_budget_msgs;
+extern unsigned   drain_budget_us;
 extern const char *nick;
+// Seconds between our PINGs to the server (see lag.h).
+extern unsigned   ping_interval;
 extern const char *port;
 extern const char *quit_message;
 extern const char *realname;
 extern const char *server;
 extern const char *username;
 
+// If true, the connection to the server uses TLS. 'verify_cert' controls
+// whether the server's certificate is verified.
+extern bool use_tls;
+extern bool verify_cert;
+
+// If true, the latency of PINGs and commands is measured (see latency.h).
+extern bool measure_latency;
+
+// Start of the virtual clock in simulation mode (see time_event.h), or 0 if
+// not simulating.
+extern time_t sim_start;
+
 // If true, a trace of all messages received from the server is printed to
 // stdout.
 extern bool exit_on_invalid_msg;
 extern bool trace_msgs;
 
 void process_cmdline(int argc, char *argv[]);
+
+// Loads the options that are set in the 'config' file in the data directory
+// and not on the command line. Options missing from the file get their
+// defaults. If the file has errors, a warning is printed, the options are
+// left unchanged, and false is returned. Called again to reload the file.
+bool load_config_file(void);
+
+// Frees the contents of the 'config' file.
+void free_config_file(void);
@@ -0,0 +1,21 @@
+// Command rate limiting per sender, so that no one can make the bot flood
+// itself off the network.
+//
+// Senders are identified by user@host and kept in a fixed-size table, with the
+// least recently seen sender evicted when it's full. Each sender has a token
+// bucket that allows short bursts of commands, and each command has a cooldown
+// between uses by the same sender. Nothing is allocated, and rejecting a
+// command takes constant time.
+
+// Maximum number of commands with a cooldown. Command numbers passed below
+// must be less than this.
+#define RATE_LIMIT_MAX_CMDS 16
+
+// Initializes the sender table. Must be called before the function below.
+void init_rate_limit(void);
+
+// Returns true if the sender 'user'@'host' may run command number 'cmd' now,
+// and records the use. 'cooldown' is the minimum time in seconds between uses
+// of the command by the same sender. 'host' may be NULL.
+bool rate_limit_admit(const char *user, const char *host, unsigned cmd,
+                      unsigned cooldown);
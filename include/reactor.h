@@ -0,0 +1,45 @@
+// Event loop reactor. Subsystems register the file descriptors they want to
+// hear about together with a handler, and reactor_poll() waits for events on
+// all of them and calls the handlers.
+//
+// Handlers may add, modify, and remove registrations (including their own)
+// while events are being dispatched. A removed registration gets no further
+// events, even if some were already harvested in the same batch.
+
+// Interest flags for reactor_add() and reactor_modify(). Errors and hangups
+// are always reported.
+#define REACTOR_READ EPOLLIN
+#define REACTOR_WRITE EPOLLOUT
+// Edge-triggered notification. The handler only gets called when the state of
+// the fd changes, so it must consume everything available (or not care).
+#define REACTOR_EDGE EPOLLET
+
+// Creates the epoll instance. Must be called before the functions below.
+void init_reactor(void);
+
+// Closes the epoll instance and frees any remaining registrations. Does not
+// close the registered file descriptors.
+void free_reactor(void);
+
+// Registers 'fd' with interest 'interest' (REACTOR_* flags). 'handler' is
+// called with the fd, the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLERR,
+// EPOLLHUP, ...), and 'ctx' when events occur. 'fd' must not already be
+// registered.
+void reactor_add(int fd, unsigned interest,
+                 void (*handler)(int fd, uint32_t events, void *ctx),
+                 void *ctx);
+
+// Changes the interest for the registered 'fd'.
+void reactor_modify(int fd, unsigned interest);
+
+// Unregisters 'fd'. Must be called before closing a registered fd, unless the
+// reactor is about to be freed.
+void reactor_remove(int fd);
+
+// Waits at most 'timeout' milliseconds (-1 for no limit) for events and
+// dispatches them. Returns false if a handler called reactor_stop(), in which
+// case the remaining events in the batch are dropped.
+bool reactor_poll(int timeout);
+
+// Makes reactor_poll() return false after the current handler.
+void reactor_stop(void);
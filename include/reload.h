@@ -0,0 +1,17 @@
+// Reloading of the configuration files in the data directory while
+// connected: 'config' (options, see options.h), 'channels' (see
+// channel_config.h), and 'triggers' (see triggers.h).
+//
+// The data directory is watched with inotify, and files are reloaded when
+// they are written or replaced (e.g. by an editor renaming its temporary file
+// over them) or removed. SIGHUP reloads all of them.
+
+// Starts watching the data directory. Prints a warning if that fails (e.g.
+// if the directory does not exist yet), in which case only SIGHUP reloads.
+void init_reload(void);
+
+// Stops watching.
+void free_reload(void);
+
+// Reloads all configuration files.
+void reload_config(void);
@@ -1,7 +1,32 @@
+// Reminders. Pending reminders are indexed by target (channel or nick) and
+// have stable ids, so that they can be listed and cancelled from the target
+// they were set in.
+
+// Initializes the reminder index. Must be called before the functions below.
+void init_reminders(void);
+
+// Frees all pending reminders. Must be called before free_time_event() and
+// intern_free().
+void free_reminders(void);
+
 // Handles !remind messages. Registers a new pending reminder and saves it to
 // disk (so we can reload it when the bot is restarted) if everything looks
 // okay.
 void handle_remind(const char *arg, const char *reply_target);
 
+// Handles !reminders messages. Lists a page of the pending reminders of
+// 'reply_target', newest first. 'arg' is the page number, or NULL for the
+// first page.
+void handle_reminders(const char *arg, const char *reply_target);
+
+// Handles !unremind messages. Cancels the pending reminder of 'reply_target'
+// with the id in 'arg' and saves the cancellation to disk.
+void handle_unremind(const char *arg, const char *reply_target);
+
 // Loads saved reminders from disk.
 void restore_remind_state(void);
+
+// Saves and restores the pending reminders across a live upgrade (see
+// upgrade.h). Used instead of restore_remind_state() when resuming.
+void upgrade_save_reminders(void);
+void upgrade_restore_reminders(void);
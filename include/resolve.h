@@ -0,0 +1,29 @@
+// Asynchronous host name resolution. Lookups run getaddrinfo() on a resolver
+// thread so that a slow DNS server can't stall the event loop, and completions
+// are signalled through an eventfd.
+//
+// Successful lookups are cached for a few minutes, so that e.g. reconnecting
+// skips DNS entirely.
+
+// Initializes the resolver and registers its eventfd with the reactor (see
+// reactor.h). Must be called before the functions below.
+void init_resolve(void);
+
+// Frees the resources associated with the resolver. Lookups still in progress
+// are abandoned without calling their callbacks.
+void free_resolve(void);
+
+// Looks up 'host' and 'service' for socket type 'type' (e.g. SOCK_STREAM) and
+// calls 'callback' with the result, passing 'data' along.
+//
+// 'err' is 0 on success and a getaddrinfo() error code otherwise (see
+// gai_strerror()). 'ais' is NULL on errors, and owned by the cache otherwise.
+// It is only valid during the call.
+//
+// If the result is cached, 'callback' is called before resolve_async()
+// returns. Otherwise, it is called from the event loop once the lookup
+// completes.
+void resolve_async(const char *host, const char *service, int type,
+                   void (*callback)(struct addrinfo *ais, int err,
+                                    void *data),
+                   void *data);
@@ -0,0 +1,21 @@
+// Tracks when nicks were last seen, for !seen. The last JOIN, PART, QUIT, or
+// channel message of each nick is kept in the 'seen' store in the data
+// directory (see kv_store.h), keyed by the folded nick, so that it survives
+// restarts and scales to lots of nicks.
+
+// Opens the store. Must be called before the functions below. If the store
+// can't be opened, nothing is tracked.
+void init_seen(void);
+
+// Closes the store.
+void free_seen(void);
+
+// Record events for 'nick'. 'text' is the message, part reason, or quit
+// message, and may be NULL (e.g. for channels that aren't logged).
+void seen_join(const char *nick, const char *channel);
+void seen_part(const char *nick, const char *channel, const char *text);
+void seen_quit(const char *nick, const char *text);
+void seen_privmsg(const char *nick, const char *channel, const char *text);
+
+// Handles !seen. 'arg' is the command argument and 'rep' the reply target.
+void handle_seen(const char *arg, const char *rep);
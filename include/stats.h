@@ -0,0 +1,37 @@
+// Channel activity statistics, for !top and !active.
+//
+// Each channel gets a fixed-size record, so memory use doesn't grow with the
+// number of nicks or words seen:
+//
+//   - Top talkers and words today, from a count-min sketch of message counts
+//     together with a short list of the keys with the highest estimates
+//   - Distinct speakers today, from a HyperLogLog sketch
+//   - Messages per hour over the last week, in a ring of hourly counters
+//
+// The daily statistics restart at local midnight. Snapshots are written to
+// the 'stats' file in the data directory every few minutes and on shutdown,
+// so at most a few minutes of statistics are lost in a crash.
+
+// Initializes the statistics and schedules snapshots. Must be called after
+// init_time_event() and before the functions below.
+void init_stats(void);
+
+// Writes a final snapshot and frees the statistics.
+void free_stats(void);
+
+// Loads the last snapshot. Used when not resuming from a live upgrade.
+void restore_stats(void);
+
+// Counts a message from 'nick' to 'channel'. 'text' is NULL for channels
+// whose words shouldn't be counted (e.g. unlogged ones).
+void stats_privmsg(const char *nick, const char *channel, const char *text);
+
+// Handle !top and !active. 'arg' is the command argument, 'to' the channel
+// or nick the command was sent to, and 'rep' the reply target.
+void handle_top(const char *arg, const char *to, const char *rep);
+void handle_active(const char *arg, const char *to, const char *rep);
+
+// Saves and restores the statistics across a live upgrade (see upgrade.h).
+// Restoring is done instead of restore_stats().
+void upgrade_save_stats(void);
+void upgrade_restore_stats(void);
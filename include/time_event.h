@@ -1,17 +1,22 @@
 // Infrastructure for running functions at specific calendar times.
+//
+// Events normally fire on a timerfd. In simulation mode (-S), time is instead
+// a virtual clock (see current_time() in date.h) that a fake server advances
+// with "SIMTIME <Unix time>" messages. run_time_events() then runs the events
+// that came due, in order and with the clock set to the time of each, so that
+// days of reminders and triggers can be simulated in seconds and with the
+// same outcome every time.
 
-// timerfd handle.
-extern int timer_fd;
-
-// Initializes the timed event infrastructure. Must be called before the
-// functions below.
+// Initializes the timed event infrastructure and registers its timerfd with
+// the reactor (see reactor.h). Must be called before the functions below.
 void init_time_event(void);
 
 // Frees the resources associated with the timed event infrastructure.
 void free_time_event(void);
 
-// Handles and removes the next chronological event.
-void handle_time_event(void);
+// Advances the virtual clock to 'until', running the events due by then. Only
+// used in simulation mode.
+void run_time_events(time_t until);
 
 // Registers a function to be called at time 'when'. The function receives
 // 'data' as an argument.
@@ -24,3 +29,14 @@ void add_time_event(time_t when, void (*handler)(void *data), void *data);
 // Returns false on errors.
 bool add_time_event_tm(struct tm *when, void (*handler)(void *data),
                        void *data);
+
+// Removes all pending events with handler 'handler'. Must not be called from
+// such a handler.
+void remove_time_events(void (*handler)(void *data));
+
+// Calls 'fn' for each pending event with handler 'handler', in chronological
+// order, passing the time and data of the event along with 'ctx'. 'fn' must
+// not add or remove events.
+void for_each_time_event(void (*handler)(void *data),
+                         void (*fn)(time_t when, void *data, void *ctx),
+                         void *ctx);
@@ -0,0 +1,105 @@
+// Transport for the server connection: plain TCP, TLS offloaded to the kernel
+// (kTLS), or TLS in userspace.
+//
+// The TLS handshake is always done in userspace with OpenSSL. If the kernel
+// supports kTLS, OpenSSL then hands the record layer to the kernel, and data
+// is received and sent with plain recv()/send() on 'serv_fd', straight into
+// and out of our own buffers. Otherwise, OpenSSL encrypts and decrypts in
+// userspace.
+
+// Starts a TLS handshake with the server on the non-blocking socket 'fd'.
+// 'host' is used for SNI and for verifying the server's certificate (unless
+// 'verify' is false). The handshake runs from the event loop, and 'done' is
+// called with true once it completes, or with false after printing a warning
+// if it fails, in which case the TLS state has been freed. 'host' must stay
+// valid until then.
+//
+// Exits the program on setup errors (e.g. out of memory).
+void tls_connect(int fd, const char *host, bool verify,
+                 void (*done)(bool ok));
+
+// Abandons the handshake in progress, if any, without calling its callback.
+// The TLS state is freed, and 'fd' is left open.
+void tls_cancel(void);
+
+// Sends a TLS close_notify and frees the TLS state, if TLS is in use. Also
+// resets the transport for a new connection.
+void tls_close(void);
+
+// Receives up to 'n' bytes from the server into 'buf'. Returns like recv(),
+// except that -1 with errno set to EAGAIN means that no data is available
+// right now (e.g. because only TLS control data was received).
+//
+// If 'rx_time' is not NULL, it is set to the time the kernel received the
+// data (see enable_rx_timestamps()), or zeroed if that isn't known, e.g. with
+// TLS in userspace.
+ssize_t serv_recv(void *buf, size_t n, struct timespec *rx_time);
+
+// Returns true if data has already been received and decrypted in userspace
+// but not yet returned by serv_recv(). Such data does not make 'serv_fd'
+// readable.
+bool serv_recv_pending(void);
+
+// Queues the message in 'buf' (of length 'n') for sending to the server with
+// serv_flush(). The event loop flushes at the end of each iteration, so that
+// the replies to a batch of messages usually go out in a single send() and
+// TCP segment. Messages that are sensitive to delay (PONGs) are flushed right
+// away.
+//
+// Does nothing while not connected.
+void serv_send(const void *buf, size_t n);
+
+// Sends the queued messages to the server. Handles partial writes and signal
+// interruption. Calls latency_sent() (see latency.h) once everything is sent.
+//
+// 'serv_fd' is non-blocking, so that a server that stops reading can't stall
+// the event loop. Whatever doesn't fit in the socket buffer stays queued for
+// the next call (see serv_output_pending()).
+//
+// If sending fails, a warning is printed, and further data is dropped until
+// tls_close() (see serv_send_failed()).
+void serv_flush(void);
+
+// Returns true if serv_flush() left queued data that the socket did not take.
+// The event loop then waits for 'serv_fd' to become writable.
+bool serv_output_pending(void);
+
+// Frees the buffer for queued messages.
+void free_serv_send_buf(void);
+
+// Statistics for serv_send() and serv_flush().
+typedef struct Send_stats {
+    // Number of messages sent.
+    uint64_t n_msgs;
+    // Number of serv_flush() calls that emptied the queue.
+    uint64_t n_flushes;
+    // Number of send() (or SSL_write_ex()) calls.
+    uint64_t n_syscalls;
+    // Most messages sent by one serv_flush().
+    uint64_t max_msgs;
+} Send_stats;
+
+extern Send_stats send_stats;
+
+// Returns the number of messages and TCP segments with data sent on the
+// current connection. Returns false if they aren't known (e.g. while not
+// connected).
+bool serv_segs_out(uint64_t *n_msgs, uint64_t *n_segs);
+
+// Returns true if sending to the server has failed on the current
+// connection.
+bool serv_send_failed(void);
+
+// Makes the kernel timestamp data received on 'serv_fd' (SO_TIMESTAMPNS).
+// Prints a warning if that fails.
+void enable_rx_timestamps(void);
+
+// Returns true if the transport state can be handed over in a live upgrade
+// (see upgrade.h). That's the case for plain TCP and for TLS with kTLS in both
+// directions, where the kernel holds the state, but not for TLS in userspace.
+bool can_upgrade_transport(void);
+
+// Saves and restores the transport across a live upgrade. After restoring a
+// kTLS connection, there is no OpenSSL state, and tls_close() does nothing.
+void upgrade_save_transport(void);
+void upgrade_restore_transport(void);
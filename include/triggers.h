@@ -0,0 +1,46 @@
+// Triggers. Responds to phrases written in channels, optionally only during a
+// daily time window.
+//
+// Rules are read from the 'triggers' file in the data directory, one per
+// line:
+//
+//   <channel> <window> <phrase> | <response>[ | <miss response>]
+//
+//   window:         hh:mm-hh:mm (local time, daily), or '*' for always
+//   phrase:         Text to look for anywhere in messages. Case-insensitive
+//                   for ASCII and (UTF-8 encoded) Latin-1 letters
+//   response:       Sent to the channel on a match. "%n" is replaced by the
+//                   nick of the sender
+//   miss response:  Sent to the channel at the end of the window if no one
+//                   wrote the phrase. Optional
+//
+// A rule with a window responds to the first match in each window. A rule
+// without one responds at most once every few seconds. Empty lines are
+// ignored. If the file does not exist, the rule for the 1337 monitor is used:
+//
+//   #code.se 13:37-13:38 1337 | %n is the 1337est!!! | No one was 1337 today. :(
+//
+// The phrases of the rules in their window are compiled into a single
+// Aho-Corasick automaton, so that each message is scanned once regardless of
+// the number of rules. Windows are opened and closed from time events (see
+// time_event.h).
+
+// Loads the rules and schedules their windows. Must be called before the
+// functions below.
+void init_triggers(void);
+
+// Reloads the rules and reschedules their windows. Rules with the same
+// channel and phrase as before keep track of whether they have responded.
+void reload_triggers(void);
+
+// Frees the rules and the automaton.
+void free_triggers(void);
+
+// Examines a PRIVMSG for triggers.
+void triggers_privmsg(const char *nick, const char *to, const char *text);
+
+// Saves and restores which rules have already responded in their current
+// window across a live upgrade (see upgrade.h). Restoring reloads the rules
+// and is used instead of init_triggers() when resuming.
+void upgrade_save_triggers(void);
+void upgrade_restore_triggers(void);
@@ -0,0 +1,37 @@
+// Live upgrade. Re-executes the bot binary, which may have been replaced on
+// disk, without dropping the server connection. The new process inherits
+// 'serv_fd' and gets the rest of the state (unprocessed data in the read
+// buffer, pending timed events, channel state, etc.) in a serialized blob
+// passed as an inherited file descriptor. Options are passed by reusing the
+// command line.
+//
+// Modules with state save it with the upgrade_put_*() functions in their
+// upgrade_save_*() function and read it back in the same order with the
+// upgrade_get_*() functions in their upgrade_restore_*() function.
+
+// Remembers the binary and command line to re-execute. Must be called before
+// the functions below.
+void init_upgrade(char *argv[]);
+
+// Returns true if this process was started by upgrade() and should resume
+// with restore_upgrade() instead of connecting.
+bool resuming_upgrade(void);
+
+// Saves the state and re-executes the binary. Returns with a warning if an
+// upgrade is not possible right now or if exec fails, in which case the
+// process keeps running as before.
+void upgrade(void);
+
+// Restores the state saved by upgrade(). Exits the program if the state is
+// malformed (e.g. from an incompatible version).
+void restore_upgrade(void);
+
+void upgrade_put_u64(uint64_t val);
+void upgrade_put_bytes(const void *data, size_t len);
+void upgrade_put_str(const char *s);
+
+uint64_t upgrade_get_u64(void);
+// The returned pointers point into the saved state and remain valid until
+// restore_upgrade() returns.
+const void *upgrade_get_bytes(size_t *len);
+const char *upgrade_get_str(void);
@@ -0,0 +1,46 @@
+// Bounded pool of worker threads for work that would otherwise stall the event
+// loop (e.g. heavy commands, see commands.c). Completions are signalled through
+// an eventfd, and the completion callbacks run on the event loop thread.
+//
+// Work is grouped into classes, each limiting how many of its jobs can be
+// queued or running at a time and keeping statistics on how long jobs wait
+// for a worker.
+
+typedef struct Work_class {
+    const char *name;
+    // Maximum number of jobs of this class that can be queued or running at
+    // the same time.
+    unsigned max_jobs;
+
+    // The fields below are maintained by the worker pool.
+
+    // Number of jobs currently queued or running.
+    unsigned n_jobs;
+    // Number of completed jobs.
+    uint64_t n_done;
+    // Time from submitting a job until a worker picked it up, in
+    // milliseconds.
+    double total_queue_ms;
+    double max_queue_ms;
+} Work_class;
+
+// Starts the worker threads and registers the completion eventfd with the
+// reactor (see reactor.h). Must be called before the functions below.
+void init_workers(void);
+
+// Waits for running jobs to finish and stops the worker threads. The 'done'
+// callbacks of all remaining jobs are called with 'cancelled' set.
+void free_workers(void);
+
+// Queues 'work' to be called with 'data' on a worker thread. 'done' is then
+// called with 'data' on the event loop thread. 'work' must not touch any
+// state shared with the event loop thread.
+//
+// Returns false without queuing anything if 'class' already has 'max_jobs'
+// jobs or if the queue is full.
+bool submit_work(Work_class *class, void (*work)(void *data),
+                 void (*done)(void *data, bool cancelled), void *data);
+
+// Returns true if any jobs are queued, running, or waiting for their 'done'
+// callback.
+bool workers_busy(void);
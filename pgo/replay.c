@@ -0,0 +1,499 @@
+// Fake IRC server for profile-guided builds and throughput comparisons (see
+// 'make pgo' in the Makefile).
+//
+// Starts the bot with the given command line, connected to a local listening
+// socket, registers it, and streams a corpus of server messages to it as
+// fast as it reads them. The corpus is either synthetic (a fixed
+// pseudo-random mix of channel chatter, commands, JOINs, PARTs, QUITs, NICK
+// changes, etc.) or the lines of a file given with -f (e.g. a capture of real
+// traffic), repeated until -n messages have been sent. The end of the corpus
+// is marked by an !echo, and the time until its reply arrives gives the
+// throughput. The bot is then stopped with SIGTERM.
+//
+// usage: replay [-n <messages>] [-r <runs>] [-f <corpus>] <bot>...
+//
+// Each bot executable is run '-r' times, alternating between the bots, and
+// the best throughput is reported. With two bots, the change from the first
+// to the second is also printed. The bots are run with the data directory in
+// $HOME, which is best pointed at a scratch directory.
+
+#include "common.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#define SERVER "pgo.test"
+#define NICK "botniklas"
+
+#define N_CHANNELS 16
+// Nicks in the synthetic corpus. Many, so that the per-sender flood limits
+// (see flood.h) and command rate limits (see rate_limit.h) rarely kick in,
+// like in a big network.
+#define N_NICKS 20000
+// Nicks in the NAMES reply for each channel.
+#define N_NAMES 50
+
+// Seconds to wait for the bot before giving up.
+#define TIMEOUT 120
+
+static const char *const words[] = {
+  "the", "a", "is", "it", "to", "and", "of", "in", "that", "you", "for",
+  "on", "with", "this", "but", "not", "what", "so", "just", "like", "I",
+  "compiler", "kernel", "epoll", "patch", "build", "bug", "segfault",
+  "release", "branch", "merge", "review", "lunch", "coffee", "weekend",
+  "tomorrow", "today", "maybe", "works", "broken", "fixed", "why", "how",
+  "lol", "yeah", "nope", "thanks", "hello", "1337", "ÅÄÖ", "grüße",
+  "https://example.com/issues/4711", "O(n^2)", "-O3", "x86-64", "arm64" };
+
+static const char *const commands[] = {
+  "!echo", "!seen", "!top", "!active", "!help", "!compliment", "!unknown",
+  "!commands" };
+
+typedef struct Buf {
+    char *data;
+    size_t len;
+    size_t size;
+} Buf;
+
+static Buf corpus;
+static size_t n_msgs = 300000;
+
+static uint64_t rng_state;
+
+// The running bot, or -1.
+static pid_t bot_pid = -1;
+
+// xorshift64*. Returns a number in [0, n[.
+static uint32_t rnd(uint32_t n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return (rng_state*0x2545F4914F6CDD1DULL >> 32)%n;
+}
+
+static void append(Buf *b, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void append(Buf *b, const char *format, ...) {
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, format);
+        len = vsnprintf(b->data + b->len, b->size - b->len, format, ap);
+        va_end(ap);
+        if (len < 0)
+            err_exit("vsnprintf (corpus)");
+        if (b->len + len < b->size)
+            break;
+        b->size = max(2*b->size, b->len + len + 1);
+        b->data = erealloc(b->data, b->size, "corpus");
+    }
+    b->len += len;
+}
+
+// Appends ":<nick>!<user>@<host> " for a random nick.
+static void append_source(Buf *b) {
+    unsigned n = rnd(N_NICKS);
+
+    append(b, ":nick%u!~u%u@host%u.example ", n, n, n%977);
+}
+
+static void append_words(Buf *b, unsigned min_n, unsigned max_n) {
+    unsigned n = min_n + rnd(max_n - min_n + 1);
+
+    for (unsigned i = 0; i < n; ++i)
+        append(b, i == 0 ? "%s" : " %s", words[rnd(ARRAY_LEN(words))]);
+}
+
+// Appends a random message in roughly the proportions seen on busy channels.
+static void append_synthetic_msg(Buf *b) {
+    unsigned kind = rnd(1000);
+    unsigned chan = rnd(N_CHANNELS);
+
+    if (kind < 700) {
+        append_source(b);
+        append(b, "PRIVMSG #chan%u :", chan);
+        if (rnd(20) == 0) {
+            append(b, "\1ACTION ");
+            append_words(b, 1, 8);
+            append(b, "\1");
+        }
+        else
+            append_words(b, 1, 16);
+    }
+    else if (kind < 750) {
+        const char *cmd = commands[rnd(ARRAY_LEN(commands))];
+
+        append_source(b);
+        append(b, "PRIVMSG %s :%s ", rnd(10) == 0 ? NICK : "#chan0", cmd);
+        if (strcmp(cmd, "!seen") == 0)
+            append(b, "nick%u", (unsigned)rnd(N_NICKS));
+        else
+            append_words(b, 0, 4);
+    }
+    else if (kind < 810) {
+        append_source(b);
+        append(b, "JOIN #chan%u", chan);
+    }
+    else if (kind < 860) {
+        append_source(b);
+        append(b, "PART #chan%u :", chan);
+        append_words(b, 0, 3);
+    }
+    else if (kind < 890) {
+        append_source(b);
+        append(b, "QUIT :Quit: ");
+        append_words(b, 0, 3);
+    }
+    else if (kind < 920) {
+        append_source(b);
+        append(b, "NICK nick%u", (unsigned)rnd(N_NICKS));
+    }
+    else if (kind < 945) {
+        append_source(b);
+        append(b, "NOTICE #chan%u :", chan);
+        append_words(b, 1, 10);
+    }
+    else if (kind < 960) {
+        append_source(b);
+        append(b, "MODE #chan%u +o nick%u", chan, (unsigned)rnd(N_NICKS));
+    }
+    else if (kind < 970) {
+        append_source(b);
+        append(b, "TOPIC #chan%u :", chan);
+        append_words(b, 1, 10);
+    }
+    else if (kind < 980) {
+        append_source(b);
+        append(b, "KICK #chan%u nick%u :", chan, (unsigned)rnd(N_NICKS));
+        append_words(b, 0, 3);
+    }
+    else if (kind < 990)
+        append(b, "PING :"SERVER);
+    else {
+        append(b, ":"SERVER" 353 "NICK" = #chan%u :", chan);
+        for (unsigned i = 0; i < 10; ++i)
+            append(b, i == 0 ? "nick%u" : " +nick%u",
+                   (unsigned)rnd(N_NICKS));
+    }
+    append(b, "\r\n");
+}
+
+static void make_synthetic_corpus(void) {
+    rng_state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < n_msgs; ++i)
+        append_synthetic_msg(&corpus);
+}
+
+// Makes a corpus of 'n_msgs' lines from 'filename', repeating it as needed.
+static void make_file_corpus(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    char **lines = NULL;
+    size_t n_lines = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+
+    if (f == NULL)
+        err_exit("%s", filename);
+
+    while ((len = getline(&line, &line_size, f)) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (*line == '\0')
+            continue;
+        lines = erealloc(lines, (n_lines + 1)*sizeof *lines, "corpus lines");
+        lines[n_lines++] = estrdup(line, "corpus line");
+    }
+    if (ferror(f))
+        err_exit("%s", filename);
+    fclose(f);
+    free(line);
+
+    if (n_lines == 0)
+        fail_exit("'%s' has no messages", filename);
+
+    for (size_t i = 0; i < n_msgs; ++i)
+        append(&corpus, "%s\r\n", lines[i%n_lines]);
+
+    for (size_t i = 0; i < n_lines; ++i)
+        free(lines[i]);
+    free(lines);
+}
+
+// Connection to the bot.
+typedef struct Conn {
+    int fd;
+    // Received data, searched for whole lines.
+    char in[65536];
+    size_t in_len;
+    // Set once a line starting with 'wait_for' has been received.
+    const char *wait_for;
+    bool seen;
+} Conn;
+
+static double now_s(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+// Reads what the bot has sent and looks for 'wait_for'. Returns false if the
+// bot closed the connection.
+static bool read_from_bot(Conn *c) {
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof c->in - c->in_len);
+        char *line;
+        char *end;
+
+        if (n == -1) {
+            if (errno == EAGAIN)
+                return true;
+            if (errno == ECONNRESET)
+                return false;
+            err_exit("read (bot)");
+        }
+        if (n == 0)
+            return false;
+        c->in_len += n;
+
+        line = c->in;
+        while ((end = memchr(line, '\n', c->in + c->in_len - line)) != NULL) {
+            *end = '\0';
+            if (c->wait_for != NULL &&
+                strncmp(line, c->wait_for, strlen(c->wait_for)) == 0)
+                c->seen = true;
+            line = end + 1;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+        // Drop overlong lines.
+        if (c->in_len == sizeof c->in)
+            c->in_len = 0;
+    }
+}
+
+// Sends 'len' bytes at 'buf' to the bot while reading what it sends, and then
+// waits for a line starting with 'wait_for', unless it's NULL. Returns false
+// if the bot closed the connection.
+static bool exchange(Conn *c, const char *buf, size_t len,
+                     const char *wait_for) {
+    double deadline = now_s() + TIMEOUT;
+
+    c->wait_for = wait_for;
+    c->seen = false;
+
+    while (len != 0 || (wait_for != NULL && !c->seen)) {
+        struct pollfd pfd = { c->fd, POLLIN | (len != 0 ? POLLOUT : 0), 0 };
+
+        if (now_s() > deadline)
+            fail_exit("Timed out waiting for the bot");
+
+        if (poll(&pfd, 1, 1000) == -1)
+            err_exit("poll");
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR) && !read_from_bot(c))
+            return false;
+
+        if (len != 0 && pfd.revents & POLLOUT) {
+            ssize_t n = write(c->fd, buf, len);
+
+            if (n == -1) {
+                if (errno == EAGAIN)
+                    continue;
+                if (errno == EPIPE || errno == ECONNRESET)
+                    return false;
+                err_exit("write (bot)");
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+
+    return true;
+}
+
+static bool send_str(Conn *c, const char *s, const char *wait_for) {
+    return exchange(c, s, strlen(s), wait_for);
+}
+
+// Registers the bot and makes it part of the channels in the corpus.
+static bool set_up(Conn *c) {
+    Buf setup = { NULL, 0, 0 };
+    bool ok;
+
+    append(&setup,
+           ":"SERVER" 001 "NICK" :Welcome to the fake network\r\n"
+           ":"SERVER" 005 "NICK" CASEMAPPING=rfc1459 CHANTYPES=# "
+           "PREFIX=(ov)@+ TARGMAX=JOIN:4 :are supported by this server\r\n"
+           ":"SERVER" 376 "NICK" :End of /MOTD command.\r\n");
+    for (unsigned chan = 0; chan < N_CHANNELS; ++chan) {
+        append(&setup, ":"NICK"!bot@pgo.test JOIN #chan%u\r\n"
+               ":"SERVER" 353 "NICK" = #chan%u :@"NICK, chan, chan);
+        for (unsigned i = 0; i < N_NAMES; ++i)
+            append(&setup, " nick%u", (unsigned)rnd(N_NICKS));
+        append(&setup, "\r\n:"SERVER" 366 "NICK" #chan%u :End of /NAMES "
+               "list.\r\n", chan);
+    }
+    // Wait for the bot to get through the above.
+    append(&setup,
+           ":pgo!start@pgo.start PRIVMSG #chan0 :!echo pgo-start\r\n");
+
+    ok = exchange(c, setup.data, setup.len, "PRIVMSG #chan0 :pgo-start");
+    free(setup.data);
+
+    return ok;
+}
+
+// Kills the bot if we exit early (e.g. from fail_exit()).
+static void kill_bot(void) {
+    if (bot_pid != -1)
+        kill(bot_pid, SIGKILL);
+}
+
+// Runs 'argv' (the bot) and streams the corpus to it. Returns the
+// throughput in messages per second.
+static double run_bot(char *argv[]) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addr_len = sizeof addr;
+    char port[16];
+    char **args;
+    size_t n_args;
+    int listen_fd;
+    Conn *c;
+    int status;
+    double start;
+    double elapsed;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        err_exit("socket");
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) == -1)
+        err_exit("listening socket");
+    snprintf(port, sizeof port, "%u", ntohs(addr.sin_port));
+
+    // <bot> -n <nick> -p <port> 127.0.0.1
+    for (n_args = 0; argv[n_args] != NULL; ++n_args);
+    args = emalloc((n_args + 6)*sizeof *args, "bot arguments");
+    memcpy(args, argv, n_args*sizeof *args);
+    args[n_args++] = "-n";
+    args[n_args++] = NICK;
+    args[n_args++] = "-p";
+    args[n_args++] = port;
+    args[n_args++] = "127.0.0.1";
+    args[n_args] = NULL;
+
+    bot_pid = fork();
+    if (bot_pid == -1)
+        err_exit("fork");
+    if (bot_pid == 0) {
+        // Keep the progress messages of the bot out of the results.
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+            err_exit("redirecting stdout of the bot");
+        execv(args[0], args);
+        err_exit("execv (%s)", args[0]);
+    }
+    free(args);
+
+    c = emalloc(sizeof *c, "connection");
+    c->in_len = 0;
+    c->fd = accept(listen_fd, NULL, NULL);
+    if (c->fd == -1)
+        err_exit("accept");
+    if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1)
+        err_exit("fcntl (O_NONBLOCK)");
+    close(listen_fd);
+
+    if (!set_up(c))
+        fail_exit("%s closed the connection during registration", argv[0]);
+
+    start = now_s();
+    if (!exchange(c, corpus.data, corpus.len, NULL) ||
+        !send_str(c, ":pgo!end@pgo.end PRIVMSG #chan0 :!echo pgo-end\r\n",
+                  "PRIVMSG #chan0 :pgo-end"))
+        fail_exit("%s closed the connection", argv[0]);
+    elapsed = now_s() - start;
+
+    // Stop the bot. It sends a QUIT and exits when we close the connection.
+    if (kill(bot_pid, SIGTERM) == -1)
+        err_exit("kill");
+    send_str(c, "", "QUIT");
+    close(c->fd);
+    free(c);
+
+    if (waitpid(bot_pid, &status, 0) == -1)
+        err_exit("waitpid");
+    bot_pid = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        fail_exit("%s did not exit cleanly", argv[0]);
+
+    return n_msgs/elapsed;
+}
+
+static noreturn void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n <messages>] [-r <runs>] [-f <corpus>] "
+                    "<bot>...\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *corpus_file = NULL;
+    unsigned runs = 1;
+    double *best;
+    int n_bots;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:r:")) != -1)
+        switch (opt) {
+        case 'f': corpus_file = optarg; break;
+        case 'n': n_msgs = strtoul(optarg, NULL, 10); break;
+        case 'r': runs = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    n_bots = argc - optind;
+    if (n_bots == 0 || n_msgs == 0 || runs == 0)
+        usage(argv[0]);
+
+    // The bot might close the connection while we write.
+    signal(SIGPIPE, SIG_IGN);
+    atexit(kill_bot);
+
+    if (corpus_file != NULL)
+        make_file_corpus(corpus_file);
+    else
+        make_synthetic_corpus();
+
+    best = emalloc(n_bots*sizeof *best, "results");
+    for (int i = 0; i < n_bots; ++i)
+        best[i] = 0;
+
+    // Alternate between the bots, so that e.g. a busy machine affects all of
+    // them.
+    for (unsigned run = 0; run < runs; ++run)
+        for (int i = 0; i < n_bots; ++i) {
+            char *bot_argv[] = { argv[optind + i], NULL };
+
+            best[i] = max(best[i], run_bot(bot_argv));
+        }
+
+    for (int i = 0; i < n_bots; ++i)
+        printf("%-24s %zu messages, best of %u: %.0f messages/s\n",
+               argv[optind + i], n_msgs, runs, best[i]);
+    if (n_bots == 2)
+        printf("%s vs. %s: %+.1f%%\n", argv[optind + 1], argv[optind],
+               100*(best[1]/best[0] - 1));
+
+    free(best);
+    free(corpus.data);
+
+    exit(EXIT_SUCCESS);
+}
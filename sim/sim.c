@@ -0,0 +1,452 @@
+// Fake IRC server that drives the bot through simulated days (see 'make sim'
+// in the Makefile).
+//
+// Starts the bot in simulation mode (-S) with the given command line,
+// connected to a local listening socket, and plays a scripted scenario on the
+// bot's virtual clock: each day, users set reminders for later in the day,
+// chat in the channel, and race to write "1337" at 13:37 for the default
+// trigger (see triggers.c), with some days having no takers. A weekday
+// reminder set on the first day recurs. The clock is advanced with SIMTIME
+// messages in steps of at most -s seconds, waiting for the bot to acknowledge
+// each step, so time events run exactly when they would in real time.
+//
+// The scenario is fixed, so the bot's output is the same on every run. It is
+// checked against the expected number of reminders and trigger responses, and
+// a checksum of the output is printed for comparing runs and builds. The time
+// taken makes it a benchmark for timer-heavy workloads.
+//
+// usage: sim [-d <days>] [-s <step seconds>] <bot>
+//
+// The bot is run with the data directory in $HOME, which should be an empty
+// scratch directory, and with TZ=UTC.
+
+#include "common.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+#define SERVER "sim.test"
+#define NICK "botniklas"
+// Channel of the default trigger.
+#define CHANNEL "#code.se"
+
+// Monday 2026-01-05 00:00 UTC.
+#define START_TIME 1767571200
+#define SECS_PER_DAY (24*60*60)
+
+// One-shot reminders set per day, and chat messages per day.
+#define REMINDERS_PER_DAY 20
+#define CHAT_PER_DAY 200
+
+static const char *const words[] = {
+  "the", "a", "is", "it", "to", "and", "of", "in", "that", "you", "for",
+  "on", "with", "this", "but", "not", "what", "so", "just", "like", "I",
+  "compiler", "kernel", "epoll", "patch", "build", "bug", "segfault",
+  "release", "branch", "merge", "review", "lunch", "coffee", "weekend",
+  "tomorrow", "today", "maybe", "works", "broken", "fixed", "why", "how" };
+
+// A message from a user at a time in the scenario.
+typedef struct Event {
+    time_t when;
+    char *line;
+} Event;
+
+typedef struct Day {
+    Event *events;
+    size_t n_events;
+    // Expected responses from the bot.
+    unsigned n_reminders;
+    bool leet_hit;
+} Day;
+
+static unsigned n_days = 7;
+static unsigned step = 60;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+// The running bot, or -1.
+static pid_t bot_pid = -1;
+
+// Connection to the bot. Received data is searched for whole lines.
+static int bot_fd;
+static char in[65536];
+static size_t in_len;
+
+// What the bot sent.
+static uint64_t n_lines;
+static uint64_t n_reminders;
+static uint64_t n_leet_hits;
+static uint64_t n_leet_misses;
+// FNV-1a of all lines.
+static uint64_t checksum = 0xcbf29ce484222325ULL;
+
+// xorshift64*. Returns a number in [0, n[.
+static uint32_t rnd(uint32_t n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return (rng_state*0x2545F4914F6CDD1DULL >> 32)%n;
+}
+
+static void add_event(Day *day, time_t when, const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+static void add_event(Day *day, time_t when, const char *format, ...) {
+    va_list ap;
+    Event *event;
+    int len;
+
+    day->events = erealloc(day->events,
+                           (day->n_events + 1)*sizeof *day->events,
+                           "events");
+    event = &day->events[day->n_events++];
+    event->when = when;
+    va_start(ap, format);
+    len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (len < 0)
+        err_exit("vsnprintf (event)");
+    event->line = emalloc(len + 1, "event line");
+    va_start(ap, format);
+    vsnprintf(event->line, len + 1, format, ap);
+    va_end(ap);
+}
+
+// Sorts by time, keeping the order of events at the same time.
+static int cmp_events(const void *a, const void *b) {
+    const Event *x = a;
+    const Event *y = b;
+
+    if (x->when != y->when)
+        return (x->when > y->when) - (x->when < y->when);
+
+    return (x > y) - (x < y);
+}
+
+// Makes the scenario for day number 'n', which starts at 'start'.
+static void make_day(Day *day, unsigned n, time_t start) {
+    // 0 = Monday.
+    unsigned weekday = n%7;
+
+    day->events = NULL;
+    day->n_events = 0;
+    day->n_reminders = 0;
+
+    if (n == 0)
+        add_event(day, start + 7*60*60,
+                  ":lead!~lead@lead.example PRIVMSG "CHANNEL" :!remind every "
+                  "weekday 10:00 standup");
+    if (weekday < 5)
+        ++day->n_reminders;
+
+    // Set between 08:00 and 08:40, due between 09:00 and 23:59. Private
+    // messages, so that the similar commands aren't taken for a flood.
+    for (unsigned i = 0; i < REMINDERS_PER_DAY; ++i) {
+        unsigned due = 9*60 + rnd(15*60);
+
+        add_event(day, start + 8*60*60 + 120*i,
+                  ":rem%u!~rem@rem%u.example PRIVMSG "NICK" :!remind "
+                  "%02u:%02u day %u reminder %u", n*REMINDERS_PER_DAY + i,
+                  n*REMINDERS_PER_DAY + i, due/60, due%60, n, i);
+        ++day->n_reminders;
+    }
+
+    for (unsigned i = 0; i < CHAT_PER_DAY; ++i) {
+        unsigned n_words = 1 + rnd(12);
+        char text[256];
+        size_t len = 0;
+
+        for (unsigned w = 0; w < n_words; ++w) {
+            const char *word = words[rnd(ARRAY_LEN(words))];
+
+            len += snprintf(text + len, sizeof text - len,
+                            w == 0 ? "%s" : " %s", word);
+        }
+        add_event(day, start + rnd(SECS_PER_DAY),
+                  ":nick%u!~u@host%u.example PRIVMSG "CHANNEL" :%s",
+                  (unsigned)rnd(1000), (unsigned)rnd(100), text);
+    }
+
+    // No one is 1337 on every fourth day or so. Otherwise, a few people
+    // write "1337" within the minute, and only the first one wins.
+    day->leet_hit = rnd(4) != 0;
+    if (day->leet_hit) {
+        unsigned n_leet = 1 + rnd(3);
+        time_t t = start + 13*60*60 + 37*60;
+
+        for (unsigned i = 0; i < n_leet; ++i) {
+            t += rnd(20);
+            add_event(day, t, ":leet%u!~l@leet%u.example PRIVMSG "CHANNEL
+                      " :1337", i, i);
+        }
+    }
+
+    qsort(day->events, day->n_events, sizeof *day->events, cmp_events);
+}
+
+static void free_day(Day *day) {
+    for (size_t i = 0; i < day->n_events; ++i)
+        free(day->events[i].line);
+    free(day->events);
+}
+
+static double now_s(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static void handle_line(const char *line) {
+    ++n_lines;
+    for (const char *s = line; *s != '\0'; ++s)
+        checksum = (checksum ^ (uc)*s)*0x100000001b3ULL;
+    checksum = (checksum ^ '\n')*0x100000001b3ULL;
+
+    if (strstr(line, " :REMINDER: ") != NULL)
+        ++n_reminders;
+    else if (strstr(line, " is the 1337est!!!") != NULL)
+        ++n_leet_hits;
+    else if (strstr(line, "No one was 1337 today.") != NULL)
+        ++n_leet_misses;
+}
+
+// Reads from the bot until a line starting with 'prefix' arrives. Fails if
+// the bot closes the connection.
+static void wait_for(const char *prefix) {
+    for (;;) {
+        ssize_t n = read(bot_fd, in + in_len, sizeof in - in_len);
+        char *line;
+        char *end;
+        bool seen = false;
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            err_exit("read (bot)");
+        }
+        if (n == 0)
+            fail_exit("The bot closed the connection");
+        in_len += n;
+
+        line = in;
+        while ((end = memchr(line, '\n', in + in_len - line)) != NULL) {
+            *end = '\0';
+            if (end != line && end[-1] == '\r')
+                end[-1] = '\0';
+            if (strncmp(line, prefix, strlen(prefix)) == 0)
+                seen = true;
+            else
+                handle_line(line);
+            line = end + 1;
+        }
+        in_len -= line - in;
+        memmove(in, line, in_len);
+        // Drop overlong lines.
+        if (in_len == sizeof in)
+            in_len = 0;
+
+        if (seen)
+            return;
+    }
+}
+
+static void send_line(const char *format, ...)
+  __attribute__((format(printf, 1, 2)));
+
+static void send_line(const char *format, ...) {
+    char buf[1024];
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(buf, sizeof buf - 2, format, ap);
+    va_end(ap);
+    if (len < 0 || len >= sizeof buf - 2)
+        fail_exit("Overlong line for the bot");
+    memcpy(buf + len, "\r\n", 2);
+    len += 2;
+
+    for (const char *s = buf; len != 0;) {
+        ssize_t n = write(bot_fd, s, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            err_exit("write (bot)");
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+// Advances the bot's clock from 'cur' to 'to' in steps of at most 'step'
+// seconds. Returns the number of steps.
+static uint64_t advance(time_t *cur, time_t to) {
+    uint64_t n_steps = 0;
+    char ack[64];
+
+    while (*cur < to) {
+        *cur = min(*cur + step, to);
+        send_line("SIMTIME %jd", (intmax_t)*cur);
+        snprintf(ack, sizeof ack, "SIMTIME %jd", (intmax_t)*cur);
+        wait_for(ack);
+        ++n_steps;
+    }
+
+    return n_steps;
+}
+
+// Registers the bot and makes it join the channel. The bot has a JOIN queued
+// from the end of the MOTD, so the JOIN from the server can come right away.
+static void set_up(time_t cur) {
+    send_line(":"SERVER" 001 "NICK" :Welcome to the simulated network");
+    send_line(":"SERVER" 376 "NICK" :End of /MOTD command.");
+    send_line(":"NICK"!bot@sim.test JOIN "CHANNEL);
+    send_line(":"SERVER" 353 "NICK" = "CHANNEL" :@"NICK" lead");
+    send_line(":"SERVER" 366 "NICK" "CHANNEL" :End of /NAMES list.");
+    // Wait for the bot to get through the above.
+    send_line("SIMTIME %jd", (intmax_t)cur);
+    wait_for("SIMTIME");
+}
+
+// Kills the bot if we exit early (e.g. from fail_exit()).
+static void kill_bot(void) {
+    if (bot_pid != -1)
+        kill(bot_pid, SIGKILL);
+}
+
+static void start_bot(const char *bot) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addr_len = sizeof addr;
+    char port[16];
+    char start[32];
+    int listen_fd;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        err_exit("socket");
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) == -1)
+        err_exit("listening socket");
+    snprintf(port, sizeof port, "%u", ntohs(addr.sin_port));
+    snprintf(start, sizeof start, "%d", START_TIME);
+
+    // Local times in the bot's output (e.g. in reminder confirmations) must
+    // not depend on the machine.
+    if (setenv("TZ", "UTC", 1) == -1)
+        err_exit("setenv (TZ)");
+
+    bot_pid = fork();
+    if (bot_pid == -1)
+        err_exit("fork");
+    if (bot_pid == 0) {
+        // Keep the progress messages of the bot out of the results.
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+            err_exit("redirecting stdout of the bot");
+        execl(bot, bot, "-S", start, "-n", NICK, "-c", CHANNEL, "-p", port,
+              "127.0.0.1", (char*)NULL);
+        err_exit("execl (%s)", bot);
+    }
+
+    bot_fd = accept(listen_fd, NULL, NULL);
+    if (bot_fd == -1)
+        err_exit("accept");
+    // Each step is a round trip of small messages, which Nagle's algorithm
+    // would hold back.
+    if (setsockopt(bot_fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 },
+                   sizeof(int)) == -1)
+        err_exit("setsockopt (TCP_NODELAY)");
+    close(listen_fd);
+}
+
+static void stop_bot(const char *bot) {
+    int status;
+
+    // The bot sends a QUIT and exits when we close the connection.
+    if (kill(bot_pid, SIGTERM) == -1)
+        err_exit("kill");
+    wait_for("QUIT");
+    close(bot_fd);
+
+    if (waitpid(bot_pid, &status, 0) == -1)
+        err_exit("waitpid");
+    bot_pid = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        fail_exit("%s did not exit cleanly", bot);
+}
+
+static noreturn void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-d <days>] [-s <step seconds>] <bot>\n",
+            argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned expected_reminders = 0;
+    unsigned expected_hits = 0;
+    uint64_t n_steps = 0;
+    uint64_t n_msgs = 0;
+    time_t cur = START_TIME;
+    double start;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:")) != -1)
+        switch (opt) {
+        case 'd': n_days = strtoul(optarg, NULL, 10); break;
+        case 's': step = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    if (argc - optind != 1 || n_days == 0 || step == 0)
+        usage(argv[0]);
+
+    atexit(kill_bot);
+
+    start_bot(argv[optind]);
+    set_up(cur);
+
+    start = now_s();
+    for (unsigned n = 0; n < n_days; ++n) {
+        time_t day_start = START_TIME + (time_t)n*SECS_PER_DAY;
+        Day day;
+
+        make_day(&day, n, day_start);
+        expected_reminders += day.n_reminders;
+        expected_hits += day.leet_hit;
+
+        for (size_t i = 0; i < day.n_events; ++i) {
+            n_steps += advance(&cur, day.events[i].when);
+            send_line("%s", day.events[i].line);
+            ++n_msgs;
+        }
+        n_steps += advance(&cur, day_start + SECS_PER_DAY);
+
+        free_day(&day);
+    }
+    elapsed = now_s() - start;
+
+    stop_bot(argv[optind]);
+
+    printf("%u simulated days (%"PRIu64" clock steps of up to %u s, %"PRIu64
+           " messages) in %.2f s: %.0f steps/s\n", n_days, n_steps, step,
+           n_msgs, elapsed, n_steps/elapsed);
+    printf("Bot output: %"PRIu64" lines, %"PRIu64" reminders, %"PRIu64
+           " 1337 winners, %"PRIu64" 1337 misses, checksum %016"PRIx64"\n",
+           n_lines, n_reminders, n_leet_hits, n_leet_misses, checksum);
+
+    if (n_reminders != expected_reminders || n_leet_hits != expected_hits ||
+        n_leet_misses != n_days - expected_hits)
+        fail_exit("Expected %u reminders, %u 1337 winners, and %u 1337 "
+                  "misses", expected_reminders, expected_hits,
+                  n_days - expected_hits);
+
+    exit(EXIT_SUCCESS);
+}
@@ -1,172 +1,267 @@
 #include "common.h"
+#include "casemap.h"
+#include "channel_config.h"
+#include "channel_state.h"
+#include "chat_log.h"
+#include "flood.h"
+#include "intern.h"
 #include "irc.h"
+#include "lag.h"
+#include "latency.h"
 #include "msg_io.h"
 #include "options.h"
+#include "rate_limit.h"
+#include "reactor.h"
+#include "reload.h"
+#include "remind.h"
+#include "resolve.h"
+#include "seen.h"
 #include "state.h"
+#include "stats.h"
 #include "time_event.h"
+#include "transport.h"
+#include "triggers.h"
+#include "upgrade.h"
+#include "worker.h"
 
 static int signal_fd;
 
-static int epoll_fd;
+// Set when messages from the server were handled during the current event loop
+// iteration.
+static bool server_handled;
 
-// Event sources.
-#define SERVER 0
-#define TIMER 1
-#define SIGNAL 2
+// Set once we have sent a QUIT. The server closing the connection after that
+// shuts down the bot, and anything else makes it reconnect.
+static bool quitting;
+
+static void handle_signal(int fd, uint32_t events, void *ctx);
 
 static void init(void) {
     sigset_t sig_mask;
 
+    // Create the epoll instance that the modules below register their file
+    // descriptors with.
+    init_reactor();
+
     msg_read_buf_init();
     msg_write_buf_init();
+    init_casemap();
+    intern_init();
+    init_channel_state();
+    // Before the channel configuration, which gets its defaults from the
+    // options.
+    load_config_file();
+    load_channel_config();
+    init_rate_limit();
+    init_flood();
+    init_reminders();
+    init_seen();
 
     // Handle termination signals (except for SIGABRT and SIGQUIT) with a
     // signalfd...
     sigemptyset(&sig_mask);
     sigaddset(&sig_mask, SIGINT); // Ctrl-C
     sigaddset(&sig_mask, SIGTERM); // $ kill <bot>
+    sigaddset(&sig_mask, SIGUSR2); // Live upgrade
+    sigaddset(&sig_mask, SIGHUP); // Reload the configuration
     signal_fd = signalfd(-1, &sig_mask, SFD_CLOEXEC);
     if (signal_fd == -1)
         err_exit("signalfd");
 
-    // ...and block them to prevent their default action. Also block SIGHUP and
-    // SIGPIPE since it's probably not useful to have the bot die for those.
-    sigaddset(&sig_mask, SIGHUP);
+    // ...and block them to prevent their default action. Also block SIGPIPE
+    // since it's probably not useful to have the bot die for it.
     sigaddset(&sig_mask, SIGPIPE);
     if (sigprocmask(SIG_BLOCK, &sig_mask, NULL) == -1)
         err_exit("sigprocmask");
+    reactor_add(signal_fd, REACTOR_READ, handle_signal, NULL);
 
     // Create a timerfd to handle timer events synchronously.
     init_time_event();
 
-    // Restore saved state (e.g., reminders) from files.
-    restore_state();
+    // Watch the configuration files for changes.
+    init_reload();
+
+    // Schedules snapshots, so it needs time events.
+    init_stats();
+
+    // Start the resolver thread for looking up the server.
+    init_resolve();
+
+    // Start the worker threads for heavy commands.
+    init_workers();
+
+    // Start the chat log writer thread.
+    init_chat_log();
+
+    // Restore the state handed over by the previous process in a live
+    // upgrade, or saved state (e.g., reminders) from files.
+    if (resuming_upgrade())
+        restore_upgrade();
+    else
+        restore_state();
+}
+
+// Called when the connection to the server is closed or fails.
+static void server_lost(void) {
+    if (quitting)
+        reactor_stop();
+    else
+        reconnect_to_irc_server();
+}
+
+// True if 'serv_fd' is registered for writability, because queued output did
+// not fit in the socket buffer.
+static bool serv_want_write;
+
+static void handle_server(int fd, uint32_t events, void *ctx) {
+    // Writability just wakes up the event loop, which flushes the queued
+    // output at the end of the iteration.
+    if (events == EPOLLOUT)
+        return;
+
+    // We currently assume that any notification (EPOLLIN, EPOLLERR, EPOLLHUP)
+    // will result in a non-blocking read, meaning we can handle errors inside
+    // process_msgs().
+    if (!process_msgs())
+        // Connection shutdown by the server, or a receive or send error.
+        server_lost();
+    server_handled = true;
 }
 
-// Adds 'fd' to the monitored set for the epoll instance 'epfd'. We monitor for
-// data to read (EPOLLIN), hangups (EPOLLHUP), and errors (EPOLLERR), where the
-// latter two are implicit and don't need to be specified. 'id' is an event
-// source identifier that we receive in data.u32 when events occur. If
-// 'edge_triggered' is true, EPOLLET is used.
-static void add_epoll_read_fd(int epfd, int fd, uint32_t id,
-                              bool edge_triggered) {
-    struct epoll_event ev = {
-      .events = EPOLLIN,
-      .data.u32 = id };
-
-    if (edge_triggered)
-        ev.events |= EPOLLET;
-
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
-        err_exit("epoll_ctl (EPOLL_CTL_ADD)%s",
-                 edge_triggered ? " with EPOLLET" : "");
+// Called by connect_to_irc_server() once 'serv_fd' is connected.
+static void server_connected(void) {
+    reactor_add(serv_fd, REACTOR_READ, handle_server, NULL);
+    serv_want_write = false;
 }
 
-// Creates an epoll instance to monitor the various event sources.
-static void init_epoll(void) {
-    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd == -1)
-        err_exit("epoll_create");
-
-    add_epoll_read_fd(epoll_fd, serv_fd, SERVER, false);
-    // Use edge-triggered notification to avoid having to read() the expiration
-    // count from timerfd. It will always be 1 since we don't use interval
-    // timers.
-    add_epoll_read_fd(epoll_fd, timer_fd, TIMER, true);
-    add_epoll_read_fd(epoll_fd, signal_fd, SIGNAL, false);
+// Waits for 'serv_fd' to become writable while there is output that the
+// socket did not take.
+static void update_server_interest(void) {
+    if (serv_fd == -1 || serv_output_pending() == serv_want_write)
+        return;
+
+    serv_want_write = !serv_want_write;
+    reactor_modify(serv_fd, serv_want_write ? REACTOR_READ | REACTOR_WRITE :
+                                              REACTOR_READ);
+}
+
+static void handle_signal(int fd, uint32_t events, void *ctx) {
+    // Send a QUIT message when the first signal is received, which should
+    // cause a server-side shutdown and make sure the quit message is seen. If
+    // another signal arrives, close the connection ourselves.
+
+    static bool first_signal = true;
+    struct signalfd_siginfo si;
+
+    if (!(events & EPOLLIN) || events & EPOLLERR)
+        fail_exit("Got epoll error/weirdness related to signalfd. Not sure "
+                  "what's going on. Bailing out.");
+
+    if (read(signal_fd, &si, sizeof si) == -1)
+        err_exit("read (signalfd)");
+
+    printf("\nReceived signal '%s'. ", strsignal(si.ssi_signo));
+    if (si.ssi_signo == SIGUSR2) {
+        // Only returns if the upgrade fails.
+        upgrade();
+        return;
+    }
+    if (si.ssi_signo == SIGHUP) {
+        puts("Reloading the configuration.");
+        reload_config();
+        return;
+    }
+    if (serv_fd == -1) {
+        puts("Not connected yet. Exiting.");
+        reactor_stop();
+        return;
+    }
+    if (first_signal) {
+        printf("Sending QUIT message (\"%s\").\n", quit_message);
+        write_msg("QUIT :%s", quit_message);
+        first_signal = false;
+        quitting = true;
+    }
+    else {
+        puts("Disconnecting.");
+        reactor_stop();
+    }
 }
 
 static void deinit(void) {
+    print_latency_summary();
+
     msg_read_buf_free();
     msg_write_buf_free();
-
-    if (close(serv_fd) == -1)
-        err_exit("close (serv_fd)");
+    free_channel_state();
+    free_channel_config();
+    free_config_file();
+    free_triggers();
+    free_chat_log();
+    free_reminders();
+    free_seen();
+    free_stats();
+    free_flood();
+    intern_free();
+
+    cancel_connect_to_irc_server();
+    // Send the QUIT if it's still queued.
+    serv_flush();
+    tls_close();
+    free_serv_send_buf();
+    if (serv_fd != -1) {
+        reactor_remove(serv_fd);
+        if (close(serv_fd) == -1)
+            err_exit("close (serv_fd)");
+    }
+    reactor_remove(signal_fd);
     if (close(signal_fd) == -1)
         err_exit("close (signal_fd)");
+    free_reload();
     free_time_event();
+    free_resolve();
+    free_workers();
 
-    if (close(epoll_fd) == -1)
-        err_exit("close (epoll_fd)");
+    free_reactor();
 }
 
 int main(int argc, char *argv[]) {
-    struct epoll_event events[3];
-
     process_cmdline(argc, argv);
+    init_upgrade(argv);
 
     init();
-    connect_to_irc_server(server, port, nick, username, realname);
-    init_epoll();
+    if (resuming_upgrade()) {
+        // Already connected and registered. Handle any messages that the
+        // previous process received but didn't get to.
+        server_connected();
+        resume_msgs();
+        lag_start();
+    }
+    else
+        connect_to_irc_server(server, port, nick, username, realname,
+                              server_connected);
 
+    // Wait for messages from the server, timer expirations, signals, completed
+    // lookups, and completed heavy commands. If messages are left over from a
+    // burst, just check for other events before getting back to them.
     for (;;) {
-        int n_events;
-
-again:
-        // Wait for messages from the server, timer expirations, and signals.
-        n_events = epoll_wait(epoll_fd, events, ARRAY_LEN(events), -1);
-        if (n_events == -1) {
-            if (errno == EINTR)
-                // epoll_wait() generates EINTR if the process is stopped and
-                // resumed, so it's important that we handle this case.
-                goto again;
-            err_exit("epoll_wait");
-        }
-
-        for (int i = 0; i < n_events; ++i) {
-            switch (events[i].data.u32) {
-            case SERVER:
-                // We currently assume that any notification (EPOLLIN,
-                // EPOLLERR, EPOLLHUP) will result in a non-blocking read,
-                // meaning we can handle errors inside process_msgs().
-                if (!process_msgs())
-                    // Connection shutdown by the server or a receive error.
-                    goto done;
-                break;
-
-            case TIMER:
-                if (!(events[i].events & EPOLLIN) ||
-                      events[i].events & EPOLLERR)
-                    fail_exit("Got epoll error/weirdness related to timerfd. "
-                              "Not sure what's going on. Bailing out.");
-
-                handle_time_event();
-                break;
-
-            case SIGNAL:
-                {
-                // Send a QUIT message when the first signal is received, which
-                // should cause a server-side shutdown and make sure the quit
-                // message is seen. If another signal arrives, close the
-                // connection ourselves.
-
-                static bool first_signal = true;
-                struct signalfd_siginfo si;
-
-                if (!(events[i].events & EPOLLIN) ||
-                      events[i].events & EPOLLERR)
-                    fail_exit("Got epoll error/weirdness related to signalfd. "
-                              "Not sure what's going on. Bailing out.");
-
-                if (read(signal_fd, &si, sizeof si) == -1)
-                    err_exit("read (signalfd)");
-
-                printf("\nReceived signal '%s'. ", strsignal(si.ssi_signo));
-                if (first_signal) {
-                    printf("Sending QUIT message (\"%s\").\n", quit_message);
-                    write_msg("QUIT :%s", quit_message);
-                    first_signal = false;
-                }
-                else {
-                    puts("Disconnecting.");
-                    goto done;
-                }
-                }
-            }
-        }
+        server_handled = false;
+        if (!reactor_poll(msgs_pending() ? 0 : -1))
+            break;
+
+        if (msgs_pending() && !server_handled && !process_pending_msgs())
+            server_lost();
+
+        // Send everything written during this iteration in one go.
+        serv_flush();
+        if (serv_send_failed())
+            server_lost();
+        else
+            update_server_interest();
+
+        flush_chat_log();
     }
 
-done:
     deinit();
 
     puts("Process shut down cleanly");
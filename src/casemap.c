@@ -0,0 +1,153 @@
+// IRC casemapping. See casemap.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "upgrade.h"
+
+// All casemappings fold a contiguous range of characters starting at 'A' by
+// setting bit 0x20. 'fold_last' is the last character in the range.
+#define FOLD_FIRST 'A'
+static uc fold_last;
+
+// Folded version of each character.
+static uc fold_table[UCHAR_MAX + 1];
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Word-at-a-time versions of the range check, precomputed for 'fold_last'.
+// Adding 'lo_add' (or 'hi_add') to a byte below 0x80 sets its high bit iff the
+// byte is >= FOLD_FIRST (or > 'fold_last'). See fold_word().
+static uint64_t lo_add;
+static uint64_t hi_add;
+
+static void init_tables(uc last) {
+    fold_last = last;
+
+    for (int c = 0; c <= UCHAR_MAX; ++c)
+        fold_table[c] = c >= FOLD_FIRST && c <= last ? c | 0x20 : c;
+
+    lo_add = (0x80 - FOLD_FIRST)*ONES;
+    hi_add = (0x7F - last)*ONES;
+}
+
+// Folds the eight bytes in 'w' in parallel.
+static uint64_t fold_word(uint64_t w) {
+    // Clearing the high bits first makes sure the additions can't carry into
+    // the next byte. Bytes that had their high bit set are masked out again
+    // with ~w.
+    uint64_t low7 = w & ~HIGHS;
+    uint64_t in_range = (low7 + lo_add) & ~(low7 + hi_add) & ~w & HIGHS;
+
+    // Move each 0x80 flag down to 0x20.
+    return w | in_range >> 2;
+}
+
+bool set_casemapping(const char *name) {
+    uc last;
+
+    if (strcmp(name, "rfc1459") == 0)
+        last = '^';
+    else if (strcmp(name, "strict-rfc1459") == 0)
+        last = ']';
+    else {
+        if (strcmp(name, "ascii") != 0)
+            warning("Unknown casemapping '%s'. Using 'ascii'.", name);
+        last = 'Z';
+    }
+
+    if (last == fold_last)
+        return false;
+
+    init_tables(last);
+
+    return true;
+}
+
+void init_casemap(void) {
+    init_tables('^');
+}
+
+char casemap_fold(char c) {
+    return fold_table[(uc)c];
+}
+
+int casemap_cmp(const char *a, const char *b) {
+    const uc *ua = (const uc*)a;
+    const uc *ub = (const uc*)b;
+
+    while (*ua != '\0' && fold_table[*ua] == fold_table[*ub]) {
+        ++ua;
+        ++ub;
+    }
+
+    return fold_table[*ua] - fold_table[*ub];
+}
+
+bool casemap_eq(const char *a, const char *b) {
+    size_t len = strlen(a);
+
+    return strlen(b) == len && casemap_eq_n(a, b, len);
+}
+
+bool casemap_eq_n(const char *a, const char *b, size_t len) {
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t wa;
+        uint64_t wb;
+
+        memcpy(&wa, a, sizeof wa);
+        memcpy(&wb, b, sizeof wb);
+        if (wa != wb && fold_word(wa) != fold_word(wb))
+            return false;
+
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+    }
+
+    for (; len != 0; --len)
+        if (fold_table[(uc)*a++] != fold_table[(uc)*b++])
+            return false;
+
+    return true;
+}
+
+// Mixes 'w' into 'hash'.
+static uint64_t hash_word(uint64_t hash, uint64_t w) {
+    hash = (hash ^ w)*0x9E3779B97F4A7C15ULL;
+
+    return hash ^ hash >> 29;
+}
+
+uint32_t casemap_hash(const char *s, size_t len) {
+    uint64_t hash = len*0xC2B2AE3D27D4EB4FULL;
+    uint64_t w;
+
+    for (; len >= sizeof w; len -= sizeof w) {
+        memcpy(&w, s, sizeof w);
+        hash = hash_word(hash, fold_word(w));
+        s += sizeof w;
+    }
+
+    if (len != 0) {
+        // Zero-pad the tail. Zero bytes are unaffected by folding.
+        w = 0;
+        memcpy(&w, s, len);
+        hash = hash_word(hash, fold_word(w));
+    }
+
+    // Final avalanche (from MurmurHash3), so that the low bits used for table
+    // indices depend on all input bytes.
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+void upgrade_save_casemap(void) {
+    upgrade_put_u64(fold_last);
+}
+
+void upgrade_restore_casemap(void) {
+    init_tables(upgrade_get_u64());
+}
@@ -0,0 +1,332 @@
+// Channel configuration. See channel_config.h.
+
+#include "common.h"
+#include "channel_config.h"
+#include "files.h"
+#include "intern.h"
+#include "id_set.h"
+#include "join.h"
+#include "options.h"
+
+#define CHANNELS_FILE "channels"
+
+// A complete channel configuration. Reloading builds a new one and then
+// switches over to it.
+typedef struct Config_set {
+    Channel_config **configs;
+    size_t n;
+    // Maps interned channel names to entries in 'configs'. Holds a reference
+    // per channel.
+    Id_map by_name;
+} Config_set;
+
+Channel_config **channel_configs;
+size_t n_channel_configs;
+
+// Used for channels without a configuration and for private messages.
+static Channel_config default_config;
+
+// Maps interned channel names to entries in 'channel_configs'.
+static Id_map configs_by_name;
+
+// Parses "on"/"off" into 'res'. Returns false if 'val' is neither.
+static bool parse_on_off(const char *val, bool *res) {
+    if (strcmp(val, "on") == 0)
+        *res = true;
+    else if (strcmp(val, "off") == 0)
+        *res = false;
+    else
+        return false;
+
+    return true;
+}
+
+// Parses "off"/"ignore"/"warn" into 'res'. Returns false if 'val' is none of
+// them.
+static bool parse_flood_action(const char *val, Flood_action *res) {
+    if (strcmp(val, "off") == 0)
+        *res = FLOOD_OFF;
+    else if (strcmp(val, "ignore") == 0)
+        *res = FLOOD_IGNORE;
+    else if (strcmp(val, "warn") == 0)
+        *res = FLOOD_WARN;
+    else
+        return false;
+
+    return true;
+}
+
+// Parses a "<setting>=<value>" string into 'config'. Returns false on errors,
+// with an error message in 'err' (of length 'err_len').
+static bool parse_setting(Channel_config *config, char *setting, char *err,
+                          size_t err_len) {
+    char *val = strchr(setting, '=');
+
+    if (val == NULL) {
+        snprintf(err, err_len, "Expected <setting>=<value>, got '%s'",
+                 setting);
+
+        return false;
+    }
+    *val++ = '\0';
+
+    if (strcmp(setting, "log") == 0) {
+        if (parse_on_off(val, &config->log))
+            return true;
+    }
+    else if (strcmp(setting, "commands") == 0) {
+        if (parse_on_off(val, &config->commands))
+            return true;
+    }
+    else if (strcmp(setting, "cmd_char") == 0) {
+        if (strlen(val) == 1) {
+            config->cmd_char = val[0];
+
+            return true;
+        }
+    }
+    else if (strcmp(setting, "flood") == 0) {
+        if (parse_flood_action(val, &config->flood))
+            return true;
+    }
+    else if (strcmp(setting, "key") == 0) {
+        if (*val != '\0') {
+            free(config->key);
+            config->key = estrdup(val, "channel key");
+
+            return true;
+        }
+    }
+    else {
+        snprintf(err, err_len, "Unknown setting '%s'", setting);
+
+        return false;
+    }
+
+    snprintf(err, err_len, "Invalid value '%s' for '%s'", val, setting);
+
+    return false;
+}
+
+static void free_config(Channel_config *config) {
+    free(config->name);
+    free(config->key);
+    free(config);
+}
+
+// Adds 'config' to 'set', replacing any existing configuration for the same
+// channel.
+static void add_config(Config_set *set, Channel_config *config) {
+    Str_id id = intern(config->name);
+    Channel_config *old = id_map_get(&set->by_name, id);
+
+    if (old != NULL) {
+        warning("Channel '%s' is configured more than once. Using the last "
+                "configuration.", config->name);
+
+        for (size_t i = 0; i < set->n; ++i)
+            if (set->configs[i] == old) {
+                set->configs[i] = config;
+
+                break;
+            }
+        free_config(old);
+        // Keep a single reference per configured channel.
+        intern_unref(id);
+    }
+    else {
+        set->configs = erealloc(set->configs,
+                                (set->n + 1)*sizeof *set->configs,
+                                "channel configs");
+        set->configs[set->n++] = config;
+    }
+
+    id_map_set(&set->by_name, id, config);
+}
+
+// Parses a channel name followed by settings from 'spec' (which is modified)
+// and adds the channel to 'set'. Returns false on errors, with an error
+// message in 'err' (of length 'err_len').
+static bool parse_channel_spec(Config_set *set, char *spec, char *err,
+                               size_t err_len) {
+    Channel_config *config;
+    char *save;
+    char *name;
+
+    name = strtok_r(spec, " \t", &save);
+    if (name == NULL) {
+        snprintf(err, err_len, "Missing channel name");
+
+        return false;
+    }
+
+    config = emalloc(sizeof *config, "channel config");
+    *config = default_config;
+    config->name = estrdup(name, "channel name");
+
+    for (char *setting; (setting = strtok_r(NULL, " \t", &save)) != NULL;)
+        if (!parse_setting(config, setting, err, err_len)) {
+            free_config(config);
+
+            return false;
+        }
+
+    add_config(set, config);
+
+    return true;
+}
+
+static void load_channels_file(Config_set *set) {
+    char err[128];
+    char *file_buf;
+    size_t file_len;
+    char *line;
+    char *next;
+
+    file_buf = get_file_contents(CHANNELS_FILE, &file_len);
+    if (file_buf == NULL)
+        return;
+
+    // null-terminate for ease of parsing.
+    file_buf = erealloc(file_buf, file_len + 1, "channels file");
+    file_buf[file_len] = '\0';
+
+    line = file_buf;
+    for (size_t line_nr = 1; line != NULL; line = next, ++line_nr) {
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        // Skip empty lines.
+        if (line[strspn(line, " \t")] == '\0')
+            continue;
+
+        if (!parse_channel_spec(set, line, err, sizeof err))
+            warning("Ignoring invalid channel on line %zu in "
+                    "'"CHANNELS_FILE"': %s", line_nr, err);
+    }
+
+    free(file_buf);
+}
+
+// Builds 'set' from the channels file, the -c options, and the default
+// channel.
+static void build_config_set(Config_set *set) {
+    char err[128];
+
+    set->configs = NULL;
+    set->n = 0;
+    id_map_init(&set->by_name);
+
+    load_channels_file(set);
+
+    // The -c options and the default channel don't change, so these only
+    // fail on the first load.
+    for (size_t i = 0; i < n_channels; ++i) {
+        char *spec = estrdup(channels[i], "channel spec");
+
+        if (!parse_channel_spec(set, spec, err, sizeof err))
+            fail_exit("Invalid channel '%s' given with -c: %s", channels[i],
+                      err);
+        free(spec);
+    }
+
+    if (set->n == 0) {
+        char *spec = estrdup(default_channel, "channel spec");
+
+        if (!parse_channel_spec(set, spec, err, sizeof err))
+            fail_exit("Invalid default channel: %s", err);
+        free(spec);
+    }
+}
+
+static void free_config_set(Config_set *set) {
+    for (size_t i = 0; i < set->n; ++i) {
+        intern_unref(intern_find(set->configs[i]->name));
+        free_config(set->configs[i]);
+    }
+    free(set->configs);
+    id_map_free(&set->by_name);
+}
+
+// Makes 'set' the current configuration.
+static void use_config_set(const Config_set *set) {
+    channel_configs = set->configs;
+    n_channel_configs = set->n;
+    configs_by_name = set->by_name;
+}
+
+void load_channel_config(void) {
+    Config_set set;
+
+    default_config.name = NULL;
+    default_config.key = NULL;
+    default_config.cmd_char = cmd_char;
+    default_config.log = true;
+    default_config.commands = true;
+    default_config.flood = FLOOD_IGNORE;
+
+    build_config_set(&set);
+    use_config_set(&set);
+}
+
+void reload_channel_config(void) {
+    Config_set old = { channel_configs, n_channel_configs, configs_by_name };
+    Config_set new;
+    Channel_config **added;
+    size_t n_added = 0;
+    size_t n_removed = 0;
+
+    // Picks up a changed -m default (see load_config_file()).
+    default_config.cmd_char = cmd_char;
+
+    build_config_set(&new);
+
+    // Leave channels that are no longer configured. The configurations of
+    // both sets hold references to their names, so the ids are the same.
+    for (size_t i = 0; i < old.n; ++i)
+        if (id_map_get(&new.by_name, intern_find(old.configs[i]->name)) ==
+              NULL) {
+            part_channel(old.configs[i]->name);
+            ++n_removed;
+        }
+
+    added = emalloc(new.n*sizeof *added, "added channels");
+    for (size_t i = 0; i < new.n; ++i)
+        if (id_map_get(&old.by_name, intern_find(new.configs[i]->name)) ==
+              NULL)
+            added[n_added++] = new.configs[i];
+
+    use_config_set(&new);
+    // The join queue points into the old configuration, which is still
+    // around.
+    join_config_reloaded();
+    if (n_added != 0)
+        join_more_channels(added, n_added);
+    free(added);
+
+    free_config_set(&old);
+
+    printf("Reloaded channel configuration: %zu channel%s, %zu added, %zu "
+           "removed\n", new.n, new.n == 1 ? "" : "s", n_added, n_removed);
+}
+
+void free_channel_config(void) {
+    Config_set set = { channel_configs, n_channel_configs, configs_by_name };
+
+    free_config_set(&set);
+    channel_configs = NULL;
+    n_channel_configs = 0;
+}
+
+const Channel_config *get_channel_config(const char *channel) {
+    Str_id id = intern_find(channel);
+    Channel_config *config;
+
+    if (id == NO_STR_ID)
+        return &default_config;
+
+    config = id_map_get(&configs_by_name, id);
+
+    return config == NULL ? &default_config : config;
+}
@@ -0,0 +1,294 @@
+// Channel membership tracking. See channel_state.h.
+
+#include "common.h"
+#include "intern.h"
+#include "id_set.h"
+#include "channel_state.h"
+#include "upgrade.h"
+
+typedef struct Channel {
+    // Interned channel name.
+    Str_id name;
+    // Interned nicks of the members, including the bot itself.
+    Id_set members;
+    // True between the first RPL_NAMREPLY of a NAMES list and the
+    // RPL_ENDOFNAMES that ends it.
+    bool in_names;
+} Channel;
+
+// Maps interned channel names to Channels.
+static Id_map channels;
+
+// The bot's current nick. NO_STR_ID until we know it.
+static Str_id own_nick = NO_STR_ID;
+
+// Channel membership prefixes stripped from RPL_NAMREPLY nicks.
+#define NAMES_PREFIXES "~&@%+"
+
+void init_channel_state(void) {
+    id_map_init(&channels);
+}
+
+// Returns the Channel for 'channel', or NULL if we're not tracking it.
+static Channel *get_channel(const char *channel) {
+    Str_id id = intern_find(channel);
+
+    return id == NO_STR_ID ? NULL : id_map_get(&channels, id);
+}
+
+static void add_member(Channel *chan, const char *nick) {
+    Str_id id = intern(nick);
+
+    // Each membership holds a reference to the interned nick.
+    if (!id_set_add(&chan->members, id))
+        intern_unref(id);
+}
+
+static void remove_member(Channel *chan, Str_id nick_id) {
+    if (nick_id != NO_STR_ID && id_set_remove(&chan->members, nick_id))
+        intern_unref(nick_id);
+}
+
+static void clear_members(Channel *chan) {
+    for (size_t i = 0; i < chan->members.size; ++i)
+        if (chan->members.ids[i] != NO_STR_ID)
+            intern_unref(chan->members.ids[i]);
+    id_set_clear(&chan->members);
+}
+
+static void add_channel(const char *channel) {
+    Channel *chan = emalloc(sizeof *chan, "channel");
+
+    chan->name = intern(channel);
+    id_set_init(&chan->members);
+    chan->in_names = false;
+    id_map_set(&channels, chan->name, chan);
+}
+
+static void remove_channel(Channel *chan) {
+    clear_members(chan);
+    id_set_free(&chan->members);
+    id_map_remove(&channels, chan->name);
+    intern_unref(chan->name);
+    free(chan);
+}
+
+void free_channel_state(void) {
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            Channel *chan = channels.vals[i];
+
+            clear_members(chan);
+            id_set_free(&chan->members);
+            intern_unref(chan->name);
+            free(chan);
+        }
+    id_map_free(&channels);
+
+    if (own_nick != NO_STR_ID)
+        intern_unref(own_nick);
+    own_nick = NO_STR_ID;
+}
+
+void track_own_nick(const char *nick) {
+    Str_id old = own_nick;
+
+    own_nick = intern(nick);
+    if (old != NO_STR_ID)
+        intern_unref(old);
+}
+
+bool is_own_nick(const char *nick) {
+    return own_nick != NO_STR_ID && intern_find(nick) == own_nick;
+}
+
+void track_join(const char *nick, const char *channel) {
+    Channel *chan = get_channel(channel);
+
+    if (chan == NULL) {
+        if (!is_own_nick(nick))
+            // Not a channel we're in.
+            return;
+
+        add_channel(channel);
+        chan = get_channel(channel);
+    }
+
+    add_member(chan, nick);
+}
+
+void track_part(const char *nick, const char *channel) {
+    Channel *chan = get_channel(channel);
+
+    if (chan == NULL)
+        return;
+
+    if (is_own_nick(nick))
+        remove_channel(chan);
+    else
+        remove_member(chan, intern_find(nick));
+}
+
+void track_nick(const char *nick, const char *to) {
+    Str_id old = intern_find(nick);
+    Str_id new;
+
+    if (old == NO_STR_ID)
+        // Not in any channel we're tracking, and not us.
+        return;
+
+    // Hold a reference to 'old' while updating, since removing it from the
+    // last channel would otherwise free it.
+    intern_ref(old);
+    new = intern(to);
+
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            Channel *chan = channels.vals[i];
+
+            if (id_set_remove(&chan->members, old)) {
+                intern_unref(old);
+                if (id_set_add(&chan->members, new))
+                    intern_ref(new);
+            }
+        }
+
+    if (old == own_nick) {
+        own_nick = intern_ref(new);
+        intern_unref(old);
+    }
+
+    intern_unref(new);
+    intern_unref(old);
+}
+
+void track_quit(const char *nick) {
+    Str_id id = intern_find(nick);
+
+    if (id == NO_STR_ID)
+        return;
+
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID)
+            remove_member(channels.vals[i], id);
+}
+
+void track_names(const char *channel, char *names) {
+    Channel *chan = get_channel(channel);
+    char *cur = names;
+
+    if (chan == NULL)
+        // NAMES for a channel we're not in.
+        return;
+
+    if (!chan->in_names) {
+        // Start of a new NAMES list. It replaces what we had.
+        clear_members(chan);
+        chan->in_names = true;
+    }
+
+    // Nicks are split in place. Big channels send thousands of nicks, and
+    // neither this loop nor the interning allocates per nick.
+    for (;;) {
+        char *bang;
+        char *nick;
+
+        while (*cur == ' ')
+            ++cur;
+        if (*cur == '\0')
+            break;
+
+        // Skip membership prefixes. Several can appear with the
+        // multi-prefix extension.
+        while (*cur != '\0' && strchr(NAMES_PREFIXES, *cur) != NULL)
+            ++cur;
+
+        nick = cur;
+        while (*cur != ' ' && *cur != '\0')
+            ++cur;
+        if (*cur == ' ')
+            *cur++ = '\0';
+
+        // With the userhost-in-names extension, entries are nick!user@host.
+        if ((bang = strchr(nick, '!')) != NULL)
+            *bang = '\0';
+
+        if (*nick != '\0')
+            add_member(chan, nick);
+    }
+}
+
+void track_names_end(const char *channel) {
+    Channel *chan = get_channel(channel);
+
+    if (chan != NULL)
+        chan->in_names = false;
+}
+
+size_t for_each_channel_of(const char *nick,
+                           void (*fn)(const char *channel, void *data),
+                           void *data) {
+    Str_id id = intern_find(nick);
+    size_t n = 0;
+
+    if (id == NO_STR_ID)
+        return 0;
+
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            Channel *chan = channels.vals[i];
+
+            if (id_set_contains(&chan->members, id)) {
+                fn(intern_str(chan->name), data);
+                ++n;
+            }
+        }
+
+    return n;
+}
+
+size_t channel_n_members(const char *channel) {
+    Channel *chan = get_channel(channel);
+
+    return chan == NULL ? 0 : chan->members.count;
+}
+
+void upgrade_save_channel_state(void) {
+    upgrade_put_str(own_nick == NO_STR_ID ? "" : intern_str(own_nick));
+
+    upgrade_put_u64(channels.keys.count);
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            Channel *chan = channels.vals[i];
+
+            upgrade_put_str(intern_str(chan->name));
+            upgrade_put_u64(chan->in_names);
+            upgrade_put_u64(chan->members.count);
+            for (size_t j = 0; j < chan->members.size; ++j)
+                if (chan->members.ids[j] != NO_STR_ID)
+                    upgrade_put_str(intern_str(chan->members.ids[j]));
+        }
+}
+
+void upgrade_restore_channel_state(void) {
+    const char *nick = upgrade_get_str();
+    size_t n_channels;
+
+    if (*nick != '\0')
+        track_own_nick(nick);
+
+    n_channels = upgrade_get_u64();
+    for (size_t i = 0; i < n_channels; ++i) {
+        const char *channel = upgrade_get_str();
+        Channel *chan;
+        size_t n_members;
+
+        add_channel(channel);
+        chan = get_channel(channel);
+        chan->in_names = upgrade_get_u64();
+
+        n_members = upgrade_get_u64();
+        for (size_t j = 0; j < n_members; ++j)
+            add_member(chan, upgrade_get_str());
+    }
+}
@@ -1,9 +1,16 @@
 #include "common.h"
 #include "chat_log.h"
+#include "date.h"
+#include "dynamic_string.h"
 #include "files.h"
 
 #define CHAT_LOG_FILE "chat_log"
 
+// Length of the time at the start of each line. "%c" in the C locale always
+// gives e.g. "Mon Oct  5 01:00:00 2026", with the day padded to two
+// characters with a space.
+#define LOG_TIME_LEN 24
+
 static bool format_now(const char *format, char *buf, size_t buf_len)
     __attribute__((format(strftime, 1, 0)));
 
@@ -11,15 +18,15 @@ static bool format_now(const char *format, char *buf, size_t buf_len) {
     time_t now;
     struct tm now_tm;
 
-    now = time(NULL);
+    now = current_time();
     if (now == -1) {
         warning_err("time() failed (chat log)");
 
         return false;
     }
 
-    if (localtime_r(&now, &now_tm) == NULL) {
-        warning("localtime_r() failed (chat log)");
+    if (!local_time(now, &now_tm)) {
+        warning("local_time() failed (chat log)");
 
         return false;
     }
@@ -33,51 +40,205 @@ static bool format_now(const char *format, char *buf, size_t buf_len) {
     return true;
 }
 
-static void log_append(const char *format, ...)
-    __attribute__((format(printf, 1, 2)));
+// Log lines are formatted on the event loop thread into 'batch' and handed
+// to a writer thread by flush_chat_log(), once per event loop iteration. The
+// event loop thus never waits for the disk, and the threads synchronize once
+// per iteration rather than once per line.
 
-static void log_append(const char *format, ...) {
-    va_list ap;
-    FILE *log_file;
-    char time_str[64];
+// Only used from the event loop thread.
+static String batch;
 
-    #define PREFIX "Failed to append chat log entry to '"CHAT_LOG_FILE"': "
+static pthread_t writer;
 
-    if (!format_now("%c", time_str, sizeof time_str)) {
-        warning(PREFIX"Could not get current time");
+// Everything below is protected by 'lock'.
 
-        return;
-    }
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when 'pending' gets data or when stopping.
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when the writer thread has written everything in 'pending'.
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+// Lines waiting for the writer thread.
+static String pending;
+// True while the writer thread is writing lines taken from 'pending'.
+static bool writing;
+// Set when the writer thread should exit after writing 'pending'.
+static bool stopping;
+
+// Appends 'lines' to the log file. Runs on the writer thread.
+static void write_lines(String *lines) {
+    const char *cur = string_get(lines);
+    size_t left = string_len(lines);
+    int fd;
+
+    #define PREFIX "Failed to append chat log entries to '"CHAT_LOG_FILE"': "
 
-    log_file = open_file_stdio(CHAT_LOG_FILE, APPEND);
-    if (log_file == NULL) {
-        warning_err(PREFIX"open_file_stdio() failed");
+    fd = open_file(CHAT_LOG_FILE, APPEND);
+    if (fd == -1) {
+        warning(PREFIX"open_file() failed");
 
         return;
     }
 
-    if (fprintf(log_file, "%s  ", time_str) < 0) {
-        warning_err(PREFIX"fprintf() failed");
+    while (left != 0) {
+        ssize_t n = write(fd, cur, left);
 
-        goto close_log;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            warning_err(PREFIX"write() failed");
+
+            break;
+        }
+        cur += n;
+        left -= n;
     }
 
-    va_start(ap, format);
-    if (vfprintf(log_file, format, ap) < 0) {
-        warning_err(PREFIX"vfprintf() failed");
+    #undef PREFIX
+
+    if (close(fd) == -1)
+        warning_err("close() failed on chat log file ('"CHAT_LOG_FILE"')");
+}
+
+static void *writer_thread(void *arg) {
+    String lines;
+    int res;
+
+    string_init(&lines);
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (chat log writer)");
+
+    for (;;) {
+        while (!stopping && string_len(&pending) == 0)
+            if ((res = pthread_cond_wait(&work_cond, &lock)) != 0)
+                err_exit_n(res, "pthread_cond_wait (chat log writer)");
+
+        if (string_len(&pending) == 0)
+            // Stopping, and everything has been written.
+            break;
+
+        // Take the lines without copying them.
+        swap(lines, pending);
+        writing = true;
+
+        if ((res = pthread_mutex_unlock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_unlock (chat log writer)");
 
-        goto close_log;
+        write_lines(&lines);
+        string_clear(&lines);
+
+        if ((res = pthread_mutex_lock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_lock (chat log writer)");
+
+        writing = false;
+        if ((res = pthread_cond_broadcast(&idle_cond)) != 0)
+            err_exit_n(res, "pthread_cond_broadcast (chat log writer)");
     }
 
-    if (fputc('\n', log_file) == EOF)
-        warning_err(PREFIX"fputc() failed");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (chat log writer)");
 
-    #undef PREFIX
+    string_free(&lines);
+
+    return NULL;
+}
+
+void init_chat_log(void) {
+    int res;
+
+    string_init(&batch);
+    string_init(&pending);
+    writing = false;
+    stopping = false;
+
+    if ((res = pthread_create(&writer, NULL, writer_thread, NULL)) != 0)
+        err_exit_n(res, "pthread_create (chat log writer)");
+}
+
+void free_chat_log(void) {
+    int res;
+
+    flush_chat_log();
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (free chat log)");
+    stopping = true;
+    if ((res = pthread_cond_signal(&work_cond)) != 0)
+        err_exit_n(res, "pthread_cond_signal (free chat log)");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (free chat log)");
+
+    // Waits for the remaining lines to be written.
+    if ((res = pthread_join(writer, NULL)) != 0)
+        err_exit_n(res, "pthread_join (chat log writer)");
+
+    string_free(&batch);
+    string_free(&pending);
+}
+
+void flush_chat_log(void) {
+    int res;
+
+    if (string_len(&batch) == 0)
+        return;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (flush chat log)");
+
+    if (string_len(&pending) == 0)
+        // The common case. Hand over the lines without copying them.
+        swap(pending, batch);
+    else
+        // The writer thread is behind.
+        string_append(&pending, "%s", string_get(&batch));
+
+    if ((res = pthread_cond_signal(&work_cond)) != 0)
+        err_exit_n(res, "pthread_cond_signal (flush chat log)");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (flush chat log)");
+
+    string_clear(&batch);
+}
+
+// Waits until the writer thread has written all entries handed to it. Can be
+// called from any thread.
+static void wait_for_writer(void) {
+    int res;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (wait for chat log writer)");
+    while (writing || string_len(&pending) != 0)
+        if ((res = pthread_cond_wait(&idle_cond, &lock)) != 0)
+            err_exit_n(res, "pthread_cond_wait (wait for chat log writer)");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (wait for chat log writer)");
+}
+
+void sync_chat_log(void) {
+    flush_chat_log();
+    wait_for_writer();
+}
+
+static void log_append(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void log_append(const char *format, ...) {
+    va_list ap;
+    char time_str[64];
+
+    if (!format_now("%c", time_str, sizeof time_str)) {
+        warning("Failed to append chat log entry to '"CHAT_LOG_FILE"': "
+                "Could not get current time");
+
+        return;
+    }
 
-close_log:
+    string_append(&batch, "%s  ", time_str);
+    va_start(ap, format);
+    string_append_v(&batch, format, ap);
     va_end(ap);
-    if (fclose(log_file) == EOF)
-        warning_err("fclose() failed on chat log file ('"CHAT_LOG_FILE"')");
+    string_append(&batch, "\n");
 }
 
 void log_join(const char *nick, const char *user, const char *host,
@@ -113,10 +274,105 @@ void log_privmsg(const char *nick, const char *to, const char *text) {
 }
 
 void log_quit(const char *nick, const char *user, const char *host,
-              const char *text) {
-    if (text == NULL)
-        log_append("%s (%s@%s) quit", nick, user, host ? host : "<unknown>");
-    else
-        log_append("%s (%s@%s) quit: %s", nick, user,
-                   host ? host : "<unknown>", text);
+              const char *channel, const char *text) {
+    if (channel == NULL) {
+        if (text == NULL)
+            log_append("%s (%s@%s) quit", nick, user,
+                       host ? host : "<unknown>");
+        else
+            log_append("%s (%s@%s) quit: %s", nick, user,
+                       host ? host : "<unknown>", text);
+    }
+    else {
+        if (text == NULL)
+            log_append("%s  %s (%s@%s) quit", channel, nick, user,
+                       host ? host : "<unknown>");
+        else
+            log_append("%s  %s (%s@%s) quit: %s", channel, nick, user,
+                       host ? host : "<unknown>", text);
+    }
+}
+
+// Returns true if the 'len' bytes at 'a' and 'b' are equal, ignoring ASCII
+// case. Used instead of the IRC casemapping (casemap.h) since the casemapping
+// can change on the event loop thread while searching.
+static bool ascii_eq_n(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        if (tolower((uc)a[i]) != tolower((uc)b[i]))
+            return false;
+
+    return true;
+}
+
+// Returns true if the 'len' bytes at 'line' contain 'text', ignoring ASCII
+// case.
+static bool contains(const char *line, size_t len, const char *text) {
+    size_t text_len = strlen(text);
+
+    for (size_t i = 0; i + text_len <= len; ++i)
+        if (ascii_eq_n(line + i, text, text_len))
+            return true;
+
+    return false;
+}
+
+char *search_chat_log(const char *channel, const char *text) {
+    size_t channel_len = strlen(channel);
+    char *file_buf;
+    size_t file_len;
+    const char *cur;
+    const char *end;
+    const char *latest = NULL;
+    size_t latest_len;
+    size_t n_matches = 0;
+    char *reply;
+
+    wait_for_writer();
+    file_buf = get_file_contents(CHAT_LOG_FILE, &file_len);
+    if (file_buf == NULL)
+        return estrdup("Could not read the chat log.", "chat log search");
+
+    end = file_buf + file_len;
+    for (cur = file_buf; cur < end;) {
+        const char *line = cur;
+        const char *line_end = memchr(cur, '\n', end - cur);
+        const char *msg;
+
+        if (line_end == NULL)
+            line_end = end;
+        cur = line_end + 1;
+
+        // Lines look like "<time>  <channel>  <<nick>> <text>" for messages.
+        // The time has a fixed width, but may itself contain two consecutive
+        // spaces.
+        if (line_end - line < LOG_TIME_LEN + 2 ||
+            memcmp(line + LOG_TIME_LEN, "  ", 2) != 0)
+            continue;
+        msg = line + LOG_TIME_LEN + 2;
+
+        if (line_end - msg < channel_len + 3 ||
+            !ascii_eq_n(msg, channel, channel_len) ||
+            memcmp(msg + channel_len, "  <", 3) != 0)
+            continue;
+        msg += channel_len + 2;
+
+        if (contains(msg, line_end - msg, text)) {
+            ++n_matches;
+            latest = msg;
+            latest_len = line_end - msg;
+        }
+    }
+
+    if (n_matches == 0)
+        reply = estrdup("No matches.", "chat log search");
+    else {
+        // Fits the text of the latest match, which came from an IRC message.
+        reply = emalloc(64 + latest_len, "chat log search");
+        sprintf(reply, "%zu match%s. Latest: %.*s", n_matches,
+                n_matches == 1 ? "" : "es", (int)latest_len, latest);
+    }
+
+    free(file_buf);
+
+    return reply;
 }
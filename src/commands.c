@@ -1,10 +1,24 @@
 // Command implementations.
 
 #include "common.h"
+#include "chat_log.h"
 #include "commands.h"
+#include "irc.h"
+#include "lag.h"
+#include "latency.h"
 #include "msg_io.h"
 #include "options.h"
+#include "rate_limit.h"
 #include "remind.h"
+#include "seen.h"
+#include "stats.h"
+#include "transport.h"
+#include "worker.h"
+
+static void active(const char *from, const char *to, const char *rep,
+                   const char *arg) {
+    handle_active(arg, to, rep);
+}
 
 static void compliment(const char *from, const char *to, const char *rep,
                        const char *arg) {
@@ -17,35 +31,129 @@ static void echo(const char *from, const char *to, const char *rep,
         say(rep, "%s", arg);
 }
 
+static void lag(const char *from, const char *to, const char *rep,
+                const char *arg) {
+    handle_lag(rep);
+}
+
+static void latency(const char *from, const char *to, const char *rep,
+                    const char *arg) {
+    handle_latency(rep);
+}
+
 static void remind(const char *from, const char *to, const char *rep,
                    const char *arg) {
     handle_remind(arg, rep);
 }
 
+static void reminders(const char *from, const char *to, const char *rep,
+                      const char *arg) {
+    handle_reminders(arg, rep);
+}
+
+static void seen(const char *from, const char *to, const char *rep,
+                 const char *arg) {
+    handle_seen(arg, rep);
+}
+
+static void top(const char *from, const char *to, const char *rep,
+                const char *arg) {
+    handle_top(arg, to, rep);
+}
+
+static void unremind(const char *from, const char *to, const char *rep,
+                     const char *arg) {
+    handle_unremind(arg, rep);
+}
+
+//
+// Heavy commands. These run on a worker thread (see worker.h) and must not
+// touch any bot state. They return the reply, allocated with malloc(), or
+// NULL for no reply.
+//
+
+static char *grep(const char *rep, const char *arg) {
+    if (arg == NULL)
+        return estrdup("Usage: !grep <text>", "grep reply");
+
+    return search_chat_log(rep, arg);
+}
+
 static void commands(const char *from, const char *to, const char *rep,
                      const char *arg);
 static void help(const char *from, const char *to, const char *rep,
                  const char *arg);
+static void metrics(const char *from, const char *to, const char *rep,
+                    const char *arg);
+static void workers(const char *from, const char *to, const char *rep,
+                    const char *arg);
+
+// 'cooldown' is the minimum time in seconds between uses of the command by
+// the same user@host (see rate_limit.h).
+#define CMD(cmd, cooldown, help) { #cmd, cmd, NULL, NULL, cooldown, help }
 
-#define CMD(cmd, help) { #cmd, cmd, help }
+// Declares 'cmd' as heavy, with at most 'max' instances queued or
+// running at a time.
+#define HEAVY_CMD(cmd, max, cooldown, help)                             \
+  { #cmd, NULL, cmd, &(Work_class){ .name = #cmd, .max_jobs = max }, \
+    cooldown, help }
 
 static const struct {
     const char *cmd;
     void (*handler)(const char *from, const char *to, const char *rep,
                     const char *arg);
+    // Set instead of 'handler' for heavy commands.
+    char *(*heavy_handler)(const char *rep, const char *arg);
+    Work_class *class;
+    unsigned cooldown;
     const char *help;
-} cmds[] = { CMD(commands,
+} cmds[] = { CMD(active, 10,
+                 "Usage: !active [<channel>]. Shows the number of messages "
+                 "and speakers today and the busiest hour over the past "
+                 "week."),
+             CMD(commands, 30,
                  "Lists available commands."),
-             CMD(compliment,
+             CMD(compliment, 10,
                  "Writes a compliment."),
-             CMD(echo,
+             CMD(echo, 2,
                  "Usage: !echo <text>"),
-             CMD(help,
+             HEAVY_CMD(grep, 2, 10,
+                 "Usage: !grep <text>. Searches the chat log of the channel "
+                 "for messages containing <text>."),
+             CMD(help, 5,
                  "Usage: !help <command>"),
-             CMD(remind,
+             CMD(lag, 10,
+                 "Shows the round-trip time to the server, measured with "
+                 "PINGs, and the number of reconnects."),
+             CMD(latency, 10,
+                 "Shows the time from the kernel receiving PINGs and "
+                 "commands until they are handled and answered (needs -l)."),
+             CMD(metrics, 10,
+                 "Shows event loop statistics."),
+             CMD(remind, 5,
                  "Usage: !remind hh:mm[:ss] [dd/MM [yy]] <text of reminder>. "
                  "'yy' is nr. of years past 2000. Example: "
-                 "!remind 14:45 11/2 do your laundry foobar, you slob.") };
+                 "!remind 14:45 11/2 do your laundry foobar, you slob. "
+                 "Recurring: !remind every <days> hh:mm[:ss] <text>, where "
+                 "<days> is day, weekday, weekend, e.g. mon,thu, or "
+                 "month <dd>."),
+             CMD(reminders, 10,
+                 "Usage: !reminders [<page>]. Lists pending reminders set "
+                 "here, newest first."),
+             CMD(seen, 5,
+                 "Usage: !seen <nick>. Tells when <nick> was last seen "
+                 "joining, leaving, or writing in a channel."),
+             CMD(top, 10,
+                 "Usage: !top [<channel>]. Shows today's top talkers and "
+                 "words."),
+             CMD(unremind, 5,
+                 "Usage: !unremind <id>. Cancels a pending reminder set here. "
+                 "Use !reminders to see ids."),
+             CMD(workers, 10,
+                 "Shows statistics for commands run on worker threads.") };
+
+_Static_assert(ARRAY_LEN(cmds) <= RATE_LIMIT_MAX_CMDS,
+               "too many commands for the rate limiter");
 
 static void commands(const char *from, const char *to, const char *rep,
                      const char *arg) {
@@ -74,11 +182,121 @@ static void help(const char *from, const char *to, const char *rep,
     say(rep, "'%s': No such command. Use !commands to list commands.", arg);
 }
 
-void handle_cmd(const char *from, const char *to, const char *rep,
-                const char *cmd, const char *arg) {
+static void metrics(const char *from, const char *to, const char *rep,
+                    const char *arg) {
+    uint64_t n_msgs, n_segs;
+
+    say(rep, "Server messages: %"PRIu64" in %"PRIu64" drains, %"PRIu64" "
+             "of which ran out of budget (%u messages/%u us). Max. %"PRIu64" "
+             "messages/%.1f ms per drain. %"PRIu64" PINGs answered ahead of "
+             "other messages.",
+        drain_stats.n_msgs, drain_stats.n_drains, drain_stats.n_deferred,
+        drain_budget_msgs, drain_budget_us, drain_stats.max_msgs,
+        drain_stats.max_us/1e3, drain_stats.n_early_pongs);
+
+    // Messages are queued and sent at the end of each event loop iteration.
+    // Without that, each message would take a send() of its own.
+    begin_say(rep);
+    append_msg("Messages sent: %"PRIu64" in %"PRIu64" flushes (avg. %.2f, "
+               "max. %"PRIu64" per flush) with %"PRIu64" send() calls, "
+               "saving %"PRIu64" calls.",
+               send_stats.n_msgs, send_stats.n_flushes,
+               send_stats.n_flushes == 0 ?
+                 0 : (double)send_stats.n_msgs/send_stats.n_flushes,
+               send_stats.max_msgs, send_stats.n_syscalls,
+               send_stats.n_msgs - min(send_stats.n_syscalls,
+                                       send_stats.n_msgs));
+    if (serv_segs_out(&n_msgs, &n_segs))
+        append_msg(" This connection: %"PRIu64" messages in %"PRIu64" TCP "
+                   "segments.", n_msgs, n_segs);
+    send_msg();
+}
+
+static void workers(const char *from, const char *to, const char *rep,
+                    const char *arg) {
+    begin_say(rep);
+    append_msg("Worker jobs (queued or running/done/avg. and max. queue "
+               "time):");
+    for (size_t i = 0; i < ARRAY_LEN(cmds); ++i) {
+        Work_class *class = cmds[i].class;
+
+        if (class == NULL)
+            continue;
+
+        append_msg(" !%s %u/%" PRIu64 "/%.1f ms/%.1f ms", cmds[i].cmd,
+                   class->n_jobs, class->n_done,
+                   class->n_done == 0 ? 0 : class->total_queue_ms/class->n_done,
+                   class->max_queue_ms);
+    }
+    send_msg();
+}
+
+// A heavy command running on a worker thread.
+typedef struct Heavy_job {
+    char *(*handler)(const char *rep, const char *arg);
+    char *rep;
+    // NULL if the command has no argument.
+    char *arg;
+    // Set by the handler.
+    char *reply;
+} Heavy_job;
+
+static void run_heavy_job(void *data) {
+    Heavy_job *job = data;
+
+    job->reply = job->handler(job->rep, job->arg);
+}
+
+static void heavy_job_done(void *data, bool cancelled) {
+    Heavy_job *job = data;
+
+    if (!cancelled && job->reply != NULL)
+        say(job->rep, "%s", job->reply);
+
+    free(job->reply);
+    free(job->rep);
+    free(job->arg);
+    free(job);
+}
+
+static void start_heavy_cmd(size_t i, const char *rep, const char *arg) {
+    Heavy_job *job = emalloc(sizeof *job, "heavy command");
+
+    job->handler = cmds[i].heavy_handler;
+    job->rep = estrdup(rep, "heavy command reply target");
+    job->arg = arg == NULL ? NULL : estrdup(arg, "heavy command argument");
+    job->reply = NULL;
+
+    // Let the command see the chat log up to now (e.g. !grep).
+    flush_chat_log();
+
+    if (!submit_work(cmds[i].class, run_heavy_job, heavy_job_done, job)) {
+        say(rep, "Too many !%s commands running. Try again later.",
+            cmds[i].cmd);
+        free(job->rep);
+        free(job->arg);
+        free(job);
+    }
+}
+
+void handle_cmd(const char *from, const char *user, const char *host,
+                const char *to, const char *rep, const char *cmd,
+                const char *arg) {
     for (size_t i = 0; i < ARRAY_LEN(cmds); ++i)
         if (strcmp(cmds[i].cmd, cmd) == 0) {
-            cmds[i].handler(from, to, rep, arg);
+            // Rate-limited commands are dropped silently. Replying would
+            // defeat the purpose.
+            if (!rate_limit_admit(user, host, i, cmds[i].cooldown))
+                break;
+
+            // Only the reply sent right away is timed, which for heavy
+            // commands is at most an error message.
+            latency_begin(LATENCY_CMD);
+            if (cmds[i].heavy_handler != NULL)
+                start_heavy_cmd(i, rep, arg);
+            else
+                cmds[i].handler(from, to, rep, arg);
+            latency_end();
 
             break;
         }
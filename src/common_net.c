@@ -4,61 +4,54 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
-const char *socket_type_str(int type) {
-    #define S(val) case val: return #val;
+// Address families alternate, starting with the family of the first address
+// (RFC 8305, section 4), so that a broken family can't hold up the other one
+// for long.
+struct addrinfo **interleave_families(struct addrinfo *ais, size_t *n) {
+    struct addrinfo **order;
+    struct addrinfo *first_fam = ais;
+    struct addrinfo *other_fam = ais;
+    size_t n_ais = 0;
 
-    switch (type) {
-    S(SOCK_STREAM)
-    S(SOCK_DGRAM)
-    S(SOCK_SEQPACKET)
-    S(SOCK_RAW)
-    S(SOCK_RDM)
-    S(SOCK_PACKET)
-    default: return "<unknown type>";
-    }
+    for (struct addrinfo *ai = ais; ai != NULL; ai = ai->ai_next)
+        ++n_ais;
+    order = emalloc(n_ais*sizeof *order, "address order");
 
-    #undef S
-}
+    // Alternate between the next unused address from the first family and
+    // the next unused address from the other families.
+    *n = 0;
+    while (*n < n_ais) {
+        while (first_fam != NULL && first_fam->ai_family != ais->ai_family)
+            first_fam = first_fam->ai_next;
+        if (first_fam != NULL) {
+            order[(*n)++] = first_fam;
+            first_fam = first_fam->ai_next;
+        }
 
-int connect_to(const char *host, const char *service, int type) {
-    struct addrinfo hints;
-    struct addrinfo *ais;
-    int peer_fd;
-    int res;
+        while (other_fam != NULL && other_fam->ai_family == ais->ai_family)
+            other_fam = other_fam->ai_next;
+        if (other_fam != NULL) {
+            order[(*n)++] = other_fam;
+            other_fam = other_fam->ai_next;
+        }
+    }
 
-    clear(hints);
-    // Accept both IPv4 and IPv6 connections.
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = type;
-    // Skip IPv4 addresses if the local system does not have an IPv4 address,
-    // and ditto for IPv6.
-    hints.ai_flags = AI_ADDRCONFIG;
-    hints.ai_protocol = 0;
+    return order;
+}
 
-    res = getaddrinfo(host, service, &hints, &ais);
-    if (res != 0)
-        fail_exit("Failed to look up '%s' (using service/port '%s' and socket "
-                  "type %s): %s", host, service, socket_type_str(type),
-                  gai_strerror(res));
+void set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL);
 
-    // Try connecting to each of the returned addresses. Return on the first
-    // successful connection.
-    for (struct addrinfo *ai = ais; ai != NULL; ai = ai->ai_next) {
-        peer_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
-                         ai->ai_protocol);
-        if (peer_fd == -1)
-            continue;
-        if (connect(peer_fd, ai->ai_addr, ai->ai_addrlen) != -1)
-            goto success;
-        close(peer_fd);
-    }
-    fail_exit("Failed to connect to '%s' (using service/port '%s' and socket "
-              "type %s)", host, service, socket_type_str(type));
+    if (flags == -1)
+        err_exit("fcntl (F_GETFL)");
 
-success:
-    freeaddrinfo(ais);
+    if (nonblocking)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
 
-    return peer_fd;
+    if (fcntl(fd, F_SETFL, flags) == -1)
+        err_exit("fcntl (F_SETFL)");
 }
 
 ssize_t readn(int fd, void *buf, size_t n) {
@@ -79,21 +72,3 @@ again:
 
     return n_read_tot;
 }
-
-void writen(int fd, const void *buf, size_t n) {
-    ssize_t n_written;
-    size_t n_written_tot;
-
-    for (n_written_tot = 0; n_written_tot < n; n_written_tot += n_written) {
-again:
-        // MSG_NOSIGNAL means we return EPIPE instead of generating SIGPIPE.
-        n_written = send(fd, (char*)buf + n_written_tot, n - n_written_tot,
-                         MSG_NOSIGNAL);
-        // TODO: Is special handling for a zero return from write() warranted?
-        if (n_written == -1) {
-            if (errno == EINTR)
-                goto again;
-            err_exit("write");
-        }
-    }
-}
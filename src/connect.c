@@ -0,0 +1,200 @@
+// Non-blocking connection establishment. See connect.h.
+
+#include "common.h"
+#include "connect.h"
+#include "reactor.h"
+
+// A copy of an address from the lookup, which is only valid during
+// connect_async().
+typedef struct Addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} Addr;
+
+// The connection in progress. 'done' is NULL if there is none.
+static struct {
+    // Addresses in the order they are tried.
+    Addr *addrs;
+    size_t n_addrs;
+    // Sockets of the connection attempts, indexed like 'addrs'. -1 for
+    // attempts not yet started and attempts that failed.
+    int *fds;
+    // Next address to try.
+    size_t next;
+    // Number of attempts in progress.
+    size_t n_pending;
+    int attempt_delay_ms;
+    // Error from the last failed attempt.
+    int last_errno;
+    // Fires when it's time to start the next attempt.
+    int timer_fd;
+    void (*done)(int fd, int err);
+} race;
+
+static void start_next_attempt(void);
+
+// Frees the state of the connection in progress, closing all sockets except
+// 'keep_fd'.
+static void end_race(int keep_fd) {
+    for (size_t i = 0; i < race.n_addrs; ++i)
+        if (race.fds[i] != -1) {
+            reactor_remove(race.fds[i]);
+            if (race.fds[i] != keep_fd)
+                close(race.fds[i]);
+        }
+    reactor_remove(race.timer_fd);
+    if (close(race.timer_fd) == -1)
+        err_exit("close (connection attempt timer)");
+    free(race.fds);
+    free(race.addrs);
+    race.done = NULL;
+}
+
+// Ends the race and calls the callback with 'fd' (-1 if all attempts
+// failed).
+static void finish(int fd) {
+    void (*done)(int fd, int err) = race.done;
+    int err = race.last_errno;
+
+    end_race(fd);
+    done(fd, fd == -1 ? err : 0);
+}
+
+// Arms the timer to start the next attempt after 'delay_ms' milliseconds.
+static void arm_attempt_timer(int delay_ms) {
+    struct itimerspec time_spec = {
+      .it_value = { delay_ms/1000, delay_ms%1000*1000000 } };
+
+    // A zero it_value would disarm the timer.
+    if (delay_ms == 0)
+        time_spec.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(race.timer_fd, 0, &time_spec, NULL) == -1)
+        err_exit("timerfd_settime (connection attempt timer)");
+}
+
+static void handle_attempt(int fd, uint32_t events, void *ctx) {
+    size_t i = (uintptr_t)ctx;
+    int err;
+    socklen_t err_len = sizeof err;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1)
+        err_exit("getsockopt (SO_ERROR) (connect)");
+
+    if (err == 0) {
+        finish(fd);
+
+        return;
+    }
+
+    race.last_errno = err;
+    reactor_remove(fd);
+    close(fd);
+    race.fds[i] = -1;
+    --race.n_pending;
+    // Move on to the next address right away.
+    start_next_attempt();
+}
+
+static void handle_attempt_timer(int fd, uint32_t events, void *ctx) {
+    uint64_t n_expirations;
+
+    if (read(fd, &n_expirations, sizeof n_expirations) == -1 &&
+        errno != EAGAIN)
+        err_exit("read (connection attempt timer)");
+
+    start_next_attempt();
+}
+
+// Starts an attempt on the next address that doesn't fail right away. Ends
+// the race if there are no addresses left and no attempts in progress.
+static void start_next_attempt(void) {
+    while (race.next < race.n_addrs) {
+        size_t i = race.next++;
+        Addr *addr = &race.addrs[i];
+        int fd;
+
+        fd = socket(addr->family,
+                    addr->socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    addr->protocol);
+        if (fd == -1) {
+            race.last_errno = errno;
+
+            continue;
+        }
+
+        if (connect(fd, (struct sockaddr*)&addr->addr, addr->len) == 0) {
+            finish(fd);
+
+            return;
+        }
+
+        if (errno != EINPROGRESS) {
+            // Failed right away (e.g. ENETUNREACH). Move on to the next
+            // address without waiting.
+            race.last_errno = errno;
+            close(fd);
+
+            continue;
+        }
+
+        race.fds[i] = fd;
+        ++race.n_pending;
+        reactor_add(fd, REACTOR_WRITE, handle_attempt, (void*)(uintptr_t)i);
+        if (race.next < race.n_addrs)
+            arm_attempt_timer(race.attempt_delay_ms);
+
+        return;
+    }
+
+    if (race.n_pending == 0)
+        // All addresses tried, and all attempts failed.
+        finish(-1);
+}
+
+void connect_async(struct addrinfo *ais, int attempt_delay_ms,
+                   void (*done)(int fd, int err)) {
+    struct addrinfo **order;
+
+    assert(race.done == NULL);
+
+    order = interleave_families(ais, &race.n_addrs);
+    race.addrs = emalloc(race.n_addrs*sizeof *race.addrs,
+                         "connection addresses");
+    race.fds = emalloc(race.n_addrs*sizeof *race.fds, "connection attempts");
+    for (size_t i = 0; i < race.n_addrs; ++i) {
+        race.addrs[i].family = order[i]->ai_family;
+        race.addrs[i].socktype = order[i]->ai_socktype;
+        race.addrs[i].protocol = order[i]->ai_protocol;
+        race.addrs[i].len = order[i]->ai_addrlen;
+        memcpy(&race.addrs[i].addr, order[i]->ai_addr, order[i]->ai_addrlen);
+        race.fds[i] = -1;
+    }
+    free(order);
+
+    race.next = 0;
+    race.n_pending = 0;
+    race.attempt_delay_ms = attempt_delay_ms;
+    // Only used for an empty address list.
+    race.last_errno = EHOSTUNREACH;
+    race.done = done;
+
+    race.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_CLOEXEC | TFD_NONBLOCK);
+    if (race.timer_fd == -1)
+        err_exit("timerfd_create (connection attempt timer)");
+    reactor_add(race.timer_fd, REACTOR_READ, handle_attempt_timer, NULL);
+
+    // Start the first attempt from the event loop too, so that 'done' is never
+    // called before we return, even if connect() completes or fails right
+    // away.
+    arm_attempt_timer(0);
+}
+
+void cancel_connect(void) {
+    if (race.done != NULL)
+        end_race(-1);
+}
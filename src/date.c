@@ -1,18 +1,279 @@
 #include "common.h"
 #include "date.h"
+#include "options.h"
+
+// How often to check whether the time zone has changed (e.g. by
+// /etc/localtime being replaced), in seconds.
+#define TZ_CHECK_INTERVAL 60
+
+// How far ahead to look for the next UTC offset change, and the step used.
+// Time zones change offset at most a few times per year.
+#define TRANSITION_SEARCH_RANGE (366*24*60*60)
+#define TRANSITION_SEARCH_STEP (7*24*60*60)
+
+#define SECS_PER_DAY (24*60*60)
+
+// The UTC offset in effect during [from, until), so that conversions within
+// that interval don't need to go through localtime_r() and mktime(), which
+// consult the time zone database (and stat /etc/localtime) each time.
+static struct {
+    bool valid;
+    time_t from;
+    time_t until;
+    long utc_offset;
+    int isdst;
+    // Points into the C library's time zone data, which stays put until the
+    // time zone changes.
+    const char *zone_name;
+} zone;
+
+// The virtual clock, in simulation mode.
+static time_t virtual_now;
+
+time_t current_time(void) {
+    return sim_start != 0 ? virtual_now : time(NULL);
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+
+    if (sim_start != 0)
+        return 1000*(uint64_t)virtual_now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err_exit("clock_gettime (monotonic_ms)");
+
+    return 1000*(uint64_t)ts.tv_sec + ts.tv_nsec/1000000;
+}
+
+void set_virtual_time(time_t t) {
+    virtual_now = max(virtual_now, t);
+}
+
+// Time zone identity, for detecting changes.
+static char *tz_env;
+static struct stat localtime_stat;
+static time_t next_tz_check;
+
+// Rounds towards negative infinity, unlike '/'.
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a/b - (a%b != 0 && (a < 0) != (b < 0));
+}
+
+// Returns the number of days since 1970-01-01 for a date in the proleptic
+// Gregorian calendar, where 'month' is 1-12. Based on days_from_civil() from
+// Howard Hinnant's "chrono-Compatible Low-Level Date Algorithms".
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+    int64_t era;
+    unsigned year_of_era;
+    unsigned day_of_year;
+    unsigned day_of_era;
+
+    year -= month <= 2;
+    era = floor_div(year, 400);
+    year_of_era = year - 400*era;
+    day_of_year = (153*(month > 2 ? month - 3 : month + 9) + 2)/5 + day - 1;
+    day_of_era = 365*year_of_era + year_of_era/4 - year_of_era/100 +
+                 day_of_year;
+
+    return 146097*era + day_of_era - 719468;
+}
+
+// Inverse of days_from_civil().
+static void civil_from_days(int64_t days, int64_t *year, unsigned *month,
+                            unsigned *day) {
+    int64_t era;
+    unsigned day_of_era;
+    unsigned year_of_era;
+    unsigned day_of_year;
+    unsigned mp;
+
+    days += 719468;
+    era = floor_div(days, 146097);
+    day_of_era = days - 146097*era;
+    year_of_era = (day_of_era - day_of_era/1460 + day_of_era/36524 -
+                   day_of_era/146096)/365;
+    day_of_year = day_of_era - (365*year_of_era + year_of_era/4 -
+                                year_of_era/100);
+    mp = (5*day_of_year + 2)/153;
+    *day = day_of_year - (153*mp + 2)/5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = year_of_era + 400*era + (*month <= 2);
+}
+
+// Returns true if the time zone has changed since the last check. Checks at
+// most once every TZ_CHECK_INTERVAL seconds, so that the common case is a
+// single time() call.
+static bool tz_changed(void) {
+    const char *env;
+    struct stat st;
+    time_t now;
+    bool changed = false;
+
+    now = current_time();
+    if (now < next_tz_check)
+        return false;
+    next_tz_check = now + TZ_CHECK_INTERVAL;
+
+    env = getenv("TZ");
+    if (env == NULL ? tz_env != NULL :
+                      tz_env == NULL || strcmp(env, tz_env) != 0) {
+        free(tz_env);
+        tz_env = env == NULL ? NULL : estrdup(env, "TZ");
+        changed = true;
+    }
+
+    if (stat("/etc/localtime", &st) == -1)
+        clear(st);
+    if (st.st_ino != localtime_stat.st_ino ||
+        st.st_mtim.tv_sec != localtime_stat.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != localtime_stat.st_mtim.tv_nsec) {
+        localtime_stat = st;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Returns the UTC offset at 't', or LONG_MIN on errors.
+static long offset_at(time_t t) {
+    struct tm tm;
+
+    return localtime_r(&t, &tm) == NULL ? LONG_MIN : tm.tm_gmtoff;
+}
+
+// Returns the first time after 't' at which the UTC offset differs from the
+// one at 't'. Looks at most TRANSITION_SEARCH_RANGE seconds ahead.
+static time_t next_transition(time_t t) {
+    long offset = offset_at(t);
+    time_t lo = t;
+    time_t hi;
+
+    // Find a step with a different offset at its end...
+    for (hi = t + TRANSITION_SEARCH_STEP; offset_at(hi) == offset;
+         hi += TRANSITION_SEARCH_STEP) {
+        lo = hi;
+        if (hi - t >= TRANSITION_SEARCH_RANGE)
+            return hi;
+    }
+
+    // ...and binary search for the transition within it. The offset at 'lo'
+    // equals 'offset' and the one at 'hi' does not.
+    while (hi - lo > 1) {
+        time_t mid = lo + (hi - lo)/2;
+
+        if (offset_at(mid) == offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return hi;
+}
+
+// Caches the UTC offset in effect at 't' and the time until which it stays
+// in effect. Returns false on errors.
+static bool refresh_zone(time_t t) {
+    struct tm tm;
+
+    tzset();
+
+    if (localtime_r(&t, &tm) == NULL) {
+        zone.valid = false;
+
+        return false;
+    }
+
+    zone.valid = true;
+    zone.from = t;
+    zone.until = next_transition(t);
+    zone.utc_offset = tm.tm_gmtoff;
+    zone.isdst = tm.tm_isdst;
+    zone.zone_name = tm.tm_zone;
+
+    return true;
+}
+
+// Makes sure the cache covers 't'. Returns false on errors.
+static bool zone_for(time_t t) {
+    if (tz_changed())
+        zone.valid = false;
+
+    if (zone.valid && t >= zone.from && t < zone.until)
+        return true;
+
+    return refresh_zone(t);
+}
+
+bool local_time(time_t t, struct tm *tm) {
+    int64_t local;
+    int64_t days;
+    int64_t secs;
+    int64_t year;
+    unsigned month;
+    unsigned day;
+
+    if (!zone_for(t))
+        return false;
+
+    local = t + zone.utc_offset;
+    days = floor_div(local, SECS_PER_DAY);
+    secs = local - SECS_PER_DAY*days;
+    civil_from_days(days, &year, &month, &day);
+
+    tm->tm_year = year - 1900;
+    tm->tm_mon = month - 1;
+    tm->tm_mday = day;
+    tm->tm_hour = secs/(60*60);
+    tm->tm_min = secs/60%60;
+    tm->tm_sec = secs%60;
+    // 1970-01-01 was a Thursday.
+    tm->tm_wday = (days%7 + 7 + 4)%7;
+    tm->tm_yday = days - days_from_civil(year, 1, 1);
+    tm->tm_isdst = zone.isdst;
+    tm->tm_gmtoff = zone.utc_offset;
+    tm->tm_zone = zone.zone_name;
+
+    return true;
+}
+
+time_t make_local_time(struct tm *tm) {
+    int64_t year = tm->tm_year + 1900 + floor_div(tm->tm_mon, 12);
+    unsigned month = tm->tm_mon - 12*floor_div(tm->tm_mon, 12) + 1;
+    int64_t local;
+    time_t t;
+
+    // Fields are allowed to be out of range (e.g. tm_mday = 32), as with
+    // mktime(), which works out since the conversion is linear.
+    local = SECS_PER_DAY*(days_from_civil(year, month, 1) + tm->tm_mday - 1) +
+            60*60*(int64_t)tm->tm_hour + 60*tm->tm_min + tm->tm_sec;
+
+    // Use the cached offset if the result lies in the cached interval (after
+    // refreshing the cache for it, if needed). Otherwise, 'tm' is near a UTC
+    // offset change, where local times can be ambiguous or not exist, so
+    // leave it to mktime().
+    for (int i = 0; i < 2; ++i) {
+        t = local - zone.utc_offset;
+        if (zone_for(t) && t == local - zone.utc_offset &&
+            (tm->tm_isdst < 0 || tm->tm_isdst == zone.isdst))
+            return local_time(t, tm) ? t : -1;
+    }
+
+    return mktime(tm);
+}
 
 bool get_current_time(struct tm *tm, const char *context) {
     time_t now;
 
-    now = time(NULL);
+    now = current_time();
     if (now == -1) {
         warning_err("time() failed (%s)", context);
 
         return false;
     }
 
-    if (localtime_r(&now, tm) == NULL) {
-        warning("localtime_r() failed (%s)", context);
+    if (!local_time(now, tm)) {
+        warning("local_time() failed (%s)", context);
 
         return false;
     }
@@ -110,15 +371,15 @@ got_time:
     tm.tm_isdst = -1; // Use DST information from locale.
 
     tm_orig = tm;
-    res = mktime(&tm);
+    res = make_local_time(&tm);
     if (res == -1) {
-        warning("mktime() failed (parse date)");
+        warning("make_local_time() failed (parse date)");
 
         return -1;
     }
 
     // Assume the given time is invalid if any of the fields were adjusted by
-    // mktime().
+    // make_local_time().
     if (tm.tm_hour != tm_orig.tm_hour ||
         tm.tm_min  != tm_orig.tm_min  ||
         tm.tm_sec  != tm_orig.tm_sec  ||
@@ -131,3 +392,193 @@ got_time:
 
     return res;
 }
+
+#define ALL_DAYS 0x7F
+// Monday through Friday.
+#define WEEKDAYS 0x3E
+// Saturday and Sunday.
+#define WEEKEND 0x41
+
+static const char *const day_names[] = {
+  "sunday", "monday", "tuesday", "wednesday", "thursday", "friday",
+  "saturday" };
+
+// Parses a weekday name (abbreviated to three letters or not) from 's' and
+// returns its number (0 = Sunday), updating 's'. Returns -1 without updating
+// 's' if there is no weekday name.
+static int parse_day_name(const char **s) {
+    size_t len;
+
+    for (len = 0; isalpha((uc)(*s)[len]); ++len);
+
+    for (int i = 0; i < 7; ++i)
+        if ((len == 3 || len == strlen(day_names[i])) &&
+            strncasecmp(*s, day_names[i], len) == 0) {
+            *s += len;
+
+            return i;
+        }
+
+    return -1;
+}
+
+// Returns true and updates 's' if it starts with the word 'word'.
+static bool eat_word(const char **s, const char *word) {
+    size_t len = strlen(word);
+
+    if (strncasecmp(*s, word, len) != 0 || isalpha((uc)(*s)[len]))
+        return false;
+    *s += len;
+
+    return true;
+}
+
+bool parse_recurrence(const char **s, Recurrence *r) {
+    const char *cur = *s;
+
+    while (isspace((uc)*cur))
+        ++cur;
+
+    r->weekdays = 0;
+    r->mday = 0;
+    r->sec = 0;
+
+    if (eat_word(&cur, "day"))
+        r->weekdays = ALL_DAYS;
+    else if (eat_word(&cur, "weekday") || eat_word(&cur, "weekdays"))
+        r->weekdays = WEEKDAYS;
+    else if (eat_word(&cur, "weekend"))
+        r->weekdays = WEEKEND;
+    else if (eat_word(&cur, "month")) {
+        if (!parse_one_or_two_digits(&cur, &r->mday, true) ||
+            r->mday < 1 || r->mday > 31)
+            return false;
+    }
+    else
+        for (;;) {
+            int day = parse_day_name(&cur);
+
+            if (day == -1)
+                return false;
+            r->weekdays |= 1u << day;
+
+            if (*cur != ',')
+                break;
+            ++cur;
+        }
+
+    if (!isspace((uc)*cur))
+        return false;
+
+    if (!parse_one_or_two_digits(&cur, &r->hour, true) || r->hour > 23 ||
+        *cur++ != ':' ||
+        !parse_one_or_two_digits(&cur, &r->min, false) || r->min > 59)
+        return false;
+    if (*cur == ':' &&
+        (++cur, !parse_one_or_two_digits(&cur, &r->sec, false) ||
+                r->sec > 59))
+        return false;
+
+    *s = cur;
+
+    return true;
+}
+
+void format_recurrence(const Recurrence *r, char *buf, size_t len) {
+    size_t n = 0;
+
+    #define APPEND(...)                                                \
+      n += snprintf(buf + min(n, len), len - min(n, len), __VA_ARGS__)
+
+    if (r->mday != 0)
+        APPEND("month %d", r->mday);
+    else if (r->weekdays == ALL_DAYS)
+        APPEND("day");
+    else if (r->weekdays == WEEKDAYS)
+        APPEND("weekday");
+    else if (r->weekdays == WEEKEND)
+        APPEND("weekend");
+    else {
+        bool first = true;
+
+        // List Monday first.
+        for (int i = 1; i <= 7; ++i)
+            if (r->weekdays & 1u << i%7) {
+                APPEND("%s%.3s", first ? "" : ",", day_names[i%7]);
+                first = false;
+            }
+    }
+
+    APPEND(" %02d:%02d:%02d", r->hour, r->min, r->sec);
+
+    #undef APPEND
+}
+
+// Returns the number of days in month 'mon' (0-11) of year 'year' (years
+// since 1900, as in struct tm).
+static int days_in_month(int year, int mon) {
+    return days_from_civil(year + 1900 + (mon == 11), (mon + 1)%12 + 1, 1) -
+           days_from_civil(year + 1900, mon + 1, 1);
+}
+
+// Returns true if the time of day in 'tm' is at or after the one in 'r'.
+static bool at_or_after_time(const struct tm *tm, const Recurrence *r) {
+    return 60*60*tm->tm_hour + 60*tm->tm_min + tm->tm_sec >=
+           60*60*r->hour + 60*r->min + r->sec;
+}
+
+time_t next_occurrence(const Recurrence *r, time_t after) {
+    struct tm after_tm;
+    struct tm tm;
+    time_t t;
+
+    if (!local_time(after, &after_tm))
+        return -1;
+
+    // Candidates are compared with 'after' by local date and time of day
+    // rather than by time_t, so that times that occur twice when DST ends
+    // only match once, and times that don't exist when DST starts (and get
+    // moved forward) don't match again.
+
+    if (r->mday == 0) {
+        // Weekly. The same weekday next week is the latest candidate.
+        for (int i = 0; i <= 7; ++i) {
+            if (!(r->weekdays & 1u << (after_tm.tm_wday + i)%7))
+                continue;
+            if (i == 0 && at_or_after_time(&after_tm, r))
+                continue;
+
+            tm = after_tm;
+            tm.tm_mday += i;
+            break;
+        }
+    }
+    else {
+        // Monthly. This month or the next one always has a candidate.
+        for (int i = 0; i <= 1; ++i) {
+            tm = after_tm;
+            tm.tm_mon += i;
+            if (tm.tm_mon == 12) {
+                tm.tm_mon = 0;
+                ++tm.tm_year;
+            }
+            tm.tm_mday = min(r->mday, days_in_month(tm.tm_year, tm.tm_mon));
+
+            if (i == 1 || tm.tm_mday > after_tm.tm_mday ||
+                (tm.tm_mday == after_tm.tm_mday &&
+                 !at_or_after_time(&after_tm, r)))
+                break;
+        }
+    }
+
+    tm.tm_hour = r->hour;
+    tm.tm_min = r->min;
+    tm.tm_sec = r->sec;
+    tm.tm_isdst = -1;
+
+    t = make_local_time(&tm);
+    if (t == -1)
+        warning("make_local_time() failed (next occurrence)");
+
+    return t;
+}
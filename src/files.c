@@ -26,28 +26,42 @@ static const char *get_home_dir(void) {
     return NULL;
 }
 
-int open_file(const char *filename, Open_mode mode) {
-    size_t data_dir_path_len;
-    int fd;
+// Returns the path to 'filename' inside the data directory (e.g.,
+// "/home/foo/.botniklas/file"), allocated with malloc(), or NULL on errors.
+// The length of the data directory part is returned in 'data_dir_path_len'.
+static char *get_path(const char *filename, size_t *data_dir_path_len) {
     const char *home_dir;
-    int open_flags;
     char *path;
 
-    // Construct path to file in 'path' (e.g., "/home/foo/.botniklas/file").
-
     home_dir = get_home_dir();
     if (home_dir == NULL)
-        return -1;
+        return NULL;
 
-    data_dir_path_len = strlen(home_dir) + 1 + strlen(DATA_DIR);
-    path = emalloc(data_dir_path_len + 1 + strlen(filename) + 1, "file path");
+    *data_dir_path_len = strlen(home_dir) + 1 + strlen(DATA_DIR);
+    path = emalloc(*data_dir_path_len + 1 + strlen(filename) + 1,
+                   "file path");
     sprintf(path, "%s/%s/%s", home_dir, DATA_DIR, filename);
 
+    return path;
+}
+
+int open_file(const char *filename, Open_mode mode) {
+    size_t data_dir_path_len;
+    int fd;
+    int open_flags;
+    char *path;
+
+    path = get_path(filename, &data_dir_path_len);
+    if (path == NULL)
+        return -1;
+
     // Map mode to open() flags.
 
     switch (mode) {
     case READ: open_flags = O_RDONLY; break;
     case APPEND: open_flags = O_APPEND | O_CREAT | O_WRONLY; break;
+    case READ_WRITE: open_flags = O_CREAT | O_RDWR; break;
+    case CREATE: open_flags = O_CREAT | O_TRUNC | O_RDWR; break;
     default: fail_exit("Internal error: Bad mode passed to "
                        "open_file().");
     }
@@ -126,6 +140,8 @@ FILE *open_file_stdio(const char *filename, Open_mode mode) {
     switch (mode) {
     case READ: fdopen_mode = "r"; break;
     case APPEND: fdopen_mode = "a"; break;
+    case READ_WRITE: fdopen_mode = "r+"; break;
+    case CREATE: fdopen_mode = "w+"; break;
     default: fail_exit("Internal error: Bad mode passed to "
                        "open_file_stdio().");
     }
@@ -208,3 +224,34 @@ err_close:
 
     return NULL;
 }
+
+bool rename_file(const char *from, const char *to) {
+    size_t data_dir_path_len;
+    char *from_path;
+    char *to_path;
+    bool ok = false;
+
+    from_path = get_path(from, &data_dir_path_len);
+    if (from_path == NULL)
+        return false;
+    to_path = get_path(to, &data_dir_path_len);
+    if (to_path == NULL)
+        goto free_from;
+
+    if (rename(from_path, to_path) == -1)
+        warning_err("rename() error from '%s' to '%s'", from_path, to_path);
+    else
+        ok = true;
+
+    free(to_path);
+free_from:
+    free(from_path);
+
+    return ok;
+}
+
+char *get_data_dir_path(void) {
+    size_t data_dir_path_len;
+
+    return get_path("", &data_dir_path_len);
+}
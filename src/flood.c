@@ -0,0 +1,220 @@
+// Flood detection with SimHash fingerprints. See flood.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "channel_config.h"
+#include "date.h"
+#include "flood.h"
+#include "intern.h"
+#include "id_set.h"
+#include "msg_io.h"
+
+// Number of fingerprints kept per channel.
+#define WINDOW 64
+// Messages with fingerprints at most this many bits apart are near-duplicates.
+#define MAX_DISTANCE 3
+// A message is part of a repeat flood if at least DUP_MIN near-duplicates
+// (including itself) were seen within DUP_SECS seconds.
+#define DUP_MIN 4
+#define DUP_SECS 60
+// Shorter messages (after normalization) aren't fingerprinted, since short
+// phrases like "good morning" are repeated legitimately.
+#define MIN_TEXT_LEN 16
+// Only the start of longer messages is fingerprinted, which bounds the work
+// per message.
+#define MAX_TEXT_LEN 256
+// Length of the shingles (overlapping substrings) that are hashed.
+#define SHINGLE_LEN 4
+
+// Number of per-sender rate counters per channel. A power of two. Senders
+// whose nicks hash to the same counter evict each other.
+#define N_SENDERS 64
+// A sender is flooding if they write more than RATE_MAX messages within
+// RATE_SECS seconds.
+#define RATE_MAX 8
+#define RATE_SECS 10
+
+// Minimum time in seconds between warnings in a channel.
+#define WARN_SECS (5*60)
+
+typedef struct Fingerprint {
+    uint64_t simhash;
+    // Zero for unused entries.
+    time_t when;
+} Fingerprint;
+
+typedef struct Sender_rate {
+    // casemap_hash() of the nick.
+    uint32_t sender;
+    uint32_t n_msgs;
+    // Start of the current RATE_SECS window.
+    time_t start;
+} Sender_rate;
+
+typedef struct Channel_flood {
+    // Ring of fingerprints. 'next' is the oldest.
+    Fingerprint window[WINDOW];
+    size_t next;
+    Sender_rate senders[N_SENDERS];
+    time_t last_warning;
+} Channel_flood;
+
+// Maps interned channel names (see intern.h) to their Channel_flood. Each
+// entry holds a reference to the interned name.
+static Id_map channels;
+
+void init_flood(void) {
+    id_map_init(&channels);
+}
+
+void free_flood(void) {
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            intern_unref(channels.keys.ids[i]);
+            free(channels.vals[i]);
+        }
+    id_map_free(&channels);
+}
+
+static Channel_flood *get_channel(const char *channel) {
+    Str_id id = intern_find(channel);
+    Channel_flood *c;
+
+    if (id != NO_STR_ID) {
+        c = id_map_get(&channels, id);
+        if (c != NULL)
+            return c;
+    }
+
+    c = emalloc(sizeof *c, "channel flood state");
+    clear(*c);
+    id_map_set(&channels, intern(channel), c);
+
+    return c;
+}
+
+// Writes a normalized version of the start of 'text' to 'buf' and returns its
+// length. ASCII is folded to lower case, digits are replaced with '0' (so
+// that e.g. varying ids in URLs don't matter), control characters (e.g. IRC
+// formatting codes) are removed, and runs of spaces are collapsed.
+static size_t normalize(const char *text, char buf[MAX_TEXT_LEN]) {
+    size_t len = 0;
+
+    for (const uc *p = (const uc*)text; *p != '\0' && len < MAX_TEXT_LEN;
+         ++p) {
+        uc c = *p;
+
+        if (c < 0x20)
+            continue;
+        if (c == ' ' && (len == 0 || buf[len - 1] == ' '))
+            continue;
+
+        buf[len++] = isdigit(c) ? '0' : tolower(c);
+    }
+
+    return len;
+}
+
+// SplitMix64 finalizer.
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+// Returns the SimHash of the SHINGLE_LEN-byte shingles of the 'len' bytes at
+// 'text': bit i is set if bit i is set in the hashes of most shingles.
+// Similar texts share most shingles and so get fingerprints that differ in
+// few bits.
+//
+// The bits are counted in byte-sized lanes, eight at a time: byte k of
+// 'counts[j]' counts bit 8*k + j.
+static uint64_t simhash(const char *text, size_t len) {
+    uint64_t counts[8] = { 0 };
+    size_t n_shingles = 0;
+    uint64_t res = 0;
+
+    _Static_assert(MAX_TEXT_LEN - SHINGLE_LEN + 1 <= UINT8_MAX,
+                   "shingle counts must fit in a byte");
+
+    for (size_t i = 0; i + SHINGLE_LEN <= len; ++i) {
+        uint32_t shingle;
+        uint64_t hash;
+
+        memcpy(&shingle, text + i, SHINGLE_LEN);
+        hash = mix(shingle);
+        for (unsigned j = 0; j < 8; ++j)
+            counts[j] += hash >> j & 0x0101010101010101ULL;
+        ++n_shingles;
+    }
+
+    for (unsigned bit = 0; bit < 64; ++bit)
+        if (2*(counts[bit%8] >> 8*(bit/8) & 0xFF) > n_shingles)
+            res |= (uint64_t)1 << bit;
+
+    return res;
+}
+
+// Adds the message to the window and returns true if it's part of a repeat
+// flood.
+static bool check_repeat(Channel_flood *c, const char *text, time_t now) {
+    char buf[MAX_TEXT_LEN];
+    size_t len = normalize(text, buf);
+    unsigned n_dups = 1;
+    uint64_t hash;
+
+    if (len < MIN_TEXT_LEN)
+        return false;
+
+    hash = simhash(buf, len);
+    for (size_t i = 0; i < WINDOW; ++i)
+        if (c->window[i].when != 0 && now - c->window[i].when < DUP_SECS &&
+            __builtin_popcountll(c->window[i].simhash ^ hash) <= MAX_DISTANCE)
+            ++n_dups;
+
+    c->window[c->next].simhash = hash;
+    c->window[c->next].when = now;
+    c->next = (c->next + 1)%WINDOW;
+
+    return n_dups >= DUP_MIN;
+}
+
+// Counts the message for 'nick' and returns true if they're writing too fast.
+static bool check_rate(Channel_flood *c, const char *nick, time_t now) {
+    uint32_t sender = casemap_hash(nick, strlen(nick));
+    Sender_rate *rate = &c->senders[sender & (N_SENDERS - 1)];
+
+    if (rate->sender != sender || now - rate->start >= RATE_SECS) {
+        rate->sender = sender;
+        rate->n_msgs = 0;
+        rate->start = now;
+    }
+
+    return ++rate->n_msgs > RATE_MAX;
+}
+
+bool flood_check(const char *nick, const char *channel, const char *text,
+                 Flood_action action) {
+    time_t now = current_time();
+    Channel_flood *c;
+    bool repeat;
+    bool rate;
+
+    if (action == FLOOD_OFF)
+        return false;
+
+    c = get_channel(channel);
+    repeat = check_repeat(c, text, now);
+    rate = check_rate(c, nick, now);
+    if (!repeat && !rate)
+        return false;
+
+    if (action == FLOOD_WARN && now - c->last_warning >= WARN_SECS) {
+        say(channel, "Flood detected (%s, e.g. from %s). Ignoring it.",
+            repeat ? "repeated messages" : "messages sent too fast", nick);
+        c->last_warning = now;
+    }
+
+    return true;
+}
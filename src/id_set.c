@@ -0,0 +1,180 @@
+// Hash sets and maps of interned string ids. See id_set.h.
+
+#include "common.h"
+#include "intern.h"
+#include "id_set.h"
+
+#define MIN_SIZE 8
+
+// Ids are small and mostly sequential. Multiplying by an odd constant
+// permutes the low bits, spreading consecutive ids over the table.
+static size_t home_slot(const Id_set *set, Str_id id) {
+    return (id*2654435761u) & (set->size - 1);
+}
+
+// Returns the slot holding 'id', or the empty slot where it would go. The set
+// must have at least one slot.
+static size_t find_slot(const Id_set *set, Str_id id) {
+    size_t i;
+
+    for (i = home_slot(set, id); set->ids[i] != NO_STR_ID && set->ids[i] != id;
+         i = (i + 1) & (set->size - 1));
+
+    return i;
+}
+
+// Grows 'set' (and 'vals', if not NULL) so that one more id can be added
+// while keeping the table at most half full.
+static void reserve(Id_set *set, void ***vals) {
+    Str_id *old_ids = set->ids;
+    void **old_vals = vals ? *vals : NULL;
+    size_t old_size = set->size;
+
+    if (2*(set->count + 1) <= set->size)
+        return;
+
+    set->size = old_size == 0 ? MIN_SIZE : 2*old_size;
+    set->ids = calloc(set->size, sizeof *set->ids);
+    if (set->ids == NULL)
+        err_exit("calloc failed: id set");
+    if (vals != NULL)
+        *vals = emalloc(set->size*sizeof **vals, "id map values");
+
+    for (size_t i = 0; i < old_size; ++i)
+        if (old_ids[i] != NO_STR_ID) {
+            size_t j = find_slot(set, old_ids[i]);
+
+            set->ids[j] = old_ids[i];
+            if (vals != NULL)
+                (*vals)[j] = old_vals[i];
+        }
+
+    free(old_ids);
+    free(old_vals);
+}
+
+// Removes the id in slot 'i', shifting later entries in the same probe
+// sequence back so that lookups never need tombstones.
+static void remove_slot(Id_set *set, void **vals, size_t i) {
+    size_t mask = set->size - 1;
+
+    for (size_t j = (i + 1) & mask; set->ids[j] != NO_STR_ID;
+         j = (j + 1) & mask) {
+
+        size_t home = home_slot(set, set->ids[j]);
+
+        // The entry in slot 'j' can move back to 'i' unless its home slot
+        // lies cyclically in ]i, j].
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            set->ids[i] = set->ids[j];
+            if (vals != NULL)
+                vals[i] = vals[j];
+            i = j;
+        }
+    }
+    set->ids[i] = NO_STR_ID;
+    --set->count;
+}
+
+void id_set_init(Id_set *set) {
+    set->ids = NULL;
+    set->size = 0;
+    set->count = 0;
+}
+
+void id_set_free(Id_set *set) {
+    free(set->ids);
+}
+
+void id_set_clear(Id_set *set) {
+    if (set->ids != NULL)
+        memset(set->ids, 0, set->size*sizeof *set->ids);
+    set->count = 0;
+}
+
+bool id_set_add(Id_set *set, Str_id id) {
+    size_t i;
+
+    assert(id != NO_STR_ID);
+
+    reserve(set, NULL);
+    i = find_slot(set, id);
+    if (set->ids[i] == id)
+        return false;
+
+    set->ids[i] = id;
+    ++set->count;
+
+    return true;
+}
+
+bool id_set_remove(Id_set *set, Str_id id) {
+    size_t i;
+
+    if (set->count == 0)
+        return false;
+
+    i = find_slot(set, id);
+    if (set->ids[i] != id)
+        return false;
+
+    remove_slot(set, NULL, i);
+
+    return true;
+}
+
+bool id_set_contains(const Id_set *set, Str_id id) {
+    return set->count != 0 && set->ids[find_slot(set, id)] == id;
+}
+
+void id_map_init(Id_map *map) {
+    id_set_init(&map->keys);
+    map->vals = NULL;
+}
+
+void id_map_free(Id_map *map) {
+    id_set_free(&map->keys);
+    free(map->vals);
+}
+
+void *id_map_get(const Id_map *map, Str_id id) {
+    size_t i;
+
+    if (map->keys.count == 0)
+        return NULL;
+
+    i = find_slot(&map->keys, id);
+
+    return map->keys.ids[i] == id ? map->vals[i] : NULL;
+}
+
+void id_map_set(Id_map *map, Str_id id, void *val) {
+    size_t i;
+
+    assert(id != NO_STR_ID);
+
+    reserve(&map->keys, &map->vals);
+    i = find_slot(&map->keys, id);
+    if (map->keys.ids[i] != id) {
+        map->keys.ids[i] = id;
+        ++map->keys.count;
+    }
+    map->vals[i] = val;
+}
+
+void *id_map_remove(Id_map *map, Str_id id) {
+    size_t i;
+    void *val;
+
+    if (map->keys.count == 0)
+        return NULL;
+
+    i = find_slot(&map->keys, id);
+    if (map->keys.ids[i] != id)
+        return NULL;
+
+    val = map->vals[i];
+    remove_slot(&map->keys, map->vals, i);
+
+    return val;
+}
@@ -0,0 +1,262 @@
+// String interning table. See intern.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "intern.h"
+
+typedef struct Entry {
+    // Offset of the string in 'pool'. For free entries, the id of the next
+    // free entry instead.
+    uint32_t offset;
+    // Length of the string, excluding the terminating null.
+    uint32_t len;
+    uint32_t hash;
+    // Reference count. Zero for free entries.
+    uint32_t refs;
+} Entry;
+
+// Entries indexed by id. Entry 0 (NO_STR_ID) is never used.
+static Entry *entries;
+static size_t n_entries;
+static size_t entries_size;
+// List of free entries, linked through 'offset'.
+static Str_id free_ids;
+
+// Pool holding the null-terminated strings back-to-back. 'pool_garbage' is
+// the number of bytes belonging to removed strings, reclaimed by compaction.
+static char *pool;
+static size_t pool_len;
+static size_t pool_size;
+static size_t pool_garbage;
+
+// Hash table of ids, using linear probing. 'n_slots' is a power of two, and
+// the table is kept at most half full.
+static Str_id *slots;
+static size_t n_slots;
+static size_t n_live;
+
+#define INITIAL_N_ENTRIES 256
+#define INITIAL_POOL_SIZE 4096
+
+static uint32_t hash_str(const char *s, size_t len) {
+    return casemap_hash(s, len);
+}
+
+static bool str_eq(const Entry *entry, const char *s, size_t len) {
+    return entry->len == len && casemap_eq_n(pool + entry->offset, s, len);
+}
+
+void intern_init(void) {
+    entries_size = INITIAL_N_ENTRIES;
+    entries = emalloc(entries_size*sizeof *entries, "intern entries");
+    // Reserve NO_STR_ID.
+    n_entries = 1;
+    free_ids = NO_STR_ID;
+
+    pool_size = INITIAL_POOL_SIZE;
+    pool = emalloc(pool_size, "intern pool");
+    pool_len = 0;
+    pool_garbage = 0;
+
+    n_slots = 2*INITIAL_N_ENTRIES;
+    slots = calloc(n_slots, sizeof *slots);
+    if (slots == NULL)
+        err_exit("calloc failed: intern slots");
+    n_live = 0;
+}
+
+void intern_free(void) {
+    free(entries);
+    free(pool);
+    free(slots);
+}
+
+// Returns the slot holding the string 's' (with hash 'hash'), or the empty
+// slot where it would go.
+static size_t find_slot(const char *s, size_t len, uint32_t hash) {
+    size_t mask = n_slots - 1;
+    size_t i;
+
+    for (i = hash & mask; slots[i] != NO_STR_ID; i = (i + 1) & mask) {
+        Entry *entry = &entries[slots[i]];
+
+        if (entry->hash == hash && str_eq(entry, s, len))
+            break;
+    }
+
+    return i;
+}
+
+// Reinserts all ids into a fresh hash table with 'new_n_slots' slots.
+static void rebuild_slots(size_t new_n_slots) {
+    Str_id *old_slots = slots;
+    size_t old_n_slots = n_slots;
+
+    n_slots = new_n_slots;
+    slots = calloc(n_slots, sizeof *slots);
+    if (slots == NULL)
+        err_exit("calloc failed: intern slots (rebuild)");
+
+    for (size_t i = 0; i < old_n_slots; ++i)
+        if (old_slots[i] != NO_STR_ID) {
+            size_t j = entries[old_slots[i]].hash & (n_slots - 1);
+
+            while (slots[j] != NO_STR_ID)
+                j = (j + 1) & (n_slots - 1);
+            slots[j] = old_slots[i];
+        }
+
+    free(old_slots);
+}
+
+void intern_rehash(void) {
+    for (Str_id id = 1; id < n_entries; ++id)
+        if (entries[id].refs != 0)
+            entries[id].hash = hash_str(pool + entries[id].offset,
+                                        entries[id].len);
+
+    rebuild_slots(n_slots);
+}
+
+// Copies the live strings to the start of a fresh pool, dropping garbage.
+static void compact_pool(void) {
+    char *new_pool = emalloc(pool_size, "intern pool (compact)");
+    size_t new_len = 0;
+
+    for (Str_id id = 1; id < n_entries; ++id)
+        if (entries[id].refs != 0) {
+            memcpy(new_pool + new_len, pool + entries[id].offset,
+                   entries[id].len + 1);
+            entries[id].offset = new_len;
+            new_len += entries[id].len + 1;
+        }
+
+    free(pool);
+    pool = new_pool;
+    pool_len = new_len;
+    pool_garbage = 0;
+}
+
+// Makes room for 'n' more bytes in the pool.
+static void reserve_pool(size_t n) {
+    if (pool_len + n <= pool_size)
+        return;
+
+    // Compacting is cheaper than growing if most of the pool is garbage.
+    if (pool_garbage >= pool_len/2)
+        compact_pool();
+
+    if (pool_len + n > pool_size) {
+        pool_size = ge_pow_2(pool_len + n);
+        pool = erealloc(pool, pool_size, "intern pool (grow)");
+    }
+}
+
+static Str_id new_entry(void) {
+    Str_id id;
+
+    if (free_ids != NO_STR_ID) {
+        id = free_ids;
+        free_ids = entries[id].offset;
+
+        return id;
+    }
+
+    if (n_entries == entries_size) {
+        entries_size *= 2;
+        entries = erealloc(entries, entries_size*sizeof *entries,
+                           "intern entries (grow)");
+    }
+
+    return n_entries++;
+}
+
+Str_id intern(const char *s) {
+    size_t len = strlen(s);
+    uint32_t hash = hash_str(s, len);
+    size_t i;
+    Str_id id;
+
+    i = find_slot(s, len, hash);
+    if (slots[i] != NO_STR_ID) {
+        ++entries[slots[i]].refs;
+
+        return slots[i];
+    }
+
+    if (2*(n_live + 1) > n_slots) {
+        rebuild_slots(2*n_slots);
+        i = find_slot(s, len, hash);
+    }
+
+    reserve_pool(len + 1);
+
+    id = new_entry();
+    entries[id].offset = pool_len;
+    entries[id].len = len;
+    entries[id].hash = hash;
+    entries[id].refs = 1;
+    memcpy(pool + pool_len, s, len + 1);
+    pool_len += len + 1;
+
+    slots[i] = id;
+    ++n_live;
+
+    return id;
+}
+
+Str_id intern_find(const char *s) {
+    size_t len = strlen(s);
+
+    return slots[find_slot(s, len, hash_str(s, len))];
+}
+
+Str_id intern_ref(Str_id id) {
+    assert(id != NO_STR_ID && entries[id].refs != 0);
+    ++entries[id].refs;
+
+    return id;
+}
+
+// Removes the id in slot 'i' from the hash table. Later entries in the same
+// probe sequence are shifted back so that lookups never need tombstones.
+static void remove_slot(size_t i) {
+    size_t mask = n_slots - 1;
+
+    for (size_t j = (i + 1) & mask; slots[j] != NO_STR_ID; j = (j + 1) & mask) {
+        size_t home = entries[slots[j]].hash & mask;
+
+        // The entry in slot 'j' can move back to 'i' unless its home slot
+        // lies cyclically in ]i, j].
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = NO_STR_ID;
+}
+
+void intern_unref(Str_id id) {
+    Entry *entry = &entries[id];
+    size_t mask = n_slots - 1;
+    size_t i;
+
+    assert(id != NO_STR_ID && entry->refs != 0);
+    if (--entry->refs != 0)
+        return;
+
+    for (i = entry->hash & mask; slots[i] != id; i = (i + 1) & mask)
+        assert(slots[i] != NO_STR_ID);
+    remove_slot(i);
+    --n_live;
+
+    pool_garbage += entry->len + 1;
+    entry->offset = free_ids;
+    free_ids = id;
+}
+
+const char *intern_str(Str_id id) {
+    assert(id != NO_STR_ID && entries[id].refs != 0);
+
+    return pool + entries[id].offset;
+}
@@ -1,10 +1,28 @@
 #include "common.h"
+#include "channel_config.h"
+#include "channel_state.h"
+#include "connect.h"
+#include "date.h"
 #include "irc.h"
+#include "join.h"
+#include "lag.h"
+#include "latency.h"
 #include "msg_io.h"
 #include "msgs.h"
 #include "options.h"
+#include "reactor.h"
+#include "resolve.h"
+#include "time_event.h"
+#include "transport.h"
+#include "upgrade.h"
 
-int serv_fd;
+// Delay in seconds before the first reconnect attempt. Doubles with each
+// failed attempt, up to RECONNECT_DELAY_MAX.
+#define RECONNECT_DELAY_MIN 5
+#define RECONNECT_DELAY_MAX (5*60)
+
+// -1 while not connected.
+int serv_fd = -1;
 
 #define RET_INVALID_MSG(s)                        \
   do {                                            \
@@ -144,47 +162,408 @@ static bool split_msg(char *msg_str, IRC_msg *msg) {
     return true;
 }
 
-bool process_msgs(void) {
-    char *msg_str;
+Drain_stats drain_stats;
+
+// Set when the last drain stopped because the budget ran out.
+static bool drain_incomplete;
+
+// Budget of the current drain.
+static unsigned drain_msgs_left;
+static struct timespec drain_start;
+
+static uint64_t us_since(const struct timespec *t) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    if (!recv_msgs())
+    return 1000000*(uint64_t)(now.tv_sec - t->tv_sec) +
+           (now.tv_nsec - t->tv_nsec)/1000;
+}
+
+// scan_new_msgs() callback that answers PINGs right away, so that they are
+// not delayed by a backlog of other messages.
+static bool answer_ping(const char *msg, size_t len) {
+    const char *end = msg + len;
+    const char *cur = msg;
+    const char *param;
+
+    // Skip the prefix, if any.
+    if (*cur == ':') {
+        cur = memchr(cur, ' ', len);
+        if (cur == NULL)
+            return false;
+        ++cur;
+    }
+
+    if (end - cur < 6 || memcmp(cur, "PING ", 5) != 0)
+        return false;
+    cur += 5;
+
+    // Answer with the first parameter, like handle_ping() in msgs.c. Leave
+    // malformed PINGs to the regular message handling.
+    if (*cur == ':')
+        param = ++cur;
+    else {
+        param = cur;
+        while (cur != end && *cur != ' ')
+            ++cur;
+        end = cur;
+    }
+    if (param == end || memchr(param, '\0', end - param) != NULL)
         return false;
 
-    while (get_msg(&msg_str)) {
+    if (trace_msgs)
+        printf("message from server (answered ahead of the backlog): "
+               "'%.*s'\n", (int)len, msg);
+
+    latency_begin(LATENCY_PING);
+    write_msg("PONG :%.*s", (int)(end - param), param);
+    // Don't let the PONG wait for the replies to the backlog.
+    serv_flush();
+    latency_end();
+    ++drain_stats.n_early_pongs;
+
+    return true;
+}
+
+// Processes complete messages from the read buffer until it runs out of them
+// or the drain budget is used up. Returns false in the latter case.
+static bool process_buffered_msgs(void) {
+    char *msg_str;
+
+    while (drain_msgs_left != 0 && get_msg(&msg_str)) {
         IRC_msg msg;
 
         // Skip empty and invalid messages.
         if (msg_str == NULL)
             continue;
 
+        --drain_msgs_left;
+        ++drain_stats.n_msgs;
+
         if (trace_msgs)
             printf("message from server: '%s'\n", msg_str);
 
-        if (!split_msg(msg_str, &msg))
-            continue;
+        if (split_msg(msg_str, &msg))
+            handle_msg(&msg);
+
+        if (us_since(&drain_start) >= drain_budget_us)
+            return false;
+    }
+
+    return drain_msgs_left != 0;
+}
+
+// Processes buffered messages and receives more from the server, within the
+// drain budget. Only receives if 'readable' is true or if the transport has
+// received data pending, since the socket is blocking.
+static bool drain(bool readable) {
+    unsigned n_msgs;
+    uint64_t us;
+    bool done;
+
+    drain_msgs_left = drain_budget_msgs;
+    clock_gettime(CLOCK_MONOTONIC, &drain_start);
+
+    for (;;) {
+        done = process_buffered_msgs();
+        if (!done)
+            break;
+
+        // With userspace TLS, decrypted data can be left over after filling
+        // the read buffer. It won't make the socket readable, so loop until
+        // it has been processed.
+        if (!readable && !serv_recv_pending())
+            break;
+        readable = false;
 
-        handle_msg(&msg);
+        if (!recv_msgs())
+            return false;
+        scan_new_msgs(answer_ping);
     }
 
+    // Let the caller reconnect.
+    if (serv_send_failed())
+        return false;
+
+    drain_incomplete = !done;
+
+    n_msgs = drain_budget_msgs - drain_msgs_left;
+    us = us_since(&drain_start);
+    ++drain_stats.n_drains;
+    if (!done)
+        ++drain_stats.n_deferred;
+    drain_stats.max_msgs = max(drain_stats.max_msgs, (uint64_t)n_msgs);
+    drain_stats.max_us = max(drain_stats.max_us, us);
+
     return true;
 }
 
+bool process_msgs(void) {
+    return drain(true);
+}
+
+bool msgs_pending(void) {
+    return drain_incomplete;
+}
+
+bool process_pending_msgs(void) {
+    return drain(false);
+}
+
+void resume_msgs(void) {
+    latency_rx_unknown();
+    scan_new_msgs(answer_ping);
+    drain_incomplete = true;
+}
+
+// Parameters passed to connect_to_irc_server(), needed once the lookup
+// completes.
+static struct {
+    const char *host;
+    const char *port;
+    const char *nick;
+    const char *username;
+    const char *realname;
+    void (*connected)(void);
+} conn;
+
+// Number of reconnect attempts since the last registration. 0 for the first
+// connection, whose failure exits the program.
+static unsigned n_reconnects;
+
+static void schedule_reconnect(void);
+
+// Socket of the connection being set up (TCP connected, TLS handshake in
+// progress). It becomes 'serv_fd' once ready for registration.
+static int connecting_fd = -1;
+
+// When the connection attempt started, for the connect time.
+static struct timespec connect_start;
+
+// Abandons the connection attempt in progress, if any. Does not remove the
+// deadline.
+static void abandon_connect(void) {
+    cancel_connect();
+    tls_cancel();
+    if (connecting_fd != -1) {
+        if (close(connecting_fd) == -1)
+            warning_err("close() failed on the server socket (connecting)");
+        connecting_fd = -1;
+    }
+}
+
+// Time event for giving up on a connection attempt (including the TLS
+// handshake) that takes too long, e.g. because the server stopped responding.
+static void connect_deadline(void *data) {
+    if (n_reconnects == 0)
+        fail_exit("Timed out connecting to '%s' (using service/port '%s')",
+                  conn.host, conn.port);
+    warning("Timed out connecting to '%s' (using service/port '%s')",
+            conn.host, conn.port);
+    abandon_connect();
+    schedule_reconnect();
+}
+
+// Called once the connection is ready (including TLS). Sends the registration
+// messages.
+static void register_with_server(void) {
+    remove_time_events(connect_deadline);
+
+    // Stays non-blocking (see serv_flush()).
+    serv_fd = connecting_fd;
+    connecting_fd = -1;
+
+    set_keepalive();
+    if (measure_latency)
+        enable_rx_timestamps();
+
+    printf("Sending registration messages (nickname: %s, username: %s, "
+           "realname: '%s')\n", conn.nick, conn.username, conn.realname);
+
+    write_msg("NICK %s", conn.nick);
+    write_msg("USER %s 0 * :%s", conn.username, conn.realname);
+
+    conn.connected();
+}
+
+// Called by tls_connect() when the TLS handshake is done.
+static void server_tls_done(bool ok) {
+    if (!ok) {
+        if (n_reconnects == 0)
+            fail_exit("Failed to establish a TLS connection with '%s'",
+                      conn.host);
+        remove_time_events(connect_deadline);
+        abandon_connect();
+        schedule_reconnect();
+
+        return;
+    }
+
+    register_with_server();
+}
+
+// Called by connect_async() with the connected socket, or -1 and an error.
+static void tcp_connected(int fd, int err) {
+    struct timespec end;
+
+    if (fd == -1) {
+        errno = err;
+        if (n_reconnects == 0)
+            err_exit("Failed to connect to '%s' (using service/port '%s')",
+                     conn.host, conn.port);
+        warning_err("Failed to connect to '%s' (using service/port '%s')",
+                    conn.host, conn.port);
+        remove_time_events(connect_deadline);
+        schedule_reconnect();
+
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Connected in %.1f ms\n",
+           1e3*(end.tv_sec - connect_start.tv_sec) +
+           1e-6*(end.tv_nsec - connect_start.tv_nsec));
+
+    connecting_fd = fd;
+    if (use_tls)
+        tls_connect(fd, conn.host, verify_cert, server_tls_done);
+    else
+        register_with_server();
+}
+
+// Called with the addresses of the IRC server.
+static void irc_server_resolved(struct addrinfo *ais, int err, void *data) {
+    if (err != 0) {
+        if (n_reconnects == 0)
+            fail_exit("Failed to look up '%s' (using service/port '%s'): %s",
+                      conn.host, conn.port, gai_strerror(err));
+        warning("Failed to look up '%s' (using service/port '%s'): %s",
+                conn.host, conn.port, gai_strerror(err));
+        schedule_reconnect();
+
+        return;
+    }
+
+    // The connection and the TLS handshake are driven by the event loop, so
+    // timers and signals are still handled while a server is slow to respond.
+    clock_gettime(CLOCK_MONOTONIC, &connect_start);
+    add_time_event(current_time() + dead_timeout, connect_deadline, NULL);
+    connect_async(ais, connect_delay, tcp_connected);
+}
+
 void connect_to_irc_server(const char *host, const char *port, const char *nick,
-                           const char *username, const char *realname) {
+                           const char *username, const char *realname,
+                           void (*connected)(void)) {
+    conn.host = host;
+    conn.port = port;
+    conn.nick = nick;
+    conn.username = username;
+    conn.realname = realname;
+    conn.connected = connected;
+
     printf("Connecting to %s (port/service %s)\n", host, port);
-    serv_fd = connect_to(host, port, SOCK_STREAM);
-    printf("Sending registration messages (nickname: %s, username: %s, "
-           "realname: '%s')\n", nick, username, realname);
+    resolve_async(host, port, SOCK_STREAM, irc_server_resolved, NULL);
+}
 
-    write_msg("NICK %s", nick);
-    write_msg("USER %s 0 * :%s", username, realname);
+// Time event for a reconnect attempt.
+static void start_reconnect(void *data) {
+    printf("Reconnecting to %s (port/service %s)\n", conn.host, conn.port);
+    resolve_async(conn.host, conn.port, SOCK_STREAM, irc_server_resolved,
+                  NULL);
 }
 
-bool is_channel(const char *channel_or_nick) {
-    switch (channel_or_nick[0]) {
-    case '&': case '#': case '+': case '!': return true;
-    default: return false;
+static void schedule_reconnect(void) {
+    unsigned delay = RECONNECT_DELAY_MAX;
+
+    // Nothing would advance the virtual clock to the reconnect. The fake
+    // server going away ends the simulation.
+    if (sim_start != 0) {
+        puts("Not reconnecting in simulation mode");
+        reactor_stop();
+
+        return;
+    }
+
+    // Avoid shifting too far.
+    if (n_reconnects < 16)
+        delay = min(RECONNECT_DELAY_MIN << n_reconnects, delay);
+    ++n_reconnects;
+
+    printf("Reconnecting in %u seconds\n", delay);
+    add_time_event(current_time() + delay, start_reconnect, NULL);
+}
+
+void reconnect_to_irc_server(void) {
+    lag_stop();
+    cancel_join();
+
+    // We are no longer in any channels.
+    free_channel_state();
+    init_channel_state();
+
+    if (serv_fd != -1) {
+        reactor_remove(serv_fd);
+        tls_close();
+        if (close(serv_fd) == -1)
+            warning_err("close() failed on the server socket (reconnect)");
+        serv_fd = -1;
     }
+
+    msg_read_buf_reset();
+    drain_incomplete = false;
+    latency_rx_unknown();
+
+    schedule_reconnect();
+}
+
+void reset_reconnect_delay(void) {
+    n_reconnects = 0;
+}
+
+void cancel_connect_to_irc_server(void) {
+    remove_time_events(connect_deadline);
+    abandon_connect();
+}
+
+// Channel prefixes, indexed by character.
+static bool chantypes[UCHAR_MAX + 1] = {
+  ['&'] = true, ['#'] = true, ['+'] = true, ['!'] = true };
+
+bool is_channel(const char *channel_or_nick) {
+    return chantypes[(uc)channel_or_nick[0]];
+}
+
+void set_chantypes(const char *types) {
+    memset(chantypes, 0, sizeof chantypes);
+    for (; *types != '\0'; ++types)
+        chantypes[(uc)*types] = true;
+}
+
+void upgrade_save_irc(void) {
+    upgrade_put_u64(serv_fd);
+    upgrade_put_bytes(chantypes, sizeof chantypes);
+}
+
+void upgrade_restore_irc(void) {
+    const void *types;
+    size_t len;
+
+    serv_fd = upgrade_get_u64();
+    // The descriptor was inherited without FD_CLOEXEC.
+    if (fcntl(serv_fd, F_SETFD, FD_CLOEXEC) == -1)
+        err_exit("fcntl (serv_fd after live upgrade)");
+    // In case the previous process used a blocking socket.
+    set_nonblocking(serv_fd, true);
+    // The previous process might have used other settings.
+    set_keepalive();
+    if (measure_latency)
+        enable_rx_timestamps();
+
+    types = upgrade_get_bytes(&len);
+    if (len != sizeof chantypes)
+        fail_exit("Malformed channel prefixes in state from live upgrade");
+    memcpy(chantypes, types, len);
 }
 
 const char *irc_errnum_str(unsigned errnum) {
@@ -0,0 +1,253 @@
+// Packed and paced joining of the configured channels. See join.h.
+
+#include "common.h"
+#include "channel_config.h"
+#include "channel_state.h"
+#include "date.h"
+#include "join.h"
+#include "msg_io.h"
+#include "time_event.h"
+#include "upgrade.h"
+
+// Maximum length of an IRC message, excluding the terminating "\r\n" (RFC
+// 2812).
+#define MAX_MSG_LEN 510
+
+// Servers typically let a client send a short burst of lines and then about
+// one line every two seconds (ircd-style flood control charges two seconds
+// of "penalty" per line) before throttling or disconnecting it. Stay under
+// that with bursts of JOIN_BURST lines, each followed by a pause that pays
+// off the penalty.
+#define JOIN_BURST 4
+#define SECS_PER_LINE 2
+
+// Maximum number of channels per JOIN. 0 means no limit.
+static size_t max_targets = 0;
+
+// True once join_channels() has been called on the current connection.
+static bool joined;
+
+// Channels in the order we join them. Keys in a JOIN apply to the channels
+// positionally, so channels with keys go first. NULL when not joining.
+static const Channel_config **join_order;
+static size_t n_join;
+// Index in 'join_order' of the next channel to join.
+static size_t next_join;
+// Incremented by cancel_join(). Bursts scheduled with an earlier value are
+// stale.
+static uintptr_t join_epoch;
+
+void set_join_max_targets(size_t n) {
+    max_targets = n;
+}
+
+// Returns the number of channels starting at 'next_join' that fit in one
+// JOIN.
+static size_t n_fitting(void) {
+    size_t chans_len = 0;
+    size_t keys_len = 0;
+    size_t n = 0;
+
+    for (size_t i = next_join; i < n_join; ++i, ++n) {
+        const Channel_config *config = join_order[i];
+        size_t new_chans_len;
+        size_t new_keys_len = keys_len;
+
+        if (max_targets != 0 && n == max_targets)
+            break;
+
+        new_chans_len = chans_len + (n != 0) + strlen(config->name);
+        if (config->key != NULL)
+            new_keys_len += (keys_len != 0) + strlen(config->key);
+
+        // "JOIN <channels>[ <keys>]"
+        if (strlen("JOIN ") + new_chans_len +
+              (new_keys_len != 0 ? 1 + new_keys_len : 0) > MAX_MSG_LEN)
+            break;
+
+        chans_len = new_chans_len;
+        keys_len = new_keys_len;
+    }
+
+    // Always make progress. The server will complain about a channel whose
+    // name does not fit on its own.
+    return max(n, (size_t)1);
+}
+
+// Sends a JOIN with as many of the remaining channels as fit.
+static void send_join(void) {
+    size_t n = n_fitting();
+    bool has_keys = false;
+
+    begin_msg();
+    append_msg("JOIN ");
+    for (size_t i = 0; i < n; ++i) {
+        append_msg(i == 0 ? "%s" : ",%s", join_order[next_join + i]->name);
+        if (join_order[next_join + i]->key != NULL)
+            has_keys = true;
+    }
+    if (has_keys) {
+        append_msg(" ");
+        for (size_t i = 0; i < n && join_order[next_join + i]->key != NULL;
+             ++i)
+            append_msg(i == 0 ? "%s" : ",%s", join_order[next_join + i]->key);
+    }
+    send_msg();
+
+    next_join += n;
+}
+
+// Sends a burst of JOINs, scheduling the next burst if channels remain.
+// 'data' is the epoch the burst was scheduled in.
+static void join_burst(void *data) {
+    time_t now;
+
+    if ((uintptr_t)data != join_epoch)
+        return;
+
+    for (int i = 0; i < JOIN_BURST && next_join < n_join; ++i)
+        send_join();
+
+    if (next_join == n_join) {
+        free(join_order);
+        join_order = NULL;
+
+        return;
+    }
+
+    now = current_time();
+    if (now == -1) {
+        warning_err("time() failed (join). Not joining the remaining %zu "
+                    "channels", n_join - next_join);
+        free(join_order);
+        join_order = NULL;
+
+        return;
+    }
+
+    // Add a second since 'now' is truncated to whole seconds.
+    add_time_event(now + 1 + JOIN_BURST*SECS_PER_LINE, join_burst,
+                   (void*)join_epoch);
+}
+
+void join_channels(void) {
+    if (join_order != NULL)
+        // Already joining.
+        return;
+
+    printf("Joining %zu channel%s\n", n_channel_configs,
+           n_channel_configs == 1 ? "" : "s");
+
+    joined = true;
+    join_more_channels(channel_configs, n_channel_configs);
+}
+
+void join_more_channels(Channel_config **configs, size_t n) {
+    const Channel_config **old = join_order;
+    size_t n_old = old == NULL ? 0 : n_join - next_join;
+
+    if (!joined)
+        // join_channels() will get them.
+        return;
+
+    // Queue the new channels after the ones not joined yet, keeping channels
+    // with keys first.
+    join_order = emalloc((n_old + n)*sizeof *join_order, "join order");
+    n_join = 0;
+    for (int keys = 1; keys >= 0; --keys) {
+        for (size_t i = next_join; i < next_join + n_old; ++i)
+            if ((old[i]->key != NULL) == keys)
+                join_order[n_join++] = old[i];
+        for (size_t i = 0; i < n; ++i)
+            if ((configs[i]->key != NULL) == keys)
+                join_order[n_join++] = configs[i];
+    }
+    next_join = 0;
+
+    if (old == NULL)
+        join_burst((void*)join_epoch);
+    else
+        // A burst is already scheduled.
+        free(old);
+}
+
+void join_config_reloaded(void) {
+    size_t n = 0;
+
+    if (join_order == NULL)
+        return;
+
+    // Drop channels that are no longer configured. The list might end up
+    // empty, in which case the scheduled burst frees it.
+    for (size_t i = next_join; i < n_join; ++i) {
+        const Channel_config *config = get_channel_config(join_order[i]->name);
+
+        if (config->name != NULL)
+            join_order[n++] = config;
+    }
+    next_join = 0;
+    n_join = n;
+}
+
+void part_channel(const char *channel) {
+    if (channel_n_members(channel) != 0)
+        write_msg("PART %s", channel);
+}
+
+void cancel_join(void) {
+    free(join_order);
+    join_order = NULL;
+    joined = false;
+    ++join_epoch;
+}
+
+// for_each_time_event() callback that saves the time of the next burst.
+static void save_burst_time(time_t when, void *data, void *ctx) {
+    if ((uintptr_t)data == join_epoch)
+        upgrade_put_u64(when);
+}
+
+void upgrade_save_join(void) {
+    upgrade_put_u64(max_targets);
+    upgrade_put_u64(joined);
+
+    // An empty list (e.g. after join_config_reloaded()) is only waiting for
+    // its scheduled burst to free it, so it is saved like no list.
+    // upgrade_restore_join() then reads no burst time.
+    if (join_order == NULL || next_join == n_join) {
+        upgrade_put_u64(0);
+
+        return;
+    }
+
+    upgrade_put_u64(n_join - next_join);
+    for (size_t i = next_join; i < n_join; ++i)
+        upgrade_put_str(join_order[i]->name);
+    // There is always exactly one pending burst from the current epoch while
+    // joining.
+    for_each_time_event(join_burst, save_burst_time, NULL);
+}
+
+void upgrade_restore_join(void) {
+    size_t n_remaining;
+
+    max_targets = upgrade_get_u64();
+    joined = upgrade_get_u64();
+
+    n_remaining = upgrade_get_u64();
+    if (n_remaining == 0)
+        return;
+
+    n_join = 0;
+    next_join = 0;
+    join_order = emalloc(n_remaining*sizeof *join_order, "join order");
+    for (size_t i = 0; i < n_remaining; ++i) {
+        const Channel_config *config = get_channel_config(upgrade_get_str());
+
+        // Skip channels that are no longer configured.
+        if (config->name != NULL)
+            join_order[n_join++] = config;
+    }
+
+    add_time_event(upgrade_get_u64(), join_burst, (void*)join_epoch);
+}
@@ -0,0 +1,545 @@
+// Memory-mapped key-value store. See kv_store.h.
+//
+// File layout:
+//
+//   [header page][table or record][table or record]...[unused]
+//
+// Tables and records are allocated by bumping 'heap_end' in the header and
+// are never modified in place, except for the slots of the current table.
+// The current table is found through 'root'.
+
+#include "common.h"
+#include "files.h"
+#include "kv_store.h"
+
+#define MAGIC "BNKV0001"
+
+// Tables start on page boundaries, and the header takes up the first page.
+#define PAGE_SIZE 4096
+
+// The first table has 2^MIN_LOG2_CAP slots. Tables are grown once they're
+// more than 3/4 full.
+#define MIN_LOG2_CAP 10
+
+// The file is grown by at least this much at a time.
+#define MIN_GROW (256*1024)
+
+// Compaction is skipped while there's less garbage than this.
+#define MIN_GARBAGE (1024*1024)
+
+typedef struct Header {
+    char magic[8];
+    // Offset of the current table, which is a multiple of PAGE_SIZE, plus the
+    // base-2 logarithm of its capacity in the low bits.
+    uint64_t root;
+    // End of the allocated part of the file.
+    uint64_t heap_end;
+    // Number of keys. Can be off by one after a crash.
+    uint64_t n_entries;
+    // Total size of the records referenced from the current table. Like
+    // 'n_entries', only used for heuristics.
+    uint64_t live_bytes;
+} Header;
+
+typedef struct Slot {
+    // Hash of the key (never 0), or 0 for an empty slot.
+    uint64_t hash;
+    // Offset of the record.
+    uint64_t off;
+} Slot;
+
+typedef struct Record {
+    // Checksum of the rest of the record.
+    uint32_t check;
+    uint16_t key_len;
+    uint16_t val_len;
+    // The value, followed by the key.
+    char data[];
+} Record;
+
+struct KV_store {
+    // Name of the file in the data directory.
+    char *filename;
+    int fd;
+    char *map;
+    size_t map_len;
+};
+
+static Header *header(KV_store *kv) {
+    return (Header*)kv->map;
+}
+
+static Slot *table(KV_store *kv) {
+    return (Slot*)(kv->map + (header(kv)->root & ~(uint64_t)(PAGE_SIZE - 1)));
+}
+
+static unsigned log2_cap(KV_store *kv) {
+    return header(kv)->root & (PAGE_SIZE - 1);
+}
+
+static uint64_t align_up(uint64_t n, uint64_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+static size_t record_size(size_t key_len, size_t val_len) {
+    return align_up(sizeof(Record) + val_len + key_len, 8);
+}
+
+// FNV-1a over the key and the value, including their lengths.
+static uint32_t record_check(const Record *rec) {
+    const uc *p = (const uc*)&rec->key_len;
+    const uc *end = (const uc*)rec->data + rec->val_len + rec->key_len;
+    uint32_t hash = 0x811c9dc5;
+
+    for (; p != end; ++p)
+        hash = (hash ^ *p)*0x01000193;
+
+    return hash;
+}
+
+// FNV-1a with a final mix, since the slot index is taken from the high bits.
+static uint64_t hash_key(const void *key, size_t len) {
+    const uc *p = key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ p[i])*0x100000001b3ULL;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash == 0 ? 1 : hash;
+}
+
+// Returns the record at 'off', or NULL if it doesn't fit in the allocated
+// part of the file (which can only happen after a system crash).
+static Record *get_record(KV_store *kv, uint64_t off) {
+    Record *rec;
+
+    if (off < PAGE_SIZE || off % 8 != 0 ||
+        off + sizeof(Record) > header(kv)->heap_end)
+        return NULL;
+
+    rec = (Record*)(kv->map + off);
+    if (off + record_size(rec->key_len, rec->val_len) > header(kv)->heap_end)
+        return NULL;
+
+    return rec;
+}
+
+// Returns the index of the slot for 'key' in the current table, or the index
+// of the empty slot where it would go. 'found' is set to whether the key was
+// found.
+static size_t find_slot(KV_store *kv, uint64_t hash, const void *key,
+                        size_t key_len, bool *found) {
+    Slot *slots = table(kv);
+    size_t mask = ((size_t)1 << log2_cap(kv)) - 1;
+
+    for (size_t i = hash >> (64 - log2_cap(kv));; i = (i + 1) & mask) {
+        Record *rec;
+
+        if (slots[i].hash == 0) {
+            *found = false;
+
+            return i;
+        }
+
+        if (slots[i].hash != hash)
+            continue;
+
+        rec = get_record(kv, slots[i].off);
+        if (rec != NULL && rec->key_len == key_len &&
+            memcmp(rec->data + rec->val_len, key, key_len) == 0) {
+
+            *found = true;
+
+            return i;
+        }
+    }
+}
+
+// Makes sure that the file and the mapping extend to at least 'len' bytes.
+static bool ensure_space(KV_store *kv, uint64_t len) {
+    size_t new_len;
+    void *map;
+    int res;
+
+    if (len <= kv->map_len)
+        return true;
+
+    new_len = align_up(max(len, kv->map_len + max(kv->map_len, MIN_GROW)),
+                       PAGE_SIZE);
+
+    // Allocate the blocks up front, so that a full disk gives an error here
+    // instead of a SIGBUS when writing to the mapping.
+    if ((res = posix_fallocate(kv->fd, kv->map_len,
+                               new_len - kv->map_len)) != 0) {
+        errno = res;
+        warning_err("Failed to grow '%s' to %zu bytes", kv->filename, new_len);
+
+        return false;
+    }
+
+    // Everything refers to the mapping by offset, so it can just be remapped.
+    map = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED, kv->fd, 0);
+    if (map == MAP_FAILED) {
+        warning_err("mmap() error on '%s' (grow)", kv->filename);
+
+        return false;
+    }
+    if (munmap(kv->map, kv->map_len) == -1)
+        err_exit("munmap (%s)", kv->filename);
+    kv->map = map;
+    kv->map_len = new_len;
+
+    // Lookups are random, so readahead would mostly waste memory.
+    if (madvise(kv->map, kv->map_len, MADV_RANDOM) == -1)
+        warning_err("madvise() error on '%s'", kv->filename);
+
+    return true;
+}
+
+// Copies the slots of the current table into a new table with 2^'new_log2'
+// slots and makes it current.
+static bool grow_table(KV_store *kv, unsigned new_log2) {
+    size_t old_cap = (size_t)1 << log2_cap(kv);
+    size_t new_mask = ((size_t)1 << new_log2) - 1;
+    uint64_t off = align_up(header(kv)->heap_end, PAGE_SIZE);
+    uint64_t size = sizeof(Slot) << new_log2;
+    Slot *old_slots;
+    Slot *new_slots;
+
+    if (!ensure_space(kv, off + size))
+        return false;
+
+    old_slots = table(kv);
+    new_slots = (Slot*)(kv->map + off);
+
+    // The space might hold the remains of an update that was cut short by a
+    // crash.
+    memset(new_slots, 0, size);
+    for (size_t i = 0; i < old_cap; ++i) {
+        size_t j;
+
+        if (old_slots[i].hash == 0)
+            continue;
+
+        for (j = old_slots[i].hash >> (64 - new_log2);
+             new_slots[j].hash != 0; j = (j + 1) & new_mask);
+        new_slots[j] = old_slots[i];
+    }
+    __atomic_store_n(&header(kv)->heap_end, off + size, __ATOMIC_RELEASE);
+
+    // Make sure that the new table and everything it points to is on disk
+    // before switching to it. Otherwise, a system crash could leave the root
+    // pointing to a partially written table.
+    if (msync(kv->map, off + size, MS_SYNC) == -1) {
+        warning_err("msync() error on '%s'", kv->filename);
+
+        return false;
+    }
+    __atomic_store_n(&header(kv)->root, off | new_log2, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+// Maps the file and checks that it's a valid store. Returns false on errors.
+static bool map_file(KV_store *kv, size_t len) {
+    Header *h;
+    uint64_t root_off;
+
+    kv->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, kv->fd, 0);
+    if (kv->map == MAP_FAILED) {
+        warning_err("mmap() error on '%s'", kv->filename);
+        kv->map = NULL;
+
+        return false;
+    }
+    kv->map_len = len;
+
+    if (madvise(kv->map, kv->map_len, MADV_RANDOM) == -1)
+        warning_err("madvise() error on '%s'", kv->filename);
+
+    h = header(kv);
+    root_off = h->root & ~(uint64_t)(PAGE_SIZE - 1);
+    if (len < PAGE_SIZE || memcmp(h->magic, MAGIC, sizeof h->magic) != 0 ||
+        log2_cap(kv) < MIN_LOG2_CAP || log2_cap(kv) > 40 ||
+        root_off < PAGE_SIZE ||
+        root_off + (sizeof(Slot) << log2_cap(kv)) > h->heap_end ||
+        h->heap_end > len)
+        return false;
+
+    return true;
+}
+
+// Initializes a new store with 2^'log2' slots and room for 'len' bytes of
+// records in the (empty) open file.
+static bool init_file(KV_store *kv, unsigned log2, size_t len) {
+    uint64_t table_size = sizeof(Slot) << log2;
+    size_t file_len = align_up(PAGE_SIZE + table_size + len, PAGE_SIZE);
+    Header *h;
+    int res;
+
+    if ((res = posix_fallocate(kv->fd, 0, file_len)) != 0) {
+        errno = res;
+        warning_err("Failed to allocate %zu bytes for '%s'", file_len,
+                    kv->filename);
+
+        return false;
+    }
+
+    kv->map = mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   kv->fd, 0);
+    if (kv->map == MAP_FAILED) {
+        warning_err("mmap() error on '%s'", kv->filename);
+        kv->map = NULL;
+
+        return false;
+    }
+    kv->map_len = file_len;
+
+    // The file is all zeros, which is an empty table.
+    h = header(kv);
+    memcpy(h->magic, MAGIC, sizeof h->magic);
+    h->root = PAGE_SIZE | log2;
+    h->heap_end = PAGE_SIZE + table_size;
+    h->n_entries = 0;
+    h->live_bytes = 0;
+
+    return true;
+}
+
+static void unmap_close(KV_store *kv) {
+    if (kv->map != NULL && munmap(kv->map, kv->map_len) == -1)
+        err_exit("munmap (%s)", kv->filename);
+    kv->map = NULL;
+    if (close(kv->fd) == -1)
+        err_exit("close (%s)", kv->filename);
+}
+
+KV_store *kv_open(const char *filename) {
+    KV_store *kv = emalloc(sizeof *kv, "key-value store");
+    struct stat st;
+
+    kv->filename = estrdup(filename, "key-value store filename");
+    kv->map = NULL;
+
+    kv->fd = open_file(filename, READ_WRITE);
+    if (kv->fd == -1)
+        goto fail_free;
+
+    if (fstat(kv->fd, &st) == -1) {
+        warning_err("fstat() error on '%s'", filename);
+
+        goto fail_close;
+    }
+
+    if (st.st_size != 0 && !map_file(kv, st.st_size)) {
+        char bad_filename[strlen(filename) + sizeof ".bad"];
+
+        sprintf(bad_filename, "%s.bad", filename);
+        warning("'%s' is not a valid store. Moving it to '%s' and starting "
+                "over.", filename, bad_filename);
+
+        unmap_close(kv);
+        if (!rename_file(filename, bad_filename))
+            goto fail_free;
+
+        kv->fd = open_file(filename, CREATE);
+        if (kv->fd == -1)
+            goto fail_free;
+        st.st_size = 0;
+    }
+
+    if (st.st_size == 0 && !init_file(kv, MIN_LOG2_CAP, MIN_GROW))
+        goto fail_close;
+
+    return kv;
+
+fail_close:
+    unmap_close(kv);
+fail_free:
+    free(kv->filename);
+    free(kv);
+
+    return NULL;
+}
+
+void kv_close(KV_store *kv) {
+    unmap_close(kv);
+    free(kv->filename);
+    free(kv);
+}
+
+// Rewrites the store to a new file with just the current records, and
+// replaces the old file with it.
+static bool compact(KV_store *kv) {
+    size_t cap = (size_t)1 << log2_cap(kv);
+    char tmp_filename[strlen(kv->filename) + sizeof ".new"];
+    KV_store new = { .filename = tmp_filename, .map = NULL };
+    unsigned new_log2 = MIN_LOG2_CAP;
+    Slot *old_slots = table(kv);
+    size_t new_mask;
+    uint64_t heap_end;
+
+    // Size the table so that it's at most half full.
+    while (((size_t)1 << new_log2) < 2*header(kv)->n_entries)
+        ++new_log2;
+    new_mask = ((size_t)1 << new_log2) - 1;
+
+    sprintf(tmp_filename, "%s.new", kv->filename);
+    new.fd = open_file(tmp_filename, CREATE);
+    if (new.fd == -1)
+        return false;
+    if (!init_file(&new, new_log2, header(kv)->live_bytes))
+        goto fail;
+
+    heap_end = header(&new)->heap_end;
+    for (size_t i = 0; i < cap; ++i) {
+        Slot *new_slots;
+        Record *rec;
+        size_t size;
+        size_t j;
+
+        if (old_slots[i].hash == 0)
+            continue;
+
+        // Drop torn records.
+        rec = get_record(kv, old_slots[i].off);
+        if (rec == NULL || record_check(rec) != rec->check)
+            continue;
+
+        size = record_size(rec->key_len, rec->val_len);
+        if (!ensure_space(&new, heap_end + size))
+            goto fail;
+        memcpy(new.map + heap_end, rec, size);
+
+        new_slots = table(&new);
+        for (j = old_slots[i].hash >> (64 - new_log2);
+             new_slots[j].hash != 0; j = (j + 1) & new_mask);
+        new_slots[j].hash = old_slots[i].hash;
+        new_slots[j].off = heap_end;
+
+        heap_end += size;
+        ++header(&new)->n_entries;
+    }
+    header(&new)->heap_end = heap_end;
+    header(&new)->live_bytes =
+      heap_end - PAGE_SIZE - (sizeof(Slot) << new_log2);
+
+    // The new file must be complete on disk before it replaces the old one.
+    if (msync(new.map, new.map_len, MS_SYNC) == -1) {
+        warning_err("msync() error on '%s'", tmp_filename);
+
+        goto fail;
+    }
+    if (!rename_file(tmp_filename, kv->filename))
+        goto fail;
+
+    unmap_close(kv);
+    kv->fd = new.fd;
+    kv->map = new.map;
+    kv->map_len = new.map_len;
+
+    return true;
+
+fail:
+    unmap_close(&new);
+
+    return false;
+}
+
+// Returns true if enough of the file is garbage to make compaction worth it.
+static bool should_compact(KV_store *kv) {
+    Header *h = header(kv);
+    uint64_t used = PAGE_SIZE + (sizeof(Slot) << log2_cap(kv)) +
+                    h->live_bytes;
+    uint64_t garbage = h->heap_end > used ? h->heap_end - used : 0;
+
+    return garbage >= MIN_GARBAGE && garbage >= used;
+}
+
+const void *kv_get(KV_store *kv, const void *key, size_t key_len,
+                   size_t *val_len) {
+    bool found;
+    size_t i = find_slot(kv, hash_key(key, key_len), key, key_len, &found);
+    Record *rec;
+
+    if (!found)
+        return NULL;
+
+    rec = get_record(kv, table(kv)[i].off);
+    if (record_check(rec) != rec->check) {
+        warning("Ignoring corrupt record in '%s' (checksum mismatch)",
+                kv->filename);
+
+        return NULL;
+    }
+
+    *val_len = rec->val_len;
+
+    return rec->data;
+}
+
+bool kv_put(KV_store *kv, const void *key, size_t key_len, const void *val,
+            size_t val_len) {
+    uint64_t hash = hash_key(key, key_len);
+    size_t size = record_size(key_len, val_len);
+    uint64_t off;
+    Record *rec;
+    Slot *slot;
+    bool found;
+    size_t i;
+
+    assert(key_len <= KV_MAX_LEN && val_len <= KV_MAX_LEN);
+
+    if (should_compact(kv) && !compact(kv))
+        warning("Failed to compact '%s'. Continuing with the old file.",
+                kv->filename);
+
+    i = find_slot(kv, hash, key, key_len, &found);
+    if (!found &&
+        4*(header(kv)->n_entries + 1) > 3*((size_t)1 << log2_cap(kv))) {
+        if (!grow_table(kv, log2_cap(kv) + 1))
+            return false;
+        i = find_slot(kv, hash, key, key_len, &found);
+    }
+
+    // Write the record in unallocated space and allocate it...
+    off = header(kv)->heap_end;
+    if (!ensure_space(kv, off + size))
+        return false;
+    rec = (Record*)(kv->map + off);
+    rec->key_len = key_len;
+    rec->val_len = val_len;
+    memcpy(rec->data, val, val_len);
+    memcpy(rec->data + val_len, key, key_len);
+    memset(rec->data + val_len + key_len, 0,
+           size - sizeof(Record) - val_len - key_len);
+    rec->check = record_check(rec);
+    __atomic_store_n(&header(kv)->heap_end, off + size, __ATOMIC_RELEASE);
+
+    // ...and then publish it with a single store. For a new key, the offset
+    // is stored first so that the slot is never seen half-filled.
+    slot = &table(kv)[i];
+    if (found) {
+        Record *old = get_record(kv, slot->off);
+
+        __atomic_store_n(&slot->off, off, __ATOMIC_RELEASE);
+        header(kv)->live_bytes +=
+          size - (old == NULL ? 0 : record_size(old->key_len, old->val_len));
+    }
+    else {
+        slot->off = off;
+        __atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+        ++header(kv)->n_entries;
+        header(kv)->live_bytes += size;
+    }
+
+    return true;
+}
+
+size_t kv_count(KV_store *kv) {
+    return header(kv)->n_entries;
+}
@@ -0,0 +1,193 @@
+// Server lag monitoring. See lag.h.
+
+#include "common.h"
+#include "date.h"
+#include "irc.h"
+#include "lag.h"
+#include "msg_io.h"
+#include "options.h"
+#include "time_event.h"
+#include "transport.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Number of round-trip times kept for !lag.
+#define HISTORY 60
+
+// Seconds between TCP keepalive probes.
+#define KEEPALIVE_INTERVAL 10
+
+// Prefix of the tokens in our PINGs, followed by the sequence number.
+#define TOKEN_PREFIX "lag-"
+
+static bool running;
+
+// Incremented by lag_start(). Time events scheduled with an earlier value are
+// stale.
+static uintptr_t epoch;
+
+// Sequence number of the PING we're waiting for a PONG to. 0 if none.
+static uintptr_t outstanding;
+static uintptr_t last_seq;
+static struct timespec ping_sent;
+
+// Time of the next ping_tick(). Time events can run slightly before time()
+// reaches their time, so this is used instead of time() for scheduling.
+static time_t next_tick;
+
+// Ring of the last round-trip times in microseconds. 'n_rtts' counts all
+// measurements, so the newest is at (n_rtts - 1)%HISTORY.
+static uint64_t rtts[HISTORY];
+static uint64_t n_rtts;
+
+static unsigned n_disconnects;
+static time_t last_disconnect;
+
+void set_keepalive(void) {
+    int on = 1;
+    int idle = ping_interval;
+    int interval = KEEPALIVE_INTERVAL;
+    int count = max(dead_timeout/KEEPALIVE_INTERVAL, 1u);
+    unsigned user_timeout = 1000*dead_timeout;
+
+    // With TCP_USER_TIMEOUT, the kernel also gives up on keepalive probes
+    // after 'dead_timeout' seconds, regardless of the count.
+    if (setsockopt(serv_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on) == -1 ||
+        setsockopt(serv_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+                   sizeof idle) == -1 ||
+        setsockopt(serv_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                   sizeof interval) == -1 ||
+        setsockopt(serv_fd, IPPROTO_TCP, TCP_KEEPCNT, &count,
+                   sizeof count) == -1 ||
+        setsockopt(serv_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+                   sizeof user_timeout) == -1)
+        warning_err("Failed to set keepalive options on the server socket");
+}
+
+static uint64_t us_since(const struct timespec *t) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return 1000000*(uint64_t)(now.tv_sec - t->tv_sec) +
+           (now.tv_nsec - t->tv_nsec)/1000;
+}
+
+// Time event for the deadline of the PING with sequence number 'data'.
+static void pong_deadline(void *data) {
+    if (!running || (uintptr_t)data != outstanding)
+        return;
+
+    warning("No PONG from the server in %u seconds. Reconnecting.",
+            dead_timeout);
+    reconnect_to_irc_server();
+}
+
+// Time event that sends a PING every 'ping_interval' seconds. 'data' is the
+// epoch.
+static void ping_tick(void *data) {
+    time_t now;
+
+    if (!running || (uintptr_t)data != epoch)
+        return;
+
+    now = max(current_time(), next_tick);
+
+    // Still waiting for the previous PONG. pong_deadline() takes care of it.
+    if (outstanding == 0) {
+        outstanding = ++last_seq;
+        clock_gettime(CLOCK_MONOTONIC, &ping_sent);
+        write_msg("PING :"TOKEN_PREFIX"%"PRIuPTR, outstanding);
+        // Send it right away so that the round-trip time isn't skewed.
+        serv_flush();
+        add_time_event(now + dead_timeout, pong_deadline,
+                       (void*)outstanding);
+    }
+
+    next_tick = now + ping_interval;
+    add_time_event(next_tick, ping_tick, (void*)epoch);
+}
+
+void lag_start(void) {
+    // The virtual clock would make the PONG deadline pass before the fake
+    // server gets a chance to answer.
+    if (sim_start != 0)
+        return;
+
+    running = true;
+    ++epoch;
+    outstanding = 0;
+    ping_tick((void*)epoch);
+}
+
+void lag_stop(void) {
+    if (running) {
+        ++n_disconnects;
+        last_disconnect = current_time();
+    }
+    running = false;
+    outstanding = 0;
+}
+
+void lag_pong(const char *token) {
+    uintptr_t seq;
+    char *end;
+
+    if (strncmp(token, TOKEN_PREFIX, strlen(TOKEN_PREFIX)) != 0)
+        return;
+
+    seq = strtoumax(token + strlen(TOKEN_PREFIX), &end, 10);
+    // Ignore PONGs that arrive after their deadline (which reconnects anyway)
+    // and malformed ones.
+    if (*end != '\0' || seq == 0 || seq != outstanding)
+        return;
+
+    rtts[n_rtts++%HISTORY] = us_since(&ping_sent);
+    outstanding = 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+void handle_lag(const char *rep) {
+    begin_say(rep);
+
+    if (!running)
+        append_msg("Not connected.");
+    else if (outstanding != 0 &&
+             (n_rtts == 0 ||
+              us_since(&ping_sent) > rtts[(n_rtts - 1)%HISTORY]))
+        // The current lag is at least the time since the unanswered PING.
+        append_msg("Lag: at least %.1f ms (PING unanswered).",
+                   us_since(&ping_sent)/1e3);
+    else if (n_rtts == 0)
+        append_msg("Lag: not measured yet.");
+    else
+        append_msg("Lag: %.1f ms.", rtts[(n_rtts - 1)%HISTORY]/1e3);
+
+    if (n_rtts != 0) {
+        size_t n = min(n_rtts, (uint64_t)HISTORY);
+        uint64_t sorted[HISTORY];
+
+        memcpy(sorted, rtts, n*sizeof *sorted);
+        qsort(sorted, n, sizeof *sorted, cmp_u64);
+        append_msg(" Last %zu PINGs (every %u s): min %.1f ms, median %.1f ms, "
+                   "max %.1f ms.", n, ping_interval, sorted[0]/1e3,
+                   sorted[n/2]/1e3, sorted[n - 1]/1e3);
+    }
+
+    if (n_disconnects == 0)
+        append_msg(" No reconnects.");
+    else {
+        append_msg(" %u reconnect%s, the last one ", n_disconnects,
+                   n_disconnects == 1 ? "" : "s");
+        append_short_duration(current_time() - last_disconnect);
+        append_msg(" ago.");
+    }
+
+    send_msg();
+}
@@ -0,0 +1,294 @@
+// Latency histograms. See latency.h.
+
+#include "common.h"
+#include "latency.h"
+#include "msg_io.h"
+#include "options.h"
+
+// Latencies are recorded in microseconds. Values below 4 get a bucket each.
+// Larger values with the highest set bit 'b' go in one of four buckets for
+// [2^b, 2^(b+1)[, chosen by the two bits below 'b'. Values are capped at
+// 2^32 - 1 us (more than an hour).
+#define MAX_BIT 31
+#define N_BUCKETS (4*MAX_BIT)
+
+typedef struct Histogram {
+    uint64_t counts[N_BUCKETS];
+    uint64_t n;
+    uint64_t max_us;
+} Histogram;
+
+typedef enum Stage {
+    STAGE_QUEUE,
+    STAGE_HANDLING,
+    STAGE_TOTAL,
+    N_STAGES
+} Stage;
+
+static const char *const kind_names[N_LATENCY_KINDS] = {
+  [LATENCY_PING] = "PINGs", [LATENCY_CMD] = "Commands" };
+
+static const char *const stage_names[N_STAGES] = {
+  [STAGE_QUEUE] = "queue", [STAGE_HANDLING] = "handling",
+  [STAGE_TOTAL] = "total" };
+
+static Histogram histograms[N_LATENCY_KINDS][N_STAGES];
+
+// Number of reads from the server, and how many of them had kernel receive
+// timestamps.
+static uint64_t n_reads;
+static uint64_t n_kernel_timestamps;
+
+// Receive time of the complete messages in the read buffer. Zero if unknown.
+static struct timespec rx_time;
+
+// State for the PING or command being handled.
+static bool handling;
+static Latency_kind cur_kind;
+static struct timespec dispatch_time;
+// Zero until the first reply is sent.
+static struct timespec reply_time;
+// True once a reply has been queued (see serv_send()).
+static bool queued;
+
+// Maximum number of handled messages whose replies are still queued. Replies
+// to more messages than this are timed at latency_end() instead.
+#define MAX_UNSENT 64
+
+// Handled messages whose replies are still queued. They are recorded by the
+// next latency_sent().
+typedef struct Unsent {
+    Latency_kind kind;
+    struct timespec rx_time;
+    struct timespec dispatch_time;
+} Unsent;
+
+static Unsent unsent[MAX_UNSENT];
+static size_t n_unsent;
+
+static unsigned bucket_index(uint64_t us) {
+    unsigned bit;
+
+    if (us < 4)
+        return us;
+
+    us = min(us, ((uint64_t)1 << (MAX_BIT + 1)) - 1);
+    bit = 63 - __builtin_clzll(us);
+
+    return 4*(bit - 1) + (us >> (bit - 2) & 3);
+}
+
+// Returns the largest value that goes in bucket 'i'.
+static uint64_t bucket_max(unsigned i) {
+    unsigned bit;
+
+    if (i < 4)
+        return i;
+
+    bit = i/4 + 1;
+
+    return ((uint64_t)(4 + i%4 + 1) << (bit - 2)) - 1;
+}
+
+// Returns the microseconds from 'from' to 'to', or 0 if 'to' is earlier (e.g.
+// after a clock adjustment).
+static uint64_t us_between(const struct timespec *from,
+                           const struct timespec *to) {
+    int64_t ns = 1000000000*(int64_t)(to->tv_sec - from->tv_sec) +
+                 (to->tv_nsec - from->tv_nsec);
+
+    return ns < 0 ? 0 : ns/1000;
+}
+
+static void record(Histogram *h, uint64_t us) {
+    ++h->counts[bucket_index(us)];
+    ++h->n;
+    h->max_us = max(h->max_us, us);
+}
+
+// Returns an upper bound for the 'p'th percentile of the samples in 'h',
+// which must not be empty.
+static uint64_t percentile(const Histogram *h, double p) {
+    uint64_t rank = ceil(p/100*h->n);
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < N_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return min(bucket_max(i), h->max_us);
+    }
+
+    return h->max_us;
+}
+
+static void get_time(struct timespec *t) {
+    if (clock_gettime(CLOCK_REALTIME, t) == -1)
+        err_exit("clock_gettime (latency)");
+}
+
+void latency_received(const struct timespec *kernel_time) {
+    if (!measure_latency)
+        return;
+
+    ++n_reads;
+    if (kernel_time != NULL) {
+        ++n_kernel_timestamps;
+        rx_time = *kernel_time;
+    }
+    else
+        get_time(&rx_time);
+}
+
+void latency_rx_unknown(void) {
+    clear(rx_time);
+}
+
+void latency_begin(Latency_kind kind) {
+    if (!measure_latency)
+        return;
+
+    assert(!handling);
+    handling = true;
+    cur_kind = kind;
+    get_time(&dispatch_time);
+    clear(reply_time);
+    queued = false;
+}
+
+void latency_queued(void) {
+    if (handling)
+        queued = true;
+}
+
+// Records the handling and total latencies for a message of kind 'kind'
+// received at 'rx' (zero if unknown) and dispatched at 'dispatch', whose first
+// reply was sent at 'reply'.
+static void record_reply(Latency_kind kind, const struct timespec *rx,
+                         const struct timespec *dispatch,
+                         const struct timespec *reply) {
+    Histogram *h = histograms[kind];
+
+    record(&h[STAGE_HANDLING], us_between(dispatch, reply));
+    if (rx->tv_sec != 0)
+        record(&h[STAGE_TOTAL], us_between(rx, reply));
+}
+
+void latency_sent(void) {
+    struct timespec now;
+
+    if (!measure_latency || (n_unsent == 0 &&
+                             (!handling || reply_time.tv_sec != 0)))
+        return;
+
+    get_time(&now);
+
+    if (handling && reply_time.tv_sec == 0)
+        reply_time = now;
+
+    for (size_t i = 0; i < n_unsent; ++i)
+        record_reply(unsent[i].kind, &unsent[i].rx_time,
+                     &unsent[i].dispatch_time, &now);
+    n_unsent = 0;
+}
+
+void latency_output_dropped(void) {
+    n_unsent = 0;
+    queued = false;
+}
+
+void latency_end(void) {
+    struct timespec now;
+
+    if (!handling)
+        return;
+    handling = false;
+
+    if (rx_time.tv_sec != 0)
+        record(&histograms[cur_kind][STAGE_QUEUE],
+               us_between(&rx_time, &dispatch_time));
+
+    if (reply_time.tv_sec != 0)
+        record_reply(cur_kind, &rx_time, &dispatch_time, &reply_time);
+    else if (queued) {
+        if (n_unsent < MAX_UNSENT)
+            unsent[n_unsent++] = (Unsent){ cur_kind, rx_time, dispatch_time };
+        else {
+            // Should not happen, since the output is flushed well before
+            // this many messages queue up. Use the current time as an
+            // approximation.
+            get_time(&now);
+            record_reply(cur_kind, &rx_time, &dispatch_time, &now);
+        }
+    }
+}
+
+// Appends 'us' in a readable unit with the given append function.
+static void append_us(void (*append)(const char *format, ...), uint64_t us) {
+    if (us < 1000)
+        append("%"PRIu64" us", us);
+    else if (us < 1000000)
+        append("%.1f ms", us/1e3);
+    else
+        append("%.1f s", us/1e6);
+}
+
+// Appends a summary of the histograms for 'kind'.
+static void append_kind(void (*append)(const char *format, ...),
+                        Latency_kind kind) {
+    const Histogram *h = histograms[kind];
+
+    append("%s: %"PRIu64, kind_names[kind],
+           max(h[STAGE_QUEUE].n, h[STAGE_HANDLING].n));
+    for (unsigned stage = 0; stage < N_STAGES; ++stage) {
+        if (h[stage].n == 0)
+            continue;
+
+        append(", %s ", stage_names[stage]);
+        append_us(append, percentile(&h[stage], 50));
+        append("/");
+        append_us(append, percentile(&h[stage], 99));
+        append("/");
+        append_us(append, h[stage].max_us);
+    }
+    append(".");
+}
+
+void handle_latency(const char *rep) {
+    if (!measure_latency) {
+        say(rep, "Latency measurement is off (enable with -l).");
+
+        return;
+    }
+
+    begin_say(rep);
+    append_msg("Latency (p50/p99/max) ");
+    for (unsigned kind = 0; kind < N_LATENCY_KINDS; ++kind) {
+        append_kind(append_msg, kind);
+        append_msg(" ");
+    }
+    append_msg("%"PRIu64" of %"PRIu64" reads had kernel timestamps.",
+               n_kernel_timestamps, n_reads);
+    send_msg();
+}
+
+static void print_str(const char *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+}
+
+void print_latency_summary(void) {
+    if (!measure_latency)
+        return;
+
+    puts("Latency (p50/p99/max):");
+    for (unsigned kind = 0; kind < N_LATENCY_KINDS; ++kind) {
+        fputs("  ", stdout);
+        append_kind(print_str, kind);
+        putchar('\n');
+    }
+    printf("  %"PRIu64" of %"PRIu64" reads had kernel timestamps.\n",
+           n_kernel_timestamps, n_reads);
+}
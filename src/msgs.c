@@ -1,11 +1,24 @@
 #include "common.h"
+#include "casemap.h"
+#include "channel_config.h"
+#include "channel_state.h"
 #include "chat_log.h"
 #include "commands.h"
+#include "date.h"
+#include "flood.h"
+#include "intern.h"
 #include "irc.h"
-#include "leet_monitor.h"
+#include "join.h"
+#include "lag.h"
+#include "latency.h"
 #include "msg_io.h"
 #include "msgs.h"
 #include "options.h"
+#include "seen.h"
+#include "stats.h"
+#include "time_event.h"
+#include "transport.h"
+#include "triggers.h"
 
 static void print_params(IRC_msg *msg) {
     if (msg->n_params == 0)
@@ -21,36 +34,151 @@ static void handle_error(IRC_msg *msg) {
     warning("Received ERROR message: %s", msg->params[0]);
 }
 
+// Parses a TARGMAX value like "PRIVMSG:4,NAMES:1,JOIN:", where an empty limit
+// means no limit.
+static void parse_targmax(char *val) {
+    char *save;
+
+    for (char *entry = strtok_r(val, ",", &save); entry != NULL;
+         entry = strtok_r(NULL, ",", &save)) {
+
+        char *limit = strchr(entry, ':');
+
+        if (limit == NULL)
+            continue;
+        *limit++ = '\0';
+
+        if (strcmp(entry, "JOIN") == 0)
+            set_join_max_targets(strtoul(limit, NULL, 10));
+    }
+}
+
+// RPL_ISUPPORT. The parameters are '<own nick> <token>... :are supported by
+// this server', where each token is 'NAME' or 'NAME=VALUE'.
+static void handle_isupport(IRC_msg *msg) {
+    for (size_t i = 1; i + 1 < msg->n_params; ++i) {
+        char *name = msg->params[i];
+        char *val = strchr(name, '=');
+
+        if (val == NULL)
+            continue;
+        *val++ = '\0';
+
+        if (strcmp(name, "CASEMAPPING") == 0) {
+            if (set_casemapping(val))
+                // Nicks and channels are hashed by their folded forms.
+                intern_rehash();
+        }
+        else if (strcmp(name, "CHANTYPES") == 0)
+            set_chantypes(val);
+        else if (strcmp(name, "TARGMAX") == 0)
+            parse_targmax(val);
+    }
+}
+
+// Returns true if messages in 'channel' should be logged.
+static bool should_log(const char *channel) {
+    return get_channel_config(channel)->log;
+}
+
+// RPL_ENDOFMOTD and ERR_NOMOTD. The end of the registration burst, by which
+// time we have seen RPL_ISUPPORT.
+static void handle_endofmotd(IRC_msg *msg) {
+    join_channels();
+}
+
 static void handle_join(IRC_msg *msg) {
-    log_join(msg->nick, msg->user, msg->host, msg->params[0]);
+    if (should_log(msg->params[0]))
+        log_join(msg->nick, msg->user, msg->host, msg->params[0]);
+    track_join(msg->nick, msg->params[0]);
+    seen_join(msg->nick, msg->params[0]);
 }
 
 static void handle_kick(IRC_msg *msg) {
-    log_kick(msg->nick, msg->params[0], msg->params[1],
-             msg->n_params == 2 ? NULL : msg->params[2]);
+    if (should_log(msg->params[0]))
+        log_kick(msg->nick, msg->params[0], msg->params[1],
+                 msg->n_params == 2 ? NULL : msg->params[2]);
+    track_part(msg->params[1], msg->params[0]);
+}
+
+// RPL_NAMREPLY. The parameters are '<own nick> [<channel type>] <channel>
+// :<nicks>', where older servers omit the channel type.
+static void handle_namreply(IRC_msg *msg) {
+    track_names(msg->params[msg->n_params - 2],
+                msg->params[msg->n_params - 1]);
+}
+
+// RPL_ENDOFNAMES. The parameters are '<own nick> <channel> :<text>'.
+static void handle_endofnames(IRC_msg *msg) {
+    track_names_end(msg->params[1]);
+}
+
+// Counts the channels with logging enabled.
+static void count_logged(const char *channel, void *data) {
+    if (should_log(channel))
+        ++*(size_t*)data;
 }
 
 static void handle_nick(IRC_msg *msg) {
-    log_nick(msg->nick, msg->params[0]);
+    size_t n_logged = 0;
+
+    // Log nick changes unless all the channels the user is in have logging
+    // disabled.
+    if (for_each_channel_of(msg->nick, count_logged, &n_logged) == 0 ||
+        n_logged != 0)
+        log_nick(msg->nick, msg->params[0]);
+    track_nick(msg->nick, msg->params[0]);
 }
 
 static void handle_part(IRC_msg *msg) {
-    log_part(msg->nick, msg->user, msg->host, msg->params[0],
-             msg->n_params == 1 ? NULL : msg->params[1]);
+    const char *reason = msg->n_params == 1 ? NULL : msg->params[1];
+
+    if (should_log(msg->params[0])) {
+        log_part(msg->nick, msg->user, msg->host, msg->params[0], reason);
+        seen_part(msg->nick, msg->params[0], reason);
+    }
+    else
+        seen_part(msg->nick, msg->params[0], NULL);
+    track_part(msg->nick, msg->params[0]);
 }
 
 static void handle_ping(IRC_msg *msg) {
+    latency_begin(LATENCY_PING);
     write_msg("PONG :%s", msg->params[0]);
+    // Servers time out clients that are slow to PONG, so don't wait for the
+    // end of the event loop iteration.
+    serv_flush();
+    latency_end();
+}
+
+// The parameters are '<server> [:<token>]'. Only our own PINGs have tokens.
+static void handle_pong(IRC_msg *msg) {
+    lag_pong(msg->params[msg->n_params - 1]);
 }
 
 static void handle_privmsg(IRC_msg *msg) {
+    // The default configuration is used for private messages.
+    const Channel_config *config = get_channel_config(msg->params[0]);
+
     // TODO: Move to a separate events.c file when we get more of these. The
     // command code could probably be moved too.
-    log_privmsg(msg->nick, msg->params[0], msg->params[1]);
-    leet_monitor_privmsg(msg->nick, msg->params[0], msg->params[1]);
+    if (config->log)
+        log_privmsg(msg->nick, msg->params[0], msg->params[1]);
+    if (is_channel(msg->params[0])) {
+        // Messages that are part of a flood are only logged.
+        if (flood_check(msg->nick, msg->params[0], msg->params[1],
+                        config->flood))
+            return;
+
+        seen_privmsg(msg->nick, msg->params[0],
+                     config->log ? msg->params[1] : NULL);
+        stats_privmsg(msg->nick, msg->params[0],
+                      config->log ? msg->params[1] : NULL);
+    }
+    triggers_privmsg(msg->nick, msg->params[0], msg->params[1]);
 
     // Look for bot command.
-    if (msg->params[1][0] == cmd_char) {
+    if (config->commands && msg->params[1][0] == config->cmd_char) {
         char *arg;
 
         // The argument, if any, starts after the first space. We also treat an
@@ -64,7 +192,7 @@ static void handle_privmsg(IRC_msg *msg) {
                 arg = NULL;
         }
 
-        handle_cmd(msg->prefix, msg->params[0],
+        handle_cmd(msg->prefix, msg->user, msg->host, msg->params[0],
                    // The "natural" reply target, passed as a convenience. This
                    // is either a channel for messages to a channel or the
                    // sending nick for messages directly to the bot.
@@ -74,14 +202,72 @@ static void handle_privmsg(IRC_msg *msg) {
     }
 }
 
-static void handle_quit(IRC_msg *msg) {
-    log_quit(msg->nick, msg->user, msg->host,
+// Logs a QUIT in one of the channels the quitting user was in.
+static void log_quit_in(const char *channel, void *data) {
+    IRC_msg *msg = data;
+
+    if (channel != NULL && !should_log(channel))
+        return;
+
+    log_quit(msg->nick, msg->user, msg->host, channel,
              msg->n_params == 0 ? NULL : msg->params[0]);
 }
 
+static void handle_quit(IRC_msg *msg) {
+    const char *reason = msg->n_params == 0 ? NULL : msg->params[0];
+    size_t n_logged = 0;
+
+    // Log the QUIT once per channel the user was in, or once without a
+    // channel if we did not know of any.
+    if (for_each_channel_of(msg->nick, count_logged, &n_logged) == 0)
+        log_quit_in(NULL, msg);
+    else {
+        for_each_channel_of(msg->nick, log_quit_in, msg);
+        // Like for PARTs, only remember the quit message if it was logged.
+        if (n_logged == 0)
+            reason = NULL;
+    }
+    seen_quit(msg->nick, reason);
+    track_quit(msg->nick);
+}
+
+// Sent by the fake server in simulation mode to advance the virtual clock
+// (see time_event.h). Answered with the new time once the time events that
+// came due have run, so that the server knows their output has been sent.
+static void handle_simtime(IRC_msg *msg) {
+    char *end;
+    intmax_t t;
+
+    if (sim_start == 0) {
+        warning("Ignoring SIMTIME outside of simulation mode");
+
+        return;
+    }
+
+    errno = 0;
+    t = strtoimax(msg->params[0], &end, 10);
+    if (*msg->params[0] == '\0' || *end != '\0' || errno != 0 || t < 0 ||
+        (intmax_t)(time_t)t != t) {
+        warning("Ignoring SIMTIME with invalid time '%s'", msg->params[0]);
+
+        return;
+    }
+
+    run_time_events(t);
+    write_msg("SIMTIME %jd", (intmax_t)current_time());
+}
+
 static void handle_welcome(IRC_msg *msg) {
-    printf("Got RPL_WELCOME, joining %s\n", channel);
-    write_msg("JOIN %s", channel);
+    // The first parameter is the nick we actually got.
+    if (msg->n_params >= 1)
+        track_own_nick(msg->params[0]);
+
+    // Channels are joined at the end of the MOTD, once the server has told
+    // us its limits in RPL_ISUPPORT.
+    puts("Got RPL_WELCOME");
+
+    reset_reconnect_delay();
+    lag_start();
 }
 
 // Checks if 'msg' is an error reply (a numeric reply in the range 400-599) and
@@ -93,7 +279,9 @@ static bool check_for_error_reply(IRC_msg *msg) {
         unsigned val = 100*(msg->cmd[0] - '0') + 10*(msg->cmd[1] - '0') +
                        (msg->cmd[2] - '0');
 
-        if (val >= 400 && val <= 599) {
+        // ERR_NOMOTD just means that the server has no MOTD, and is handled
+        // like RPL_ENDOFMOTD.
+        if (val >= 400 && val <= 599 && val != 422) {
             fprintf(stderr, "warning: Received error reply %u (%s). ",
                     val, irc_errnum_str(val));
             print_params(msg);
@@ -117,15 +305,22 @@ static const struct {
     // prefix.
     bool needs_nick;
 } msgs[] = {
-  { "001",     handle_welcome, 0, SIZE_MAX, false }, // RPL_WELCOME
-  { "ERROR",   handle_error,   1, 1       , false },
-  { "JOIN",    handle_join,    1, 1       , true  },
-  { "KICK",    handle_kick,    2, 3       , true  },
-  { "NICK",    handle_nick,    1, 1       , true  },
-  { "PART",    handle_part,    1, 2       , true  },
-  { "PING",    handle_ping,    1, 1       , false },
-  { "PRIVMSG", handle_privmsg, 2, 2       , true  },
-  { "QUIT",    handle_quit,    0, 1       , true  } };
+  { "001",     handle_welcome,    0, SIZE_MAX, false }, // RPL_WELCOME
+  { "005",     handle_isupport,   2, SIZE_MAX, false }, // RPL_ISUPPORT
+  { "353",     handle_namreply,   3, 4       , false }, // RPL_NAMREPLY
+  { "366",     handle_endofnames, 2, 3       , false }, // RPL_ENDOFNAMES
+  { "376",     handle_endofmotd,  0, SIZE_MAX, false }, // RPL_ENDOFMOTD
+  { "422",     handle_endofmotd,  0, SIZE_MAX, false }, // ERR_NOMOTD
+  { "ERROR",   handle_error,      1, 1       , false },
+  { "JOIN",    handle_join,       1, 1       , true  },
+  { "KICK",    handle_kick,       2, 3       , true  },
+  { "NICK",    handle_nick,       1, 1       , true  },
+  { "PART",    handle_part,       1, 2       , true  },
+  { "PING",    handle_ping,       1, 1       , false },
+  { "PONG",    handle_pong,       1, 2       , false },
+  { "PRIVMSG", handle_privmsg,    2, 2       , true  },
+  { "QUIT",    handle_quit,       0, 1       , true  },
+  { "SIMTIME", handle_simtime,    1, 1       , false } };
 
 void handle_msg(IRC_msg *msg) {
     if (check_for_error_reply(msg))
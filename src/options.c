@@ -1,28 +1,104 @@
 #include "common.h"
+#include "files.h"
 #include "options.h"
 
 #define CHANNEL_DEFAULT "#botniklas"
 #define CMD_CHAR_DEFAULT '!'
+// Recommended by RFC 8305.
+#define CONNECT_DELAY_DEFAULT 250
+#define DEAD_TIMEOUT_DEFAULT 150
+#define DRAIN_BUDGET_MSGS_DEFAULT 64
+#define DRAIN_BUDGET_US_DEFAULT 5000
 #define NICK_DEFAULT "botniklas"
+#define PING_INTERVAL_DEFAULT 60
 #define PORT_DEFAULT "6667"
+#define TLS_PORT_DEFAULT "6697"
 #define QUIT_MESSAGE_DEFAULT "botniklas IRC bot signing off"
 #define REALNAME_DEFAULT NICK_DEFAULT
 #define USERNAME_DEFAULT NICK_DEFAULT
 
+#define CONFIG_FILE "config"
+
 // Option definitions and default values.
 
-const char *channel = CHANNEL_DEFAULT;
+const char **channels = NULL;
+size_t      n_channels = 0;
+const char *default_channel = CHANNEL_DEFAULT;
 char       cmd_char = CMD_CHAR_DEFAULT;
+int        connect_delay = CONNECT_DELAY_DEFAULT;
+unsigned   dead_timeout = DEAD_TIMEOUT_DEFAULT;
+unsigned   drain_budget_msgs = DRAIN_BUDGET_MSGS_DEFAULT;
+unsigned   drain_budget_us = DRAIN_BUDGET_US_DEFAULT;
 const char *nick = NICK_DEFAULT;
-const char *port = PORT_DEFAULT;
+unsigned   ping_interval = PING_INTERVAL_DEFAULT;
+// Set to the default for plain or TLS connections after option processing,
+// unless given.
+const char *port = NULL;
 const char *quit_message = QUIT_MESSAGE_DEFAULT;
 const char *realname = REALNAME_DEFAULT;
 const char *server;
 const char *username = USERNAME_DEFAULT;
 
+bool use_tls = false;
+bool verify_cert = true;
+
+bool measure_latency = false;
+
+time_t sim_start = 0;
+
 bool exit_on_invalid_msg = false;
 bool trace_msgs = false;
 
+typedef enum Setting_type {
+    SETTING_UNSIGNED,
+    SETTING_INT,
+    SETTING_CHAR,
+    SETTING_STR
+} Setting_type;
+
+typedef union Setting_val {
+    long num;
+    char c;
+    const char *str;
+} Setting_val;
+
+// Options that can also be set in CONFIG_FILE.
+typedef struct Setting {
+    const char *name;
+    // Command line flag for the option.
+    char flag;
+    Setting_type type;
+    // Range for SETTING_UNSIGNED and SETTING_INT.
+    long min_val;
+    long max_val;
+    void *var;
+    Setting_val default_val;
+    // Set if the option was given on the command line, which takes precedence
+    // over the file.
+    bool from_cmdline;
+} Setting;
+
+static Setting settings[] = {
+  { "budget_msgs", 'b', SETTING_UNSIGNED, 1, UINT_MAX, &drain_budget_msgs,
+    { .num = DRAIN_BUDGET_MSGS_DEFAULT }, false },
+  { "budget_us", 'B', SETTING_UNSIGNED, 1, UINT_MAX, &drain_budget_us,
+    { .num = DRAIN_BUDGET_US_DEFAULT }, false },
+  { "cmd_char", 'm', SETTING_CHAR, 0, 0, &cmd_char,
+    { .c = CMD_CHAR_DEFAULT }, false },
+  { "connect_delay", 'd', SETTING_INT, 0, INT_MAX, &connect_delay,
+    { .num = CONNECT_DELAY_DEFAULT }, false },
+  { "dead_timeout", 'D', SETTING_UNSIGNED, 1, INT_MAX/1000, &dead_timeout,
+    { .num = DEAD_TIMEOUT_DEFAULT }, false },
+  { "ping_interval", 'i', SETTING_UNSIGNED, 1, INT_MAX, &ping_interval,
+    { .num = PING_INTERVAL_DEFAULT }, false },
+  { "quit_message", 'q', SETTING_STR, 0, 0, &quit_message,
+    { .str = QUIT_MESSAGE_DEFAULT }, false }
+};
+
+// Contents of CONFIG_FILE, which string settings point into. NULL if the
+// defaults are used.
+static char *config_buf;
+
 static void print_usage(char *argv[], FILE *stream) {
     fprintf(stream,
             "usage: %s [<options>] <server>\n"
@@ -30,23 +106,84 @@ static void print_usage(char *argv[], FILE *stream) {
             "<server> is the IRC server to connect to.\n"
             "\n"
             "<options>:\n"
+            "  -b <messages> (default: %u)\n"
+            "  -B <microseconds> (default: %u)\n"
+            "     Maximum number of messages from the server to process,\n"
+            "     and time to spend on them, before checking for timers\n"
+            "     and signals. PINGs are always answered right away.\n"
             "  -c <channel to join> (default: \""CHANNEL_DEFAULT"\")\n"
             "     The channel name might have to be quoted to avoid\n"
             "     interpretation of '#' as the start of a comment.\n"
+            "     Can be given more than once, and the channel can be\n"
+            "     followed by settings, as in '-c \"#chan log=off\"'.\n"
+            "     Settings: log=on|off commands=on|off cmd_char=<char>\n"
+            "     key=<channel key> flood=off|ignore|warn.\n"
+            "     Channels are also read from ~/.botniklas/channels, one\n"
+            "     per line. The default channel is only joined if no\n"
+            "     channels are given.\n"
+            "  -d <connection attempt delay in ms> (default: %d)\n"
+            "     Delay before trying the next address when the server\n"
+            "     has several (e.g. both IPv6 and IPv4).\n"
+            "  -D <seconds> (default: %u)\n"
+            "     Reconnect if the server does not answer a PING within\n"
+            "     this time. Also used as the TCP user timeout.\n"
             "  -e  Exit the process when an invalid message is\n"
             "      received. Debugging helper.\n"
             "  -h  Print this usage message to stdout and exit. Other\n"
             "      arguments are ignored.\n"
+            "  -i <seconds> (default: %u)\n"
+            "     Interval between PINGs to the server, for measuring lag\n"
+            "     (see !lag) and detecting dead connections.\n"
+            "  -k  Do not verify the server's TLS certificate.\n"
+            "  -l  Measure the latency of PINGs and commands, from the\n"
+            "      kernel receiving them to the reply being sent. See\n"
+            "      !latency.\n"
             "  -m <initial command (mnemonic: magic) character> (default: "
                   "'%c')\n"
             "  -n <nick to use> (default: \""NICK_DEFAULT"\")\n"
-            "  -p <IRC server port> (default: \""PORT_DEFAULT"\")\n"
+            "  -p <IRC server port> (default: \""PORT_DEFAULT"\", or \""
+                  TLS_PORT_DEFAULT"\" with -s)\n"
             "     Service names from /etc/services are also supported.\n"
             "  -q <quit message> (default: \""QUIT_MESSAGE_DEFAULT"\")\n"
             "  -r <realname to use> (default: \""REALNAME_DEFAULT"\")\n"
+            "  -s  Connect using TLS. The kernel handles encryption after\n"
+            "      the handshake if it supports kTLS.\n"
+            "  -S <Unix time>\n"
+            "     Simulation mode, for tests and benchmarks with a fake\n"
+            "     server. Time starts at <Unix time> and only advances\n"
+            "     when the server sends 'SIMTIME <Unix time>'. Timers run\n"
+            "     on this virtual clock, and the bot does not PING the\n"
+            "     server or reconnect.\n"
             "  -u <username to use> (default: \""USERNAME_DEFAULT"\")\n"
-            "  -t  Print a trace of messages received from the server to stdout\n",
-            argv[0] ? argv[0] : "bot", CMD_CHAR_DEFAULT);
+            "  -t  Print a trace of messages received from the server to stdout\n"
+            "\n"
+            "The options -b, -B, -d, -D, -i, -m, and -q can also be set in\n"
+            "~/.botniklas/config, as lines like 'ping_interval = 30' (see\n"
+            "the source for the names). The file is reloaded when it\n"
+            "changes and on SIGHUP. Options on the command line take\n"
+            "precedence.\n",
+            argv[0] ? argv[0] : "bot", DRAIN_BUDGET_MSGS_DEFAULT,
+            DRAIN_BUDGET_US_DEFAULT, CONNECT_DELAY_DEFAULT,
+            DEAD_TIMEOUT_DEFAULT, PING_INTERVAL_DEFAULT, CMD_CHAR_DEFAULT);
+}
+
+// Parses 'arg' as an integer in the range ['min_val', 'max_val'], or prints an
+// error mentioning 'desc' and exits.
+static long parse_int_arg(char *argv[], const char *arg, long min_val,
+                          long max_val, const char *desc) {
+    char *end;
+    long val;
+
+    errno = 0;
+    val = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || errno != 0 || val < min_val ||
+        val > max_val) {
+        fprintf(stderr, "Invalid %s '%s'.\n\n", desc, arg);
+        print_usage(argv, stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
 }
 
 void process_cmdline(int argc, char *argv[]) {
@@ -55,9 +192,30 @@ void process_cmdline(int argc, char *argv[]) {
     // Print errors ourself.
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, ":c:ehn:m:p:q:r:tu:")) != -1)
+    while ((opt = getopt(argc, argv, ":b:B:c:d:D:ehi:kln:m:p:q:r:sS:tu:")) != -1) {
         switch (opt) {
-        case 'c': channel = optarg; break;
+        case 'b':
+            drain_budget_msgs = parse_int_arg(argv, optarg, 1, UINT_MAX,
+                                              "message budget");
+            break;
+        case 'B':
+            drain_budget_us = parse_int_arg(argv, optarg, 1, UINT_MAX,
+                                            "time budget");
+            break;
+        case 'c':
+            channels = erealloc(channels, (n_channels + 1)*sizeof *channels,
+                                "channel list");
+            channels[n_channels++] = optarg;
+            break;
+        case 'd':
+            connect_delay = parse_int_arg(argv, optarg, 0, INT_MAX,
+                                          "connection attempt delay");
+            break;
+        case 'D':
+            // Bounded so that the TCP user timeout in milliseconds fits.
+            dead_timeout = parse_int_arg(argv, optarg, 1, INT_MAX/1000,
+                                         "dead connection timeout");
+            break;
         case 'e': exit_on_invalid_msg = true; break;
         case 'h': print_usage(argv, stdout); exit(EXIT_SUCCESS);
         case 'm':
@@ -69,10 +227,21 @@ void process_cmdline(int argc, char *argv[]) {
             }
             cmd_char = optarg[0];
             break;
+        case 'i':
+            ping_interval = parse_int_arg(argv, optarg, 1, INT_MAX,
+                                          "PING interval");
+            break;
+        case 'k': verify_cert = false; break;
+        case 'l': measure_latency = true; break;
         case 'n': nick = optarg; break;
         case 'p': port = optarg; break;
         case 'q': quit_message = optarg; break;
         case 'r': realname = optarg; break;
+        case 's': use_tls = true; break;
+        case 'S':
+            sim_start = parse_int_arg(argv, optarg, 1, LONG_MAX,
+                                      "simulation start time");
+            break;
         case 't': trace_msgs = true; break;
         case 'u': username = optarg; break;
 
@@ -87,6 +256,11 @@ void process_cmdline(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
 
+        for (size_t i = 0; i < ARRAY_LEN(settings); ++i)
+            if (settings[i].flag == opt)
+                settings[i].from_cmdline = true;
+    }
+
     if (argc - optind != 1) {
         fputs("Expected a single non-flag argument (the IRC server).\n\n",
               stderr);
@@ -95,4 +269,154 @@ void process_cmdline(int argc, char *argv[]) {
     }
 
     server = argv[optind];
+
+    if (port == NULL)
+        port = use_tls ? TLS_PORT_DEFAULT : PORT_DEFAULT;
+}
+
+// Parses 'val' for 'setting' into 'res'. Returns false if it is invalid.
+static bool parse_setting_val(const Setting *setting, const char *val,
+                              Setting_val *res) {
+    char *end;
+
+    switch (setting->type) {
+    case SETTING_UNSIGNED:
+    case SETTING_INT:
+        errno = 0;
+        res->num = strtol(val, &end, 10);
+
+        return *val != '\0' && *end == '\0' && errno == 0 &&
+               res->num >= setting->min_val && res->num <= setting->max_val;
+
+    case SETTING_CHAR:
+        res->c = val[0];
+
+        return strlen(val) == 1;
+
+    case SETTING_STR:
+        res->str = val;
+
+        return true;
+    }
+
+    return false;
+}
+
+// Parses the "<name> = <value>" lines in 'buf' (which is modified) into
+// 'vals', leaving settings that are not given unchanged. Returns false on
+// errors, after printing a warning.
+static bool parse_config(char *buf, Setting_val vals[]) {
+    char *line;
+    char *next;
+
+    line = buf;
+    for (size_t line_nr = 1; line != NULL; line = next, ++line_nr) {
+        char *name;
+        char *val;
+        char *end;
+        size_t i;
+
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        // Skip empty lines and comments.
+        line += strspn(line, " \t");
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        val = strchr(line, '=');
+        if (val == NULL) {
+            warning("Expected <name> = <value> on line %zu in "
+                    "'"CONFIG_FILE"'", line_nr);
+
+            return false;
+        }
+        *val++ = '\0';
+
+        // Trim the name and the value.
+        name = line;
+        end = val - 1;
+        while (end > name && (end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+        *end = '\0';
+        val += strspn(val, " \t");
+        end = val + strlen(val);
+        while (end > val && (end[-1] == ' ' || end[-1] == '\t' ||
+                             end[-1] == '\r'))
+            --end;
+        *end = '\0';
+
+        for (i = 0; i < ARRAY_LEN(settings); ++i)
+            if (strcmp(settings[i].name, name) == 0)
+                break;
+        if (i == ARRAY_LEN(settings)) {
+            warning("Unknown setting '%s' on line %zu in '"CONFIG_FILE"'",
+                    name, line_nr);
+
+            return false;
+        }
+
+        if (!parse_setting_val(&settings[i], val, &vals[i])) {
+            warning("Invalid value '%s' for '%s' on line %zu in "
+                    "'"CONFIG_FILE"'", val, name, line_nr);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool load_config_file(void) {
+    Setting_val vals[ARRAY_LEN(settings)];
+    char *file_buf;
+    size_t file_len;
+
+    for (size_t i = 0; i < ARRAY_LEN(settings); ++i)
+        vals[i] = settings[i].default_val;
+
+    file_buf = get_file_contents(CONFIG_FILE, &file_len);
+    if (file_buf != NULL) {
+        // null-terminate for ease of parsing.
+        file_buf = erealloc(file_buf, file_len + 1, "config file");
+        file_buf[file_len] = '\0';
+
+        if (!parse_config(file_buf, vals)) {
+            warning("Keeping the previous settings");
+            free(file_buf);
+
+            return false;
+        }
+    }
+
+    // The file parsed fine. Switch all settings over to it at once.
+    for (size_t i = 0; i < ARRAY_LEN(settings); ++i) {
+        const Setting *setting = &settings[i];
+
+        if (setting->from_cmdline)
+            continue;
+
+        switch (setting->type) {
+        case SETTING_UNSIGNED: *(unsigned*)setting->var = vals[i].num; break;
+        case SETTING_INT: *(int*)setting->var = vals[i].num; break;
+        case SETTING_CHAR: *(char*)setting->var = vals[i].c; break;
+        case SETTING_STR: *(const char**)setting->var = vals[i].str; break;
+        }
+    }
+
+    free(config_buf);
+    config_buf = file_buf;
+
+    return true;
+}
+
+void free_config_file(void) {
+    // Point string settings back at their defaults.
+    for (size_t i = 0; i < ARRAY_LEN(settings); ++i)
+        if (settings[i].type == SETTING_STR && !settings[i].from_cmdline)
+            *(const char**)settings[i].var = settings[i].default_val.str;
+
+    free(config_buf);
+    config_buf = NULL;
 }
@@ -0,0 +1,180 @@
+// Per-sender command rate limiting with a fixed-size LRU table. See
+// rate_limit.h.
+
+#include "common.h"
+#include "date.h"
+#include "rate_limit.h"
+
+// Number of senders remembered.
+#define N_SENDERS 512
+// Number of hash chains. A power of two.
+#define N_BUCKETS 1024
+
+// Token bucket parameters. A sender can run BURST commands in a row, and then
+// one command every REFILL_MS milliseconds.
+#define BURST 4
+#define REFILL_MS 5000
+
+// Stored (possibly truncated) length of user@host keys. The hash is computed
+// over the whole key, so truncation only matters for keys that share a
+// prefix and have the same hash.
+#define KEY_LEN 80
+
+// Marks the end of hash chains and the LRU list.
+#define NONE UINT16_MAX
+
+typedef struct Sender {
+    // Hash of the full user@host key.
+    uint64_t hash;
+    // Null-terminated, possibly truncated user@host key.
+    char key[KEY_LEN];
+
+    // Next sender in the same hash chain.
+    uint16_t chain_next;
+    // Neighbors in the LRU list. 'lru_prev' is more recently used.
+    uint16_t lru_prev;
+    uint16_t lru_next;
+
+    // Available tokens, in milliseconds of refill time (one token is
+    // REFILL_MS).
+    uint32_t tokens;
+    // monotonic_ms() time of the last refill.
+    uint64_t refilled;
+    // monotonic_ms() time at which each command was last run. 0 if never.
+    uint64_t last_use[RATE_LIMIT_MAX_CMDS];
+} Sender;
+
+static Sender senders[N_SENDERS];
+// Number of entries in 'senders' that are in use. Unused entries are taken
+// before evicting.
+static size_t n_senders;
+
+static uint16_t buckets[N_BUCKETS];
+
+// Most and least recently used senders.
+static uint16_t lru_head = NONE;
+static uint16_t lru_tail = NONE;
+
+void init_rate_limit(void) {
+    for (size_t i = 0; i < N_BUCKETS; ++i)
+        buckets[i] = NONE;
+}
+
+// FNV-1a, continued from 'hash'.
+static uint64_t hash_str(uint64_t hash, const char *s) {
+    for (; *s != '\0'; ++s)
+        hash = (hash ^ (uc)*s)*0x100000001b3ULL;
+
+    return hash;
+}
+
+static uint64_t hash_key(const char *user, const char *host) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = hash_str(hash, user);
+    hash = hash_str(hash, "@");
+
+    return hash_str(hash, host);
+}
+
+// Writes the (possibly truncated) key for 'user'@'host' to 'key'.
+static void make_key(char key[KEY_LEN], const char *user, const char *host) {
+    snprintf(key, KEY_LEN, "%s@%s", user, host);
+}
+
+static void lru_unlink(uint16_t i) {
+    Sender *s = &senders[i];
+
+    if (s->lru_prev == NONE)
+        lru_head = s->lru_next;
+    else
+        senders[s->lru_prev].lru_next = s->lru_next;
+
+    if (s->lru_next == NONE)
+        lru_tail = s->lru_prev;
+    else
+        senders[s->lru_next].lru_prev = s->lru_prev;
+}
+
+static void lru_push_front(uint16_t i) {
+    senders[i].lru_prev = NONE;
+    senders[i].lru_next = lru_head;
+    if (lru_head != NONE)
+        senders[lru_head].lru_prev = i;
+    lru_head = i;
+    if (lru_tail == NONE)
+        lru_tail = i;
+}
+
+// Removes sender 'i' from its hash chain.
+static void chain_unlink(uint16_t i) {
+    uint16_t *link = &buckets[senders[i].hash & (N_BUCKETS - 1)];
+
+    while (*link != i)
+        link = &senders[*link].chain_next;
+    *link = senders[i].chain_next;
+}
+
+// Returns the sender for the key, creating it (possibly evicting the least
+// recently used sender) if needed, and makes it the most recently used.
+static Sender *get_sender(const char *user, const char *host, uint64_t now) {
+    uint64_t hash = hash_key(user, host);
+    uint16_t *bucket = &buckets[hash & (N_BUCKETS - 1)];
+    char key[KEY_LEN];
+    uint16_t i;
+
+    make_key(key, user, host);
+
+    for (i = *bucket; i != NONE; i = senders[i].chain_next)
+        if (senders[i].hash == hash && strcmp(senders[i].key, key) == 0) {
+            lru_unlink(i);
+            lru_push_front(i);
+
+            return &senders[i];
+        }
+
+    if (n_senders < N_SENDERS)
+        i = n_senders++;
+    else {
+        // Evict the least recently used sender.
+        i = lru_tail;
+        lru_unlink(i);
+        chain_unlink(i);
+    }
+
+    senders[i].hash = hash;
+    memcpy(senders[i].key, key, KEY_LEN);
+    senders[i].chain_next = *bucket;
+    *bucket = i;
+    lru_push_front(i);
+
+    senders[i].tokens = BURST*REFILL_MS;
+    senders[i].refilled = now;
+    memset(senders[i].last_use, 0, sizeof senders[i].last_use);
+
+    return &senders[i];
+}
+
+bool rate_limit_admit(const char *user, const char *host, unsigned cmd,
+                      unsigned cooldown) {
+    uint64_t now = monotonic_ms();
+    Sender *s;
+
+    assert(cmd < RATE_LIMIT_MAX_CMDS);
+
+    s = get_sender(user, host == NULL ? "" : host, now);
+
+    if (s->last_use[cmd] != 0 && now - s->last_use[cmd] < 1000*cooldown)
+        return false;
+
+    s->tokens = min(s->tokens + (now - s->refilled),
+                    (uint64_t)BURST*REFILL_MS);
+    s->refilled = now;
+    if (s->tokens < REFILL_MS)
+        return false;
+
+    s->tokens -= REFILL_MS;
+    s->last_use[cmd] = now;
+
+    return true;
+}
@@ -0,0 +1,154 @@
+// Event loop reactor on top of epoll. See reactor.h.
+
+#include "common.h"
+#include "reactor.h"
+
+// Maximum number of events harvested per epoll_wait(). Events beyond this are
+// picked up by the next call.
+#define MAX_EVENTS 64
+
+typedef struct Handler {
+    int fd;
+    void (*fn)(int fd, uint32_t events, void *ctx);
+    void *ctx;
+
+    // Set by reactor_remove() during dispatch. The handler is freed once the
+    // batch has been dispatched, since later events in it may point to it.
+    bool removed;
+    // Next handler waiting to be freed.
+    struct Handler *next_removed;
+} Handler;
+
+static int epoll_fd;
+
+// Registered handlers, indexed by fd.
+static Handler **handlers;
+static size_t handlers_len;
+
+// True while events are being dispatched.
+static bool dispatching;
+// Handlers removed during the current dispatch.
+static Handler *removed;
+
+static bool stopped;
+
+void init_reactor(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        err_exit("epoll_create");
+
+    handlers = NULL;
+    handlers_len = 0;
+    removed = NULL;
+    stopped = false;
+}
+
+void free_reactor(void) {
+    for (size_t i = 0; i < handlers_len; ++i)
+        free(handlers[i]);
+    free(handlers);
+
+    if (close(epoll_fd) == -1)
+        err_exit("close (epoll_fd)");
+}
+
+static Handler *get_handler(int fd) {
+    return fd >= 0 && fd < handlers_len ? handlers[fd] : NULL;
+}
+
+void reactor_add(int fd, unsigned interest,
+                 void (*handler)(int fd, uint32_t events, void *ctx),
+                 void *ctx) {
+    struct epoll_event ev = { .events = interest };
+    Handler *h;
+
+    assert(fd >= 0 && get_handler(fd) == NULL);
+
+    if (fd >= handlers_len) {
+        size_t new_len = max(2*handlers_len, (size_t)fd + 1);
+
+        handlers = erealloc(handlers, new_len*sizeof *handlers,
+                            "reactor handlers");
+        for (size_t i = handlers_len; i < new_len; ++i)
+            handlers[i] = NULL;
+        handlers_len = new_len;
+    }
+
+    h = emalloc(sizeof *h, "reactor handler");
+    h->fd = fd;
+    h->fn = handler;
+    h->ctx = ctx;
+    h->removed = false;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        err_exit("epoll_ctl (EPOLL_CTL_ADD)%s",
+                 interest & REACTOR_EDGE ? " with EPOLLET" : "");
+
+    handlers[fd] = h;
+}
+
+void reactor_modify(int fd, unsigned interest) {
+    struct epoll_event ev = { .events = interest };
+
+    assert(get_handler(fd) != NULL);
+
+    ev.data.ptr = handlers[fd];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        err_exit("epoll_ctl (EPOLL_CTL_MOD)");
+}
+
+void reactor_remove(int fd) {
+    Handler *h = get_handler(fd);
+
+    assert(h != NULL);
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        err_exit("epoll_ctl (EPOLL_CTL_DEL)");
+    handlers[fd] = NULL;
+
+    if (dispatching) {
+        h->removed = true;
+        h->next_removed = removed;
+        removed = h;
+    }
+    else
+        free(h);
+}
+
+bool reactor_poll(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    int n_events;
+
+    n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (n_events == -1) {
+        if (errno == EINTR)
+            // epoll_wait() generates EINTR if the process is stopped and
+            // resumed, so it's important that we handle this case. Just let
+            // the caller try again.
+            return true;
+        err_exit("epoll_wait");
+    }
+
+    dispatching = true;
+    for (int i = 0; i < n_events && !stopped; ++i) {
+        Handler *h = events[i].data.ptr;
+
+        if (!h->removed)
+            h->fn(h->fd, events[i].events, h->ctx);
+    }
+    dispatching = false;
+
+    while (removed != NULL) {
+        Handler *next = removed->next_removed;
+
+        free(removed);
+        removed = next;
+    }
+
+    return !stopped;
+}
+
+void reactor_stop(void) {
+    stopped = true;
+}
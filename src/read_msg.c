@@ -5,8 +5,11 @@
 
 #include "common.h"
 #include "irc.h"
+#include "latency.h"
 #include "msg_io.h"
 #include "options.h"
+#include "transport.h"
+#include "upgrade.h"
 
 static char *buf;
 // The buffer contents is stored in the index range [start,end[.
@@ -16,6 +19,9 @@ static char *buf;
 // 'page_size' bytes starting at 'start' can be safely accessed.
 static size_t start;
 static size_t end;
+// Data before index 'scanned' has been passed to scan_new_msgs(). Adjusted
+// together with 'start' and 'end'.
+static size_t scanned;
 static long page_size;
 
 static void test_mirroring(void) {
@@ -96,9 +102,13 @@ static void set_up_mirroring(void) {
 
 void msg_read_buf_init(void) {
     set_up_mirroring();
+    msg_read_buf_reset();
+}
 
+void msg_read_buf_reset(void) {
     start = 0;
     end = 0;
+    scanned = 0;
 }
 
 void msg_read_buf_free(void) {
@@ -117,10 +127,12 @@ static void adjust_indices(void) {
     if (start > page_size) {
         start -= page_size;
         end -= page_size;
+        scanned = scanned > page_size ? scanned - page_size : 0;
     }
 }
 
 bool recv_msgs(void) {
+    struct timespec rx_time;
     ssize_t n_recv;
 
     assert_index_sanity();
@@ -131,7 +143,8 @@ bool recv_msgs(void) {
                   "the read buffer is %zu bytes)", page_size);
 
 again:
-    n_recv = recv(serv_fd, buf + end, page_size - (end - start), 0);
+    n_recv = serv_recv(buf + end, page_size - (end - start),
+                       measure_latency ? &rx_time : NULL);
 
     if (n_recv == 0) {
         puts("The server closed the connection");
@@ -143,6 +156,10 @@ again:
         if (errno == EINTR)
             goto again;
 
+        if (errno == EAGAIN)
+            // Only TLS control data this time.
+            return true;
+
         warning_err("recv() error while reading messages from server");
 
         return false;
@@ -151,6 +168,11 @@ again:
     end += n_recv;
     assert_index_sanity();
 
+    // Messages are only received once the ones in the buffer have been
+    // processed, so the complete messages now in the buffer all arrived in
+    // this read.
+    latency_received(measure_latency && rx_time.tv_sec != 0 ? &rx_time : NULL);
+
     return true;
 }
 
@@ -202,3 +224,42 @@ invalid_msg:
 
     return true;
 }
+
+void scan_new_msgs(bool (*fn)(const char *msg, size_t len)) {
+    size_t line_start;
+
+    adjust_indices();
+    // Must be set after a possible index adjustment.
+    line_start = max(scanned, start);
+
+    for (size_t cur = line_start; cur < end; ++cur)
+        if (buf[cur] == '\r' || buf[cur] == '\n') {
+            if (cur > line_start &&
+                fn(buf + line_start, cur - line_start))
+                // Blank out the message. get_msg() skips the resulting empty
+                // messages.
+                memset(buf + line_start, '\n', cur - line_start);
+            line_start = cur + 1;
+        }
+
+    // Rescan a trailing partial message once it's complete.
+    scanned = line_start;
+}
+
+void upgrade_save_msg_read_buf(void) {
+    adjust_indices();
+    upgrade_put_bytes(buf + start, end - start);
+}
+
+void upgrade_restore_msg_read_buf(void) {
+    size_t len;
+    const void *data = upgrade_get_bytes(&len);
+
+    if (len > page_size)
+        fail_exit("Unprocessed data from live upgrade does not fit in the "
+                  "read buffer");
+    memcpy(buf, data, len);
+    start = 0;
+    end = len;
+    scanned = 0;
+}
@@ -0,0 +1,113 @@
+// Configuration reloading. See reload.h.
+
+#include "common.h"
+#include "channel_config.h"
+#include "files.h"
+#include "irc.h"
+#include "lag.h"
+#include "options.h"
+#include "reactor.h"
+#include "reload.h"
+#include "triggers.h"
+
+// Configuration files, as flags for reload().
+enum {
+    CONFIG = 1 << 0,
+    CHANNELS = 1 << 1,
+    TRIGGERS = 1 << 2
+};
+
+static const struct {
+    const char *name;
+    unsigned flag;
+} files[] = {
+  { "config", CONFIG }, { "channels", CHANNELS }, { "triggers", TRIGGERS } };
+
+static int inotify_fd;
+
+static void handle_inotify(int fd, uint32_t events, void *ctx);
+
+void init_reload(void) {
+    char *path;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+        err_exit("inotify_init1");
+    reactor_add(inotify_fd, REACTOR_READ, handle_inotify, NULL);
+
+    path = get_data_dir_path();
+    if (path == NULL)
+        return;
+    if (inotify_add_watch(inotify_fd, path,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                            IN_DELETE | IN_ONLYDIR) == -1)
+        warning_err("Failed to watch '%s' for configuration changes. "
+                    "SIGHUP still reloads the configuration", path);
+    free(path);
+}
+
+void free_reload(void) {
+    reactor_remove(inotify_fd);
+    if (close(inotify_fd) == -1)
+        err_exit("close (inotify)");
+}
+
+// Reloads the files in 'which' (a set of flags).
+static void reload(unsigned which) {
+    if (which & CONFIG) {
+        char old_cmd_char = cmd_char;
+        unsigned old_dead_timeout = dead_timeout;
+        unsigned old_ping_interval = ping_interval;
+
+        if (load_config_file())
+            puts("Reloaded options");
+
+        // The default command character is used for channels that don't set
+        // one.
+        if (cmd_char != old_cmd_char)
+            which |= CHANNELS;
+        // The TCP keepalive settings are derived from these. The PINGs pick
+        // up the new values by themselves.
+        if ((dead_timeout != old_dead_timeout ||
+             ping_interval != old_ping_interval) && serv_fd != -1)
+            set_keepalive();
+    }
+    if (which & CHANNELS)
+        reload_channel_config();
+    if (which & TRIGGERS)
+        reload_triggers();
+}
+
+void reload_config(void) {
+    reload(CONFIG | CHANNELS | TRIGGERS);
+}
+
+static void handle_inotify(int fd, uint32_t events, void *ctx) {
+    // Aligned as required by inotify(7).
+    char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    unsigned which = 0;
+    ssize_t len;
+
+    if (!(events & EPOLLIN) || events & EPOLLERR)
+        fail_exit("Got epoll error/weirdness related to inotify. Not sure "
+                  "what's going on. Bailing out.");
+
+    // Collect all pending events first, so that e.g. an editor writing a
+    // file in several steps causes a single reload.
+    while ((len = read(inotify_fd, buf, sizeof buf)) > 0)
+        for (char *cur = buf; cur < buf + len;) {
+            const struct inotify_event *event = (struct inotify_event*)cur;
+
+            if (event->len != 0)
+                for (size_t i = 0; i < ARRAY_LEN(files); ++i)
+                    if (strcmp(event->name, files[i].name) == 0)
+                        which |= files[i].flag;
+            cur += sizeof *event + event->len;
+        }
+    if (len == -1 && errno != EAGAIN)
+        err_exit("read (inotify)");
+
+    if (which != 0)
+        reload(which);
+}
@@ -1,20 +1,199 @@
 #include "common.h"
 #include "date.h"
 #include "files.h"
+#include "intern.h"
+#include "id_set.h"
 #include "msg_io.h"
 #include "options.h"
 #include "remind.h"
 #include "time_event.h"
+#include "upgrade.h"
 
 // File to keep a persistent record of reminders in. (Future) reminders are
 // restored from this file on startup. Includes past reminders too - we only
 // ever append to it.
+//
+// Each line is one of
+//
+//   #<id> <when> <target> <message>
+//   cancel <target> #<id>
+//
+// where <when> is either a timestamp or "every <recurrence>" (see
+// parse_recurrence()). Reminder lines from before reminders had ids lack the
+// "#<id> " prefix, and are numbered in order after the highest id seen so far.
 #define REMINDERS_FILE "reminders"
 
-// Appends a reminder to the file.
-static void save_reminder(time_t when, const char *target,
-                          const char *message) {
+// Maximum length of a formatted recurrence.
+#define RECURRENCE_LEN 64
+
+// Number of reminders listed per !reminders page.
+#define PAGE_SIZE 5
+
+typedef struct Reminder {
+    // Stable id, shown to users and used in the reminders file.
+    uint32_t id;
+    // Time of the reminder, or of the next occurrence for recurring
+    // reminders. Only the next occurrence is ever registered as a time event,
+    // and the one after it is computed when it fires.
+    time_t when;
+    bool recurring;
+    // Only used if 'recurring' is set.
+    Recurrence rule;
+    // Set by !unremind. The pending time event is left in place and frees the
+    // reminder when it fires, so that cancelling doesn't need to search the
+    // event list.
+    bool cancelled;
+    // "<target of message (channel or nick)>\0<reminder message>\0".
+    char target_and_reminder[];
+} Reminder;
+
+// The pending reminders of a target, sorted by id.
+typedef struct Target_reminders {
+    Reminder **reminders;
+    size_t len;
+    size_t cap;
+} Target_reminders;
+
+// Maps interned targets (see intern.h) to their Target_reminders. Each entry
+// holds a reference to the interned target.
+static Id_map by_target;
+
+// Id of the next new reminder.
+static uint32_t next_id;
+
+// Returns the target of a reminder.
+static const char *target(const Reminder *r) {
+    return r->target_and_reminder;
+}
+
+// Returns the message of a reminder.
+static const char *reminder(const Reminder *r) {
+    return r->target_and_reminder + strlen(r->target_and_reminder) + 1;
+}
+
+// Returns the size of packed target and reminder data.
+static size_t reminder_data_len(const char *target_and_reminder) {
+    const char *msg = target_and_reminder + strlen(target_and_reminder) + 1;
+
+    return msg + strlen(msg) + 1 - target_and_reminder;
+}
+
+static Reminder *new_reminder(uint32_t id, const char *target,
+                              const char *message) {
+    size_t target_len = strlen(target) + 1;
+    size_t reminder_len = strlen(message) + 1;
+    Reminder *r;
+
+    r = emalloc(sizeof *r + target_len + reminder_len, "reminder");
+    r->id = id;
+    r->recurring = false;
+    r->cancelled = false;
+    memcpy(r->target_and_reminder, target, target_len);
+    memcpy(r->target_and_reminder + target_len, message, reminder_len);
+
+    return r;
+}
+
+void init_reminders(void) {
+    id_map_init(&by_target);
+    next_id = 1;
+}
+
+// Returns the pending reminders of 'target', or NULL if it has none.
+static Target_reminders *get_target_reminders(const char *target) {
+    Str_id id = intern_find(target);
+
+    return id == NO_STR_ID ? NULL : id_map_get(&by_target, id);
+}
+
+// Returns the position of the first reminder in 'tr' with an id of 'id' or
+// greater.
+static size_t find_pos(const Target_reminders *tr, uint32_t id) {
+    size_t lo = 0;
+    size_t hi = tr->len;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+
+        if (tr->reminders[mid]->id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Adds 'r' to the index.
+static void index_add(Reminder *r) {
+    Str_id id = intern(target(r));
+    Target_reminders *tr = id_map_get(&by_target, id);
+    size_t pos;
+
+    if (tr == NULL) {
+        tr = emalloc(sizeof *tr, "target reminders");
+        tr->reminders = NULL;
+        tr->len = tr->cap = 0;
+        id_map_set(&by_target, id, tr);
+    }
+    else
+        intern_unref(id);
+
+    if (tr->len == tr->cap) {
+        tr->cap = tr->cap == 0 ? 4 : 2*tr->cap;
+        tr->reminders = erealloc(tr->reminders,
+                                 tr->cap*sizeof *tr->reminders,
+                                 "target reminders");
+    }
+
+    // New reminders get the highest id, so this is normally an append.
+    pos = find_pos(tr, r->id);
+    memmove(tr->reminders + pos + 1, tr->reminders + pos,
+            (tr->len - pos)*sizeof *tr->reminders);
+    tr->reminders[pos] = r;
+    ++tr->len;
+}
+
+// Removes 'r' from the index.
+static void index_remove(Reminder *r) {
+    Str_id id = intern_find(target(r));
+    Target_reminders *tr = id_map_get(&by_target, id);
+    size_t pos = find_pos(tr, r->id);
+
+    assert(pos < tr->len && tr->reminders[pos] == r);
+
+    memmove(tr->reminders + pos, tr->reminders + pos + 1,
+            (tr->len - pos - 1)*sizeof *tr->reminders);
+    if (--tr->len == 0) {
+        id_map_remove(&by_target, id);
+        intern_unref(id);
+        free(tr->reminders);
+        free(tr);
+    }
+}
+
+// Returns the pending reminder of 'target' with id 'id', or NULL if there is
+// none.
+static Reminder *index_find(const char *target, uint32_t id) {
+    Target_reminders *tr = get_target_reminders(target);
+    size_t pos;
+
+    if (tr == NULL)
+        return NULL;
+
+    pos = find_pos(tr, id);
+
+    return pos < tr->len && tr->reminders[pos]->id == id ?
+             tr->reminders[pos] : NULL;
+}
+
+// Appends a line to the reminders file.
+static void save_line(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void save_line(const char *format, ...) {
     FILE *remind_file;
+    va_list ap;
 
     #define PREFIX "Failed to save reminder in '"REMINDERS_FILE"': "
 
@@ -25,9 +204,10 @@ static void save_reminder(time_t when, const char *target,
         return;
     }
 
-    if (fprintf(remind_file, "%lld %s %s\n", (long long)when, target,
-                message) < 0)
-        warning_err(PREFIX"fprintf() failed");
+    va_start(ap, format);
+    if (vfprintf(remind_file, format, ap) < 0)
+        warning_err(PREFIX"vfprintf() failed");
+    va_end(ap);
 
     #undef PREFIX
 
@@ -36,34 +216,149 @@ static void save_reminder(time_t when, const char *target,
                     "('"REMINDERS_FILE"')");
 }
 
-// Reminder data is stored in a char array with the format
-// "<target of message (channel or nick)>\0<reminder message>\0".
-
-// Returns the target from a packed target and reminder string.
-static char *target(char *target_and_reminder) {
-    return target_and_reminder;
-}
+// Appends a reminder to the file.
+static void save_reminder(const Reminder *r) {
+    char rule_str[RECURRENCE_LEN];
 
-// Returns the reminder message from a packed target and reminder string.
-static char *reminder(char *target_and_reminder) {
-    return target_and_reminder + strlen(target_and_reminder) + 1;
+    if (r->recurring) {
+        format_recurrence(&r->rule, rule_str, sizeof rule_str);
+        save_line("#%"PRIu32" every %s %s %s\n", r->id, rule_str, target(r),
+                  reminder(r));
+    }
+    else
+        save_line("#%"PRIu32" %lld %s %s\n", r->id, (long long)r->when,
+                  target(r), reminder(r));
 }
 
 // Callback called at the time of the reminder.
 static void remind(void *data) {
-    char *target_and_reminder = (char*)data;
+    Reminder *r = data;
+
+    if (r->cancelled) {
+        free(r);
+
+        return;
+    }
+
+    say(target(r), "REMINDER: %s", reminder(r));
+
+    if (r->recurring) {
+        // Skip occurrences that were missed, e.g. while the machine was
+        // suspended, instead of firing them all at once.
+        r->when = next_occurrence(&r->rule, max(r->when, current_time()));
+        if (r->when != -1) {
+            add_time_event(r->when, remind, r);
+
+            return;
+        }
+
+        warning("Failed to schedule the next occurrence of recurring "
+                "reminder #%"PRIu32" for %s", r->id, target(r));
+    }
+
+    index_remove(r);
+    free(r);
+}
+
+// Registers 'r' in the index and as a time event.
+static void add_reminder(Reminder *r) {
+    index_add(r);
+    add_time_event(r->when, remind, r);
+}
+
+// Appends "approx. <duration>" to the current message (see begin_say()).
+static void append_duration(time_t diff) {
+    unsigned n_days = diff/(60*60*24);
+    unsigned n_hours = diff/(60*60)%24;
+    unsigned n_minutes = diff/60%60;
+    unsigned n_seconds = diff%60;
+
+    append_msg("approx. ");
+    if (n_days != 0)
+        append_msg("%u day%s, ", n_days, n_days == 1 ? "" : "s");
+    if (n_hours != 0)
+        append_msg("%u hour%s, ", n_hours, n_hours == 1 ? "" : "s");
+    if (n_minutes != 0)
+        append_msg("%u minute%s, ", n_minutes, n_minutes == 1 ? "" : "s");
+    append_msg("%u second%s", n_seconds, n_seconds == 1 ? "" : "s");
+}
+
+// Checks the message after the time of a !remind and returns it, or replies
+// with an error and returns NULL.
+static const char *get_message(const char *cur, const char *rep) {
+    if (cur[0] != ' ') {
+        say(rep, "Error: Expected a space and the message after the time.");
+
+        return NULL;
+    }
+
+    if (cur[1] == '\0') {
+        say(rep, "Error: Empty reminder message.");
+
+        return NULL;
+    }
+
+    return cur + 1;
+}
+
+// Handles "!remind every ...". 'arg' points after "every".
+static void handle_recurring_remind(const char *arg, const char *rep) {
+    const char *cur = arg;
+    const char *message;
+    char rule_str[RECURRENCE_LEN];
+    Recurrence rule;
+    Reminder *r;
+    time_t now;
+
+    if (!parse_recurrence(&cur, &rule)) {
+        say(rep, "Error: Malformed recurrence. Expected e.g. 'every day "
+                 "8:00', 'every weekday 9:30', 'every mon,thu 18:00', or "
+                 "'every month 25 12:00'.");
+
+        return;
+    }
+
+    message = get_message(cur, rep);
+    if (message == NULL)
+        return;
+
+    now = current_time();
+    if (now == -1) {
+        warning_err("time() failed (add recurring reminder)");
+        say(rep, "Failed to add reminder due to an unexpected error.");
+
+        return;
+    }
+
+    r = new_reminder(next_id, rep, message);
+    r->recurring = true;
+    r->rule = rule;
+    r->when = next_occurrence(&rule, now);
+    if (r->when == -1) {
+        free(r);
+        say(rep, "Failed to add reminder due to an unexpected error.");
+
+        return;
+    }
+    ++next_id;
+
+    save_reminder(r);
+    add_reminder(r);
 
-    say(target(target_and_reminder), "REMINDER: %s",
-        reminder(target_and_reminder));
-    free(target_and_reminder);
+    format_recurrence(&rule, rule_str, sizeof rule_str);
+    begin_say(rep);
+    append_msg("I will remind you every %s (#%"PRIu32"). The first reminder "
+               "is in ", rule_str, r->id);
+    append_duration(r->when - now);
+    append_msg("!");
+    send_msg();
 }
 
 void handle_remind(const char *arg, const char *rep) {
     const char *cur;
+    const char *message;
     time_t now;
-    char *reminder_data;
-    size_t target_len;
-    size_t reminder_len;
+    Reminder *r;
     time_t when;
 
     if (arg == NULL) {
@@ -72,6 +367,12 @@ void handle_remind(const char *arg, const char *rep) {
         return;
     }
 
+    if (strncmp(arg, "every ", 6) == 0) {
+        handle_recurring_remind(arg + 6, rep);
+
+        return;
+    }
+
     cur = arg;
 
     when = parse_date(&cur);
@@ -81,67 +382,128 @@ void handle_remind(const char *arg, const char *rep) {
         return;
     }
 
-    if (cur[0] != ' ') {
-        say(rep, "Error: Expected a space and the message after the time.");
+    message = get_message(cur, rep);
+    if (message == NULL)
+        return;
+
+    now = current_time();
+    if (now == -1) {
+        warning_err("time() failed (add reminder)");
+        say(rep, "Failed to add reminder due to an unexpected error.");
 
         return;
     }
 
-    if (cur[1] == '\0') {
-        say(rep, "Error: Empty reminder message.");
+    if (when < now) {
+        say(rep, "Error: That's in the past.");
 
         return;
     }
 
-    ++cur;
+    r = new_reminder(next_id++, rep, message);
+    r->when = when;
 
-    now = time(NULL);
-    if (now == -1) {
-        warning_err("time() failed (add reminder)");
-        say(rep, "Failed to add reminder due to an unexpected error.");
+    // Save the reminder to the reminders file and register it.
+    save_reminder(r);
+    add_reminder(r);
+
+    // Reply with confirmation.
+    begin_say(rep);
+    append_msg("I will remind you in ");
+    append_duration(when - now);
+    append_msg(" (#%"PRIu32")!", r->id);
+    send_msg();
+}
+
+void handle_reminders(const char *arg, const char *rep) {
+    Target_reminders *tr = get_target_reminders(rep);
+    size_t n_pages;
+    unsigned long page = 1;
+
+    if (tr == NULL) {
+        say(rep, "No pending reminders.");
 
         return;
     }
 
-    if (when < now) {
-        say(rep, "Error: That's in the past.");
+    n_pages = (tr->len + PAGE_SIZE - 1)/PAGE_SIZE;
 
-        return;
+    if (arg != NULL) {
+        char *end;
+
+        errno = 0;
+        page = strtoul(arg, &end, 10);
+        if (!isdigit((uc)*arg) || *end != '\0' || errno == ERANGE ||
+            page == 0 || page > n_pages) {
+            say(rep, "Error: No page '%s'. There %s %zu page%s.", arg,
+                n_pages == 1 ? "is" : "are", n_pages,
+                n_pages == 1 ? "" : "s");
+
+            return;
+        }
     }
 
-    // Save the reminder to the reminders file.
-    save_reminder(when, rep, cur);
+    // Newest first.
+    for (size_t i = (page - 1)*PAGE_SIZE;
+         i < tr->len && i < page*PAGE_SIZE; ++i) {
+        const Reminder *r = tr->reminders[tr->len - 1 - i];
+        char when_str[64];
+        struct tm tm;
+
+        if (!local_time(r->when, &tm) ||
+            strftime(when_str, sizeof when_str, "%a %Y-%m-%d %H:%M:%S",
+                     &tm) == 0)
+            strcpy(when_str, "?");
+
+        begin_say(rep);
+        append_msg("#%"PRIu32" ", r->id);
+        if (r->recurring) {
+            char rule_str[RECURRENCE_LEN];
+
+            format_recurrence(&r->rule, rule_str, sizeof rule_str);
+            append_msg("every %s (next %s)", rule_str, when_str);
+        }
+        else
+            append_msg("%s", when_str);
+        append_msg(": %s", reminder(r));
+        send_msg();
+    }
 
-    // Allocate and initialize data for callback.
+    if (n_pages > 1)
+        say(rep, "Page %lu of %zu. Use !reminders <page> to see the others.",
+            page, n_pages);
+}
 
-    target_len = strlen(rep) + 1;
-    reminder_len = strlen(cur) + 1;
+void handle_unremind(const char *arg, const char *rep) {
+    const char *cur = arg;
+    unsigned long id;
+    Reminder *r;
+    char *end;
 
-    reminder_data = emalloc(target_len + reminder_len, "reminder data");
-    memcpy(reminder_data, rep, target_len);
-    memcpy(reminder_data + target_len, cur, reminder_len);
+    if (cur != NULL && *cur == '#')
+        ++cur;
+    if (cur == NULL || !isdigit((uc)*cur)) {
+        say(rep, "Usage: !unremind <id>. Use !reminders to list reminders.");
 
-    // Register callback.
-    add_time_event(when, remind, reminder_data);
+        return;
+    }
 
-    // Reply with confirmation.
+    errno = 0;
+    id = strtoul(cur, &end, 10);
+    r = *end != '\0' || errno == ERANGE || id > UINT32_MAX ?
+          NULL : index_find(rep, id);
+    if (r == NULL) {
+        say(rep, "Error: No pending reminder #%s here.", cur);
 
-    time_t diff = when - now;
-    unsigned n_days = diff/(60*60*24);
-    unsigned n_hours = diff/(60*60)%24;
-    unsigned n_minutes = diff/60%60;
-    unsigned n_seconds = diff%60;
+        return;
+    }
 
-    begin_say(rep);
-    append_msg("I will remind you in approx. ");
-    if (n_days != 0)
-        append_msg("%u day%s, ", n_days, n_days == 1 ? "" : "s");
-    if (n_hours != 0)
-        append_msg("%u hour%s, ", n_hours, n_hours == 1 ? "" : "s");
-    if (n_minutes != 0)
-        append_msg("%u minute%s, ", n_minutes, n_minutes == 1 ? "" : "s");
-    append_msg("%u second%s!", n_seconds, n_seconds == 1 ? "" : "s");
-    send_msg();
+    // Leave the time event to free it (see Reminder).
+    r->cancelled = true;
+    index_remove(r);
+    save_line("cancel %s #%"PRIu32"\n", rep, r->id);
+
+    say(rep, "Cancelled reminder #%"PRIu32".", r->id);
 }
 
 void restore_remind_state(void) {
@@ -151,7 +513,7 @@ void restore_remind_state(void) {
     size_t file_len;
     time_t now;
 
-    now = time(NULL);
+    now = current_time();
     if (now == -1)
         err_exit("time (load reminders)");
 
@@ -163,11 +525,15 @@ void restore_remind_state(void) {
     end = file_buf + file_len; // End sentinel.
 
     for (size_t line_nr = 1;; ++line_nr) {
-        char *reminder_data;
         char *reminder_str;
         char *target_str;
         long long when;
         char *when_str;
+        unsigned long long id;
+        char *id_str;
+        bool recurring;
+        Recurrence rule;
+        Reminder *r;
 
         // Count a file with just a newline as empty too, for ease of manual
         // editing.
@@ -190,16 +556,72 @@ void restore_remind_state(void) {
         #define EXPECT_CHAR(c, err_msg) \
           EXPECT(cur != end && *cur == c, err_msg)
 
-        // Parse timestamp.
-        for (when_str = cur; cur != end && isdigit(*cur); ++cur);
-        EXPECT(cur > when_str, "Missing or malformed timestamp");
-        EXPECT_CHAR(' ', "Expected space after timestamp");
-        *cur++ = '\0';
-        errno = 0;
-        when = strtoll(when_str, NULL, 10);
-        EXPECT(!(when == LLONG_MAX && errno == ERANGE) &&
-               (time_t)when == when, // Truncation check.
-               "Timestamp too large");
+        // Parses an id after '#' into 'id'.
+        #define PARSE_ID                                                 \
+          for (id_str = ++cur; cur != end && isdigit(*cur); ++cur);      \
+          EXPECT(cur > id_str && cur - id_str <= 10, "Malformed id");    \
+          id = strtoull(id_str, NULL, 10);                               \
+          EXPECT(id > 0 && id < UINT32_MAX, "Id out of range")
+
+        if (end - cur > 7 && memcmp(cur, "cancel ", 7) == 0) {
+            // Parse cancellation.
+            for (target_str = cur += 7; cur != end && *cur != ' '; ++cur);
+            EXPECT(cur > target_str, "Missing or malformed target");
+            EXPECT_CHAR(' ', "Expected space after target");
+            *cur++ = '\0';
+            EXPECT_CHAR('#', "Expected '#' and id after target");
+            PARSE_ID;
+            EXPECT_CHAR('\n', "Expected newline after id");
+            ++cur;
+
+            r = index_find(target_str, id);
+            if (r != NULL) {
+                r->cancelled = true;
+                index_remove(r);
+            }
+
+            continue;
+        }
+
+        if (*cur == '#') {
+            PARSE_ID;
+            EXPECT_CHAR(' ', "Expected space after id");
+            ++cur;
+        }
+        else
+            id = next_id;
+        next_id = max(next_id, (uint32_t)id + 1);
+
+        recurring = end - cur > 6 && memcmp(cur, "every ", 6) == 0;
+        if (recurring) {
+            // Parse recurrence. The buffer is not null-terminated, so
+            // temporarily terminate the line to keep the parser within it.
+            char *nl = memchr(cur, '\n', end - cur);
+            const char *rule_end = cur + 6;
+            bool ok;
+
+            EXPECT(nl != NULL, "Missing newline after reminder message");
+            *nl = '\0';
+            ok = parse_recurrence(&rule_end, &rule);
+            *nl = '\n';
+            EXPECT(ok, "Malformed recurrence");
+            cur = (char*)rule_end;
+            EXPECT_CHAR(' ', "Expected space after recurrence");
+            ++cur;
+            when = 0;
+        }
+        else {
+            // Parse timestamp.
+            for (when_str = cur; cur != end && isdigit(*cur); ++cur);
+            EXPECT(cur > when_str, "Missing or malformed timestamp");
+            EXPECT_CHAR(' ', "Expected space after timestamp");
+            *cur++ = '\0';
+            errno = 0;
+            when = strtoll(when_str, NULL, 10);
+            EXPECT(!(when == LLONG_MAX && errno == ERANGE) &&
+                   (time_t)when == when, // Truncation check.
+                   "Timestamp too large");
+        }
 
         // Parse target.
         for (target_str = cur; cur != end && *cur != ' '; ++cur);
@@ -214,21 +636,115 @@ void restore_remind_state(void) {
         EXPECT(cur != end, "Missing newline after reminder message");
         *cur++ = '\0';
 
-        if (when < now)
+        if (!recurring && when < now)
             // Skip reminders from the past.
             continue;
 
-        // Allocate and initialize reminder data. The target and reminder
-        // strings already appear together in the correct format.
-
-        reminder_data = emalloc(cur - target_str, "reminder data (from file)");
-        memcpy(reminder_data, target_str, cur - target_str);
+        r = new_reminder(id, target_str, reminder_str);
+        r->recurring = recurring;
+        if (recurring) {
+            r->rule = rule;
+            r->when = next_occurrence(&rule, now);
+            if (r->when == -1) {
+                free(r);
 
-        // Register callback.
+                continue;
+            }
+        }
+        else
+            r->when = when;
 
-        add_time_event(when, remind, reminder_data);
+        add_reminder(r);
 
         #undef EXPECT
         #undef EXPECT_CHAR
+        #undef PARSE_ID
+    }
+}
+
+// for_each_time_event() callback that counts pending reminders.
+static void count_reminder(time_t when, void *data, void *ctx) {
+    if (!((Reminder*)data)->cancelled)
+        ++*(size_t*)ctx;
+}
+
+// for_each_time_event() callback that saves a pending reminder. Recurrences
+// are saved in text form.
+static void save_pending_reminder(time_t when, void *data, void *ctx) {
+    Reminder *r = data;
+    char rule_str[RECURRENCE_LEN] = "";
+
+    if (r->cancelled)
+        return;
+
+    if (r->recurring)
+        format_recurrence(&r->rule, rule_str, sizeof rule_str);
+
+    upgrade_put_u64(r->id);
+    upgrade_put_u64(when);
+    upgrade_put_str(rule_str);
+    upgrade_put_bytes(r->target_and_reminder,
+                      reminder_data_len(r->target_and_reminder));
+}
+
+void upgrade_save_reminders(void) {
+    size_t n = 0;
+
+    upgrade_put_u64(next_id);
+    for_each_time_event(remind, count_reminder, &n);
+    upgrade_put_u64(n);
+    for_each_time_event(remind, save_pending_reminder, NULL);
+}
+
+void upgrade_restore_reminders(void) {
+    size_t n;
+
+    next_id = upgrade_get_u64();
+    n = upgrade_get_u64();
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t id = upgrade_get_u64();
+        time_t when = upgrade_get_u64();
+        const char *rule_str = upgrade_get_str();
+        const char *data;
+        Recurrence rule;
+        Reminder *r;
+        size_t len;
+
+        data = upgrade_get_bytes(&len);
+        if (len < 2 || data[len - 1] != '\0' ||
+            reminder_data_len(data) != len)
+            fail_exit("Malformed reminder in state from live upgrade");
+
+        r = new_reminder(id, data, data + strlen(data) + 1);
+        r->when = when;
+        if (*rule_str != '\0') {
+            if (!parse_recurrence(&rule_str, &rule) || *rule_str != '\0')
+                fail_exit("Malformed recurring reminder in state from live "
+                          "upgrade");
+            r->recurring = true;
+            r->rule = rule;
+        }
+
+        add_reminder(r);
     }
 }
+
+// for_each_time_event() callback that frees a reminder.
+static void free_reminder(time_t when, void *data, void *ctx) {
+    free(data);
+}
+
+void free_reminders(void) {
+    for (size_t i = 0; i < by_target.keys.size; ++i)
+        if (by_target.keys.ids[i] != NO_STR_ID) {
+            Target_reminders *tr = by_target.vals[i];
+
+            intern_unref(by_target.keys.ids[i]);
+            free(tr->reminders);
+            free(tr);
+        }
+    id_map_free(&by_target);
+
+    // This includes cancelled reminders, which are no longer in the index.
+    for_each_time_event(remind, free_reminder, NULL);
+}
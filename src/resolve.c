@@ -0,0 +1,319 @@
+// Asynchronous host name resolution using a resolver thread. See resolve.h.
+
+#include "common.h"
+#include "reactor.h"
+#include "resolve.h"
+
+static int resolve_fd;
+
+// getaddrinfo() does not tell us the DNS TTL, so cache results for a fixed
+// time.
+#define CACHE_TTL (5*60)
+#define CACHE_SIZE 8
+
+typedef struct Request {
+    // Next request in the queue.
+    struct Request *next;
+
+    char *host;
+    char *service;
+    int type;
+    void (*callback)(struct addrinfo *ais, int err, void *data);
+    void *data;
+
+    // Result, filled in by the resolver thread.
+    struct addrinfo *ais;
+    int err;
+} Request;
+
+// A singly-linked FIFO of requests.
+typedef struct Queue {
+    Request *head;
+    Request **tail;
+} Queue;
+
+// Everything below is protected by 'lock', except where noted.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a request is added to 'pending' or when stopping.
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+// Lookups waiting for the resolver thread.
+static Queue pending;
+// Lookups waiting for handle_resolve_event().
+static Queue done;
+
+// Set when the resolver is being freed. The resolver thread checks it before
+// touching 'resolve_fd'.
+static bool stopping;
+
+// The cache is only used from the event loop thread and needs no locking.
+static struct {
+    char *host;
+    char *service;
+    int type;
+    struct addrinfo *ais;
+    // CLOCK_MONOTONIC time (in seconds) after which the entry is stale. 0 for
+    // unused entries.
+    time_t expires;
+} cache[CACHE_SIZE];
+
+static void queue_init(Queue *queue) {
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+static void queue_push(Queue *queue, Request *req) {
+    req->next = NULL;
+    *queue->tail = req;
+    queue->tail = &req->next;
+}
+
+static Request *queue_pop(Queue *queue) {
+    Request *req = queue->head;
+
+    if (req != NULL) {
+        queue->head = req->next;
+        if (queue->head == NULL)
+            queue->tail = &queue->head;
+    }
+
+    return req;
+}
+
+static void free_request(Request *req) {
+    free(req->host);
+    free(req->service);
+    free(req);
+}
+
+static void *resolver_thread(void *arg) {
+    int res;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (resolver)");
+
+    for (;;) {
+        struct addrinfo hints;
+        Request *req;
+        uint64_t one = 1;
+
+        while (!stopping && pending.head == NULL)
+            if ((res = pthread_cond_wait(&pending_cond, &lock)) != 0)
+                err_exit_n(res, "pthread_cond_wait (resolver)");
+
+        if (stopping)
+            break;
+
+        req = queue_pop(&pending);
+
+        // Do the (potentially slow) lookup without holding the lock.
+        if ((res = pthread_mutex_unlock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_unlock (resolver)");
+
+        // Accept both IPv4 and IPv6 addresses, but skip the families the
+        // local system has no address for.
+        clear(hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = req->type;
+        hints.ai_flags = AI_ADDRCONFIG;
+        req->err = getaddrinfo(req->host, req->service, &hints, &req->ais);
+        if (req->err != 0)
+            req->ais = NULL;
+
+        if ((res = pthread_mutex_lock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_lock (resolver)");
+
+        if (stopping) {
+            if (req->ais != NULL)
+                freeaddrinfo(req->ais);
+            free_request(req);
+
+            break;
+        }
+
+        queue_push(&done, req);
+        // Wake up the event loop. Done with 'lock' held so that
+        // free_resolve() can't close 'resolve_fd' under us.
+        if (write(resolve_fd, &one, sizeof one) == -1)
+            err_exit("write (resolver eventfd)");
+    }
+
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (resolver)");
+
+    return NULL;
+}
+
+static void handle_resolve_event(int fd, uint32_t events, void *ctx);
+
+void init_resolve(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int res;
+
+    resolve_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (resolve_fd == -1)
+        err_exit("eventfd (resolver)");
+    reactor_add(resolve_fd, REACTOR_READ, handle_resolve_event, NULL);
+
+    queue_init(&pending);
+    queue_init(&done);
+    stopping = false;
+
+    // The thread is detached since a lookup can't be interrupted. On
+    // shutdown, it exits once its current lookup (if any) finishes.
+    if ((res = pthread_attr_init(&attr)) != 0)
+        err_exit_n(res, "pthread_attr_init (resolver)");
+    if ((res = pthread_attr_setdetachstate(&attr,
+                                           PTHREAD_CREATE_DETACHED)) != 0)
+        err_exit_n(res, "pthread_attr_setdetachstate (resolver)");
+    if ((res = pthread_create(&thread, &attr, resolver_thread, NULL)) != 0)
+        err_exit_n(res, "pthread_create (resolver)");
+    pthread_attr_destroy(&attr);
+}
+
+void free_resolve(void) {
+    Request *req;
+    int res;
+
+    reactor_remove(resolve_fd);
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (free resolver)");
+
+    stopping = true;
+    if ((res = pthread_cond_signal(&pending_cond)) != 0)
+        err_exit_n(res, "pthread_cond_signal (free resolver)");
+
+    while ((req = queue_pop(&pending)) != NULL)
+        free_request(req);
+    while ((req = queue_pop(&done)) != NULL) {
+        if (req->ais != NULL)
+            freeaddrinfo(req->ais);
+        free_request(req);
+    }
+
+    if (close(resolve_fd) == -1)
+        err_exit("close (resolver eventfd)");
+
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (free resolver)");
+
+    for (size_t i = 0; i < CACHE_SIZE; ++i)
+        if (cache[i].expires != 0) {
+            free(cache[i].host);
+            free(cache[i].service);
+            freeaddrinfo(cache[i].ais);
+            cache[i].expires = 0;
+        }
+}
+
+// Returns the current CLOCK_MONOTONIC time in seconds. Unlike time(), it does
+// not jump if the clock is set.
+static time_t monotonic_now(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err_exit("clock_gettime (resolver cache)");
+
+    return ts.tv_sec;
+}
+
+// Returns the cache entry index for the lookup, or -1 if it isn't cached (or
+// is stale).
+static int cache_find(const char *host, const char *service, int type) {
+    time_t now = monotonic_now();
+
+    for (int i = 0; i < CACHE_SIZE; ++i)
+        if (cache[i].expires > now && cache[i].type == type &&
+            strcmp(cache[i].host, host) == 0 &&
+            strcmp(cache[i].service, service) == 0)
+            return i;
+
+    return -1;
+}
+
+// Caches the result of 'req', taking ownership of its addrinfo list. Replaces
+// the entry closest to expiring (which is also the oldest).
+static void cache_add(Request *req) {
+    int victim = 0;
+
+    for (int i = 1; i < CACHE_SIZE; ++i)
+        if (cache[i].expires < cache[victim].expires)
+            victim = i;
+
+    if (cache[victim].expires != 0) {
+        free(cache[victim].host);
+        free(cache[victim].service);
+        freeaddrinfo(cache[victim].ais);
+    }
+
+    cache[victim].host = estrdup(req->host, "resolver cache host");
+    cache[victim].service = estrdup(req->service, "resolver cache service");
+    cache[victim].type = req->type;
+    cache[victim].ais = req->ais;
+    cache[victim].expires = monotonic_now() + CACHE_TTL;
+}
+
+void resolve_async(const char *host, const char *service, int type,
+                   void (*callback)(struct addrinfo *ais, int err,
+                                    void *data),
+                   void *data) {
+    Request *req;
+    int i;
+    int res;
+
+    i = cache_find(host, service, type);
+    if (i != -1) {
+        callback(cache[i].ais, 0, data);
+
+        return;
+    }
+
+    req = emalloc(sizeof *req, "resolver request");
+    req->host = estrdup(host, "resolver request host");
+    req->service = estrdup(service, "resolver request service");
+    req->type = type;
+    req->callback = callback;
+    req->data = data;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (resolve)");
+    queue_push(&pending, req);
+    if ((res = pthread_cond_signal(&pending_cond)) != 0)
+        err_exit_n(res, "pthread_cond_signal (resolve)");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (resolve)");
+}
+
+// Calls the callbacks for completed lookups.
+static void handle_resolve_event(int fd, uint32_t events, void *ctx) {
+    Queue completed;
+    Request *req;
+    uint64_t n;
+    int res;
+
+    // Reset the eventfd counter. EAGAIN just means that an earlier call
+    // already picked up the completions.
+    if (read(resolve_fd, &n, sizeof n) == -1 && errno != EAGAIN)
+        err_exit("read (resolver eventfd)");
+
+    // Grab all completed lookups at once and run the callbacks without
+    // holding the lock.
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (resolve event)");
+    completed = done;
+    if (completed.head == NULL)
+        completed.tail = &completed.head;
+    queue_init(&done);
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (resolve event)");
+
+    while ((req = queue_pop(&completed)) != NULL) {
+        if (req->err == 0)
+            cache_add(req);
+        req->callback(req->ais, req->err, req->data);
+        free_request(req);
+    }
+}
@@ -0,0 +1,175 @@
+// Last-seen tracking on top of the key-value store. See seen.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "date.h"
+#include "kv_store.h"
+#include "msg_io.h"
+#include "seen.h"
+
+// Longer nicks are truncated in keys.
+#define MAX_NICK_LEN 64
+// Longer channel names are not recorded.
+#define MAX_CHANNEL_LEN 200
+// Longer messages are truncated.
+#define MAX_TEXT_LEN 200
+
+typedef enum Seen_event {
+    SEEN_JOIN,
+    SEEN_PART,
+    SEEN_QUIT,
+    SEEN_PRIVMSG
+} Seen_event;
+
+// Value stored for each nick.
+typedef struct Seen {
+    int64_t when;
+    uint8_t event;
+    uint8_t channel_len;
+    // The channel (empty for QUIT), followed by the text.
+    char data[];
+} Seen;
+
+// NULL if the store could not be opened.
+static KV_store *store;
+
+void init_seen(void) {
+    store = kv_open("seen");
+    if (store == NULL)
+        warning("Failed to open the seen store. !seen will be unavailable.");
+}
+
+void free_seen(void) {
+    if (store != NULL)
+        kv_close(store);
+}
+
+// Writes the folded (possibly truncated) 'nick' to 'key' and returns its
+// length.
+static size_t make_key(char key[MAX_NICK_LEN], const char *nick) {
+    size_t len;
+
+    for (len = 0; len < MAX_NICK_LEN && nick[len] != '\0'; ++len)
+        key[len] = casemap_fold(nick[len]);
+
+    return len;
+}
+
+// Returns the length of the first 'max_len' or fewer bytes of 'text',
+// without splitting UTF-8 sequences.
+static size_t truncated_len(const char *text, size_t max_len) {
+    size_t len = strlen(text);
+
+    if (len <= max_len)
+        return len;
+
+    for (len = max_len; len > 0 && ((uc)text[len] & 0xC0) == 0x80; --len);
+
+    return len;
+}
+
+static void record(const char *nick, Seen_event event, const char *channel,
+                   const char *text) {
+    char key[MAX_NICK_LEN];
+    size_t key_len;
+    size_t channel_len;
+    size_t text_len;
+    _Alignas(Seen) char buf[sizeof(Seen) + MAX_CHANNEL_LEN + MAX_TEXT_LEN];
+    Seen *seen = (Seen*)buf;
+
+    if (store == NULL)
+        return;
+
+    if (channel == NULL)
+        channel = "";
+    if (text == NULL)
+        text = "";
+    channel_len = strlen(channel);
+    text_len = truncated_len(text, MAX_TEXT_LEN);
+    if (channel_len > MAX_CHANNEL_LEN)
+        return;
+
+    key_len = make_key(key, nick);
+    seen->when = current_time();
+    seen->event = event;
+    seen->channel_len = channel_len;
+    memcpy(seen->data, channel, channel_len);
+    memcpy(seen->data + channel_len, text, text_len);
+
+    // kv_put() has already warned on errors, and there's not much else to
+    // do.
+    kv_put(store, key, key_len, seen,
+           offsetof(Seen, data) + channel_len + text_len);
+}
+
+void seen_join(const char *nick, const char *channel) {
+    record(nick, SEEN_JOIN, channel, NULL);
+}
+
+void seen_part(const char *nick, const char *channel, const char *text) {
+    record(nick, SEEN_PART, channel, text);
+}
+
+void seen_quit(const char *nick, const char *text) {
+    record(nick, SEEN_QUIT, NULL, text);
+}
+
+void seen_privmsg(const char *nick, const char *channel, const char *text) {
+    record(nick, SEEN_PRIVMSG, channel, text);
+}
+
+void handle_seen(const char *arg, const char *rep) {
+    char key[MAX_NICK_LEN];
+    const Seen *seen;
+    size_t len;
+    int text_len;
+
+    if (arg == NULL || strchr(arg, ' ') != NULL) {
+        say(rep, "Usage: !seen <nick>");
+
+        return;
+    }
+
+    if (store == NULL) {
+        say(rep, "Sorry, I can't remember anyone right now.");
+
+        return;
+    }
+
+    seen = kv_get(store, key, make_key(key, arg), &len);
+    if (seen == NULL) {
+        say(rep, "I haven't seen %s.", arg);
+
+        return;
+    }
+    text_len = len - offsetof(Seen, data) - seen->channel_len;
+
+    begin_say(rep);
+    append_msg("%s was last seen ", arg);
+    append_short_duration(current_time() - seen->when);
+    append_msg(" ago, ");
+    switch (seen->event) {
+    case SEEN_JOIN:
+        append_msg("joining %.*s", seen->channel_len, seen->data);
+        break;
+
+    case SEEN_PART:
+        append_msg("leaving %.*s", seen->channel_len, seen->data);
+        break;
+
+    case SEEN_QUIT:
+        append_msg("quitting");
+        break;
+
+    case SEEN_PRIVMSG:
+        append_msg("in %.*s", seen->channel_len, seen->data);
+        if (text_len != 0)
+            append_msg(", saying \"%.*s\"", text_len,
+                       seen->data + seen->channel_len);
+        break;
+    }
+    if (seen->event != SEEN_PRIVMSG && text_len != 0)
+        append_msg(" (%.*s)", text_len, seen->data + seen->channel_len);
+    append_msg(".");
+    send_msg();
+}
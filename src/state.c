@@ -1,9 +1,11 @@
 #include "common.h"
-#include "leet_monitor.h"
 #include "remind.h"
 #include "state.h"
+#include "stats.h"
+#include "triggers.h"
 
 void restore_state(void) {
-    init_leet_monitor();
+    init_triggers();
     restore_remind_state();
+    restore_stats();
 }
@@ -0,0 +1,523 @@
+// Channel activity statistics with sketches. See stats.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "date.h"
+#include "files.h"
+#include "intern.h"
+#include "id_set.h"
+#include "irc.h"
+#include "msg_io.h"
+#include "stats.h"
+#include "time_event.h"
+#include "upgrade.h"
+
+// Snapshot file, and the file it's written to before being renamed over it.
+// The format is STATS_MAGIC and the size of Channel_stats (as a uint32_t),
+// followed by a one-byte channel name length, the channel name, and the
+// Channel_stats for each channel.
+#define STATS_FILE "stats"
+#define STATS_TMP_FILE "stats.new"
+#define STATS_MAGIC "BNSTATS1"
+
+// Seconds between snapshots.
+#define SNAPSHOT_INTERVAL (5*60)
+
+// Count-min sketch dimensions. CMS_WIDTH is a power of two, at most 2^16.
+// Estimates are at most ~0.5% (e/CMS_WIDTH) of the total count too high,
+// with high probability.
+#define CMS_DEPTH 4
+#define CMS_WIDTH 512
+
+// Number of keys with the highest estimates that are tracked, and the number
+// of them shown.
+#define TOP_K 16
+#define TOP_SHOWN 5
+
+// Longer keys are truncated.
+#define MAX_KEY_LEN 31
+
+// Shorter words are not counted, which skips most filler words.
+#define MIN_WORD_LEN 4
+// Maximum number of words counted per message.
+#define MAX_WORDS 32
+
+// HyperLogLog with 2^HLL_BITS registers, for a standard error of ~3%.
+#define HLL_BITS 10
+#define HLL_REGS (1 << HLL_BITS)
+
+// Length of the hourly message count ring.
+#define N_HOURS (7*24)
+
+typedef struct Top_entry {
+    char key[MAX_KEY_LEN + 1];
+    // Count-min estimate as of the key's last occurrence.
+    uint32_t count;
+} Top_entry;
+
+// Count-min sketch with the keys that have the highest estimates.
+typedef struct Top_k {
+    uint32_t sketch[CMS_DEPTH][CMS_WIDTH];
+    Top_entry top[TOP_K];
+    uint32_t n_top;
+} Top_k;
+
+typedef struct Channel_stats {
+    // Local date (tm_year*1000 + tm_yday) that the daily statistics are for.
+    int32_t day;
+
+    // Daily statistics.
+    uint32_t n_msgs;
+    Top_k speakers;
+    Top_k words;
+    uint8_t hll[HLL_REGS];
+
+    // Messages per hour, indexed by hours since the epoch modulo N_HOURS.
+    uint32_t hours[N_HOURS];
+    // The last hour (since the epoch) that 'hours' was advanced to. Buckets
+    // for earlier hours than the N_HOURS last ones are reset when advancing.
+    int64_t last_hour;
+} Channel_stats;
+
+// Maps interned channel names (see intern.h) to their Channel_stats. Each
+// entry holds a reference to the interned name.
+static Id_map channels;
+
+static void snapshot_event(void *data);
+
+void init_stats(void) {
+    id_map_init(&channels);
+    add_time_event(current_time() + SNAPSHOT_INTERVAL, snapshot_event, NULL);
+}
+
+// Returns the statistics for 'channel', creating them if 'create' is true.
+// Returns NULL if they don't exist and 'create' is false.
+static Channel_stats *get_stats(const char *channel, bool create) {
+    Str_id id = intern_find(channel);
+    Channel_stats *s;
+
+    if (id != NO_STR_ID) {
+        s = id_map_get(&channels, id);
+        if (s != NULL)
+            return s;
+    }
+
+    if (!create)
+        return NULL;
+
+    s = emalloc(sizeof *s, "channel stats");
+    clear(*s);
+    id_map_set(&channels, intern(channel), s);
+
+    return s;
+}
+
+// Expands a casemap_hash() into 64 well-mixed bits (SplitMix64 finalizer).
+static uint64_t key_hash(const char *key, size_t len) {
+    uint64_t hash = casemap_hash(key, len);
+
+    hash = (hash ^ (hash >> 30))*0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27))*0x94D049BB133111EBULL;
+
+    return hash ^ (hash >> 31);
+}
+
+// Counts an occurrence of the 'len'-byte 'key'.
+static void top_k_add(Top_k *t, const char *key, size_t len) {
+    uint64_t hash = key_hash(key, len);
+    uint32_t est = UINT32_MAX;
+    char trunc[MAX_KEY_LEN + 1];
+    size_t min_i = 0;
+
+    for (size_t row = 0; row < CMS_DEPTH; ++row) {
+        uint32_t *c = &t->sketch[row][(hash >> 16*row) & (CMS_WIDTH - 1)];
+
+        if (*c != UINT32_MAX)
+            ++*c;
+        est = min(est, *c);
+    }
+
+    len = min(len, (size_t)MAX_KEY_LEN);
+    memcpy(trunc, key, len);
+    trunc[len] = '\0';
+
+    for (size_t i = 0; i < t->n_top; ++i) {
+        if (casemap_eq(t->top[i].key, trunc)) {
+            t->top[i].count = est;
+
+            return;
+        }
+        if (t->top[i].count < t->top[min_i].count)
+            min_i = i;
+    }
+
+    if (t->n_top < TOP_K)
+        min_i = t->n_top++;
+    else if (est <= t->top[min_i].count)
+        return;
+
+    memcpy(t->top[min_i].key, trunc, len + 1);
+    t->top[min_i].count = est;
+}
+
+static void hll_add(uint8_t *hll, uint64_t hash) {
+    uint64_t rest = hash << HLL_BITS;
+    uint8_t rank = rest == 0 ? 64 - HLL_BITS + 1 : __builtin_clzll(rest) + 1;
+    uint8_t *reg = &hll[hash >> (64 - HLL_BITS)];
+
+    *reg = max(*reg, rank);
+}
+
+static unsigned hll_estimate(const uint8_t *hll) {
+    double sum = 0;
+    unsigned n_zero = 0;
+    double est;
+
+    for (size_t i = 0; i < HLL_REGS; ++i) {
+        sum += ldexp(1, -hll[i]);
+        n_zero += hll[i] == 0;
+    }
+
+    est = 0.7213/(1 + 1.079/HLL_REGS)*HLL_REGS*HLL_REGS/sum;
+    // Use linear counting for small cardinalities, where it's more
+    // accurate.
+    if (est <= 2.5*HLL_REGS && n_zero != 0)
+        est = HLL_REGS*log((double)HLL_REGS/n_zero);
+
+    return lround(est);
+}
+
+// Starts new daily statistics at local midnight and resets hourly buckets
+// that have fallen out of the ring.
+static void advance(Channel_stats *s, time_t now) {
+    int64_t hour = now/(60*60);
+    struct tm tm;
+
+    if (local_time(now, &tm) && tm.tm_year*1000 + tm.tm_yday != s->day) {
+        s->day = tm.tm_year*1000 + tm.tm_yday;
+        s->n_msgs = 0;
+        clear(s->speakers);
+        clear(s->words);
+        memset(s->hll, 0, sizeof s->hll);
+    }
+
+    if (hour > s->last_hour) {
+        for (int64_t h = max(s->last_hour + 1, hour - N_HOURS + 1); h <= hour;
+             ++h)
+            s->hours[h%N_HOURS] = 0;
+        s->last_hour = hour;
+    }
+}
+
+// Returns true if the 'len' bytes at 's' look like they contain a URL.
+static bool is_url(const char *s, size_t len) {
+    for (size_t i = 0; i + 3 <= len; ++i)
+        if (memcmp(s + i, "://", 3) == 0)
+            return true;
+
+    return false;
+}
+
+// Counts the words in 'text'. Words are runs of ASCII letters and digits and
+// non-ASCII (UTF-8) bytes, with ASCII folded to lower case. Space-separated
+// chunks that look like URLs are skipped.
+static void count_words(Top_k *t, const char *text) {
+    unsigned n_words = 0;
+
+    for (const char *cur = text; *cur != '\0' && n_words < MAX_WORDS;) {
+        size_t chunk_len = strcspn(cur, " ");
+
+        if (!is_url(cur, chunk_len)) {
+            char word[MAX_KEY_LEN];
+            size_t len = 0;
+
+            for (size_t i = 0; i <= chunk_len; ++i) {
+                if (i != chunk_len &&
+                    (isalnum((uc)cur[i]) || (uc)cur[i] >= 0x80)) {
+                    if (len < sizeof word)
+                        word[len++] = tolower((uc)cur[i]);
+                    continue;
+                }
+
+                if (len >= MIN_WORD_LEN && n_words < MAX_WORDS) {
+                    top_k_add(t, word, len);
+                    ++n_words;
+                }
+                len = 0;
+            }
+        }
+
+        cur += chunk_len;
+        if (*cur == ' ')
+            ++cur;
+    }
+}
+
+void stats_privmsg(const char *nick, const char *channel, const char *text) {
+    time_t now = current_time();
+    Channel_stats *s = get_stats(channel, true);
+
+    advance(s, now);
+
+    ++s->n_msgs;
+    ++s->hours[s->last_hour%N_HOURS];
+    top_k_add(&s->speakers, nick, strlen(nick));
+    hll_add(s->hll, key_hash(nick, strlen(nick)));
+    if (text != NULL)
+        count_words(&s->words, text);
+}
+
+// Returns the channel a command is about: 'arg' if given, and otherwise the
+// channel the command was sent to. Replies with an error and returns NULL if
+// there is no channel.
+static const char *cmd_channel(const char *arg, const char *to,
+                               const char *rep, const char *cmd) {
+    const char *channel = arg != NULL ? arg : to;
+
+    if (!is_channel(channel) || strchr(channel, ' ') != NULL) {
+        say(rep, "Usage: !%s [<channel>]", cmd);
+
+        return NULL;
+    }
+
+    return channel;
+}
+
+// Returns the statistics for 'channel' if there were messages today, and
+// otherwise replies and returns NULL.
+static Channel_stats *todays_stats(const char *channel, const char *rep) {
+    Channel_stats *s = get_stats(channel, false);
+
+    if (s != NULL)
+        advance(s, current_time());
+
+    if (s == NULL || s->n_msgs == 0) {
+        say(rep, "No messages in %s today.", channel);
+
+        return NULL;
+    }
+
+    return s;
+}
+
+static int cmp_top_entries(const void *a, const void *b) {
+    const Top_entry *ea = a;
+    const Top_entry *eb = b;
+
+    return (ea->count < eb->count) - (ea->count > eb->count);
+}
+
+// Appends the keys with the highest counts in 't' to the current message
+// (see begin_say()).
+static void append_top(const Top_k *t) {
+    Top_entry top[TOP_K];
+
+    memcpy(top, t->top, t->n_top*sizeof *top);
+    qsort(top, t->n_top, sizeof *top, cmp_top_entries);
+
+    for (size_t i = 0; i < min(t->n_top, (uint32_t)TOP_SHOWN); ++i)
+        append_msg("%s%s (~%" PRIu32 ")", i == 0 ? "" : ", ", top[i].key,
+                   top[i].count);
+}
+
+void handle_top(const char *arg, const char *to, const char *rep) {
+    const char *channel = cmd_channel(arg, to, rep, "top");
+    Channel_stats *s;
+
+    if (channel == NULL || (s = todays_stats(channel, rep)) == NULL)
+        return;
+
+    begin_say(rep);
+    append_msg("Top talkers in %s today: ", channel);
+    append_top(&s->speakers);
+    if (s->words.n_top != 0) {
+        append_msg(". Top words: ");
+        append_top(&s->words);
+    }
+    append_msg(".");
+    send_msg();
+}
+
+void handle_active(const char *arg, const char *to, const char *rep) {
+    const char *channel = cmd_channel(arg, to, rep, "active");
+    uint32_t by_hour[24] = { 0 };
+    int busiest = 0;
+    unsigned n_speakers;
+    Channel_stats *s;
+
+    if (channel == NULL || (s = todays_stats(channel, rep)) == NULL)
+        return;
+
+    // Sum the last week by local hour of the day.
+    for (int64_t h = s->last_hour - N_HOURS + 1; h <= s->last_hour; ++h) {
+        struct tm tm;
+
+        if (s->hours[h%N_HOURS] != 0 && local_time(h*60*60, &tm))
+            by_hour[tm.tm_hour] += s->hours[h%N_HOURS];
+    }
+    for (int i = 1; i < 24; ++i)
+        if (by_hour[i] > by_hour[busiest])
+            busiest = i;
+
+    n_speakers = hll_estimate(s->hll);
+    say(rep, "%s today: %" PRIu32 " message%s from ~%u speaker%s. Busiest "
+             "hour over the past week: %02d:00-%02d:00 (%" PRIu32 " "
+             "message%s).",
+        channel, s->n_msgs, s->n_msgs == 1 ? "" : "s",
+        n_speakers, n_speakers == 1 ? "" : "s",
+        busiest, (busiest + 1)%24, by_hour[busiest],
+        by_hour[busiest] == 1 ? "" : "s");
+}
+
+// Writes 'len' bytes from 'data' to 'fd'. Returns false on errors.
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *cur = data;
+
+    while (len != 0) {
+        ssize_t n = write(fd, cur, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            warning_err("write() error on '%s'", STATS_TMP_FILE);
+
+            return false;
+        }
+        cur += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Writes all statistics to STATS_TMP_FILE and renames it to STATS_FILE, so
+// that a crash while writing leaves the previous snapshot intact.
+static void write_snapshot(void) {
+    uint32_t size = sizeof(Channel_stats);
+    bool ok;
+    int fd;
+
+    fd = open_file(STATS_TMP_FILE, CREATE);
+    if (fd == -1)
+        return;
+
+    ok = write_all(fd, STATS_MAGIC, strlen(STATS_MAGIC)) &&
+         write_all(fd, &size, sizeof size);
+    for (size_t i = 0; ok && i < channels.keys.size; ++i) {
+        const char *name;
+        uint8_t name_len;
+
+        if (channels.keys.ids[i] == NO_STR_ID)
+            continue;
+
+        name = intern_str(channels.keys.ids[i]);
+        if (strlen(name) > UINT8_MAX)
+            continue;
+        name_len = strlen(name);
+
+        ok = write_all(fd, &name_len, sizeof name_len) &&
+             write_all(fd, name, name_len) &&
+             write_all(fd, channels.vals[i], sizeof(Channel_stats));
+    }
+
+    if (close(fd) == -1) {
+        warning_err("close() error on '%s'", STATS_TMP_FILE);
+        ok = false;
+    }
+
+    if (ok)
+        rename_file(STATS_TMP_FILE, STATS_FILE);
+}
+
+static void snapshot_event(void *data) {
+    write_snapshot();
+    add_time_event(current_time() + SNAPSHOT_INTERVAL, snapshot_event, NULL);
+}
+
+void restore_stats(void) {
+    char *file_buf;
+    size_t file_len;
+    const char *cur;
+    const char *end;
+    uint32_t size;
+
+    file_buf = get_file_contents(STATS_FILE, &file_len);
+    if (file_buf == NULL)
+        return;
+    cur = file_buf;
+    end = file_buf + file_len;
+
+    if (file_len < strlen(STATS_MAGIC) + sizeof size ||
+        memcmp(cur, STATS_MAGIC, strlen(STATS_MAGIC)) != 0) {
+        warning("'%s' is not a statistics snapshot. Ignoring it.",
+                STATS_FILE);
+        goto done;
+    }
+    cur += strlen(STATS_MAGIC);
+
+    memcpy(&size, cur, sizeof size);
+    cur += sizeof size;
+    if (size != sizeof(Channel_stats)) {
+        warning("'%s' is from an incompatible version. Ignoring it.",
+                STATS_FILE);
+        goto done;
+    }
+
+    while (cur != end) {
+        char name[UINT8_MAX + 1];
+        uint8_t name_len = *cur++;
+
+        if (end - cur < name_len + sizeof(Channel_stats)) {
+            warning("'%s' is truncated. Ignoring the rest of it.", STATS_FILE);
+            break;
+        }
+
+        memcpy(name, cur, name_len);
+        name[name_len] = '\0';
+        cur += name_len;
+
+        memcpy(get_stats(name, true), cur, sizeof(Channel_stats));
+        cur += sizeof(Channel_stats);
+    }
+
+done:
+    free(file_buf);
+}
+
+void free_stats(void) {
+    write_snapshot();
+
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            intern_unref(channels.keys.ids[i]);
+            free(channels.vals[i]);
+        }
+    id_map_free(&channels);
+}
+
+void upgrade_save_stats(void) {
+    upgrade_put_u64(channels.keys.count);
+    for (size_t i = 0; i < channels.keys.size; ++i)
+        if (channels.keys.ids[i] != NO_STR_ID) {
+            upgrade_put_str(intern_str(channels.keys.ids[i]));
+            upgrade_put_bytes(channels.vals[i], sizeof(Channel_stats));
+        }
+}
+
+void upgrade_restore_stats(void) {
+    size_t n = upgrade_get_u64();
+
+    for (size_t i = 0; i < n; ++i) {
+        const char *name = upgrade_get_str();
+        const void *data;
+        size_t len;
+
+        data = upgrade_get_bytes(&len);
+        if (len != sizeof(Channel_stats))
+            fail_exit("Malformed channel statistics in state from live "
+                      "upgrade");
+
+        memcpy(get_stats(name, true), data, len);
+    }
+}
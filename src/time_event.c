@@ -1,13 +1,17 @@
-// Timed event infrastructure implemented using timerfd.
+// Timed event infrastructure implemented using timerfd, or a virtual clock in
+// simulation mode.
 
 #include "common.h"
+#include "date.h"
+#include "options.h"
+#include "reactor.h"
 #include "time_event.h"
 
-// timerfd handle.
+// timerfd handle. -1 in simulation mode.
 //
 // Set to fire at the next chronological event (corresponding to the first
-// Time_event in the linked list).
-int timer_fd;
+// Time_event in the linked list), and disarmed when there are no events.
+static int timer_fd = -1;
 
 typedef struct Time_event {
     // Pointer to next chronological event or NULL in case of no more events.
@@ -25,17 +29,33 @@ typedef struct Time_event {
 // unlikely that we'll have a massive number of events.
 static Time_event *start = NULL;
 
+static void handle_timer(int fd, uint32_t events, void *ctx);
+
 void init_time_event(void) {
-    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if (sim_start != 0) {
+        set_virtual_time(sim_start);
+
+        return;
+    }
+
+    // Non-blocking, as the timer might have been rearmed (which resets the
+    // expiration count) between epoll reporting it and handle_timer()
+    // reading it.
+    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
     if (timer_fd == -1)
         err_exit("timerfd_create");
+
+    reactor_add(timer_fd, REACTOR_READ, handle_timer, NULL);
 }
 
 void free_time_event(void) {
     Time_event *next;
 
-    if (close(timer_fd) == -1)
-        err_exit("close timer_fd (for time events)");
+    if (timer_fd != -1) {
+        reactor_remove(timer_fd);
+        if (close(timer_fd) == -1)
+            err_exit("close timer_fd (for time events)");
+    }
 
     for (Time_event *event = start; event != NULL; event = next) {
         next = event->next;
@@ -48,6 +68,10 @@ void free_time_event(void) {
 static void arm_timer(Time_event *event) {
     struct itimerspec time_spec;
 
+    // run_time_events() takes care of it.
+    if (timer_fd == -1)
+        return;
+
     time_spec.it_interval.tv_sec = 0;
     time_spec.it_interval.tv_nsec = 0;
     time_spec.it_value.tv_sec = event->when;
@@ -57,7 +81,26 @@ static void arm_timer(Time_event *event) {
         err_exit("timerfd_settime (for time events)");
 }
 
-void handle_time_event(void) {
+// Arms the timer for the next event, or disarms it if there are no events.
+static void rearm_timer(void) {
+    struct itimerspec time_spec = { { 0, 0 }, { 0, 0 } };
+
+    if (start != NULL) {
+        arm_timer(start);
+
+        return;
+    }
+
+    if (timer_fd == -1)
+        return;
+
+    // A zero it_value disarms the timer.
+    if (timerfd_settime(timer_fd, 0, &time_spec, NULL) == -1)
+        err_exit("timerfd_settime (disarming time event timer)");
+}
+
+// Handles and removes the next chronological event.
+static void run_next_event(void) {
     Time_event *old_start;
 
     // Handle the event.
@@ -67,8 +110,41 @@ void handle_time_event(void) {
     old_start = start;
     start = start->next;
     free(old_start);
-    if (start != NULL)
+    rearm_timer();
+}
+
+static void handle_timer(int fd, uint32_t events, void *ctx) {
+    uint64_t n_expirations;
+
+    if (!(events & EPOLLIN) || events & EPOLLERR)
+        fail_exit("Got epoll error/weirdness related to timerfd. Not sure "
+                  "what's going on. Bailing out.");
+
+    // Clear the expiration. EAGAIN means the timer was rearmed after it
+    // expired, e.g. by an earlier handler in the same reactor batch.
+    if (read(timer_fd, &n_expirations, sizeof n_expirations) == -1 &&
+        errno != EAGAIN)
+        err_exit("read (timerfd for time events)");
+
+    // The expiration might be stale, for an event that has since been
+    // removed or replaced by a later one.
+    if (start == NULL)
+        return;
+    if (start->when > current_time()) {
         arm_timer(start);
+
+        return;
+    }
+
+    run_next_event();
+}
+
+void run_time_events(time_t until) {
+    while (start != NULL && start->when <= until) {
+        set_virtual_time(start->when);
+        run_next_event();
+    }
+    set_virtual_time(until);
 }
 
 void add_time_event(time_t when, void (*handler)(void *data), void *data) {
@@ -95,9 +171,9 @@ bool add_time_event_tm(struct tm *when, void (*handler)(void *data),
                        void *data) {
     time_t t;
 
-    t = mktime(when);
+    t = make_local_time(when);
     if (t == -1) {
-        warning("mktime() failed (time event)");
+        warning("make_local_time() failed (time event)");
 
         return false;
     }
@@ -105,3 +181,30 @@ bool add_time_event_tm(struct tm *when, void (*handler)(void *data),
 
     return true;
 }
+
+void remove_time_events(void (*handler)(void *data)) {
+    Time_event *old_start = start;
+
+    for (Time_event **cur = &start; *cur != NULL;)
+        if ((*cur)->handler == handler) {
+            Time_event *event = *cur;
+
+            *cur = event->next;
+            free(event);
+        }
+        else
+            cur = &(*cur)->next;
+
+    // Rearm the timer if the next event was removed, or disarm it if no
+    // events are left, so that it doesn't fire early.
+    if (start != old_start)
+        rearm_timer();
+}
+
+void for_each_time_event(void (*handler)(void *data),
+                         void (*fn)(time_t when, void *data, void *ctx),
+                         void *ctx) {
+    for (Time_event *event = start; event != NULL; event = event->next)
+        if (event->handler == handler)
+            fn(event->when, event->data, ctx);
+}
@@ -0,0 +1,508 @@
+// Server connection transport. See transport.h.
+
+#include "common.h"
+#include "irc.h"
+#include "latency.h"
+#include "reactor.h"
+#include "transport.h"
+#include "upgrade.h"
+#include <linux/tcp.h>
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#ifndef SOL_TLS
+#  define SOL_TLS 282
+#endif
+
+// TLS record content types (RFC 8446, section 5.1).
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+static SSL_CTX *ssl_ctx;
+// NULL when not using TLS.
+static SSL *ssl;
+
+// The handshake in progress. 'handshake_fd' is -1 if there is none.
+static int handshake_fd = -1;
+static const char *handshake_host;
+static void (*handshake_done)(bool ok);
+
+// True if the kernel handles the record layer in the respective direction.
+static bool ktls_recv;
+static bool ktls_send;
+
+// Set when sending fails. Later sends are dropped.
+static bool send_failed;
+
+// Queued data is sent right away once there is this much of it.
+#define MAX_QUEUED 16384
+
+// Data queued by serv_send() for the next serv_flush(), and the number of
+// messages in it.
+static char *out_buf;
+static size_t out_len;
+static size_t out_size;
+static uint64_t out_msgs;
+
+// Number of messages sent on the current connection.
+static uint64_t conn_msgs;
+
+Send_stats send_stats;
+
+// Prints the OpenSSL error queue after a message and exits.
+noreturn static void ssl_fail_exit(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+}
+
+// Frees the TLS state.
+static void tls_free(void) {
+    SSL_free(ssl);
+    SSL_CTX_free(ssl_ctx);
+    ssl = NULL;
+    ssl_ctx = NULL;
+}
+
+// Ends the handshake in progress.
+static void end_handshake(void) {
+    reactor_remove(handshake_fd);
+    handshake_fd = -1;
+}
+
+// Continues the handshake in progress. Called when the socket is ready for
+// what OpenSSL last asked for.
+static void handle_handshake(int fd, uint32_t events, void *ctx) {
+    void (*done)(bool ok) = handshake_done;
+    int res = SSL_connect(ssl);
+    long verify_res;
+
+    if (res == 1) {
+        end_handshake();
+
+        ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+        ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+        printf("TLS connection established (%s, %s). Receiving %s, sending "
+               "%s.\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+               ktls_recv ? "via kTLS" : "in userspace",
+               ktls_send ? "via kTLS" : "in userspace");
+        done(true);
+
+        return;
+    }
+
+    switch (SSL_get_error(ssl, res)) {
+    case SSL_ERROR_WANT_READ:
+        reactor_modify(fd, REACTOR_READ);
+        return;
+
+    case SSL_ERROR_WANT_WRITE:
+        reactor_modify(fd, REACTOR_WRITE);
+        return;
+    }
+
+    verify_res = SSL_get_verify_result(ssl);
+    if (verify_res != X509_V_OK)
+        warning("TLS handshake with '%s' failed: certificate verification "
+                "failed: %s", handshake_host,
+                X509_verify_cert_error_string(verify_res));
+    else {
+        warning("TLS handshake with '%s' failed", handshake_host);
+        ERR_print_errors_fp(stderr);
+    }
+    ERR_clear_error();
+    end_handshake();
+    tls_free();
+    done(false);
+}
+
+void tls_connect(int fd, const char *host, bool verify,
+                 void (*done)(bool ok)) {
+    assert(handshake_fd == -1);
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == NULL)
+        ssl_fail_exit("SSL_CTX_new() failed");
+
+    if (!SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION))
+        ssl_fail_exit("SSL_CTX_set_min_proto_version() failed");
+
+    // Ask OpenSSL to set up kTLS after the handshake, when the kernel and the
+    // negotiated cipher support it.
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+
+    // Without this, SSL_read() would go on reading for application data after
+    // processing e.g. a TLS 1.3 NewSessionTicket, instead of returning to the
+    // event loop.
+    SSL_CTX_clear_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+
+    // The socket is non-blocking, and serv_flush() keeps what the socket
+    // didn't take at the start of the output buffer, which might get
+    // reallocated before the write is retried.
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (verify) {
+        if (!SSL_CTX_set_default_verify_paths(ssl_ctx))
+            ssl_fail_exit("SSL_CTX_set_default_verify_paths() failed");
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL)
+        ssl_fail_exit("SSL_new() failed");
+
+    if (!SSL_set_tlsext_host_name(ssl, host))
+        ssl_fail_exit("SSL_set_tlsext_host_name() failed");
+    if (verify && !SSL_set1_host(ssl, host))
+        ssl_fail_exit("SSL_set1_host() failed");
+
+    if (!SSL_set_fd(ssl, fd))
+        ssl_fail_exit("SSL_set_fd() failed");
+
+    handshake_fd = fd;
+    handshake_host = host;
+    handshake_done = done;
+    // The socket is writable for the ClientHello.
+    reactor_add(fd, REACTOR_WRITE, handle_handshake, NULL);
+}
+
+void tls_cancel(void) {
+    if (handshake_fd == -1)
+        return;
+
+    end_handshake();
+    tls_free();
+}
+
+void tls_close(void) {
+    if (ssl != NULL) {
+        // Send close_notify without waiting for the server's, unless the
+        // connection is known to be broken.
+        if (!send_failed)
+            SSL_shutdown(ssl);
+        tls_free();
+    }
+
+    ktls_recv = ktls_send = false;
+    send_failed = false;
+
+    // Queued data was for the old connection.
+    out_len = 0;
+    out_msgs = 0;
+    conn_msgs = 0;
+    latency_output_dropped();
+}
+
+// Sets 'rx_time' (if not NULL) to the SO_TIMESTAMPNS receive timestamp in
+// 'msg', or zeroes it if there is none.
+static void get_rx_time(struct msghdr *msg, struct timespec *rx_time) {
+    if (rx_time == NULL)
+        return;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+
+            memcpy(rx_time, CMSG_DATA(cmsg), sizeof *rx_time);
+
+            return;
+        }
+
+    clear(*rx_time);
+}
+
+// recv() with the kernel receive timestamp.
+static ssize_t recv_timestamped(void *buf, size_t n, struct timespec *rx_time) {
+    char cmsg_buf[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cmsg_buf,
+      .msg_controllen = sizeof cmsg_buf };
+    ssize_t n_recv;
+
+    n_recv = recvmsg(serv_fd, &msg, 0);
+    if (n_recv > 0)
+        get_rx_time(&msg, rx_time);
+
+    return n_recv;
+}
+
+// recv() on a kTLS socket. Non-data records (e.g. TLS 1.3 session tickets)
+// make a plain recv() fail with EIO, so use recvmsg() and look at the record
+// type.
+static ssize_t ktls_recv_record(void *buf, size_t n, struct timespec *rx_time) {
+    char cmsg_buf[CMSG_SPACE(sizeof(unsigned char)) +
+                  CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cmsg_buf,
+      .msg_controllen = sizeof cmsg_buf };
+    ssize_t n_recv;
+
+    n_recv = recvmsg(serv_fd, &msg, 0);
+    if (n_recv <= 0)
+        return n_recv;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+
+        unsigned char type;
+
+        if (cmsg->cmsg_level != SOL_TLS ||
+            cmsg->cmsg_type != TLS_GET_RECORD_TYPE)
+            continue;
+
+        type = *CMSG_DATA(cmsg);
+
+        if (type == TLS_RECORD_ALERT) {
+            // Most likely close_notify. Treat it like an orderly shutdown.
+            puts("Received TLS alert from the server");
+
+            return 0;
+        }
+
+        if (type != TLS_RECORD_APPLICATION_DATA) {
+            // Handshake messages after the handshake (session tickets, key
+            // updates). Nothing for us. The data is not consumed by the
+            // caller.
+            errno = EAGAIN;
+
+            return -1;
+        }
+    }
+
+    get_rx_time(&msg, rx_time);
+
+    return n_recv;
+}
+
+ssize_t serv_recv(void *buf, size_t n, struct timespec *rx_time) {
+    int n_read;
+
+    // Checked first since a kTLS connection inherited in a live upgrade has no
+    // SSL object.
+    if (ktls_recv)
+        return ktls_recv_record(buf, n, rx_time);
+
+    if (ssl == NULL)
+        return rx_time == NULL ? recv(serv_fd, buf, n, 0) :
+                                 recv_timestamped(buf, n, rx_time);
+
+    // OpenSSL reads the socket itself, so there is no receive timestamp.
+    if (rx_time != NULL)
+        clear(*rx_time);
+
+    // Lets us tell an unexpected EOF apart from an error below.
+    errno = 0;
+    n_read = SSL_read(ssl, buf, n);
+    if (n_read > 0)
+        return n_read;
+
+    switch (SSL_get_error(ssl, n_read)) {
+    case SSL_ERROR_ZERO_RETURN:
+        // close_notify from the server.
+        return 0;
+
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+    case SSL_ERROR_SYSCALL:
+        // errno is set, unless the server closed the connection without a
+        // close_notify.
+        if (errno == 0)
+            return 0;
+        return -1;
+
+    default:
+        ERR_print_errors_fp(stderr);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+bool serv_recv_pending(void) {
+    return ssl != NULL && !ktls_recv && SSL_pending(ssl) > 0;
+}
+
+// Sends as much as possible of the 'n' bytes at 'buf' on 'serv_fd', handling
+// partial writes and signal interruption. Returns the number of bytes sent,
+// which is less than 'n' if the socket buffer filled up, or -1 on errors.
+static ssize_t send_all(const void *buf, size_t n) {
+    ssize_t n_sent;
+    size_t n_sent_tot;
+
+    for (n_sent_tot = 0; n_sent_tot < n; n_sent_tot += n_sent) {
+        ++send_stats.n_syscalls;
+        // MSG_NOSIGNAL means we get EPIPE instead of SIGPIPE.
+        n_sent = send(serv_fd, (const char*)buf + n_sent_tot, n - n_sent_tot,
+                      MSG_NOSIGNAL);
+        if (n_sent == -1) {
+            if (errno == EAGAIN)
+                break;
+            if (errno != EINTR)
+                return -1;
+            n_sent = 0;
+        }
+    }
+
+    return n_sent_tot;
+}
+
+void serv_send(const void *buf, size_t n) {
+    if (serv_fd == -1 || send_failed)
+        return;
+
+    if (out_len + n > out_size) {
+        out_size = max(2*out_size, out_len + n);
+        out_buf = erealloc(out_buf, out_size, "output buffer");
+    }
+    memcpy(out_buf + out_len, buf, n);
+    out_len += n;
+    ++out_msgs;
+    latency_queued();
+
+    if (out_len >= MAX_QUEUED)
+        serv_flush();
+}
+
+// Sends as much as possible of the 'n' bytes at 'buf' to the server. Returns
+// the number of bytes sent, or -1 on errors, after printing a warning.
+static ssize_t send_to_serv(const void *buf, size_t n) {
+    size_t n_sent_tot = 0;
+    size_t written;
+    ssize_t res;
+
+    if (ssl == NULL || ktls_send) {
+        // The kernel encrypts for us with kTLS.
+        res = send_all(buf, n);
+        if (res == -1)
+            warning_err("Failed to send to the server");
+
+        return res;
+    }
+
+    // With SSL_MODE_ENABLE_PARTIAL_WRITE, SSL_write_ex() returns after each
+    // record.
+    while (n_sent_tot < n) {
+        int ret;
+
+        ++send_stats.n_syscalls;
+        ret = SSL_write_ex(ssl, (const char*)buf + n_sent_tot, n - n_sent_tot,
+                           &written);
+        if (ret == 1) {
+            n_sent_tot += written;
+
+            continue;
+        }
+
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            // The unsent data must be passed again on the retry, which it is
+            // since it stays at the start of the output buffer.
+            return n_sent_tot;
+        }
+
+        warning("Failed to send to the server (SSL_write_ex() failed)");
+        ERR_print_errors_fp(stderr);
+
+        return -1;
+    }
+
+    return n_sent_tot;
+}
+
+void serv_flush(void) {
+    ssize_t n_sent;
+
+    if (out_len == 0)
+        return;
+
+    n_sent = send_to_serv(out_buf, out_len);
+    if (n_sent == -1) {
+        send_failed = true;
+        out_len = 0;
+        out_msgs = 0;
+
+        return;
+    }
+
+    if (n_sent < out_len) {
+        // The socket buffer is full. Keep the rest for when the server has
+        // read more (see serv_output_pending()).
+        memmove(out_buf, out_buf + n_sent, out_len - n_sent);
+        out_len -= n_sent;
+
+        return;
+    }
+
+    ++send_stats.n_flushes;
+    send_stats.n_msgs += out_msgs;
+    send_stats.max_msgs = max(send_stats.max_msgs, out_msgs);
+    conn_msgs += out_msgs;
+    latency_sent();
+
+    out_len = 0;
+    out_msgs = 0;
+}
+
+bool serv_output_pending(void) {
+    return out_len != 0;
+}
+
+void free_serv_send_buf(void) {
+    free(out_buf);
+    out_buf = NULL;
+    out_size = 0;
+}
+
+bool serv_segs_out(uint64_t *n_msgs, uint64_t *n_segs) {
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+
+    if (serv_fd == -1 ||
+        getsockopt(serv_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 ||
+        len < offsetof(struct tcp_info, tcpi_data_segs_out) +
+                sizeof info.tcpi_data_segs_out)
+        return false;
+
+    *n_msgs = conn_msgs;
+    *n_segs = info.tcpi_data_segs_out;
+
+    return true;
+}
+
+bool serv_send_failed(void) {
+    return send_failed;
+}
+
+void enable_rx_timestamps(void) {
+    int on = 1;
+
+    if (setsockopt(serv_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on) == -1)
+        warning_err("Failed to enable receive timestamps on the server "
+                    "socket");
+}
+
+bool can_upgrade_transport(void) {
+    return ssl == NULL || (ktls_recv && ktls_send);
+}
+
+void upgrade_save_transport(void) {
+    assert(can_upgrade_transport());
+    upgrade_put_u64(ktls_recv);
+}
+
+void upgrade_restore_transport(void) {
+    ktls_recv = ktls_send = upgrade_get_u64();
+}
@@ -0,0 +1,621 @@
+// Triggers using an Aho-Corasick automaton. See triggers.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "date.h"
+#include "files.h"
+#include "msg_io.h"
+#include "time_event.h"
+#include "triggers.h"
+#include "upgrade.h"
+
+#define TRIGGERS_FILE "triggers"
+
+// Used if TRIGGERS_FILE does not exist.
+#define DEFAULT_TRIGGERS                                  \
+  "#code.se 13:37-13:38 1337 | %n is the 1337est!!! | " \
+  "No one was 1337 today. :(\n"
+
+// Minimum time in seconds between responses from a rule without a window.
+#define ALWAYS_COOLDOWN 10
+
+#define MINS_PER_DAY (24*60)
+
+// Marks missing states and rules.
+#define NONE UINT16_MAX
+// Maximum number of automaton states, which is one more than the total length
+// of the phrases.
+#define MAX_STATES NONE
+
+typedef struct Rule {
+    char *channel;
+    // Folded phrase (see fold_byte()).
+    char *phrase;
+    char *response;
+    // NULL if the rule has no miss response.
+    char *miss_response;
+
+    // False for rules that are always active.
+    bool has_window;
+    // Start of the window in minutes after midnight, and its length in
+    // minutes.
+    int start;
+    int len;
+    // End of the current or next window.
+    time_t window_end;
+
+    // True while in the window. Always true for rules without a window.
+    bool active;
+    // True if the rule has responded in the current window.
+    bool fired;
+    // Time of the last response from a rule without a window.
+    time_t last_response;
+    // Number of the last message the rule matched (see 'n_scans'), so that
+    // it responds at most once per message.
+    unsigned long last_scan;
+
+    // Next rule with the same phrase in the automaton, or NONE.
+    uint16_t next_same;
+} Rule;
+
+// Not resized after loading, since time events point to the rules.
+// reload_triggers() removes the time events before replacing the rules.
+static Rule *rules;
+static size_t n_rules;
+
+// Aho-Corasick automaton for the phrases of the active rules, with the
+// failure transitions precomputed into a DFA.
+//
+// Bytes are mapped to classes first, with all bytes that don't appear in any
+// phrase in class 0. That keeps the transition table small.
+static uc byte_class[UCHAR_MAX + 1];
+static size_t n_classes;
+// Transitions, indexed by <state>*n_classes + <class>. State 0 is the start
+// state.
+static uint16_t *delta;
+// First rule whose phrase ends in the state, or NONE.
+static uint16_t *state_rule;
+// Closest state along the failure links that has rules, or NONE. Used to
+// find phrases that end in the middle of the current match.
+static uint16_t *dict_link;
+static size_t n_states;
+
+// Number of scanned messages.
+static unsigned long n_scans;
+
+// Returns the folded version of byte 'c' in UTF-8 text, where 'prev' is the
+// preceding byte. Folds ASCII letters and the Latin-1 letters U+00C0-U+00DE
+// (except U+00D7, the multiplication sign), whose lower-case versions are
+// U+00E0-U+00FE. Both are encoded as 0xC3 followed by a byte that differs by
+// 0x20.
+static uc fold_byte(uc prev, uc c) {
+    if (c >= 'A' && c <= 'Z')
+        return c | 0x20;
+    if (prev == 0xC3 && c >= 0x80 && c <= 0x9E && c != 0x97)
+        return c + 0x20;
+
+    return c;
+}
+
+// Folds 's' in place.
+static void fold(char *s) {
+    uc prev = 0;
+
+    for (uc *cur = (uc*)s; *cur != '\0'; ++cur) {
+        uc c = *cur;
+
+        *cur = fold_byte(prev, c);
+        prev = c;
+    }
+}
+
+// Adds a new state with no transitions to the automaton being built.
+static uint16_t new_state(void) {
+    for (size_t c = 0; c < n_classes; ++c)
+        delta[n_states*n_classes + c] = NONE;
+    state_rule[n_states] = NONE;
+    dict_link[n_states] = NONE;
+
+    return n_states++;
+}
+
+// (Re)builds the automaton from the phrases of the active rules.
+static void build_automaton(void) {
+    size_t max_states = 1;
+    uint16_t *fail;
+    uint16_t *queue;
+    size_t head = 0;
+    size_t tail = 0;
+
+    free(delta);
+    free(state_rule);
+    free(dict_link);
+
+    memset(byte_class, 0, sizeof byte_class);
+    n_classes = 1;
+    for (size_t i = 0; i < n_rules; ++i)
+        if (rules[i].active) {
+            for (const uc *cur = (uc*)rules[i].phrase; *cur != '\0'; ++cur)
+                if (byte_class[*cur] == 0)
+                    byte_class[*cur] = n_classes++;
+            max_states += strlen(rules[i].phrase);
+        }
+    // Guaranteed by load_rules().
+    assert(max_states <= MAX_STATES);
+
+    delta = emalloc(max_states*n_classes*sizeof *delta, "trigger automaton");
+    state_rule = emalloc(max_states*sizeof *state_rule, "trigger automaton");
+    dict_link = emalloc(max_states*sizeof *dict_link, "trigger automaton");
+    n_states = 0;
+    new_state();
+
+    // Build a trie of the phrases.
+    for (size_t i = 0; i < n_rules; ++i) {
+        uint16_t s = 0;
+
+        if (!rules[i].active)
+            continue;
+
+        for (const uc *cur = (uc*)rules[i].phrase; *cur != '\0'; ++cur) {
+            uint16_t *next = &delta[s*n_classes + byte_class[*cur]];
+
+            if (*next == NONE)
+                *next = new_state();
+            s = *next;
+        }
+        rules[i].next_same = state_rule[s];
+        state_rule[s] = i;
+    }
+
+    // Compute the failure links in breadth-first order, which guarantees that
+    // the transitions of the failure state are complete, and fill in the
+    // missing transitions from them.
+
+    fail = emalloc(n_states*sizeof *fail, "trigger automaton build");
+    queue = emalloc(n_states*sizeof *queue, "trigger automaton build");
+
+    for (size_t c = 0; c < n_classes; ++c) {
+        uint16_t t = delta[c];
+
+        if (t == NONE)
+            delta[c] = 0;
+        else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        uint16_t s = queue[head++];
+
+        for (size_t c = 0; c < n_classes; ++c) {
+            uint16_t t = delta[s*n_classes + c];
+            uint16_t f = delta[fail[s]*n_classes + c];
+
+            if (t == NONE)
+                delta[s*n_classes + c] = f;
+            else {
+                fail[t] = f;
+                dict_link[t] = state_rule[f] != NONE ? f : dict_link[f];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+}
+
+// Sends 'text' to 'to' with "%n" replaced by 'nick'.
+static void respond(const char *to, const char *text, const char *nick) {
+    begin_say(to);
+    for (const char *cur = text;;) {
+        const char *var = strstr(cur, "%n");
+
+        if (var == NULL) {
+            append_msg("%s", cur);
+
+            break;
+        }
+        append_msg("%.*s%s", (int)(var - cur), cur, nick);
+        cur = var + 2;
+    }
+    send_msg();
+}
+
+// Called when the phrase of 'rule' is found in a message.
+static void rule_matched(Rule *rule, const char *nick, const char *to) {
+    if (rule->last_scan == n_scans || !casemap_eq(to, rule->channel))
+        return;
+    rule->last_scan = n_scans;
+
+    if (rule->has_window) {
+        if (rule->fired)
+            return;
+        rule->fired = true;
+    }
+    else {
+        time_t now = current_time();
+
+        if (now - rule->last_response < ALWAYS_COOLDOWN)
+            return;
+        rule->last_response = now;
+    }
+
+    respond(to, rule->response, nick);
+}
+
+void triggers_privmsg(const char *nick, const char *to, const char *text) {
+    uint16_t s = 0;
+    uc prev = 0;
+
+    if (n_states == 1)
+        // No active rules.
+        return;
+
+    ++n_scans;
+
+    for (const uc *cur = (const uc*)text; *cur != '\0'; prev = *cur++) {
+        s = delta[s*n_classes + byte_class[fold_byte(prev, *cur)]];
+
+        for (uint16_t m = state_rule[s] != NONE ? s : dict_link[s];
+             m != NONE; m = dict_link[m])
+            for (uint16_t r = state_rule[m]; r != NONE; r = rules[r].next_same)
+                rule_matched(&rules[r], nick, to);
+    }
+}
+
+static void schedule_window(Rule *rule, time_t now);
+
+// Called at the end of the window of a rule.
+static void close_window(void *data) {
+    Rule *rule = data;
+
+    if (!rule->fired && rule->miss_response != NULL)
+        respond(rule->channel, rule->miss_response, "");
+
+    rule->active = false;
+    build_automaton();
+    // Use the end of the window rather than the current time, which might
+    // still read as being inside the window. time() uses a coarser clock than
+    // the timerfd.
+    schedule_window(rule, rule->window_end);
+}
+
+// Called at the start of the window of a rule.
+static void open_window(void *data) {
+    Rule *rule = data;
+
+    rule->active = true;
+    rule->fired = false;
+    build_automaton();
+    add_time_event(rule->window_end, close_window, rule);
+}
+
+// Schedules the next opening of the window of 'rule' after 'now', or opens it
+// right away if 'now' is inside it.
+static void schedule_window(Rule *rule, time_t now) {
+    struct tm tm;
+    int since_start;
+    time_t start;
+
+    if (!local_time(now, &tm)) {
+        warning("local_time() failed (trigger schedule)");
+
+        return;
+    }
+
+    // Minutes since the start of the window today (or yesterday, for windows
+    // that cross midnight).
+    since_start = (tm.tm_hour*60 + tm.tm_min - rule->start + MINS_PER_DAY) %
+                  MINS_PER_DAY;
+
+    if (since_start < rule->len)
+        // Inside the window.
+        tm.tm_min -= since_start;
+    else
+        tm.tm_min += MINS_PER_DAY - since_start;
+    tm.tm_sec = 0;
+    // Automatically deduce whether daylight saving time is in effect.
+    tm.tm_isdst = -1;
+
+    start = make_local_time(&tm);
+    if (start == -1) {
+        warning("make_local_time() failed for the trigger window in %s",
+                rule->channel);
+
+        return;
+    }
+    rule->window_end = start + 60*rule->len;
+
+    if (since_start < rule->len)
+        open_window(rule);
+    else
+        add_time_event(start, open_window, rule);
+}
+
+// Returns the next space-separated token at '*cur' and null-terminates it,
+// updating '*cur' to point after it. Returns NULL if there are no more tokens.
+static char *next_token(char **cur) {
+    char *token;
+
+    *cur += strspn(*cur, " \t");
+    if (**cur == '\0')
+        return NULL;
+
+    token = *cur;
+    *cur += strcspn(*cur, " \t");
+    if (**cur != '\0')
+        *(*cur)++ = '\0';
+
+    return token;
+}
+
+// Returns 's' with leading and trailing whitespace removed. Modifies 's'.
+static char *trim(char *s) {
+    char *end;
+
+    s += strspn(s, " \t");
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        --end;
+    *end = '\0';
+
+    return s;
+}
+
+// Parses a "hh:mm-hh:mm" window or "*" into 'rule'. Returns false if 'window'
+// is malformed.
+static bool parse_window(const char *window, Rule *rule) {
+    unsigned start_h, start_m, end_h, end_m;
+    int n;
+
+    if (strcmp(window, "*") == 0) {
+        rule->has_window = false;
+
+        return true;
+    }
+
+    if (sscanf(window, "%2u:%2u-%2u:%2u%n", &start_h, &start_m, &end_h,
+               &end_m, &n) != 4 || window[n] != '\0' ||
+        start_h > 23 || end_h > 23 || start_m > 59 || end_m > 59)
+        return false;
+
+    rule->has_window = true;
+    rule->start = 60*start_h + start_m;
+    rule->len = (60*end_h + end_m - rule->start + MINS_PER_DAY) %
+                MINS_PER_DAY;
+
+    return rule->len != 0;
+}
+
+// Parses a rule from 'line' (which is modified) into 'rule'. Returns false on
+// errors, with an error message in 'err' (of length 'err_len').
+static bool parse_rule(char *line, Rule *rule, char *err, size_t err_len) {
+    char *cur = line;
+    char *channel;
+    char *window;
+    char *phrase;
+    char *response;
+    char *miss_response;
+    char *sep;
+
+    channel = next_token(&cur);
+    window = next_token(&cur);
+    if (channel == NULL || window == NULL) {
+        snprintf(err, err_len, "Expected a channel and a time window");
+
+        return false;
+    }
+
+    if (!parse_window(window, rule)) {
+        snprintf(err, err_len, "Invalid time window '%s' (expected "
+                 "hh:mm-hh:mm or '*')", window);
+
+        return false;
+    }
+
+    sep = strchr(cur, '|');
+    if (sep == NULL) {
+        snprintf(err, err_len, "Expected '|' between the phrase and the "
+                 "response");
+
+        return false;
+    }
+    *sep++ = '\0';
+    phrase = trim(cur);
+    cur = sep;
+
+    miss_response = NULL;
+    sep = strchr(cur, '|');
+    if (sep != NULL) {
+        *sep++ = '\0';
+        miss_response = trim(sep);
+    }
+    response = trim(cur);
+
+    if (*phrase == '\0' || *response == '\0' ||
+        (miss_response != NULL && *miss_response == '\0')) {
+        snprintf(err, err_len, "Empty phrase or response");
+
+        return false;
+    }
+
+    rule->channel = estrdup(channel, "trigger channel");
+    rule->phrase = estrdup(phrase, "trigger phrase");
+    fold(rule->phrase);
+    rule->response = estrdup(response, "trigger response");
+    rule->miss_response = miss_response == NULL ?
+      NULL : estrdup(miss_response, "trigger miss response");
+    rule->window_end = 0;
+    rule->active = !rule->has_window;
+    rule->fired = false;
+    rule->last_response = 0;
+    rule->last_scan = 0;
+
+    return true;
+}
+
+// Parses the rules in 'buf' (of length 'len').
+static void load_rules(const char *buf, size_t len) {
+    // Total length of the phrases, which bounds the size of the automaton.
+    size_t phrases_len = 0;
+    char err[128];
+    char *copy;
+    char *line;
+    char *next;
+
+    // null-terminate for ease of parsing.
+    copy = emalloc(len + 1, "triggers file");
+    memcpy(copy, buf, len);
+    copy[len] = '\0';
+
+    line = copy;
+    for (size_t line_nr = 1; line != NULL; line = next, ++line_nr) {
+        Rule rule;
+
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        // Skip empty lines.
+        if (line[strspn(line, " \t")] == '\0')
+            continue;
+
+        if (!parse_rule(line, &rule, err, sizeof err)) {
+            warning("Ignoring invalid trigger on line %zu in "
+                    "'"TRIGGERS_FILE"': %s", line_nr, err);
+
+            continue;
+        }
+
+        if (n_rules == NONE ||
+            phrases_len + strlen(rule.phrase) >= MAX_STATES) {
+            warning("Too many triggers in '"TRIGGERS_FILE"'. Ignoring the "
+                    "trigger on line %zu and later triggers.", line_nr);
+            free(rule.channel);
+            free(rule.phrase);
+            free(rule.response);
+            free(rule.miss_response);
+
+            break;
+        }
+        phrases_len += strlen(rule.phrase);
+
+        rules = erealloc(rules, (n_rules + 1)*sizeof *rules, "triggers");
+        rules[n_rules++] = rule;
+    }
+
+    free(copy);
+}
+
+void init_triggers(void) {
+    char *file_buf;
+    size_t file_len;
+    time_t now;
+
+    file_buf = get_file_contents(TRIGGERS_FILE, &file_len);
+    if (file_buf == NULL)
+        load_rules(DEFAULT_TRIGGERS, strlen(DEFAULT_TRIGGERS));
+    else {
+        load_rules(file_buf, file_len);
+        free(file_buf);
+    }
+
+    now = current_time();
+    if (now == -1)
+        err_exit("time (triggers)");
+
+    for (size_t i = 0; i < n_rules; ++i)
+        if (rules[i].has_window)
+            schedule_window(&rules[i], now);
+
+    build_automaton();
+}
+
+static void free_rules(Rule *rs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        free(rs[i].channel);
+        free(rs[i].phrase);
+        free(rs[i].response);
+        free(rs[i].miss_response);
+    }
+    free(rs);
+}
+
+// Carries over whether the rules with 'channel' and 'phrase' have responded,
+// when the rules are reloaded.
+static void restore_rule_state(const char *channel, const char *phrase,
+                               bool fired, time_t last_response) {
+    for (size_t i = 0; i < n_rules; ++i)
+        if (casemap_eq(rules[i].channel, channel) &&
+            strcmp(rules[i].phrase, phrase) == 0) {
+            rules[i].fired = fired;
+            rules[i].last_response = last_response;
+        }
+}
+
+void reload_triggers(void) {
+    Rule *old_rules = rules;
+    size_t n_old = n_rules;
+
+    // The time events point to the old rules.
+    remove_time_events(open_window);
+    remove_time_events(close_window);
+
+    rules = NULL;
+    n_rules = 0;
+    init_triggers();
+
+    // Match the old rules by channel and phrase, so that unchanged rules
+    // don't respond twice in a window.
+    for (size_t i = 0; i < n_old; ++i)
+        restore_rule_state(old_rules[i].channel, old_rules[i].phrase,
+                           old_rules[i].fired, old_rules[i].last_response);
+    free_rules(old_rules, n_old);
+
+    printf("Reloaded triggers: %zu rule%s\n", n_rules,
+           n_rules == 1 ? "" : "s");
+}
+
+void free_triggers(void) {
+    free_rules(rules, n_rules);
+    rules = NULL;
+    n_rules = 0;
+
+    free(delta);
+    free(state_rule);
+    free(dict_link);
+    delta = state_rule = dict_link = NULL;
+    n_states = 0;
+}
+
+void upgrade_save_triggers(void) {
+    upgrade_put_u64(n_rules);
+    for (size_t i = 0; i < n_rules; ++i) {
+        upgrade_put_str(rules[i].channel);
+        upgrade_put_str(rules[i].phrase);
+        upgrade_put_u64(rules[i].fired);
+        upgrade_put_u64(rules[i].last_response);
+    }
+}
+
+void upgrade_restore_triggers(void) {
+    size_t n_saved;
+
+    // The windows are scheduled from the current time, which gives the same
+    // time events as in the old process.
+    init_triggers();
+
+    // Match the saved rules by channel and phrase, since the rules might have
+    // changed.
+    n_saved = upgrade_get_u64();
+    for (size_t i = 0; i < n_saved; ++i) {
+        const char *channel = upgrade_get_str();
+        const char *phrase = upgrade_get_str();
+        bool fired = upgrade_get_u64();
+        time_t last_response = upgrade_get_u64();
+
+        restore_rule_state(channel, phrase, fired, last_response);
+    }
+}
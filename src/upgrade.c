@@ -0,0 +1,324 @@
+// Live upgrade by re-executing the binary. See upgrade.h.
+
+#include "common.h"
+#include "casemap.h"
+#include "channel_config.h"
+#include "chat_log.h"
+#include "channel_state.h"
+#include "irc.h"
+#include "join.h"
+#include "msg_io.h"
+#include "options.h"
+#include "remind.h"
+#include "stats.h"
+#include "transport.h"
+#include "triggers.h"
+#include "upgrade.h"
+#include "worker.h"
+
+// Environment variable holding the file descriptor with the saved state. Set
+// only for the re-executed process.
+#define UPGRADE_FD_ENV "BOTNIKLAS_UPGRADE_FD"
+
+// Written first. Bump the version if the format of the saved state changes in
+// an incompatible way.
+#define UPGRADE_MAGIC "botniklas-upgrade-5"
+
+// Binary and command line to re-execute. 'exe_path' is resolved when starting
+// so that a binary replaced on disk since then is picked up.
+static char *exe_path;
+static char **exec_argv;
+
+// True if this process was started by upgrade().
+static bool resuming;
+
+// The saved state, being built by upgrade() or read by restore_upgrade().
+static char *state;
+static size_t state_len;
+static size_t state_size;
+// Read position during restore_upgrade().
+static size_t state_pos;
+
+void init_upgrade(char *argv[]) {
+    char path[PATH_MAX];
+    ssize_t len;
+
+    exec_argv = argv;
+    resuming = getenv(UPGRADE_FD_ENV) != NULL;
+
+    len = readlink("/proc/self/exe", path, sizeof path - 1);
+    if (len == -1) {
+        warning_err("readlink() failed on /proc/self/exe. Live upgrades "
+                    "will not be possible");
+
+        return;
+    }
+    path[len] = '\0';
+    exe_path = estrdup(path, "executable path");
+}
+
+bool resuming_upgrade(void) {
+    return resuming;
+}
+
+// Appends 'len' bytes from 'data' to the saved state.
+static void put_raw(const void *data, size_t len) {
+    if (state_len + len > state_size) {
+        state_size = max(2*state_size, state_len + len);
+        state = erealloc(state, state_size, "upgrade state");
+    }
+    memcpy(state + state_len, data, len);
+    state_len += len;
+}
+
+void upgrade_put_u64(uint64_t val) {
+    put_raw(&val, sizeof val);
+}
+
+void upgrade_put_bytes(const void *data, size_t len) {
+    upgrade_put_u64(len);
+    put_raw(data, len);
+}
+
+void upgrade_put_str(const char *s) {
+    // Include the null terminator so that the string can be used in place
+    // when restoring.
+    upgrade_put_bytes(s, strlen(s) + 1);
+}
+
+// Returns a pointer to the next 'len' bytes of the saved state.
+static const void *get_raw(size_t len) {
+    const void *res;
+
+    if (len > state_len - state_pos)
+        fail_exit("Truncated state from live upgrade. Exiting.");
+
+    res = state + state_pos;
+    state_pos += len;
+
+    return res;
+}
+
+uint64_t upgrade_get_u64(void) {
+    uint64_t val;
+
+    memcpy(&val, get_raw(sizeof val), sizeof val);
+
+    return val;
+}
+
+const void *upgrade_get_bytes(size_t *len) {
+    *len = upgrade_get_u64();
+
+    return get_raw(*len);
+}
+
+const char *upgrade_get_str(void) {
+    size_t len;
+    const char *s = upgrade_get_bytes(&len);
+
+    if (len == 0 || s[len - 1] != '\0')
+        fail_exit("Malformed string in state from live upgrade. Exiting.");
+
+    return s;
+}
+
+// Writes the saved state to an unlinked shared memory object and returns a
+// file descriptor for it that will be inherited over exec, or -1 on errors.
+static int write_state_fd(void) {
+    char shm_tmp_name[64];
+    int fd;
+
+    // Same naming scheme as for the read buffer (see read_msg.c).
+    snprintf(shm_tmp_name, sizeof shm_tmp_name,
+             "/botniklas-upgrade-%llu", (unsigned long long)getpid());
+
+    fd = shm_open(shm_tmp_name, O_RDWR | O_CREAT | O_EXCL, 0);
+    if (fd == -1) {
+        warning_err("shm_open() failed (upgrade)");
+
+        return -1;
+    }
+
+    if (shm_unlink(shm_tmp_name) == -1)
+        warning_err("shm_unlink() failed (upgrade)");
+
+    // shm_open() sets FD_CLOEXEC.
+    if (fcntl(fd, F_SETFD, 0) == -1) {
+        warning_err("fcntl() failed (upgrade state)");
+        close(fd);
+
+        return -1;
+    }
+
+    // Writes to a shared memory object are only short on errors.
+    if (write(fd, state, state_len) != state_len) {
+        warning_err("write() failed (upgrade state)");
+        close(fd);
+
+        return -1;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        warning_err("lseek() failed (upgrade state)");
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+// Saves the state of each module. The order must match restore_upgrade().
+static void save_state(void) {
+    state_len = 0;
+
+    upgrade_put_str(UPGRADE_MAGIC);
+    upgrade_save_casemap();
+    upgrade_save_irc();
+    upgrade_save_transport();
+    upgrade_save_channel_state();
+    upgrade_save_join();
+    upgrade_save_msg_read_buf();
+    upgrade_save_reminders();
+    upgrade_save_triggers();
+    upgrade_save_stats();
+}
+
+void upgrade(void) {
+    char fd_str[16];
+    int state_fd;
+
+    if (exe_path == NULL) {
+        warning("Not upgrading: the path of the executable is unknown");
+
+        return;
+    }
+
+    if (sim_start != 0) {
+        warning("Not upgrading: the virtual clock of simulation mode is not "
+                "handed over");
+
+        return;
+    }
+
+    if (serv_fd == -1) {
+        warning("Not upgrading: not connected yet");
+
+        return;
+    }
+
+    if (workers_busy()) {
+        warning("Not upgrading: heavy commands are still running");
+
+        return;
+    }
+
+    if (!can_upgrade_transport()) {
+        warning("Not upgrading: the TLS state is kept in userspace and can't "
+                "be handed over to the new process");
+
+        return;
+    }
+
+    // The new process starts without the chat log writer thread.
+    sync_chat_log();
+
+    // Queued output is not part of the saved state.
+    serv_flush();
+    if (serv_output_pending()) {
+        warning("Not upgrading: output to the server is still being sent");
+
+        return;
+    }
+
+    save_state();
+
+    state_fd = write_state_fd();
+    if (state_fd == -1)
+        return;
+
+    // Let the server connection survive the exec. It is the only descriptor
+    // besides the saved state that does (all others have FD_CLOEXEC).
+    if (fcntl(serv_fd, F_SETFD, 0) == -1) {
+        warning_err("fcntl() failed on the server socket (upgrade)");
+        close(state_fd);
+
+        return;
+    }
+
+    snprintf(fd_str, sizeof fd_str, "%d", state_fd);
+    if (setenv(UPGRADE_FD_ENV, fd_str, 1) == -1) {
+        warning_err("setenv() failed (upgrade)");
+        goto fail;
+    }
+
+    printf("Upgrading by re-executing '%s' (%zu bytes of saved state)\n",
+           exe_path, state_len);
+    // Buffered output would otherwise be lost.
+    fflush(stdout);
+
+    execv(exe_path, exec_argv);
+
+    warning_err("execv() failed on '%s' (upgrade). Continuing with the "
+                "current process", exe_path);
+    unsetenv(UPGRADE_FD_ENV);
+
+fail:
+    if (fcntl(serv_fd, F_SETFD, FD_CLOEXEC) == -1)
+        warning_err("fcntl() failed on the server socket (upgrade)");
+    close(state_fd);
+}
+
+// Reads the saved state from 'fd' into 'state'.
+static void read_state_fd(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        err_exit("fstat (state from live upgrade)");
+
+    state_len = st.st_size;
+    state = emalloc(max(state_len, (size_t)1), "upgrade state");
+    if (readn(fd, state, state_len) != state_len)
+        fail_exit("Short read of the state from live upgrade. Exiting.");
+
+    if (close(fd) == -1)
+        err_exit("close (state from live upgrade)");
+}
+
+void restore_upgrade(void) {
+    const char *fd_str = getenv(UPGRADE_FD_ENV);
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    read_state_fd(atoi(fd_str));
+    // Don't pass the variable on to processes we might start.
+    unsetenv(UPGRADE_FD_ENV);
+
+    state_pos = 0;
+    if (strcmp(upgrade_get_str(), UPGRADE_MAGIC) != 0)
+        fail_exit("The state from the live upgrade is from an incompatible "
+                  "version. Exiting.");
+
+    upgrade_restore_casemap();
+    upgrade_restore_irc();
+    upgrade_restore_transport();
+    upgrade_restore_channel_state();
+    upgrade_restore_join();
+    upgrade_restore_msg_read_buf();
+    upgrade_restore_reminders();
+    upgrade_restore_triggers();
+    upgrade_restore_stats();
+
+    if (state_pos != state_len)
+        fail_exit("Trailing data in the state from live upgrade. Exiting.");
+
+    free(state);
+    state = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Resumed after live upgrade in %.1f ms\n",
+           1e3*(end.tv_sec - start.tv_sec) + 1e-6*(end.tv_nsec - start.tv_nsec));
+}
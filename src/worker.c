@@ -0,0 +1,262 @@
+// Worker thread pool. See worker.h.
+
+#include "common.h"
+#include "reactor.h"
+#include "worker.h"
+
+static int worker_fd;
+
+#define N_WORKERS 2
+// Maximum number of jobs waiting for a worker, over all classes.
+#define MAX_QUEUED 16
+
+typedef struct Job {
+    // Next job in the queue.
+    struct Job *next;
+
+    Work_class *class;
+    void (*work)(void *data);
+    void (*done)(void *data, bool cancelled);
+    void *data;
+
+    // CLOCK_MONOTONIC time at which the job was submitted.
+    struct timespec submitted;
+    // Filled in by the worker when it picks up the job.
+    double queue_ms;
+} Job;
+
+// A singly-linked FIFO of jobs.
+typedef struct Queue {
+    Job *head;
+    Job **tail;
+} Queue;
+
+static pthread_t workers[N_WORKERS];
+
+// Everything below is protected by 'lock', except where noted.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a job is added to 'pending' or when stopping.
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+// Jobs waiting for a worker.
+static Queue pending;
+static size_t n_pending;
+// Jobs waiting for handle_worker_event().
+static Queue done;
+
+// Set when the pool is being freed.
+static bool stopping;
+
+// Number of jobs submitted but not yet passed to their 'done' callback. Only
+// used from the event loop thread.
+static size_t n_in_flight;
+
+static void queue_init(Queue *queue) {
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+static void queue_push(Queue *queue, Job *job) {
+    job->next = NULL;
+    *queue->tail = job;
+    queue->tail = &job->next;
+}
+
+static Job *queue_pop(Queue *queue) {
+    Job *job = queue->head;
+
+    if (job != NULL) {
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = &queue->head;
+    }
+
+    return job;
+}
+
+static double ms_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return 1e3*(now.tv_sec - start->tv_sec) +
+           1e-6*(now.tv_nsec - start->tv_nsec);
+}
+
+static void *worker_thread(void *arg) {
+    int res;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (worker)");
+
+    for (;;) {
+        Job *job;
+        uint64_t one = 1;
+
+        while (!stopping && pending.head == NULL)
+            if ((res = pthread_cond_wait(&pending_cond, &lock)) != 0)
+                err_exit_n(res, "pthread_cond_wait (worker)");
+
+        if (stopping)
+            break;
+
+        job = queue_pop(&pending);
+        --n_pending;
+
+        if ((res = pthread_mutex_unlock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_unlock (worker)");
+
+        job->queue_ms = ms_since(&job->submitted);
+        job->work(job->data);
+
+        if ((res = pthread_mutex_lock(&lock)) != 0)
+            err_exit_n(res, "pthread_mutex_lock (worker)");
+
+        queue_push(&done, job);
+        // Wake up the event loop. free_workers() joins the workers before
+        // closing 'worker_fd'.
+        if (write(worker_fd, &one, sizeof one) == -1)
+            err_exit("write (worker eventfd)");
+    }
+
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (worker)");
+
+    return NULL;
+}
+
+static void handle_worker_event(int fd, uint32_t events, void *ctx);
+
+void init_workers(void) {
+    int res;
+
+    worker_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (worker_fd == -1)
+        err_exit("eventfd (workers)");
+    reactor_add(worker_fd, REACTOR_READ, handle_worker_event, NULL);
+
+    queue_init(&pending);
+    queue_init(&done);
+    n_pending = 0;
+    stopping = false;
+
+    for (size_t i = 0; i < N_WORKERS; ++i)
+        if ((res = pthread_create(&workers[i], NULL, worker_thread,
+                                  NULL)) != 0)
+            err_exit_n(res, "pthread_create (worker)");
+}
+
+// Updates the statistics and calls the 'done' callback for 'job'.
+static void finish_job(Job *job, bool cancelled) {
+    Work_class *class = job->class;
+
+    --class->n_jobs;
+    --n_in_flight;
+    if (!cancelled) {
+        ++class->n_done;
+        class->total_queue_ms += job->queue_ms;
+        class->max_queue_ms = max(class->max_queue_ms, job->queue_ms);
+    }
+
+    job->done(job->data, cancelled);
+    free(job);
+}
+
+void free_workers(void) {
+    Job *job;
+    int res;
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (free workers)");
+    stopping = true;
+    if ((res = pthread_cond_broadcast(&pending_cond)) != 0)
+        err_exit_n(res, "pthread_cond_broadcast (free workers)");
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (free workers)");
+
+    // Jobs are short, so just wait for the running ones.
+    for (size_t i = 0; i < N_WORKERS; ++i)
+        if ((res = pthread_join(workers[i], NULL)) != 0)
+            err_exit_n(res, "pthread_join (worker)");
+
+    while ((job = queue_pop(&pending)) != NULL)
+        finish_job(job, true);
+    while ((job = queue_pop(&done)) != NULL)
+        finish_job(job, true);
+
+    reactor_remove(worker_fd);
+    if (close(worker_fd) == -1)
+        err_exit("close (worker eventfd)");
+}
+
+bool submit_work(Work_class *class, void (*work)(void *data),
+                 void (*done)(void *data, bool cancelled), void *data) {
+    Job *job;
+    bool full;
+    int res;
+
+    if (class->n_jobs == class->max_jobs)
+        return false;
+
+    job = emalloc(sizeof *job, "worker job");
+    job->class = class;
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (submit work)");
+    full = n_pending == MAX_QUEUED;
+    if (!full) {
+        queue_push(&pending, job);
+        ++n_pending;
+        if ((res = pthread_cond_signal(&pending_cond)) != 0)
+            err_exit_n(res, "pthread_cond_signal (submit work)");
+    }
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (submit work)");
+
+    if (full) {
+        free(job);
+
+        return false;
+    }
+
+    ++class->n_jobs;
+    ++n_in_flight;
+
+    return true;
+}
+
+bool workers_busy(void) {
+    return n_in_flight != 0;
+}
+
+// Calls the 'done' callbacks of completed jobs.
+static void handle_worker_event(int fd, uint32_t events, void *ctx) {
+    Queue completed;
+    Job *job;
+    uint64_t n;
+    int res;
+
+    // Reset the eventfd counter. EAGAIN just means that an earlier call
+    // already picked up the completions.
+    if (read(worker_fd, &n, sizeof n) == -1 && errno != EAGAIN)
+        err_exit("read (worker eventfd)");
+
+    // Grab all completed jobs at once and run the callbacks without holding
+    // the lock.
+    if ((res = pthread_mutex_lock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_lock (worker event)");
+    completed = done;
+    if (completed.head == NULL)
+        completed.tail = &completed.head;
+    queue_init(&done);
+    if ((res = pthread_mutex_unlock(&lock)) != 0)
+        err_exit_n(res, "pthread_mutex_unlock (worker event)");
+
+    while ((job = queue_pop(&completed)) != NULL)
+        finish_job(job, false);
+}
@@ -3,6 +3,7 @@
 #include "irc.h"
 #include "msg_io.h"
 #include "options.h"
+#include "transport.h"
 
 static String msg_write_buf;
 
@@ -20,7 +21,7 @@ void write_msg(const char *format, ...) {
     va_start(ap, format);
     string_set_v(&msg_write_buf, format, ap);
     string_append(&msg_write_buf, "\r\n");
-    writen(serv_fd, string_get(&msg_write_buf), string_len(&msg_write_buf));
+    serv_send(string_get(&msg_write_buf), string_len(&msg_write_buf));
     va_end(ap);
 }
 
@@ -38,7 +39,7 @@ void append_msg(const char *format, ...) {
 
 void send_msg(void) {
     string_append(&msg_write_buf, "\r\n");
-    writen(serv_fd, string_get(&msg_write_buf), string_len(&msg_write_buf));
+    serv_send(string_get(&msg_write_buf), string_len(&msg_write_buf));
 }
 
 void say(const char *to, const char *format, ...) {
@@ -48,10 +49,32 @@ void say(const char *to, const char *format, ...) {
     string_set(&msg_write_buf, "PRIVMSG %s :", to);
     string_append_v(&msg_write_buf, format, ap);
     string_append(&msg_write_buf, "\r\n");
-    writen(serv_fd, string_get(&msg_write_buf), string_len(&msg_write_buf));
+    serv_send(string_get(&msg_write_buf), string_len(&msg_write_buf));
     va_end(ap);
 }
 
 void begin_say(const char *to) {
     string_set(&msg_write_buf, "PRIVMSG %s :", to);
 }
+
+void append_short_duration(time_t diff) {
+    static const struct {
+        const char *name;
+        time_t secs;
+    } units[] = { { "day", 60*60*24 }, { "hour", 60*60 }, { "minute", 60 },
+                  { "second", 1 } };
+    unsigned n;
+    size_t i;
+
+    diff = max(diff, (time_t)0);
+    for (i = 0; i + 1 < ARRAY_LEN(units) && diff < units[i].secs; ++i);
+
+    n = diff/units[i].secs;
+    append_msg("%u %s%s", n, units[i].name, n == 1 ? "" : "s");
+
+    if (i + 1 < ARRAY_LEN(units)) {
+        n = diff%units[i].secs/units[i + 1].secs;
+        if (n != 0)
+            append_msg(", %u %s%s", n, units[i + 1].name, n == 1 ? "" : "s");
+    }
+}
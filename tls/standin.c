@@ -0,0 +1,298 @@
+// Local TLS stand-in for an IRC server, for checking the TLS transport (see
+// transport.c and 'make tls' in the Makefile).
+//
+// Each scenario starts the bot with -s, connected to a TLS listener on
+// 127.0.0.1 that uses the certificate in <cert> (made for "localhost") and
+// allows at most a given TLS version. Connections that should succeed are
+// checked for the negotiated version and the registration messages, and the
+// bot is then made to quit. Connections that should fail certificate
+// verification (untrusted certificate, wrong host name) are checked for the
+// bot exiting with the verification error, since the first connection is not
+// retried. The bot trusts the certificate when SSL_CERT_FILE points to it.
+//
+// The bot's "TLS connection established" line is printed for each scenario,
+// showing whether kTLS was used in each direction.
+//
+// usage: standin <cert> <key> <bot>
+//
+// The bot is run with the data directory in $HOME, which should be a scratch
+// directory.
+
+#include "common.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define NICK "botniklas"
+
+// Longest wait for the bot, in milliseconds.
+#define TIMEOUT_MS 5000
+
+typedef struct Scenario {
+    const char *desc;
+    // Highest TLS version the server accepts.
+    int max_version;
+    // Host the bot connects to.
+    const char *host;
+    // True if the bot verifies the certificate (no -k).
+    bool verify;
+    // True if the bot trusts the certificate.
+    bool trusted;
+    // True if the connection should succeed.
+    bool ok;
+} Scenario;
+
+static const Scenario scenarios[] = {
+  { "TLS 1.3, not verified", TLS1_3_VERSION, "127.0.0.1", false, false, true },
+  { "TLS 1.2, not verified", TLS1_2_VERSION, "127.0.0.1", false, false, true },
+  { "TLS 1.3, verified", TLS1_3_VERSION, "localhost", true, true, true },
+  { "TLS 1.2, verified", TLS1_2_VERSION, "localhost", true, true, true },
+  { "untrusted certificate", TLS1_3_VERSION, "localhost", true, false,
+    false },
+  { "wrong host name", TLS1_3_VERSION, "127.0.0.1", true, true, false } };
+
+static const char *cert_file;
+static const char *key_file;
+static const char *bot;
+
+static pid_t bot_pid = -1;
+// Read end of a pipe with the bot's stdout and stderr.
+static int bot_out_fd;
+
+// Received data on the current connection.
+static char in_buf[4096];
+static size_t in_len;
+
+// Prints the OpenSSL error queue after a message and exits.
+static noreturn void ssl_fail_exit(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+}
+
+// Kills the bot if we exit early (e.g. from fail_exit()).
+static void kill_bot(void) {
+    if (bot_pid != -1)
+        kill(bot_pid, SIGKILL);
+}
+
+static SSL_CTX *make_ctx(int max_version) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+    if (ctx == NULL)
+        ssl_fail_exit("SSL_CTX_new() failed");
+    if (!SSL_CTX_set_max_proto_version(ctx, max_version))
+        ssl_fail_exit("SSL_CTX_set_max_proto_version() failed");
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1)
+        ssl_fail_exit("Failed to load the certificate");
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1)
+        ssl_fail_exit("Failed to load the private key");
+
+    return ctx;
+}
+
+// Returns a socket listening on 127.0.0.1, with the port in 'port'.
+static int listen_local(char *port, size_t port_size) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addr_len = sizeof addr;
+    int fd;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        err_exit("socket");
+    if (bind(fd, (struct sockaddr*)&addr, sizeof addr) == -1 ||
+        listen(fd, 1) == -1 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) == -1)
+        err_exit("listening socket");
+    snprintf(port, port_size, "%u", ntohs(addr.sin_port));
+
+    return fd;
+}
+
+static void start_bot(const Scenario *scenario, const char *port) {
+    int out_pipe[2];
+
+    if (pipe(out_pipe) == -1)
+        err_exit("pipe");
+
+    bot_pid = fork();
+    if (bot_pid == -1)
+        err_exit("fork");
+    if (bot_pid == 0) {
+        if (dup2(out_pipe[1], STDOUT_FILENO) == -1 ||
+            dup2(out_pipe[1], STDERR_FILENO) == -1)
+            err_exit("redirecting the output of the bot");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        // Also used for the bot's default verify paths.
+        if (scenario->trusted && setenv("SSL_CERT_FILE", cert_file, 1) == -1)
+            err_exit("setenv (SSL_CERT_FILE)");
+        if (scenario->verify)
+            execl(bot, bot, "-s", "-n", NICK, "-p", port, scenario->host,
+                  (char*)NULL);
+        else
+            execl(bot, bot, "-s", "-k", "-n", NICK, "-p", port,
+                  scenario->host, (char*)NULL);
+        err_exit("execl (%s)", bot);
+    }
+
+    close(out_pipe[1]);
+    bot_out_fd = out_pipe[0];
+}
+
+// Waits for the bot to exit. Returns its output and sets 'exit_ok' to
+// whether it exited successfully.
+static char *stop_bot(bool *exit_ok) {
+    static char out[16384];
+    size_t out_len = 0;
+    ssize_t n;
+    int status;
+
+    // The output is small, so the bot doesn't block on a full pipe.
+    if (waitpid(bot_pid, &status, 0) == -1)
+        err_exit("waitpid");
+    bot_pid = -1;
+    *exit_ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+
+    while (out_len < sizeof out - 1 &&
+           (n = read(bot_out_fd, out + out_len, sizeof out - 1 - out_len)) > 0)
+        out_len += n;
+    out[out_len] = '\0';
+    close(bot_out_fd);
+
+    return out;
+}
+
+// Returns the connection from the bot.
+static int accept_bot(int listen_fd) {
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    struct timeval timeout = { TIMEOUT_MS/1000, TIMEOUT_MS%1000*1000 };
+    int fd;
+
+    if (poll(&pfd, 1, TIMEOUT_MS) != 1)
+        fail_exit("The bot did not connect");
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        err_exit("accept");
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof timeout) == -1)
+        err_exit("setsockopt (SO_RCVTIMEO)");
+
+    return fd;
+}
+
+// Reads from the bot until 'text' has been received. Returns false if the
+// connection ends or times out first.
+static bool wait_for(SSL *ssl, const char *text) {
+    size_t n_read;
+
+    for (;;) {
+        in_buf[in_len] = '\0';
+        if (strstr(in_buf, text) != NULL)
+            return true;
+        if (in_len == sizeof in_buf - 1 ||
+            !SSL_read_ex(ssl, in_buf + in_len, sizeof in_buf - 1 - in_len,
+                         &n_read))
+            return false;
+        in_len += n_read;
+    }
+}
+
+// Prints the line containing 'text' in 'out', if any.
+static void print_line(const char *out, const char *text) {
+    const char *line = strstr(out, text);
+
+    if (line != NULL)
+        printf("  %.*s\n", (int)strcspn(line, "\n"), line);
+}
+
+// Runs a scenario. Returns false if the outcome is unexpected.
+static bool run(const Scenario *scenario) {
+    SSL_CTX *ctx = make_ctx(scenario->max_version);
+    SSL *ssl;
+    char port[16];
+    bool handshake_ok;
+    bool registered = false;
+    bool quit = false;
+    bool exit_ok;
+    int version = 0;
+    int listen_fd;
+    int fd;
+    char *out;
+
+    printf("%s:\n", scenario->desc);
+
+    listen_fd = listen_local(port, sizeof port);
+    start_bot(scenario, port);
+    fd = accept_bot(listen_fd);
+    close(listen_fd);
+
+    ssl = SSL_new(ctx);
+    if (ssl == NULL || !SSL_set_fd(ssl, fd))
+        ssl_fail_exit("Failed to set up the TLS connection");
+    in_len = 0;
+
+    handshake_ok = SSL_accept(ssl) == 1;
+    if (handshake_ok) {
+        version = SSL_version(ssl);
+        registered = wait_for(ssl, "NICK "NICK) && wait_for(ssl, "USER ");
+        // The bot sends a QUIT on the first signal and exits once we close
+        // the connection.
+        if (kill(bot_pid, SIGTERM) == -1)
+            err_exit("kill");
+        quit = wait_for(ssl, "QUIT");
+        SSL_shutdown(ssl);
+    }
+    else {
+        // The bot's alert.
+        ERR_clear_error();
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    close(fd);
+
+    out = stop_bot(&exit_ok);
+    print_line(out, "TLS connection established");
+    print_line(out, "TLS handshake");
+
+    if (scenario->ok)
+        return handshake_ok && version == scenario->max_version &&
+               registered && quit && exit_ok;
+
+    return !exit_ok &&
+           strstr(out, "certificate verification failed") != NULL;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned n_failed = 0;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <cert> <key> <bot>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    cert_file = argv[1];
+    key_file = argv[2];
+    bot = argv[3];
+
+    // Writes to the bot after it exits must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    atexit(kill_bot);
+
+    for (size_t i = 0; i < ARRAY_LEN(scenarios); ++i)
+        if (!run(&scenarios[i])) {
+            puts("  FAILED");
+            ++n_failed;
+        }
+
+    if (n_failed != 0)
+        fail_exit("%u of %zu scenarios failed", n_failed,
+                  ARRAY_LEN(scenarios));
+
+    puts("All scenarios passed");
+
+    exit(EXIT_SUCCESS);
+}